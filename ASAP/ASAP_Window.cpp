@@ -31,12 +31,14 @@
 
 #include "ASAP_Window.h"
 #include "PathologyViewer.h"
+#include "StatisticsDockWidget.h"
 #include "interfaces/interfaces.h"
 #include "WSITileGraphicsItemCache.h"
 #include "config/ASAPMacros.h"
 #include "multiresolutionimageinterface/MultiResolutionImageReader.h"
 #include "multiresolutionimageinterface/MultiResolutionImage.h"
 #include "multiresolutionimageinterface/MultiResolutionImageFactory.h"
+#include "multiresolutionimageinterface/TileCacheManager.h"
 #include "multiresolutionimageinterface/OpenSlideImage.h"
 
 #ifdef WIN32
@@ -61,6 +63,7 @@ ASAP_Window::ASAP_Window(QWidget *parent) :
   PathologyViewer* view = this->findChild<PathologyViewer*>("pathologyView");
   this->loadPlugins();
   view->setCacheSize(_cacheMaxByteSize);
+  initializeDocks();
   if (view->hasTool("pan")) {
     view->setActiveTool("pan");
     QList<QAction*> toolButtons = mainToolBar->actions();
@@ -73,6 +76,10 @@ ASAP_Window::ASAP_Window(QWidget *parent) :
   view->setEnabled(false);
   _settings = new QSettings(QSettings::IniFormat, QSettings::UserScope, "DIAG", "ASAP", this);
   readSettings();
+  // Optionally let the viewer and the caches of all opened images share one memory budget
+  if (_settings->value("shareTileCacheBudget", false).toBool()) {
+    TileCacheManager::getInstance().setMaxCacheSize(_cacheMaxByteSize);
+  }
   QStringList args = QApplication::arguments();
   if (args.size() > 1) {
     openFile(args[1], "default");
@@ -97,6 +104,22 @@ void ASAP_Window::readSettings()
   _settings->endGroup();
 }
 
+void ASAP_Window::initializeDocks() {
+  // Debug information on reading the image, hidden until enabled from the view menu
+  StatisticsDockWidget* statisticsDock = new StatisticsDockWidget(this);
+  statisticsDock->setAllowedAreas(Qt::LeftDockWidgetArea | Qt::RightDockWidgetArea);
+  this->addDockWidget(Qt::RightDockWidgetArea, statisticsDock);
+  statisticsDock->hide();
+  connect(this, SIGNAL(newImageLoaded(std::weak_ptr<MultiResolutionImage>, std::string)), statisticsDock, SLOT(onNewImageLoaded(std::weak_ptr<MultiResolutionImage>, std::string)));
+  connect(this, SIGNAL(imageClosed()), statisticsDock, SLOT(onImageClosed()));
+  QMenu* viewDocksMenu = menuView->findChild<QMenu*>("menuViewDocks");
+  if (!viewDocksMenu) {
+    viewDocksMenu = menuView->addMenu("Docks");
+    viewDocksMenu->setObjectName("menuViewDocks");
+  }
+  viewDocksMenu->addAction(statisticsDock->toggleViewAction());
+}
+
 void ASAP_Window::loadPlugins() {
   PathologyViewer* viewer = this->findChild<PathologyViewer*>("pathologyView");
   _pluginsDir = QDir(qApp->applicationDirPath());
@@ -257,10 +280,15 @@ void ASAP_Window::openFile(const QString& fileName, const QString& factoryName)
     _settings->setValue("lastOpenendPath", QFileInfo(fileName).dir().path());
     _settings->setValue("currentFile", QFileInfo(fileName).fileName());
     this->setWindowTitle(QString("ASAP - ") + QFileInfo(fileName).fileName());
+    // Mapping slides into memory is only safe for local files, so it is opt-in
+    ByteSource::setMemoryMappingEnabled(_settings->value("useMemoryMappedFiles", false).toBool());
     MultiResolutionImageReader imgReader;
     _img.reset(imgReader.open(fn, factoryName.toStdString()));
     if (_img) {
       if (_img->valid()) {
+        _img->setAccessPattern(ByteSource::RandomAccess);
+        // Compressed tiles are small, keeping them lets revisited areas be decoded without disk access
+        _img->setEncodedCacheSize(_settings->value("encodedTileCacheSize", 256 * 1024 * 1024).toULongLong());
         vector<unsigned long long> dimensions = _img->getLevelDimensions(_img->getNumberOfLevels() - 1);
         PathologyViewer* view = this->findChild<PathologyViewer*>("pathologyView");
         view->initialize(_img);
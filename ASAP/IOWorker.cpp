@@ -170,31 +170,21 @@ QPixmap* IOWorker::renderBackgroundImage(std::shared_ptr<MultiResolutionImage> l
 template<typename T>
 Patch<T>* IOWorker::getForegroundTile(std::shared_ptr<MultiResolutionImage> local_for_img, const IOJob* job) {
   std::shared_ptr<MultiResolutionImage> loc_bck_img = _bck_img.lock();
-  int levelDifference = loc_bck_img->getBestLevelForDownSample(_foregroundImageScale);
-  int fgImageLevel = job->_level - levelDifference;
 
-  // If we request a level which is outside the range of the foreground image (e.g. level 8 when it only has 7 levels), get level 7 and scale up.
-  float foregroundExtraScaling = 1.;
-  if (fgImageLevel > local_for_img->getNumberOfLevels()) {
-    fgImageLevel = local_for_img->getNumberOfLevels() - 1;
-  }
-  else if (fgImageLevel < 0) {
-    fgImageLevel = 0;
-  }
-  foregroundExtraScaling = local_for_img->getLevelDimensions(fgImageLevel)[0] / static_cast<float>(loc_bck_img->getLevelDimensions(job->_level)[0]);
-  pathology::DataType foregroundDataType = local_for_img->getDataType();
-
-  int correctedTileSize = job->_tileSize * foregroundExtraScaling;
+  // The foreground is read straight at the resolution of the background tile, so it does not have to be
+  // rescaled when rendering. Foreground images are mostly label maps, nearest neighbour keeps the labels intact.
+  double foregroundDownsample = local_for_img->getDimensions()[0] / static_cast<double>(loc_bck_img->getLevelDimensions(job->_level)[0]);
   unsigned int samplesPerPixel = local_for_img->getSamplesPerPixel();
-  float fgLevelDownsample = local_for_img->getLevelDownsample(fgImageLevel);
-  T* imgBuf = new T[correctedTileSize * correctedTileSize * samplesPerPixel];
-  local_for_img->getRawRegion(job->_imgPosX * fgLevelDownsample * foregroundExtraScaling * job->_tileSize, job->_imgPosY * fgLevelDownsample * foregroundExtraScaling * job->_tileSize, correctedTileSize, correctedTileSize, fgImageLevel, imgBuf);
+  unsigned int tileSize = job->_tileSize;
+  T* imgBuf = new T[tileSize * tileSize * samplesPerPixel];
+  local_for_img->getRegionAtDownsample(job->_imgPosX * foregroundDownsample * tileSize, job->_imgPosY * foregroundDownsample * tileSize, tileSize, tileSize,
+    foregroundDownsample, imgBuf, core::NearestResampling);
   std::vector<double> minValues, maxValues;
   for (unsigned int i = 0; i < local_for_img->getSamplesPerPixel(); ++i) {
     minValues.push_back(local_for_img->getMinValue(i));
     maxValues.push_back(local_for_img->getMaxValue(i));
   }
-  Patch<T>* foregroundTile = new Patch<T>({ static_cast<unsigned long long>(correctedTileSize), static_cast<unsigned long long>(correctedTileSize), 1 }, local_for_img->getColorType(), imgBuf, true, minValues, maxValues);
+  Patch<T>* foregroundTile = new Patch<T>({ static_cast<unsigned long long>(tileSize), static_cast<unsigned long long>(tileSize), 1 }, local_for_img->getColorType(), imgBuf, true, minValues, maxValues);
   return foregroundTile;
 }
 
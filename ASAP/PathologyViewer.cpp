@@ -21,6 +21,7 @@
 #include "IOThread.h"
 #include "PrefetchThread.h"
 #include "multiresolutionimageinterface/MultiResolutionImage.h"
+#include "multiresolutionimageinterface/TileCacheManager.h"
 #include "interfaces/interfaces.h"
 #include "core/PathologyEnums.h"
 #include "WSITileGraphicsItem.h"
@@ -89,7 +90,10 @@ PathologyViewer::~PathologyViewer()
 }
 
 unsigned long long PathologyViewer::getCacheSize() {
-  if (_cache) {
+  if (TileCacheManager::getInstance().isEnabled()) {
+    return TileCacheManager::getInstance().getMaxCacheSize();
+  }
+  else if (_cache) {
     return _cache->maxCacheSize();
   }
   else {
@@ -98,6 +102,11 @@ unsigned long long PathologyViewer::getCacheSize() {
 }
 
 void PathologyViewer::setCacheSize(unsigned long long& maxCacheSize) {
+  // With a shared budget the viewer's cache size is the budget for the viewer and all open images
+  _cacheSize = maxCacheSize;
+  if (TileCacheManager::getInstance().isEnabled()) {
+    TileCacheManager::getInstance().setMaxCacheSize(maxCacheSize);
+  }
   if (_cache) {
     _cache->setMaxCacheSize(maxCacheSize);
   }
@@ -248,6 +257,11 @@ void PathologyViewer::initialize(std::shared_ptr<MultiResolutionImage> img) {
   }
   _cache = new WSITileGraphicsItemCache();
   _cache->setMaxCacheSize(_cacheSize);
+  if (TileCacheManager::getInstance().isEnabled()) {
+    // The items count towards the budget, but keep the viewer's own cache size and are only evicted by
+    // the cache itself, on the GUI thread that inserts them and owns the scene
+    TileCacheManager::getInstance().registerCache(_cache, "viewer", 1.0, false, false);
+  }
   _ioThread = new IOThread(this);
   _ioThread->setBackgroundImage(img);
   _manager = new TileManager(_img, tileSize, lastLevel, _ioThread, _cache, scene());
@@ -477,6 +491,10 @@ void PathologyViewer::close() {
     _prefetchthread->deleteLater();
     _prefetchthread = NULL;
   }
+  if (_cache) {
+    // Other caches growing must no longer evict items of this viewer
+    TileCacheManager::getInstance().unregisterCache(_cache);
+  }
   scene()->clear();
   if (_manager) {
     _manager->clear();
@@ -20,6 +20,7 @@ PrefetchThread::~PrefetchThread()
 {
   _mutex.lock();
   _abort = true;
+  _prefetchToken.cancel();
   _mutex.unlock();
   while (isRunning()) {
     _condition.wakeOne();
@@ -35,6 +36,7 @@ void PrefetchThread::FOVChanged(MultiResolutionImage* img, const QRectF& FOV, co
   _img = img;
   _level = level;
   _FOV = FOV;
+  _prefetchToken.cancel();
 
   if (!isRunning()) {
       start(HighPriority);
@@ -58,30 +60,24 @@ void PrefetchThread::run()
       std::vector<unsigned long long> L0Dims = img->getDimensions();
       QRectF maxFOV(0, 0, L0Dims[0], L0Dims[1]);
       int levelDownsample = img->getLevelDownsample(level);
+      CancellationToken token;
+      _prefetchToken = token;
       _mutex.unlock();
 
       if (img) {
         if (_abort) {
           return;
         }
+        std::vector<RegionRequest> regions;
         // Cache level below
-        if (level - 1 >= 0 && !_restart) {
+        if (level - 1 >= 0) {
           unsigned int width = FOV.width() / img->getLevelDownsample(level - 1);
           unsigned int height = FOV.height() / img->getLevelDownsample(level - 1);
-          unsigned char* data = NULL;
-          data = new unsigned char[width*height*img->getSamplesPerPixel()];
-          img->getRawRegion(FOV.left(), FOV.top(), width, height, level - 1, data);
-          delete[] data;
+          regions.push_back(RegionRequest(FOV.left(), FOV.top(), width, height, level - 1));
         }
         // Cache around current FOV if needed
         for (int x = -1; x < 2; ++x) {
-          if (_restart) {
-            break;
-          }
           for (int y = -1; y < 2; ++y) {
-            if (_restart) {
-              break;
-            }
             if (x == 0 && y == 0) {
               continue;
             }
@@ -89,11 +85,23 @@ void PrefetchThread::run()
             cur = cur.intersected(maxFOV);
             unsigned int width = cur.width() / levelDownsample;
             unsigned int height = cur.height() / levelDownsample;
-            unsigned char* data = new unsigned char[width*height*img->getSamplesPerPixel()];
-            img->getRawRegion(cur.left(), cur.top(), width, height, level, data);
-            delete[] data;
+            regions.push_back(RegionRequest(cur.left(), cur.top(), width, height, level));
           }
         }
+        // The reads run on the worker threads of the image below the default priority, so other reads
+        // go first; a new FOV cancels the reads which did not start yet. Prefetched tiles are admitted
+        // cold, so they do not push the tiles of the current view out of the cache before they are used.
+        ScopedCacheAccessHint scan(ScanCacheAccess);
+        std::vector<std::vector<unsigned char> > buffers(regions.size());
+        std::vector<std::future<bool> > reads;
+        for (unsigned int i = 0; i < regions.size(); ++i) {
+          const RegionRequest& region = regions[i];
+          buffers[i].resize(region.width * region.height * img->getSamplesPerPixel());
+          reads.push_back(img->getRawRegionAsync(region.startX, region.startY, region.width, region.height, region.level, buffers[i].data(), -1, token));
+        }
+        for (unsigned int i = 0; i < reads.size(); ++i) {
+          reads[i].wait();
+        }
       }
 
       _mutex.lock();
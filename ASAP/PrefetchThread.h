@@ -5,6 +5,7 @@
 #include <QMutex>
 #include <QWaitCondition>
 #include <QRect>
+#include "multiresolutionimageinterface/TaskExecutor.h"
 
 class MultiResolutionImage;
 
@@ -31,6 +32,7 @@ private :
   QRectF _FOV;
   unsigned int _level;
   MultiResolutionImage *_img;
+  CancellationToken _prefetchToken;
 
 };
   
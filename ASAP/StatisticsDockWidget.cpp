@@ -0,0 +1,126 @@
+#include "StatisticsDockWidget.h"
+
+#include <QTreeWidget>
+#include <QTimer>
+#include <QPushButton>
+#include <QVBoxLayout>
+
+#include "multiresolutionimageinterface/MultiResolutionImage.h"
+
+namespace {
+
+  QString formatBytes(const unsigned long long& bytes) {
+    if (bytes >= 1024 * 1024) {
+      return QString::number(bytes / (1024. * 1024.), 'f', 1) + " MB";
+    }
+    return QString::number(bytes / 1024., 'f', 1) + " kB";
+  }
+
+  QTreeWidgetItem* addRow(QTreeWidgetItem* parent, const QString& name, const QString& value) {
+    QTreeWidgetItem* item = new QTreeWidgetItem(parent, QStringList() << name << value);
+    return item;
+  }
+
+  void addCacheRows(QTreeWidgetItem* parent, const TileCacheStatistics& statistics) {
+    addRow(parent, "Hit rate", QString::number(100. * statistics.hitRate(), 'f', 1) + " %");
+    addRow(parent, "Size", formatBytes(statistics.currentByteSize) + " / " + formatBytes(statistics.maxByteSize));
+    addRow(parent, "Tiles", QString::number(statistics.numberOfTiles));
+    addRow(parent, "Evictions", QString::number(statistics.evictions));
+    for (unsigned int level = 0; level < statistics.hitsPerLevel.size(); ++level) {
+      unsigned long long lookups = statistics.hitsPerLevel[level] + statistics.missesPerLevel[level];
+      if (lookups > 0) {
+        addRow(parent, QString("Level %1").arg(level), QString("%1 hits, %2 misses").arg(statistics.hitsPerLevel[level]).arg(statistics.missesPerLevel[level]));
+      }
+    }
+  }
+
+  QString formatDurations(const DurationHistogram& histogram) {
+    return QString("%1 x, mean %2 us, p50 < %3 us, p99 < %4 us").arg(histogram.count).arg(histogram.mean(), 0, 'f', 0)
+      .arg(histogram.percentile(0.5)).arg(histogram.percentile(0.99));
+  }
+
+}
+
+StatisticsDockWidget::StatisticsDockWidget(QWidget *parent, Qt::WindowFlags flags) :
+  QDockWidget("Image Statistics", parent, flags),
+  _statisticsTree(NULL),
+  _refreshTimer(NULL)
+{
+  QWidget* contents = new QWidget(this);
+  QVBoxLayout* layout = new QVBoxLayout(contents);
+  _statisticsTree = new QTreeWidget(contents);
+  _statisticsTree->setColumnCount(2);
+  _statisticsTree->setHeaderLabels(QStringList() << "Statistic" << "Value");
+  layout->addWidget(_statisticsTree);
+  QPushButton* resetButton = new QPushButton("Reset", contents);
+  layout->addWidget(resetButton);
+  this->setWidget(contents);
+  this->setObjectName("StatisticsDockWidget");
+
+  _refreshTimer = new QTimer(this);
+  _refreshTimer->setInterval(1000);
+  connect(_refreshTimer, SIGNAL(timeout()), this, SLOT(refresh()));
+  connect(resetButton, SIGNAL(clicked()), this, SLOT(onResetClicked()));
+  connect(this, SIGNAL(visibilityChanged(bool)), this, SLOT(onVisibilityChanged(bool)));
+}
+
+void StatisticsDockWidget::onNewImageLoaded(std::weak_ptr<MultiResolutionImage> img, std::string fileName) {
+  _img = img;
+  refresh();
+}
+
+void StatisticsDockWidget::onImageClosed() {
+  _img.reset();
+  _statisticsTree->clear();
+}
+
+void StatisticsDockWidget::onVisibilityChanged(bool visible) {
+  // Polling only happens while the dock can be seen
+  if (visible) {
+    refresh();
+    _refreshTimer->start();
+  }
+  else {
+    _refreshTimer->stop();
+  }
+}
+
+void StatisticsDockWidget::onResetClicked() {
+  if (std::shared_ptr<MultiResolutionImage> img = _img.lock()) {
+    img->resetStatistics();
+  }
+  refresh();
+}
+
+void StatisticsDockWidget::refresh() {
+  std::shared_ptr<MultiResolutionImage> img = _img.lock();
+  if (!img || !isVisible()) {
+    return;
+  }
+  ImageStatistics statistics = img->getStatistics();
+  _statisticsTree->clear();
+
+  QTreeWidgetItem* cache = new QTreeWidgetItem(_statisticsTree, QStringList("Tile cache"));
+  addCacheRows(cache, statistics.cache);
+  QTreeWidgetItem* encodedCache = new QTreeWidgetItem(_statisticsTree, QStringList("Encoded tile cache"));
+  addCacheRows(encodedCache, statistics.encodedCache);
+
+  QTreeWidgetItem* reading = new QTreeWidgetItem(_statisticsTree, QStringList("Reading"));
+  addRow(reading, "Bytes read", formatBytes(statistics.bytesRead));
+  addRow(reading, "Reads", QString::number(statistics.numberOfReads));
+  addRow(reading, "Lock waits", formatDurations(statistics.lockWait));
+
+  QTreeWidgetItem* decoding = new QTreeWidgetItem(_statisticsTree, QStringList("Decoding"));
+  for (std::vector<DecodeStatistics>::const_iterator it = statistics.decoding.begin(); it != statistics.decoding.end(); ++it) {
+    addRow(decoding, QString::fromStdString(it->codec), formatDurations(it->decodeTime));
+  }
+
+  QTreeWidgetItem* requests = new QTreeWidgetItem(_statisticsTree, QStringList("Requests"));
+  addRow(requests, "In flight", QString::number(statistics.requestsInFlight));
+  addRow(requests, "Peak in flight", QString::number(statistics.peakRequestsInFlight));
+  addRow(requests, "Queued", QString::number(statistics.requestsQueued));
+  addRow(requests, "Completed", QString::number(statistics.requestsCompleted));
+
+  _statisticsTree->expandAll();
+  _statisticsTree->resizeColumnToContents(0);
+}
@@ -0,0 +1,35 @@
+#ifndef _StatisticsDockWidget
+#define _StatisticsDockWidget
+
+#include <QDockWidget>
+#include <memory>
+#include <string>
+
+class MultiResolutionImage;
+class QTreeWidget;
+class QTimer;
+
+//! Debug dock which shows the statistics of the opened image (cache hit rates per level, bytes read,
+//! decode times, lock waits and reads in flight), refreshed every second while it is visible
+class StatisticsDockWidget : public QDockWidget {
+  Q_OBJECT
+
+private :
+  QTreeWidget* _statisticsTree;
+  QTimer* _refreshTimer;
+  std::weak_ptr<MultiResolutionImage> _img;
+
+private slots :
+  void refresh();
+  void onResetClicked();
+  void onVisibilityChanged(bool visible);
+
+public slots :
+  void onNewImageLoaded(std::weak_ptr<MultiResolutionImage> img, std::string fileName);
+  void onImageClosed();
+
+public :
+  StatisticsDockWidget(QWidget *parent = 0, Qt::WindowFlags flags = 0);
+};
+
+#endif
@@ -1,4 +1,3 @@
-#include <sstream>
 #include "core/ImageSource.h"
 #include "TileManager.h"
 #include "multiresolutionimageinterface/MultiResolutionImage.h"
@@ -130,10 +129,7 @@ void TileManager::updateTileForegounds() {
 
 void TileManager::onForegroundTileRendered(QPixmap* tile, unsigned int tileX, unsigned int tileY, unsigned int tileLevel) {
   if (_cache) {
-    std::stringstream ss;
-    ss << tileX << "_" << tileY << "_" << tileLevel;
-    std::string key;
-    ss >> key;
+    TileKey key = makeTileKey(tileLevel, 0, tileX, tileY);
 
     WSITileGraphicsItem* item = NULL;
     unsigned int size = 0;
@@ -153,10 +149,7 @@ void TileManager::onForegroundTileRendered(QPixmap* tile, unsigned int tileX, un
 void TileManager::onTileLoaded(QPixmap* tile, unsigned int tileX, unsigned int tileY, unsigned int tileSize, unsigned int tileByteSize, unsigned int tileLevel, ImageSource* foregroundTile, QPixmap* foregroundPixmap) {
   if (tile) {
     WSITileGraphicsItem* item = new WSITileGraphicsItem(tile, tileX, tileY, tileSize, tileByteSize, tileLevel, _lastRenderLevel, _levelDownsamples, this, foregroundPixmap, foregroundTile, _foregroundOpacity, _renderForeground);
-    std::stringstream ss;
-    ss << tileX << "_" << tileY << "_" << tileLevel;
-    std::string key;
-    ss >> key;
+    TileKey key = makeTileKey(tileLevel, 0, tileX, tileY);
     if (_scene) {
       setCoverage(tileLevel, tileX, tileY, 2);
       float tileDownsample = _levelDownsamples[tileLevel];
@@ -6,27 +6,22 @@
 
 class WSITileGraphicsItem;
 
-class WSITileGraphicsItemCache : public QObject, public TileCache<WSITileGraphicsItem* >  {
+class WSITileGraphicsItemCache : public QObject, public TileCacheBase {
   Q_OBJECT
 
 public :
+  typedef TileKey keyType;
+
   ~WSITileGraphicsItemCache();
-  void clear();
   void get(const keyType& k, WSITileGraphicsItem*& tile, unsigned int& size);
   int set(const keyType& k, WSITileGraphicsItem* v, unsigned int size, bool topLevel = false);
   std::vector<WSITileGraphicsItem*> getAllItems();
 
 protected:
-  void evict();
-
-private :
-
-  // Structure of the cache is as follow: each entry has a position string as the key (x-y-level)
-  // Each value contains ((tile, size), iterator to position in _LRU)
-  std::map<keyType, std::pair<std::pair<WSITileGraphicsItem*, unsigned int>, keyTypeList::iterator> > _cache;
+  void evicted(const TileKey& k, const std::shared_ptr<void>& value, const unsigned int& size);
 
 signals:
   void itemEvicted(WSITileGraphicsItem* item);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -56,12 +56,14 @@ namespace ASAP
 				if (image->getNumberOfLevels() > 1)
 				{
 					dimensions = image->getLevelDimensions(image->getNumberOfLevels() - 1);
+					data = new unsigned char[dimensions[0] * dimensions[1] * image->getSamplesPerPixel()];
 					image->getRawRegion(0, 0, dimensions[0], dimensions[1], image->getNumberOfLevels() - 1, data);
 				}
 				else
 				{
 					dimensions = image->getDimensions();
 					if (dimensions[0] * dimensions[1] < (1024 * 1024)) {
+						data = new unsigned char[dimensions[0] * dimensions[1] * image->getSamplesPerPixel()];
 						image->getRawRegion(0, 0, dimensions[0], dimensions[1], 0, data);
 					}
 					else {
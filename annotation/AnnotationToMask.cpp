@@ -55,7 +55,7 @@ void AnnotationToMask::convert(const std::shared_ptr<AnnotationList>& annotation
 		writer.setCompression(pathology::LZW);
 		writer.setTileSize(512);
 		writer.setDataType(pathology::UChar);
-		writer.setInterpolation(pathology::NearestNeighbor);
+		writer.setInterpolation(pathology::Mode);
     std::vector<double> spacing_copy(spacing);
 		writer.setSpacing(spacing_copy);
 		writer.writeImageInformation(dimensions[0], dimensions[1]);
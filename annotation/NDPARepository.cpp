@@ -3,7 +3,6 @@
 #include "AnnotationGroup.h"
 #include "AnnotationList.h"
 #include "multiresolutionimageinterface/MultiResolutionImageReader.h"
-#include "multiresolutionimageinterface/MultiResolutionImage.h"
 #include "core/Point.h"
 #include "core/filetools.h"
 #include "core/stringconversion.h"
@@ -39,27 +38,28 @@ bool NDPARepository::loadFromRepo()
   _list->removeAllAnnotations();
   _list->removeAllGroups();
 
-  std::shared_ptr<MultiResolutionImage> ndpi;
-  if (_ndpiSourceFile.empty()) {
+  std::string ndpiFile = _ndpiSourceFile;
+  if (ndpiFile.empty()) {
     std::vector<std::string> ndpaParts;
     core::split(_source, ndpaParts, ".ndpa");
-    if (core::fileExists(ndpaParts[0])) {
-      MultiResolutionImageReader reader;
-      ndpi.reset(reader.open(ndpaParts[0]));
-      if (!ndpi) {
-        return false;
-      }
-    }
-    else {
-      return false;
-    }
+    ndpiFile = ndpaParts[0];
+  }
+  if (!core::fileExists(ndpiFile)) {
+    return false;
+  }
+
+  // Only the slide properties and dimensions are needed, so the slide is not opened for reading
+  ImageMetadata ndpi;
+  MultiResolutionImageReader reader;
+  if (!reader.openMetadata(ndpiFile, ndpi) || ndpi.levelDimensions.empty()) {
+    return false;
   }
 
-  float offsetX = core::fromstring<float>(ndpi->getProperty("hamamatsu.XOffsetFromSlideCentre"));
-  float offsetY = core::fromstring<float>(ndpi->getProperty("hamamatsu.YOffsetFromSlideCentre"));
-  float mppX = core::fromstring<float>(ndpi->getProperty("openslide.mpp-x"));
-  float mppY = core::fromstring<float>(ndpi->getProperty("openslide.mpp-y"));
-  std::vector<unsigned long long> dims = ndpi->getDimensions();
+  float offsetX = core::fromstring<float>(ndpi.properties["hamamatsu.XOffsetFromSlideCentre"]);
+  float offsetY = core::fromstring<float>(ndpi.properties["hamamatsu.YOffsetFromSlideCentre"]);
+  float mppX = core::fromstring<float>(ndpi.properties["openslide.mpp-x"]);
+  float mppY = core::fromstring<float>(ndpi.properties["openslide.mpp-y"]);
+  std::vector<unsigned long long> dims = ndpi.levelDimensions[0];
 
 	pugi::xml_document xml_doc;
   pugi::xml_parse_result tree = xml_doc.load_file(_source.c_str());
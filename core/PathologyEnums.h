@@ -43,7 +43,10 @@ namespace pathology {
 
   enum Interpolation : int  {
     NearestNeighbor,
-    Linear
+    Linear,
+    Area,
+    Lanczos,
+    Mode
   };
 
 }
@@ -0,0 +1,464 @@
+#include "PixelConversion.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PIXELCONVERSION_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define PIXELCONVERSION_TARGET(instructionSet)
+#else
+#define PIXELCONVERSION_TARGET(instructionSet) __attribute__((target(instructionSet)))
+#endif
+#endif
+
+using namespace pathology;
+
+namespace core
+{
+
+  namespace {
+
+    SIMDInstructionSet detectInstructionSet() {
+#if defined(PIXELCONVERSION_X86) && defined(_MSC_VER)
+      int info[4];
+      __cpuid(info, 0);
+      const int highestLeaf = info[0];
+      __cpuid(info, 1);
+      const bool sse41 = (info[2] & (1 << 19)) != 0;
+      const bool osSavesAVX = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+      bool avx2 = false;
+      if (highestLeaf >= 7 && osSavesAVX) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+      }
+      return avx2 && sse41 ? AVX2Instructions : (sse41 ? SSE41Instructions : ScalarInstructions);
+#elif defined(PIXELCONVERSION_X86)
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.1")) {
+        return AVX2Instructions;
+      }
+      return __builtin_cpu_supports("sse4.1") ? SSE41Instructions : ScalarInstructions;
+#else
+      return ScalarInstructions;
+#endif
+    }
+
+    const SIMDInstructionSet supportedInstructionSet = detectInstructionSet();
+    std::atomic<int> maximumInstructionSet(AVX2Instructions);
+
+    unsigned int bytesPerSample(const DataType& dataType) {
+      switch (dataType) {
+      case UChar:
+        return 1;
+      case UInt16:
+        return 2;
+      case UInt32:
+      case Float:
+        return 4;
+      default:
+        return 0;
+      }
+    }
+
+    // Scalar versions, also used for the samples that are left over by the vector loops
+
+    template <typename S, typename D> void convertScalar(const S* source, D* destination, const unsigned long long& count) {
+      for (unsigned long long i = 0; i < count; ++i) {
+        destination[i] = static_cast<D>(source[i]);
+      }
+    }
+
+    // Floats are saturated, as the vector versions do
+    template <typename D> void convertFloatScalar(const float* source, D* destination, const unsigned long long& count, const float& maximum) {
+      for (unsigned long long i = 0; i < count; ++i) {
+        destination[i] = static_cast<D>(std::min(std::max(source[i], 0.f), maximum));
+      }
+    }
+
+    template <typename S> void convertScalarTo(const S* source, void* destination, const DataType& destinationType, const unsigned long long& count) {
+      if (destinationType == UChar) {
+        convertScalar(source, static_cast<unsigned char*>(destination), count);
+      }
+      else if (destinationType == UInt16) {
+        convertScalar(source, static_cast<unsigned short*>(destination), count);
+      }
+      else if (destinationType == UInt32) {
+        convertScalar(source, static_cast<unsigned int*>(destination), count);
+      }
+      else if (destinationType == Float) {
+        convertScalar(source, static_cast<float*>(destination), count);
+      }
+    }
+
+    void convertSamplesScalar(const void* source, const DataType& sourceType, void* destination, const DataType& destinationType, const unsigned long long& count) {
+      if (sourceType == UChar) {
+        convertScalarTo(static_cast<const unsigned char*>(source), destination, destinationType, count);
+      }
+      else if (sourceType == UInt16) {
+        convertScalarTo(static_cast<const unsigned short*>(source), destination, destinationType, count);
+      }
+      else if (sourceType == UInt32) {
+        convertScalarTo(static_cast<const unsigned int*>(source), destination, destinationType, count);
+      }
+      else if (sourceType == Float) {
+        const float* floats = static_cast<const float*>(source);
+        if (destinationType == UChar) {
+          convertFloatScalar(floats, static_cast<unsigned char*>(destination), count, 255.f);
+        }
+        else if (destinationType == UInt16) {
+          convertFloatScalar(floats, static_cast<unsigned short*>(destination), count, 65535.f);
+        }
+        else if (destinationType == UInt32) {
+          convertFloatScalar(floats, static_cast<unsigned int*>(destination), count, 4294967040.f);
+        }
+      }
+    }
+
+    void swapRedAndBlueScalar(unsigned char* pixels, const unsigned int& sampleSize, const unsigned long long& numberOfPixels) {
+      for (unsigned long long i = 0; i < numberOfPixels; ++i) {
+        unsigned char* pixel = pixels + i * 4 * sampleSize;
+        std::swap_ranges(pixel, pixel + sampleSize, pixel + 2 * sampleSize);
+      }
+    }
+
+    // Division by alpha as a multiplication: (x * reciprocal[a]) >> 24 equals x / a for all x < 2^16
+    struct Reciprocals {
+      Reciprocals() {
+        values[0] = 0;
+        for (unsigned int a = 1; a < 256; ++a) {
+          values[a] = ((1u << 24) + a - 1) / a;
+        }
+      }
+      unsigned int values[256];
+    };
+    const Reciprocals reciprocals;
+
+    inline unsigned char unpremultiply(const unsigned int& value, const unsigned int& alpha) {
+      return value >= alpha ? 255 : static_cast<unsigned char>((static_cast<unsigned long long>(255 * value) * reciprocals.values[alpha]) >> 24);
+    }
+
+    void unpremultiplyScalar(const unsigned char* bgra, unsigned char* rgb, const unsigned long long& numberOfPixels, const unsigned char* background) {
+      for (unsigned long long i = 0; i < numberOfPixels; ++i, bgra += 4, rgb += 3) {
+        const unsigned int alpha = bgra[3];
+        if (alpha == 255) {
+          rgb[0] = bgra[2];
+          rgb[1] = bgra[1];
+          rgb[2] = bgra[0];
+        }
+        else if (alpha == 0) {
+          rgb[0] = background[0];
+          rgb[1] = background[1];
+          rgb[2] = background[2];
+        }
+        else {
+          rgb[0] = unpremultiply(bgra[2], alpha);
+          rgb[1] = unpremultiply(bgra[1], alpha);
+          rgb[2] = unpremultiply(bgra[0], alpha);
+        }
+      }
+    }
+
+#ifdef PIXELCONVERSION_X86
+
+    // SSE4.1 versions; each returns the number of samples (or pixels) it handled, the caller finishes the
+    // rest with the scalar code
+
+    PIXELCONVERSION_TARGET("sse4.1") unsigned long long convertSSE41(const void* source, const DataType& sourceType, void* destination,
+      const DataType& destinationType, const unsigned long long& count) {
+      unsigned long long i = 0;
+      if (sourceType == UChar) {
+        const unsigned char* s = static_cast<const unsigned char*>(source);
+        if (destinationType == Float) {
+          float* d = static_cast<float*>(destination);
+          for (; i + 16 <= count; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            _mm_storeu_ps(d + i, _mm_cvtepi32_ps(_mm_cvtepu8_epi32(v)));
+            _mm_storeu_ps(d + i + 4, _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(v, 4))));
+            _mm_storeu_ps(d + i + 8, _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(v, 8))));
+            _mm_storeu_ps(d + i + 12, _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(v, 12))));
+          }
+        }
+        else if (destinationType == UInt16) {
+          unsigned short* d = static_cast<unsigned short*>(destination);
+          for (; i + 16 <= count; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), _mm_cvtepu8_epi16(v));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i + 8), _mm_cvtepu8_epi16(_mm_srli_si128(v, 8)));
+          }
+        }
+        else if (destinationType == UInt32) {
+          unsigned int* d = static_cast<unsigned int*>(destination);
+          for (; i + 16 <= count; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), _mm_cvtepu8_epi32(v));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i + 4), _mm_cvtepu8_epi32(_mm_srli_si128(v, 4)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i + 8), _mm_cvtepu8_epi32(_mm_srli_si128(v, 8)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i + 12), _mm_cvtepu8_epi32(_mm_srli_si128(v, 12)));
+          }
+        }
+      }
+      else if (sourceType == UInt16) {
+        const unsigned short* s = static_cast<const unsigned short*>(source);
+        if (destinationType == Float) {
+          float* d = static_cast<float*>(destination);
+          for (; i + 8 <= count; i += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            _mm_storeu_ps(d + i, _mm_cvtepi32_ps(_mm_cvtepu16_epi32(v)));
+            _mm_storeu_ps(d + i + 4, _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(v, 8))));
+          }
+        }
+        else if (destinationType == UInt32) {
+          unsigned int* d = static_cast<unsigned int*>(destination);
+          for (; i + 8 <= count; i += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), _mm_cvtepu16_epi32(v));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i + 4), _mm_cvtepu16_epi32(_mm_srli_si128(v, 8)));
+          }
+        }
+      }
+      else if (sourceType == Float) {
+        const float* s = static_cast<const float*>(source);
+        const __m128 zero = _mm_setzero_ps();
+        if (destinationType == UChar) {
+          unsigned char* d = static_cast<unsigned char*>(destination);
+          const __m128 maximum = _mm_set1_ps(255.f);
+          for (; i + 16 <= count; i += 16) {
+            __m128i a = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(s + i), zero), maximum));
+            __m128i b = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(s + i + 4), zero), maximum));
+            __m128i c = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(s + i + 8), zero), maximum));
+            __m128i e = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(s + i + 12), zero), maximum));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, e)));
+          }
+        }
+        else if (destinationType == UInt16) {
+          unsigned short* d = static_cast<unsigned short*>(destination);
+          const __m128 maximum = _mm_set1_ps(65535.f);
+          for (; i + 8 <= count; i += 8) {
+            __m128i a = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(s + i), zero), maximum));
+            __m128i b = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(s + i + 4), zero), maximum));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), _mm_packus_epi32(a, b));
+          }
+        }
+      }
+      return i;
+    }
+
+    // Byte shuffles which swap samples 0 and 2 of every pixel, for 1, 2 and 4 byte samples; a 16 byte
+    // block always holds whole pixels
+    PIXELCONVERSION_TARGET("sse4.1") __m128i swapMask(const unsigned int& sampleSize) {
+      if (sampleSize == 1) {
+        return _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+      }
+      else if (sampleSize == 2) {
+        return _mm_setr_epi8(4, 5, 2, 3, 0, 1, 6, 7, 12, 13, 10, 11, 8, 9, 14, 15);
+      }
+      return _mm_setr_epi8(8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3, 12, 13, 14, 15);
+    }
+
+    PIXELCONVERSION_TARGET("sse4.1") unsigned long long swapRedAndBlueSSE41(unsigned char* pixels, const unsigned int& sampleSize, const unsigned long long& numberOfPixels) {
+      const unsigned long long pixelsPerBlock = 16 / (4 * sampleSize);
+      const __m128i mask = swapMask(sampleSize);
+      unsigned long long i = 0;
+      for (; i + pixelsPerBlock <= numberOfPixels; i += pixelsPerBlock) {
+        __m128i* block = reinterpret_cast<__m128i*>(pixels + i * 4 * sampleSize);
+        _mm_storeu_si128(block, _mm_shuffle_epi8(_mm_loadu_si128(block), mask));
+      }
+      return i;
+    }
+
+    // Handles blocks of four pixels which are all opaque or all transparent, mixed blocks go through the
+    // scalar code. Sixteen bytes are stored for twelve bytes of output, so the last block is left over.
+    PIXELCONVERSION_TARGET("sse4.1") unsigned long long unpremultiplySSE41(const unsigned char* bgra, unsigned char* rgb, const unsigned long long& numberOfPixels,
+      const unsigned char* background) {
+      const __m128i toRGB = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+      const __m128i opaque = _mm_set1_epi8(-1);
+      const __m128i transparent = _mm_setzero_si128();
+      const __m128i backgroundPixels = _mm_setr_epi8(background[0], background[1], background[2], background[0], background[1], background[2],
+        background[0], background[1], background[2], background[0], background[1], background[2], 0, 0, 0, 0);
+      unsigned long long i = 0;
+      for (; i + 6 <= numberOfPixels; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bgra + i * 4));
+        __m128i* out = reinterpret_cast<__m128i*>(rgb + i * 3);
+        if ((_mm_movemask_epi8(_mm_cmpeq_epi8(v, opaque)) & 0x8888) == 0x8888) {
+          _mm_storeu_si128(out, _mm_shuffle_epi8(v, toRGB));
+        }
+        else if ((_mm_movemask_epi8(_mm_cmpeq_epi8(v, transparent)) & 0x8888) == 0x8888) {
+          _mm_storeu_si128(out, backgroundPixels);
+        }
+        else {
+          unpremultiplyScalar(bgra + i * 4, rgb + i * 3, 4, background);
+        }
+      }
+      return i;
+    }
+
+    // AVX2 versions, conversions that are not listed fall back to SSE4.1
+
+    PIXELCONVERSION_TARGET("avx2") unsigned long long convertAVX2(const void* source, const DataType& sourceType, void* destination,
+      const DataType& destinationType, const unsigned long long& count) {
+      unsigned long long i = 0;
+      if (sourceType == UChar) {
+        const unsigned char* s = static_cast<const unsigned char*>(source);
+        if (destinationType == Float) {
+          float* d = static_cast<float*>(destination);
+          for (; i + 16 <= count; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            _mm256_storeu_ps(d + i, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)));
+            _mm256_storeu_ps(d + i + 8, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(v, 8))));
+          }
+        }
+        else if (destinationType == UInt16) {
+          unsigned short* d = static_cast<unsigned short*>(destination);
+          for (; i + 16 <= count; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i), _mm256_cvtepu8_epi16(v));
+          }
+        }
+        else if (destinationType == UInt32) {
+          unsigned int* d = static_cast<unsigned int*>(destination);
+          for (; i + 16 <= count; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i), _mm256_cvtepu8_epi32(v));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i + 8), _mm256_cvtepu8_epi32(_mm_srli_si128(v, 8)));
+          }
+        }
+      }
+      else if (sourceType == UInt16) {
+        const unsigned short* s = static_cast<const unsigned short*>(source);
+        if (destinationType == Float) {
+          float* d = static_cast<float*>(destination);
+          for (; i + 8 <= count; i += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            _mm256_storeu_ps(d + i, _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(v)));
+          }
+        }
+        else if (destinationType == UInt32) {
+          unsigned int* d = static_cast<unsigned int*>(destination);
+          for (; i + 8 <= count; i += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i), _mm256_cvtepu16_epi32(v));
+          }
+        }
+      }
+      return i;
+    }
+
+    PIXELCONVERSION_TARGET("avx2") unsigned long long swapRedAndBlueAVX2(unsigned char* pixels, const unsigned int& sampleSize, const unsigned long long& numberOfPixels) {
+      // The shuffle works within 16 byte lanes, which hold whole pixels
+      const unsigned long long pixelsPerBlock = 32 / (4 * sampleSize);
+      const __m128i laneMask = swapMask(sampleSize);
+      const __m256i mask = _mm256_inserti128_si256(_mm256_castsi128_si256(laneMask), laneMask, 1);
+      unsigned long long i = 0;
+      for (; i + pixelsPerBlock <= numberOfPixels; i += pixelsPerBlock) {
+        __m256i* block = reinterpret_cast<__m256i*>(pixels + i * 4 * sampleSize);
+        _mm256_storeu_si256(block, _mm256_shuffle_epi8(_mm256_loadu_si256(block), mask));
+      }
+      return i;
+    }
+
+    PIXELCONVERSION_TARGET("avx2") unsigned long long unpremultiplyAVX2(const unsigned char* bgra, unsigned char* rgb, const unsigned long long& numberOfPixels,
+      const unsigned char* background) {
+      const __m256i toRGB = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+      const __m256i opaque = _mm256_set1_epi8(-1);
+      const __m256i transparent = _mm256_setzero_si256();
+      const __m128i backgroundPixels = _mm_setr_epi8(background[0], background[1], background[2], background[0], background[1], background[2],
+        background[0], background[1], background[2], background[0], background[1], background[2], 0, 0, 0, 0);
+      unsigned long long i = 0;
+      for (; i + 10 <= numberOfPixels; i += 8) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bgra + i * 4));
+        unsigned char* out = rgb + i * 3;
+        const unsigned int alphaBits = 0x88888888u;
+        if ((static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, opaque))) & alphaBits) == alphaBits) {
+          // Each lane yields twelve bytes, the second store overwrites the padding of the first
+          __m256i shuffled = _mm256_shuffle_epi8(v, toRGB);
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm256_castsi256_si128(shuffled));
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 12), _mm256_extracti128_si256(shuffled, 1));
+        }
+        else if ((static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, transparent))) & alphaBits) == alphaBits) {
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(out), backgroundPixels);
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 12), backgroundPixels);
+        }
+        else {
+          unpremultiplyScalar(bgra + i * 4, out, 8, background);
+        }
+      }
+      return i;
+    }
+
+#endif
+
+    SIMDInstructionSet activeInstructionSet() {
+      return static_cast<SIMDInstructionSet>(std::min<int>(supportedInstructionSet, maximumInstructionSet.load(std::memory_order_relaxed)));
+    }
+
+  }
+
+  SIMDInstructionSet getSIMDInstructionSet() {
+    return activeInstructionSet();
+  }
+
+  void setMaximumSIMDInstructionSet(const SIMDInstructionSet& instructionSet) {
+    maximumInstructionSet = instructionSet;
+  }
+
+  void convertSamples(const void* source, const DataType& sourceType, void* destination, const DataType& destinationType, const unsigned long long& count) {
+    const unsigned int sourceSize = bytesPerSample(sourceType), destinationSize = bytesPerSample(destinationType);
+    if (sourceSize == 0 || destinationSize == 0 || count == 0) {
+      return;
+    }
+    if (sourceType == destinationType) {
+      std::memmove(destination, source, count * sourceSize);
+      return;
+    }
+    unsigned long long done = 0;
+#ifdef PIXELCONVERSION_X86
+    const SIMDInstructionSet instructionSet = activeInstructionSet();
+    if (instructionSet == AVX2Instructions) {
+      done = convertAVX2(source, sourceType, destination, destinationType, count);
+    }
+    if (done == 0 && instructionSet >= SSE41Instructions) {
+      done = convertSSE41(source, sourceType, destination, destinationType, count);
+    }
+#endif
+    convertSamplesScalar(static_cast<const unsigned char*>(source) + done * sourceSize, sourceType,
+      static_cast<unsigned char*>(destination) + done * destinationSize, destinationType, count - done);
+  }
+
+  void swapRedAndBlue(void* pixels, const DataType& dataType, const unsigned long long& numberOfPixels) {
+    const unsigned int sampleSize = bytesPerSample(dataType);
+    if (sampleSize == 0) {
+      return;
+    }
+    unsigned char* bytes = static_cast<unsigned char*>(pixels);
+    unsigned long long done = 0;
+#ifdef PIXELCONVERSION_X86
+    const SIMDInstructionSet instructionSet = activeInstructionSet();
+    if (instructionSet == AVX2Instructions) {
+      done = swapRedAndBlueAVX2(bytes, sampleSize, numberOfPixels);
+    }
+    else if (instructionSet == SSE41Instructions) {
+      done = swapRedAndBlueSSE41(bytes, sampleSize, numberOfPixels);
+    }
+#endif
+    swapRedAndBlueScalar(bytes + done * 4 * sampleSize, sampleSize, numberOfPixels - done);
+  }
+
+  void unpremultiplyBGRAToRGB(const unsigned char* bgra, unsigned char* rgb, const unsigned long long& numberOfPixels, const unsigned char* background) {
+    unsigned long long done = 0;
+#ifdef PIXELCONVERSION_X86
+    const SIMDInstructionSet instructionSet = activeInstructionSet();
+    if (instructionSet == AVX2Instructions) {
+      done = unpremultiplyAVX2(bgra, rgb, numberOfPixels, background);
+    }
+    else if (instructionSet == SSE41Instructions) {
+      done = unpremultiplySSE41(bgra, rgb, numberOfPixels, background);
+    }
+#endif
+    unpremultiplyScalar(bgra + done * 4, rgb + done * 3, numberOfPixels - done, background);
+  }
+
+}
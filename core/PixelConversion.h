@@ -0,0 +1,47 @@
+#ifndef _PixelConversion
+#define _PixelConversion
+
+#include "core_export.h"
+#include "PathologyEnums.h"
+
+namespace core
+{
+
+// Conversion kernels for pixel data. On x86 the SSE4.1 or AVX2 version is picked at runtime depending
+// on the processor, elsewhere (or on older processors) plain loops are used. All versions give the
+// same results for values that fit the destination type.
+
+  enum SIMDInstructionSet : int {
+    ScalarInstructions,
+    SSE41Instructions,
+    AVX2Instructions
+  };
+
+/////////////////////
+// Returns the instruction set the kernels currently use
+  SIMDInstructionSet CORE_EXPORT getSIMDInstructionSet();
+
+/////////////////////
+// Limits the kernels to the given instruction set, e.g. to compare against the scalar code. The
+// kernels never use instructions the processor does not support.
+  void CORE_EXPORT setMaximumSIMDInstructionSet(const SIMDInstructionSet& instructionSet);
+
+/////////////////////
+// Converts count samples of sourceType to destinationType, like a static_cast per sample. Floats
+// that do not fit an integer destination are saturated.
+  void CORE_EXPORT convertSamples(const void* source, const pathology::DataType& sourceType, void* destination,
+    const pathology::DataType& destinationType, const unsigned long long& count);
+
+/////////////////////
+// Swaps the first and third sample of every pixel of four samples in place (BGRA <-> RGBA)
+  void CORE_EXPORT swapRedAndBlue(void* pixels, const pathology::DataType& dataType, const unsigned long long& numberOfPixels);
+
+/////////////////////
+// Converts premultiplied BGRA pixels (as returned by OpenSlide) to RGB. Fully transparent pixels
+// get the background color, given as red, green and blue.
+  void CORE_EXPORT unpremultiplyBGRAToRGB(const unsigned char* bgra, unsigned char* rgb, const unsigned long long& numberOfPixels,
+    const unsigned char* background);
+
+}
+
+#endif
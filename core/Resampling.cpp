@@ -0,0 +1,794 @@
+#include "Resampling.h"
+#include "PixelConversion.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RESAMPLING_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define RESAMPLING_TARGET(instructionSet)
+#else
+#define RESAMPLING_TARGET(instructionSet) __attribute__((target(instructionSet)))
+#endif
+#endif
+
+using namespace pathology;
+
+namespace core
+{
+
+  namespace {
+
+    const double pi = 3.14159265358979323846;
+
+    // Source strips are read in chunks of about this many bytes
+    const unsigned long long stripBytes = 4 << 20;
+
+    unsigned int bytesPerSample(const DataType& dataType) {
+      switch (dataType) {
+      case UChar:
+        return 1;
+      case UInt16:
+        return 2;
+      case UInt32:
+      case Float:
+        return 4;
+      default:
+        return 0;
+      }
+    }
+
+    double filterRadius(const ResamplingFilter& filter) {
+      switch (filter) {
+      case LanczosResampling:
+        return 3.;
+      case BilinearResampling:
+        return 1.;
+      default:
+        return 0.5;
+      }
+    }
+
+    double sinc(const double& x) {
+      if (x == 0.) {
+        return 1.;
+      }
+      return std::sin(pi * x) / (pi * x);
+    }
+
+    double filterWeight(const ResamplingFilter& filter, const double& x) {
+      const double distance = std::abs(x);
+      if (filter == LanczosResampling) {
+        return distance < 3. ? sinc(x) * sinc(x / 3.) : 0.;
+      }
+      return distance < 1. ? 1. - distance : 0.;
+    }
+
+    // Source pixels contributing to every destination pixel along one axis, with weights summing to 1
+    struct Contributions {
+      std::vector<long long> first;
+      std::vector<unsigned int> count;
+      std::vector<unsigned int> offset;
+      std::vector<float> weights;
+      unsigned int maxCount;
+    };
+
+    void computeContributions(const ResamplingFilter& requestedFilter, const unsigned long long& sourceSize, const double& sourceStart,
+      const double& scale, const unsigned long long& destinationSize, Contributions& contributions) {
+      // Area averaging only makes sense when downsampling
+      const ResamplingFilter filter = requestedFilter == AreaResampling && scale < 1. ? BilinearResampling : requestedFilter;
+      const double filterScale = std::max(scale, 1.);
+      const double support = filterRadius(filter) * filterScale;
+      const long long lastSourcePixel = static_cast<long long>(sourceSize) - 1;
+      contributions.first.resize(destinationSize);
+      contributions.count.resize(destinationSize);
+      contributions.offset.resize(destinationSize);
+      contributions.weights.clear();
+      contributions.maxCount = 0;
+      std::vector<double> weights;
+      for (unsigned long long i = 0; i < destinationSize; ++i) {
+        const double start = sourceStart + i * scale;
+        const double center = start + 0.5 * scale;
+        long long first = 0, last = -1;
+        weights.clear();
+        if (sourceSize > 0) {
+          if (filter == NearestResampling) {
+            first = last = std::min(std::max(static_cast<long long>(std::floor(center)), 0LL), lastSourcePixel);
+            weights.push_back(1.);
+          }
+          else {
+            first = std::max(static_cast<long long>(std::floor(center - support)), 0LL);
+            last = std::min(static_cast<long long>(std::ceil(center + support)), lastSourcePixel);
+            for (long long j = first; j <= last; ++j) {
+              double weight = 0.;
+              if (filter == AreaResampling) {
+                weight = std::max(std::min(start + scale, j + 1.) - std::max(start, static_cast<double>(j)), 0.);
+              }
+              else {
+                weight = filterWeight(filter, (j + 0.5 - center) / filterScale);
+              }
+              weights.push_back(weight);
+            }
+            // Zero weights at the ends are dropped, so fewer source rows and columns are touched
+            while (!weights.empty() && weights.back() == 0.) {
+              weights.pop_back();
+              --last;
+            }
+            unsigned int leading = 0;
+            while (leading < weights.size() && weights[leading] == 0.) {
+              ++leading;
+            }
+            weights.erase(weights.begin(), weights.begin() + leading);
+            first += leading;
+            double sum = 0.;
+            for (unsigned int k = 0; k < weights.size(); ++k) {
+              sum += weights[k];
+            }
+            if (weights.empty() || sum == 0.) {
+              // Entirely beyond the source, take the nearest edge pixel
+              first = last = std::min(std::max(static_cast<long long>(std::floor(center)), 0LL), lastSourcePixel);
+              weights.assign(1, 1.);
+              sum = 1.;
+            }
+            for (unsigned int k = 0; k < weights.size(); ++k) {
+              weights[k] /= sum;
+            }
+          }
+        }
+        contributions.first[i] = first;
+        contributions.count[i] = static_cast<unsigned int>(weights.size());
+        contributions.offset[i] = static_cast<unsigned int>(contributions.weights.size());
+        contributions.weights.insert(contributions.weights.end(), weights.begin(), weights.end());
+        contributions.maxCount = std::max(contributions.maxCount, contributions.count[i]);
+      }
+    }
+
+    // Source pixels whose centers lie in the area covered by every destination pixel along one axis, at
+    // least the nearest one, for mode resampling
+    void computeBlocks(const unsigned long long& sourceSize, const double& sourceStart, const double& scale,
+      const unsigned long long& destinationSize, std::vector<long long>& first, std::vector<unsigned int>& count) {
+      const long long lastSourcePixel = static_cast<long long>(sourceSize) - 1;
+      first.resize(destinationSize);
+      count.resize(destinationSize);
+      for (unsigned long long i = 0; i < destinationSize; ++i) {
+        const double start = sourceStart + i * scale;
+        long long firstPixel = std::max(static_cast<long long>(std::ceil(start - 0.5)), 0LL);
+        long long lastPixel = std::min(static_cast<long long>(std::ceil(start + scale - 0.5)) - 1, lastSourcePixel);
+        if (lastPixel < firstPixel) {
+          firstPixel = lastPixel = std::min(std::max(static_cast<long long>(std::floor(start + 0.5 * scale)), 0LL), lastSourcePixel);
+        }
+        first[i] = firstPixel;
+        count[i] = static_cast<unsigned int>(lastPixel - firstPixel + 1);
+      }
+    }
+
+    // Returns the pixel that occurs most often among the given ones, the first of them on a tie
+    const unsigned char* mostFrequentPixel(const unsigned char* const* pixels, const unsigned int& count, const unsigned int& pixelBytes) {
+      unsigned int best = 0, bestCount = 0;
+      // Pixels equal to an earlier one are counted again, but can never beat it
+      for (unsigned int i = 0; i < count && bestCount < count - i; ++i) {
+        unsigned int occurrences = 1;
+        for (unsigned int j = i + 1; j < count; ++j) {
+          if (std::memcmp(pixels[i], pixels[j], pixelBytes) == 0) {
+            ++occurrences;
+          }
+        }
+        if (occurrences > bestCount) {
+          best = i;
+          bestCount = occurrences;
+        }
+      }
+      return pixels[best];
+    }
+
+    void resampleRow(const float* source, const unsigned int& samplesPerPixel, const Contributions& columns, float* destination) {
+      for (unsigned long long x = 0; x < columns.first.size(); ++x) {
+        const float* weights = &columns.weights[0] + columns.offset[x];
+        const float* pixel = source + columns.first[x] * samplesPerPixel;
+        float* out = destination + x * samplesPerPixel;
+        for (unsigned int c = 0; c < samplesPerPixel; ++c) {
+          float sum = 0.f;
+          for (unsigned int k = 0; k < columns.count[x]; ++k) {
+            sum += weights[k] * pixel[k * samplesPerPixel + c];
+          }
+          out[c] = sum;
+        }
+      }
+    }
+
+    // destination = bias + sum of weights[k] * rows[k], the vertical pass over the horizontally resampled rows
+    void combineRowsScalar(const float* const* rows, const float* weights, const unsigned int& numberOfRows, const float& bias,
+      float* destination, const unsigned long long& count, unsigned long long i) {
+      for (; i < count; ++i) {
+        float sum = bias;
+        for (unsigned int k = 0; k < numberOfRows; ++k) {
+          sum += weights[k] * rows[k][i];
+        }
+        destination[i] = sum;
+      }
+    }
+
+#ifdef RESAMPLING_X86
+
+    RESAMPLING_TARGET("sse4.1") void combineRowsSSE41(const float* const* rows, const float* weights, const unsigned int& numberOfRows,
+      const float& bias, float* destination, const unsigned long long& count) {
+      unsigned long long i = 0;
+      for (; i + 4 <= count; i += 4) {
+        __m128 sum = _mm_set1_ps(bias);
+        for (unsigned int k = 0; k < numberOfRows; ++k) {
+          sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(rows[k] + i)));
+        }
+        _mm_storeu_ps(destination + i, sum);
+      }
+      combineRowsScalar(rows, weights, numberOfRows, bias, destination, count, i);
+    }
+
+    RESAMPLING_TARGET("avx2") void combineRowsAVX2(const float* const* rows, const float* weights, const unsigned int& numberOfRows,
+      const float& bias, float* destination, const unsigned long long& count) {
+      unsigned long long i = 0;
+      for (; i + 8 <= count; i += 8) {
+        __m256 sum = _mm256_set1_ps(bias);
+        for (unsigned int k = 0; k < numberOfRows; ++k) {
+          sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(weights[k]), _mm256_loadu_ps(rows[k] + i)));
+        }
+        _mm256_storeu_ps(destination + i, sum);
+      }
+      combineRowsScalar(rows, weights, numberOfRows, bias, destination, count, i);
+    }
+
+#endif
+
+    void combineRows(const SIMDInstructionSet& instructionSet, const float* const* rows, const float* weights, const unsigned int& numberOfRows,
+      const float& bias, float* destination, const unsigned long long& count) {
+#ifdef RESAMPLING_X86
+      if (instructionSet == AVX2Instructions) {
+        combineRowsAVX2(rows, weights, numberOfRows, bias, destination, count);
+        return;
+      }
+      else if (instructionSet == SSE41Instructions) {
+        combineRowsSSE41(rows, weights, numberOfRows, bias, destination, count);
+        return;
+      }
+#endif
+      combineRowsScalar(rows, weights, numberOfRows, bias, destination, count, 0);
+    }
+
+    // The two rows of a 2x2 block are added first, in a type wide enough for the sum of the whole block
+    template <typename T> struct PairSum {
+      typedef T Type;
+    };
+
+    template <> struct PairSum<unsigned char> {
+      typedef unsigned short Type;
+    };
+
+    template <> struct PairSum<unsigned short> {
+      typedef unsigned int Type;
+    };
+
+    template <> struct PairSum<unsigned int> {
+      typedef unsigned long long Type;
+    };
+
+    // Exactly rounded average of a 2x2 block from the sums of its left and right column
+    inline unsigned char averageOfColumns(const unsigned short& left, const unsigned short& right) {
+      return static_cast<unsigned char>((left + right + 2u) >> 2);
+    }
+
+    inline unsigned short averageOfColumns(const unsigned int& left, const unsigned int& right) {
+      return static_cast<unsigned short>((left + right + 2u) >> 2);
+    }
+
+    inline unsigned int averageOfColumns(const unsigned long long& left, const unsigned long long& right) {
+      return static_cast<unsigned int>((left + right + 2u) >> 2);
+    }
+
+    inline float averageOfColumns(const float& left, const float& right) {
+      return (left + right) * 0.25f;
+    }
+
+    // sums[i] = first[i] + second[i]
+    template <typename T> void addRowsScalar(const T* first, const T* second, typename PairSum<T>::Type* sums,
+      const unsigned long long& count, unsigned long long i) {
+      typedef typename PairSum<T>::Type Sum;
+      for (; i < count; ++i) {
+        sums[i] = static_cast<Sum>(first[i]) + static_cast<Sum>(second[i]);
+      }
+    }
+
+#ifdef RESAMPLING_X86
+
+    // The vector kernels return how many sums they computed, the rest is left to the scalar code. The sums
+    // are exact, so the results do not depend on the kernel.
+    RESAMPLING_TARGET("sse4.1") unsigned long long addRowsSSE41(const DataType& dataType, const void* firstRow, const void* secondRow,
+      void* sumRow, const unsigned long long& count) {
+      unsigned long long i = 0;
+      if (dataType == UChar) {
+        const unsigned char* first = static_cast<const unsigned char*>(firstRow);
+        const unsigned char* second = static_cast<const unsigned char*>(secondRow);
+        unsigned short* sums = static_cast<unsigned short*>(sumRow);
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= count; i += 16) {
+          const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first + i));
+          const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(second + i));
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(sums + i), _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)));
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(sums + i + 8), _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)));
+        }
+      }
+      else if (dataType == UInt16) {
+        const unsigned short* first = static_cast<const unsigned short*>(firstRow);
+        const unsigned short* second = static_cast<const unsigned short*>(secondRow);
+        unsigned int* sums = static_cast<unsigned int*>(sumRow);
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 8 <= count; i += 8) {
+          const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first + i));
+          const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(second + i));
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(sums + i), _mm_add_epi32(_mm_unpacklo_epi16(a, zero), _mm_unpacklo_epi16(b, zero)));
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(sums + i + 4), _mm_add_epi32(_mm_unpackhi_epi16(a, zero), _mm_unpackhi_epi16(b, zero)));
+        }
+      }
+      else if (dataType == UInt32) {
+        const unsigned int* first = static_cast<const unsigned int*>(firstRow);
+        const unsigned int* second = static_cast<const unsigned int*>(secondRow);
+        unsigned long long* sums = static_cast<unsigned long long*>(sumRow);
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 4 <= count; i += 4) {
+          const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first + i));
+          const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(second + i));
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(sums + i), _mm_add_epi64(_mm_unpacklo_epi32(a, zero), _mm_unpacklo_epi32(b, zero)));
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(sums + i + 2), _mm_add_epi64(_mm_unpackhi_epi32(a, zero), _mm_unpackhi_epi32(b, zero)));
+        }
+      }
+      else if (dataType == Float) {
+        const float* first = static_cast<const float*>(firstRow);
+        const float* second = static_cast<const float*>(secondRow);
+        float* sums = static_cast<float*>(sumRow);
+        for (; i + 4 <= count; i += 4) {
+          _mm_storeu_ps(sums + i, _mm_add_ps(_mm_loadu_ps(first + i), _mm_loadu_ps(second + i)));
+        }
+      }
+      return i;
+    }
+
+    RESAMPLING_TARGET("avx2") unsigned long long addRowsAVX2(const DataType& dataType, const void* firstRow, const void* secondRow,
+      void* sumRow, const unsigned long long& count) {
+      unsigned long long i = 0;
+      // Unpacking works within 128 bit lanes, so the samples are widened from 128 bit loads instead
+      if (dataType == UChar) {
+        const unsigned char* first = static_cast<const unsigned char*>(firstRow);
+        const unsigned char* second = static_cast<const unsigned char*>(secondRow);
+        unsigned short* sums = static_cast<unsigned short*>(sumRow);
+        for (; i + 16 <= count; i += 16) {
+          const __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(first + i)));
+          const __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(second + i)));
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(sums + i), _mm256_add_epi16(a, b));
+        }
+      }
+      else if (dataType == UInt16) {
+        const unsigned short* first = static_cast<const unsigned short*>(firstRow);
+        const unsigned short* second = static_cast<const unsigned short*>(secondRow);
+        unsigned int* sums = static_cast<unsigned int*>(sumRow);
+        for (; i + 8 <= count; i += 8) {
+          const __m256i a = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(first + i)));
+          const __m256i b = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(second + i)));
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(sums + i), _mm256_add_epi32(a, b));
+        }
+      }
+      else if (dataType == UInt32) {
+        const unsigned int* first = static_cast<const unsigned int*>(firstRow);
+        const unsigned int* second = static_cast<const unsigned int*>(secondRow);
+        unsigned long long* sums = static_cast<unsigned long long*>(sumRow);
+        for (; i + 4 <= count; i += 4) {
+          const __m256i a = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(first + i)));
+          const __m256i b = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(second + i)));
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(sums + i), _mm256_add_epi64(a, b));
+        }
+      }
+      else if (dataType == Float) {
+        const float* first = static_cast<const float*>(firstRow);
+        const float* second = static_cast<const float*>(secondRow);
+        float* sums = static_cast<float*>(sumRow);
+        for (; i + 8 <= count; i += 8) {
+          _mm256_storeu_ps(sums + i, _mm256_add_ps(_mm256_loadu_ps(first + i), _mm256_loadu_ps(second + i)));
+        }
+      }
+      return i;
+    }
+
+    // Averages the 2x2 blocks of two rows of unsigned chars that start at the even pixels, count is the
+    // number of destination samples. Every step loads 16 bytes of both rows and shuffles the left and the
+    // right pixels of as many blocks as fit into 16 bit lanes, so only the samples of those blocks are added.
+    RESAMPLING_TARGET("sse4.1") unsigned long long averageEvenBlocksSSE41(const unsigned char* first, const unsigned char* second,
+      const unsigned int& samplesPerPixel, unsigned char* destination, const unsigned long long& count) {
+      if (samplesPerPixel == 0 || samplesPerPixel > 8) {
+        return 0;
+      }
+      const unsigned int samples = (8 / samplesPerPixel) * samplesPerPixel;
+      char left[16], right[16];
+      for (unsigned int k = 0; k < 8; ++k) {
+        const char offset = static_cast<char>((k / samplesPerPixel) * 2 * samplesPerPixel + k % samplesPerPixel);
+        left[2 * k] = k < samples ? offset : -128;
+        right[2 * k] = k < samples ? static_cast<char>(offset + samplesPerPixel) : -128;
+        left[2 * k + 1] = -128;
+        right[2 * k + 1] = -128;
+      }
+      const __m128i leftMask = _mm_loadu_si128(reinterpret_cast<const __m128i*>(left));
+      const __m128i rightMask = _mm_loadu_si128(reinterpret_cast<const __m128i*>(right));
+      const __m128i two = _mm_set1_epi16(2);
+      // Destination sample i comes from source sample 2 * i onwards; 8 bytes are stored, of which the first
+      // samples are kept and the rest is overwritten by the next step
+      unsigned long long i = 0;
+      for (; i + 8 <= count; i += samples) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first + 2 * i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(second + 2 * i));
+        __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_shuffle_epi8(a, leftMask), _mm_shuffle_epi8(a, rightMask)),
+          _mm_add_epi16(_mm_shuffle_epi8(b, leftMask), _mm_shuffle_epi8(b, rightMask)));
+        sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(destination + i), _mm_packus_epi16(sum, sum));
+      }
+      return i;
+    }
+
+#endif
+
+    // Returns how many destination samples were averaged straight from the rows, the rest goes through addRows
+    template <typename T> unsigned long long averageEvenBlocks(const SIMDInstructionSet& instructionSet, const T* first, const T* second,
+      const unsigned int& samplesPerPixel, T* destination, const unsigned long long& count) {
+      return 0;
+    }
+
+    template <> unsigned long long averageEvenBlocks(const SIMDInstructionSet& instructionSet, const unsigned char* first, const unsigned char* second,
+      const unsigned int& samplesPerPixel, unsigned char* destination, const unsigned long long& count) {
+#ifdef RESAMPLING_X86
+      if (instructionSet == AVX2Instructions || instructionSet == SSE41Instructions) {
+        return averageEvenBlocksSSE41(first, second, samplesPerPixel, destination, count);
+      }
+#endif
+      return 0;
+    }
+
+    template <typename T> void addRows(const SIMDInstructionSet& instructionSet, const DataType& dataType, const T* first, const T* second,
+      typename PairSum<T>::Type* sums, const unsigned long long& count) {
+      unsigned long long i = 0;
+#ifdef RESAMPLING_X86
+      if (instructionSet == AVX2Instructions) {
+        i = addRowsAVX2(dataType, first, second, sums, count);
+      }
+      else if (instructionSet == SSE41Instructions) {
+        i = addRowsSSE41(dataType, first, second, sums, count);
+      }
+#endif
+      addRowsScalar(first, second, sums, count, i);
+    }
+
+    // Averages the pairs of summed pixels that start at the even pixels, with the common numbers of samples
+    // per pixel known to the compiler
+    template <typename T, unsigned int SamplesPerPixel> void averageEvenPairs(const typename PairSum<T>::Type* sums, T* destination,
+      const unsigned long long& count) {
+      for (unsigned long long x = 0; x < count; ++x) {
+        const typename PairSum<T>::Type* left = sums + x * 2 * SamplesPerPixel;
+        for (unsigned int c = 0; c < SamplesPerPixel; ++c) {
+          destination[x * SamplesPerPixel + c] = averageOfColumns(left[c], left[SamplesPerPixel + c]);
+        }
+      }
+    }
+
+    template <typename T> void averageEvenPairs(const typename PairSum<T>::Type* sums, const unsigned int& samplesPerPixel, T* destination,
+      const unsigned long long& count) {
+      if (samplesPerPixel == 1) {
+        averageEvenPairs<T, 1>(sums, destination, count);
+      }
+      else if (samplesPerPixel == 3) {
+        averageEvenPairs<T, 3>(sums, destination, count);
+      }
+      else if (samplesPerPixel == 4) {
+        averageEvenPairs<T, 4>(sums, destination, count);
+      }
+      else {
+        for (unsigned long long x = 0; x < count; ++x) {
+          const typename PairSum<T>::Type* left = sums + x * 2 * samplesPerPixel;
+          for (unsigned int c = 0; c < samplesPerPixel; ++c) {
+            destination[x * samplesPerPixel + c] = averageOfColumns(left[c], left[samplesPerPixel + c]);
+          }
+        }
+      }
+    }
+
+    // Sums of factor x factor samples, wide enough for factors up to 256
+    template <typename T> struct BlockSum {
+      typedef unsigned int Type;
+    };
+
+    template <> struct BlockSum<unsigned int> {
+      typedef unsigned long long Type;
+    };
+
+    template <> struct BlockSum<float> {
+      typedef double Type;
+    };
+
+    template <typename T> T roundedAverage(const unsigned int& sum, const unsigned long long& area) {
+      return static_cast<T>((sum + area / 2) / area);
+    }
+
+    template <typename T> T roundedAverage(const unsigned long long& sum, const unsigned long long& area) {
+      return static_cast<T>((sum + area / 2) / area);
+    }
+
+    template <typename T> T roundedAverage(const double& sum, const unsigned long long& area) {
+      return static_cast<T>(sum / area);
+    }
+
+    template <typename T> void downsampleBlocks(const T* source, const DataType& dataType, const unsigned int& samplesPerPixel,
+      const unsigned long long& sourceRowStride, const unsigned int& factor, const unsigned long long& destinationWidth,
+      const unsigned long long& destinationHeight, T* destination, const unsigned long long& destinationRowStride, const ResamplingFilter& filter) {
+      const unsigned long long rowLength = destinationWidth * samplesPerPixel;
+      if (filter == NearestResampling) {
+        // The pixel at the center of the block, or just right and below of it, like resample
+        for (unsigned long long y = 0; y < destinationHeight; ++y) {
+          const T* row = source + (y * factor + factor / 2) * sourceRowStride + (factor / 2) * samplesPerPixel;
+          T* out = destination + y * destinationRowStride;
+          for (unsigned long long x = 0; x < destinationWidth; ++x) {
+            std::copy(row + x * factor * samplesPerPixel, row + (x * factor + 1) * samplesPerPixel, out + x * samplesPerPixel);
+          }
+        }
+      }
+      else if (filter == ModeResampling) {
+        const unsigned int pixelBytes = samplesPerPixel * sizeof(T);
+        std::vector<const unsigned char*> pixels(factor * factor);
+        for (unsigned long long y = 0; y < destinationHeight; ++y) {
+          const T* row = source + y * factor * sourceRowStride;
+          T* out = destination + y * destinationRowStride;
+          for (unsigned long long x = 0; x < destinationWidth; ++x) {
+            for (unsigned int j = 0; j < factor; ++j) {
+              for (unsigned int i = 0; i < factor; ++i) {
+                pixels[j * factor + i] = reinterpret_cast<const unsigned char*>(row + j * sourceRowStride + (x * factor + i) * samplesPerPixel);
+              }
+            }
+            const T* mode = reinterpret_cast<const T*>(mostFrequentPixel(&pixels[0], factor * factor, pixelBytes));
+            std::copy(mode, mode + samplesPerPixel, out + x * samplesPerPixel);
+          }
+        }
+      }
+      else if (factor == 2) {
+        // Only the blocks at the even pixels are averaged. Unsigned chars are shuffled into place from both
+        // rows; otherwise the two rows are added with vector instructions and then the column sums of every
+        // block are combined, so each source sample is added once.
+        std::vector<typename PairSum<T>::Type> sums(rowLength * 2);
+        const SIMDInstructionSet instructionSet = getSIMDInstructionSet();
+        for (unsigned long long y = 0; y < destinationHeight; ++y) {
+          const T* first = source + y * 2 * sourceRowStride;
+          T* out = destination + y * destinationRowStride;
+          const unsigned long long done = averageEvenBlocks(instructionSet, first, first + sourceRowStride, samplesPerPixel, out, rowLength);
+          if (done < rowLength) {
+            addRows(instructionSet, dataType, first + 2 * done, first + sourceRowStride + 2 * done, &sums[0], (rowLength - done) * 2);
+            averageEvenPairs(&sums[0], samplesPerPixel, out + done, (rowLength - done) / samplesPerPixel);
+          }
+        }
+      }
+      else {
+        typedef typename BlockSum<T>::Type Sum;
+        const unsigned long long area = static_cast<unsigned long long>(factor) * factor;
+        std::vector<Sum> sums(rowLength);
+        for (unsigned long long y = 0; y < destinationHeight; ++y) {
+          std::fill(sums.begin(), sums.end(), Sum(0));
+          for (unsigned int j = 0; j < factor; ++j) {
+            const T* row = source + (y * factor + j) * sourceRowStride;
+            for (unsigned long long x = 0; x < destinationWidth; ++x) {
+              const T* block = row + x * factor * samplesPerPixel;
+              Sum* sum = &sums[x * samplesPerPixel];
+              for (unsigned int i = 0; i < factor; ++i) {
+                for (unsigned int c = 0; c < samplesPerPixel; ++c) {
+                  sum[c] += block[i * samplesPerPixel + c];
+                }
+              }
+            }
+          }
+          T* out = destination + y * destinationRowStride;
+          for (unsigned long long i = 0; i < rowLength; ++i) {
+            out[i] = roundedAverage<T>(sums[i], area);
+          }
+        }
+      }
+    }
+
+    // Mode resampling does not separate into a horizontal and a vertical pass, every destination pixel
+    // picks the most frequent of the source pixels in its block
+    void resampleModeRows(const DataType& sourceType, const unsigned int& samplesPerPixel, const unsigned long long& sourceWidth,
+      const unsigned long long& sourceHeight, const std::function<const void*(const unsigned long long&, const unsigned long long&)>& rowAt,
+      const double& sourceX, const double& sourceY, const double& scaleX, const double& scaleY, void* destination,
+      const DataType& destinationType, const unsigned long long& destinationWidth, const unsigned long long& destinationHeight,
+      const unsigned long long& destinationRowStride) {
+      std::vector<long long> firstColumn, firstRow;
+      std::vector<unsigned int> columnCount, rowCount;
+      computeBlocks(sourceWidth, sourceX, scaleX, destinationWidth, firstColumn, columnCount);
+      computeBlocks(sourceHeight, sourceY, scaleY, destinationHeight, firstRow, rowCount);
+      std::vector<long long> runEnd(destinationHeight);
+      for (unsigned long long y = destinationHeight; y-- > 0;) {
+        const long long last = firstRow[y] + rowCount[y] - 1;
+        runEnd[y] = y + 1 < destinationHeight && firstRow[y + 1] <= last + 1 ? std::max(last, runEnd[y + 1]) : last;
+      }
+
+      const unsigned int pixelBytes = samplesPerPixel * bytesPerSample(sourceType);
+      const unsigned long long rowBytes = sourceWidth * pixelBytes;
+      const unsigned long long destinationRowBytes = destinationRowStride * bytesPerSample(destinationType);
+      unsigned char* out = static_cast<unsigned char*>(destination);
+      // The source rows of a destination row are copied, a strip may end halfway
+      std::vector<unsigned char> rows;
+      std::vector<unsigned char> modes(destinationWidth * pixelBytes);
+      std::vector<const unsigned char*> pixels;
+      long long bufferedFirst = -1;
+      unsigned int bufferedCount = 0;
+      for (unsigned long long y = 0; y < destinationHeight; ++y) {
+        if (firstRow[y] != bufferedFirst || rowCount[y] != bufferedCount) {
+          rows.resize(rowCount[y] * rowBytes);
+          for (unsigned int k = 0; k < rowCount[y]; ++k) {
+            const unsigned char* row = static_cast<const unsigned char*>(rowAt(firstRow[y] + k, runEnd[y]));
+            std::copy(row, row + rowBytes, &rows[k * rowBytes]);
+          }
+          bufferedFirst = firstRow[y];
+          bufferedCount = rowCount[y];
+        }
+        for (unsigned long long x = 0; x < destinationWidth; ++x) {
+          pixels.clear();
+          for (unsigned int k = 0; k < rowCount[y]; ++k) {
+            for (unsigned int i = 0; i < columnCount[x]; ++i) {
+              pixels.push_back(&rows[k * rowBytes + (firstColumn[x] + i) * pixelBytes]);
+            }
+          }
+          const unsigned char* mode = mostFrequentPixel(&pixels[0], static_cast<unsigned int>(pixels.size()), pixelBytes);
+          std::copy(mode, mode + pixelBytes, &modes[x * pixelBytes]);
+        }
+        convertSamples(&modes[0], sourceType, out + y * destinationRowBytes, destinationType, destinationWidth * samplesPerPixel);
+      }
+    }
+
+    // rowAt(row, lastRow) returns a pointer to the source row; rows are requested in increasing order and
+    // all rows from row up to lastRow will be needed
+    void resampleRows(const DataType& sourceType, const unsigned int& samplesPerPixel, const unsigned long long& sourceWidth,
+      const unsigned long long& sourceHeight, const std::function<const void*(const unsigned long long&, const unsigned long long&)>& rowAt,
+      const double& sourceX, const double& sourceY, const double& scaleX, const double& scaleY, void* destination,
+      const DataType& destinationType, const unsigned long long& destinationWidth, const unsigned long long& destinationHeight,
+      const unsigned long long& destinationRowStride, const ResamplingFilter& filter) {
+      const unsigned int destinationSampleSize = bytesPerSample(destinationType);
+      if (bytesPerSample(sourceType) == 0 || destinationSampleSize == 0 || samplesPerPixel == 0 || destinationWidth == 0 || destinationHeight == 0) {
+        return;
+      }
+      unsigned char* out = static_cast<unsigned char*>(destination);
+      const unsigned long long destinationRowBytes = destinationRowStride * destinationSampleSize;
+      const unsigned long long rowLength = destinationWidth * samplesPerPixel;
+      if (sourceWidth == 0 || sourceHeight == 0) {
+        std::vector<float> zeros(rowLength, 0.f);
+        for (unsigned long long y = 0; y < destinationHeight; ++y) {
+          convertSamples(&zeros[0], Float, out + y * destinationRowBytes, destinationType, rowLength);
+        }
+        return;
+      }
+      if (filter == ModeResampling) {
+        resampleModeRows(sourceType, samplesPerPixel, sourceWidth, sourceHeight, rowAt, sourceX, sourceY, scaleX, scaleY, destination,
+          destinationType, destinationWidth, destinationHeight, destinationRowStride);
+        return;
+      }
+
+      Contributions columns, rows;
+      computeContributions(filter, sourceWidth, sourceX, scaleX, destinationWidth, columns);
+      computeContributions(filter, sourceHeight, sourceY, scaleY, destinationHeight, rows);
+
+      // Horizontally resampled source rows are kept in a ring which holds all rows of one destination row;
+      // the first source row of the destination rows never decreases, so every source row is resampled once
+      const unsigned int ringSize = rows.maxCount;
+      std::vector<float> ring(static_cast<size_t>(ringSize) * rowLength);
+      std::vector<float> sourceRow(sourceWidth * samplesPerPixel);
+      std::vector<float> combined(rowLength);
+      std::vector<const float*> rowPointers(ringSize);
+      long long nextSourceRow = 0;
+      const SIMDInstructionSet instructionSet = getSIMDInstructionSet();
+      const float bias = destinationType == Float ? 0.f : 0.5f;
+
+      // Last source row of the run of consecutive rows needed from every destination row on, so strips do
+      // not read rows which are skipped when downsampling with the nearest neighbour
+      std::vector<long long> runEnd(destinationHeight);
+      for (unsigned long long y = destinationHeight; y-- > 0;) {
+        const long long last = rows.first[y] + rows.count[y] - 1;
+        runEnd[y] = y + 1 < destinationHeight && rows.first[y + 1] <= last + 1 ? std::max(last, runEnd[y + 1]) : last;
+      }
+
+      for (unsigned long long y = 0; y < destinationHeight; ++y) {
+        const long long first = rows.first[y];
+        const long long last = first + rows.count[y] - 1;
+        for (long long r = std::max(nextSourceRow, first); r <= last; ++r) {
+          convertSamples(rowAt(r, runEnd[y]), sourceType, &sourceRow[0], Float, sourceRow.size());
+          resampleRow(&sourceRow[0], samplesPerPixel, columns, &ring[(r % ringSize) * rowLength]);
+        }
+        nextSourceRow = std::max(nextSourceRow, last + 1);
+        for (unsigned int k = 0; k < rows.count[y]; ++k) {
+          rowPointers[k] = &ring[((first + k) % ringSize) * rowLength];
+        }
+        combineRows(instructionSet, &rowPointers[0], &rows.weights[0] + rows.offset[y], rows.count[y], bias, &combined[0], rowLength);
+        convertSamples(&combined[0], Float, out + y * destinationRowBytes, destinationType, rowLength);
+      }
+    }
+
+  }
+
+  double getResamplingSupport(const ResamplingFilter& filter, const double& scale) {
+    return filterRadius(filter) * std::max(scale, 1.) + 1.;
+  }
+
+  void resample(const DataType& sourceType, const unsigned int& samplesPerPixel, const unsigned long long& sourceWidth,
+    const unsigned long long& sourceHeight, const std::function<void(const unsigned long long&, const unsigned long long&, void*)>& readRows,
+    const double& sourceX, const double& sourceY, const double& scaleX, const double& scaleY, void* destination,
+    const DataType& destinationType, const unsigned long long& destinationWidth, const unsigned long long& destinationHeight,
+    const unsigned long long& destinationRowStride, const ResamplingFilter& filter) {
+    const unsigned long long rowBytes = sourceWidth * samplesPerPixel * bytesPerSample(sourceType);
+    const unsigned long long rowsPerStrip = std::max(stripBytes / std::max(rowBytes, 1ULL), 1ULL);
+    std::vector<unsigned char> strip;
+    long long stripStart = 0, stripEnd = 0;
+    std::function<const void*(const unsigned long long&, const unsigned long long&)> rowAt =
+      [&](const unsigned long long& row, const unsigned long long& lastRow) -> const void* {
+      const long long r = static_cast<long long>(row);
+      if (r < stripStart || r >= stripEnd) {
+        // The next strip starts at the requested row and stops at the last row that will be needed
+        const unsigned long long numberOfRows = std::min(rowsPerStrip, lastRow - row + 1);
+        strip.resize(numberOfRows * rowBytes);
+        readRows(row, numberOfRows, &strip[0]);
+        stripStart = r;
+        stripEnd = r + numberOfRows;
+      }
+      return &strip[(r - stripStart) * rowBytes];
+    };
+    resampleRows(sourceType, samplesPerPixel, sourceWidth, sourceHeight, rowAt, sourceX, sourceY, scaleX, scaleY, destination,
+      destinationType, destinationWidth, destinationHeight, destinationRowStride, filter);
+  }
+
+  void resample(const void* source, const DataType& sourceType, const unsigned int& samplesPerPixel,
+    const unsigned long long& sourceWidth, const unsigned long long& sourceHeight, const unsigned long long& sourceRowStride,
+    const double& sourceX, const double& sourceY, const double& scaleX, const double& scaleY, void* destination,
+    const DataType& destinationType, const unsigned long long& destinationWidth, const unsigned long long& destinationHeight,
+    const unsigned long long& destinationRowStride, const ResamplingFilter& filter) {
+    const unsigned char* sourceBytes = static_cast<const unsigned char*>(source);
+    const unsigned long long rowBytes = sourceRowStride * bytesPerSample(sourceType);
+    std::function<const void*(const unsigned long long&, const unsigned long long&)> rowAt =
+      [sourceBytes, rowBytes](const unsigned long long& row, const unsigned long long& lastRow) -> const void* {
+      return sourceBytes + row * rowBytes;
+    };
+    resampleRows(sourceType, samplesPerPixel, sourceWidth, sourceHeight, rowAt, sourceX, sourceY, scaleX, scaleY, destination,
+      destinationType, destinationWidth, destinationHeight, destinationRowStride, filter);
+  }
+
+  void downsample(const void* source, const DataType& dataType, const unsigned int& samplesPerPixel,
+    const unsigned long long& sourceWidth, const unsigned long long& sourceHeight, const unsigned long long& sourceRowStride,
+    const unsigned int& factor, void* destination, const unsigned long long& destinationRowStride, const ResamplingFilter& filter) {
+    if (factor == 0 || samplesPerPixel == 0 || bytesPerSample(dataType) == 0) {
+      return;
+    }
+    const unsigned long long destinationWidth = sourceWidth / factor, destinationHeight = sourceHeight / factor;
+    if (destinationWidth == 0 || destinationHeight == 0) {
+      return;
+    }
+    if (filter != NearestResampling && filter != AreaResampling && filter != ModeResampling) {
+      resample(source, dataType, samplesPerPixel, sourceWidth, sourceHeight, sourceRowStride, 0., 0., factor, factor, destination,
+        dataType, destinationWidth, destinationHeight, destinationRowStride, filter);
+    }
+    else if (dataType == UChar) {
+      downsampleBlocks(static_cast<const unsigned char*>(source), dataType, samplesPerPixel, sourceRowStride, factor, destinationWidth,
+        destinationHeight, static_cast<unsigned char*>(destination), destinationRowStride, filter);
+    }
+    else if (dataType == UInt16) {
+      downsampleBlocks(static_cast<const unsigned short*>(source), dataType, samplesPerPixel, sourceRowStride, factor, destinationWidth,
+        destinationHeight, static_cast<unsigned short*>(destination), destinationRowStride, filter);
+    }
+    else if (dataType == UInt32) {
+      downsampleBlocks(static_cast<const unsigned int*>(source), dataType, samplesPerPixel, sourceRowStride, factor, destinationWidth,
+        destinationHeight, static_cast<unsigned int*>(destination), destinationRowStride, filter);
+    }
+    else {
+      downsampleBlocks(static_cast<const float*>(source), dataType, samplesPerPixel, sourceRowStride, factor, destinationWidth,
+        destinationHeight, static_cast<float*>(destination), destinationRowStride, filter);
+    }
+  }
+
+}
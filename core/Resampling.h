@@ -0,0 +1,60 @@
+#ifndef _Resampling
+#define _Resampling
+
+#include <functional>
+#include "core_export.h"
+#include "PathologyEnums.h"
+
+namespace core
+{
+
+// Separable resampling of interleaved pixel data. The source is consumed row by row in strips, so
+// resampling a large region only needs one strip of it in memory at a time.
+
+  enum ResamplingFilter {
+    NearestResampling,   // Nearest source pixel, keeps label values intact
+    BilinearResampling,  // Triangle filter, widened when downsampling so every source pixel contributes
+    AreaResampling,      // Average of the covered source pixels; bilinear when upsampling
+    LanczosResampling,   // Lanczos with three lobes, the sharpest but may ring at strong edges
+    ModeResampling       // Most frequent pixel value among the source pixels whose centers are covered, for label images
+  };
+
+/////////////////////
+// Returns how many source pixels the filter reaches beyond the area covered by a destination pixel,
+// scale is the number of source pixels per destination pixel
+  double CORE_EXPORT getResamplingSupport(const ResamplingFilter& filter, const double& scale);
+
+/////////////////////
+// Resamples part of a source image of sourceWidth x sourceHeight pixels. Destination pixel (i, j)
+// covers the source area starting at (sourceX + i * scaleX, sourceY + j * scaleY) in pixel edge
+// coordinates, so (0, 0) is the top left corner of the first source pixel. readRows(firstRow,
+// numberOfRows, rows) is called with increasing rows and has to fill rows with numberOfRows rows of
+// sourceWidth pixels of sourceType; rows the filter does not need are never requested. Pixels beyond the
+// edges of the source do not contribute. Integer destinations are rounded and saturated.
+  void CORE_EXPORT resample(const pathology::DataType& sourceType, const unsigned int& samplesPerPixel, const unsigned long long& sourceWidth,
+    const unsigned long long& sourceHeight, const std::function<void(const unsigned long long&, const unsigned long long&, void*)>& readRows,
+    const double& sourceX, const double& sourceY, const double& scaleX, const double& scaleY, void* destination,
+    const pathology::DataType& destinationType, const unsigned long long& destinationWidth, const unsigned long long& destinationHeight,
+    const unsigned long long& destinationRowStride, const ResamplingFilter& filter);
+
+/////////////////////
+// Same as above for a source in memory with rows of sourceRowStride samples
+  void CORE_EXPORT resample(const void* source, const pathology::DataType& sourceType, const unsigned int& samplesPerPixel,
+    const unsigned long long& sourceWidth, const unsigned long long& sourceHeight, const unsigned long long& sourceRowStride,
+    const double& sourceX, const double& sourceY, const double& scaleX, const double& scaleY, void* destination,
+    const pathology::DataType& destinationType, const unsigned long long& destinationWidth, const unsigned long long& destinationHeight,
+    const unsigned long long& destinationRowStride, const ResamplingFilter& filter);
+
+/////////////////////
+// Downsamples by an integer factor to sourceWidth / factor x sourceHeight / factor pixels of the same
+// data type; destination pixel (i, j) is made from the factor x factor source pixels starting at
+// (i * factor, j * factor). Matches resample with scales of factor, but nearest, area and mode have
+// dedicated kernels, with vector instructions for area averaging by a factor of 2. Integer averages are
+// rounded exactly, also for samples too large for a float.
+  void CORE_EXPORT downsample(const void* source, const pathology::DataType& dataType, const unsigned int& samplesPerPixel,
+    const unsigned long long& sourceWidth, const unsigned long long& sourceHeight, const unsigned long long& sourceRowStride,
+    const unsigned int& factor, void* destination, const unsigned long long& destinationRowStride, const ResamplingFilter& filter);
+
+}
+
+#endif
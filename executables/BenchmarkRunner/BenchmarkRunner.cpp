@@ -0,0 +1,20 @@
+#include "UnitTest++/UnitTest++.h"
+#include "UnitTest++/TestReporterStdout.h"
+#include <iostream>
+#include "config/ASAPMacros.h"
+
+using namespace std;
+
+int main(int argc, char* argv[])
+{
+  std::cout << "BenchmarkRunner v" << ASAP_VERSION_STRING << endl;
+  string suite;
+  if (argc >= 2)
+  {
+    suite = argv[1];
+    std::cout << "Running only suite " << suite << endl;
+  }
+  UnitTest::TestReporterStdout reporter;
+  UnitTest::TestRunner runner(reporter);
+  return runner.RunTestsIf(UnitTest::Test::GetTestList(), suite.empty() ? NULL : suite.c_str(), UnitTest::True(), 0);
+}
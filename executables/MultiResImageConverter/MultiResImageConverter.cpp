@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "multiresolutionimageinterface/MultiResolutionImageReader.h"
@@ -19,7 +21,7 @@ namespace po = boost::program_options;
 using namespace std;
 using namespace pathology;
 
-void convertImage(std::string fileIn, std::string fileOut, bool svs = false, std::string compression = "LZW", double quality = 70., double spacingX = -1.0, double spacingY = -1.0, unsigned int tileSize = 512, int maxPyramidLevels = -1, int downsamplePerLevel =2) {
+void convertImage(std::string fileIn, std::string fileOut, bool svs = false, std::string compression = "LZW", double quality = 70., double spacingX = -1.0, double spacingY = -1.0, unsigned int tileSize = 512, int maxPyramidLevels = -1, int downsamplePerLevel =2, unsigned int threads = 0, std::string interpolation = "Linear") {
   MultiResolutionImageReader read;
   MultiResolutionImageWriter* writer;
   if (svs) {
@@ -59,8 +61,31 @@ void convertImage(std::string fileIn, std::string fileOut, bool svs = false, std
           writer->setJPEGQuality(quality);
         }
 
-        writer->setDownsamplePerLevel(downsamplePerLevel);
+        if (interpolation == string("Nearest")) {
+          writer->setInterpolation(NearestNeighbor);
+        }
+        else if (interpolation == string("Linear")) {
+          writer->setInterpolation(Linear);
+        }
+        else if (interpolation == string("Area")) {
+          writer->setInterpolation(Area);
+        }
+        else if (interpolation == string("Lanczos")) {
+          writer->setInterpolation(Lanczos);
+        }
+        else if (interpolation == string("Mode")) {
+          writer->setInterpolation(Mode);
+        }
+        else {
+          cout << "Invalid interpolation, setting default Linear as interpolation" << endl;
+          writer->setInterpolation(Linear);
+        }
+
+        if (writer->setDownsamplePerLevel(downsamplePerLevel) < 0) {
+          cout << "Downsample per level has to divide the tile size, setting default 2" << endl;
+        }
         writer->setMaxNumberOfPyramidLevels(maxPyramidLevels);
+        writer->setNumberOfCompressionThreads(threads > 0 ? threads : std::max(std::thread::hardware_concurrency(), 1u));
 
         if (spacingX > 0.0 && spacingY > 0.0) {
           std::vector<double> overrideSpacing;
@@ -90,11 +115,12 @@ void convertImage(std::string fileIn, std::string fileOut, bool svs = false, std
 int main(int argc, char *argv[]) {
   try {
 
-    std::string inputPth, outputPth, codec;
+    std::string inputPth, outputPth, codec, interpolation;
     double rate, spacingX, spacingY;
     unsigned int tileSize;
     int pyramidLevels;
     unsigned int downsamplePerLevel;
+    unsigned int threads;
     po::options_description desc("Options");
     desc.add_options()
       ("help,h", "Displays this message")
@@ -106,6 +132,8 @@ int main(int argc, char *argv[]) {
       ("tileSize,t", po::value<unsigned int>(&tileSize)->default_value(512), "Sets the tile size for the TIF")
       ("pyramidLevels,p", po::value<int>(&pyramidLevels)->default_value(-1), "Sets the maximum number of pyramid levels; -1 indicates that the number of levels is automatically determined")
       ("downsample,d", po::value<unsigned int>(&downsamplePerLevel)->default_value(2), "Sets the downsample factor between each pyramid level")
+      ("threads,n", po::value<unsigned int>(&threads)->default_value(0), "Sets the number of threads that compress tiles; 0 uses one per core")
+      ("interpolation,i", po::value<std::string>(&interpolation)->default_value("Linear"), "Sets the interpolation to downsample the pyramid levels. Can be one of the following: Nearest, Linear, Area, Lanczos, Mode (for label images)")
       ;
   
     po::positional_options_description positionalOptions;
@@ -150,10 +178,10 @@ int main(int argc, char *argv[]) {
 
     if (core::fileExists(inputPth) && !core::dirExists(outputPth)) {
       if (!vm["spacingX"].defaulted() || !vm["spacingY"].defaulted()) {
-        convertImage(inputPth, outputPth, svs, codec, rate, spacingX, spacingY, tileSize, pyramidLevels, downsamplePerLevel);
+        convertImage(inputPth, outputPth, svs, codec, rate, spacingX, spacingY, tileSize, pyramidLevels, downsamplePerLevel, threads, interpolation);
       }
       else {
-        convertImage(inputPth, outputPth, svs, codec, rate, -1., -1., tileSize, pyramidLevels, downsamplePerLevel);
+        convertImage(inputPth, outputPth, svs, codec, rate, -1., -1., tileSize, pyramidLevels, downsamplePerLevel, threads, interpolation);
       }
     } 
     else if (core::dirExists(outputPth)) { //Could be wildcards and output dir 
@@ -171,10 +199,10 @@ int main(int argc, char *argv[]) {
           core::changeExtension(outPth, "tif");
         }
         if (!vm["spacingX"].defaulted() || !vm["spacingY"].defaulted()) {
-          convertImage(fls[i], outPth, svs, codec, rate, spacingX, spacingY, tileSize, pyramidLevels, downsamplePerLevel);
+          convertImage(fls[i], outPth, svs, codec, rate, spacingX, spacingY, tileSize, pyramidLevels, downsamplePerLevel, threads, interpolation);
         }
         else {
-          convertImage(fls[i], outPth, svs, codec, rate, -1., -1., tileSize, pyramidLevels, downsamplePerLevel);
+          convertImage(fls[i], outPth, svs, codec, rate, -1., -1., tileSize, pyramidLevels, downsamplePerLevel, threads, interpolation);
         }
       }
     }
@@ -63,7 +63,9 @@ bool ArithmeticWholeSlideFilter::process() {
   writer.setCompression(pathology::Compression::LZW);
   writer.setDataType(pathology::DataType::UInt32);
   writer.setInterpolation(pathology::Interpolation::NearestNeighbor);
-  writer.setTileSize(512);
+  TileIterationOptions options;
+  unsigned int tileSize = img->getOutputTileSize(this->_processedLevel, options);
+  writer.setTileSize(tileSize);
   std::vector<double> spacing = img->getSpacing();
   if (!spacing.empty()) {
     spacing[0] *= downsample;
@@ -84,28 +86,19 @@ bool ArithmeticWholeSlideFilter::process() {
   for (unsigned int i = 0; i < stringLabels.size() - 1; ++i) {
     labels[core::fromstring<unsigned int>(stringLabels[i])] = 1;
   }
-  unsigned int* tile = new unsigned int[512 * 512];
-  unsigned int* out_tile = new unsigned int[512 * 512];
-  for (unsigned long long t_y = 0; t_y < dims[1]; t_y += 512) {
-    for (unsigned long long t_x = 0; t_x < dims[0]; t_x += 512) {
-      img->getRawRegion<unsigned int>(static_cast<unsigned long long>(t_x*downsample), static_cast<unsigned long long>(t_y*downsample), 512, 512, this->_processedLevel, tile);
-      for (unsigned int y = 0; y < 512; ++y) {
-        for (unsigned int x = 0; x < 512; ++x) {
-          float curVal = tile[y * 512 + x];
-          if (curVal > 0 && labels[curVal]==0) {
-            out_tile[y * 512 + x] = curVal;
-          }
-          else {
-            out_tile[y * 512 + x] = 0;
-          }
+  std::vector<unsigned int> out_tile(tileSize * tileSize);
+  img->forEachTile<unsigned int>(this->_processedLevel, [&](const TileView<unsigned int>& tile) {
+    std::fill(out_tile.begin(), out_tile.end(), 0);
+    for (unsigned int y = 0; y < tile.height; ++y) {
+      for (unsigned int x = 0; x < tile.width; ++x) {
+        float curVal = tile.at(x, y);
+        if (curVal > 0 && labels[curVal]==0) {
+          out_tile[y * tileSize + x] = curVal;
         }
       }
-      writer.writeBaseImagePart(reinterpret_cast<void*>(out_tile));
     }
-  }
+    writer.writeBaseImagePart(reinterpret_cast<void*>(out_tile.data()));
+  }, options);
   writer.finishImage();
-
-  delete[] tile;
-  delete[] out_tile;
   return true;
 }
\ No newline at end of file
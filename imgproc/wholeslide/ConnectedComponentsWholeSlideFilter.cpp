@@ -164,8 +164,10 @@ bool ConnectedComponentsWholeSlideFilter::process() const {
   writer.setColorType(pathology::ColorType::Monochrome);
   writer.setCompression(pathology::Compression::LZW);
   writer.setDataType(pathology::DataType::UInt32);
-  writer.setInterpolation(pathology::Interpolation::NearestNeighbor);
-  writer.setTileSize(512);
+  writer.setInterpolation(pathology::Interpolation::Mode);
+  TileIterationOptions options;
+  unsigned int tileSize = img->getOutputTileSize(this->_processedLevel, options);
+  writer.setTileSize(tileSize);
   std::vector<double> spacing = img->getSpacing();
   if (!spacing.empty()) {
     spacing[0] *= downsample;
@@ -181,75 +183,70 @@ bool ConnectedComponentsWholeSlideFilter::process() const {
 
   DisjointSet dset;
   dset.addElements(1);
-  unsigned int* buffer_t_x = new unsigned int[512];
-  unsigned int* buffer_t_y = new unsigned int[512 * dims[0]];
-  float* tile = new float[512 * 512];
-  unsigned int* label_tile = new unsigned int[512 * 512];
-  std::fill(label_tile, label_tile + 512 * 512, 0);
-  std::fill(buffer_t_x, buffer_t_x + 512, 0);
-  std::fill(buffer_t_y, buffer_t_y + 512 * dims[0], 0);
+  std::vector<unsigned int> buffer_t_x(tileSize, 0);
+  std::vector<unsigned int> buffer_t_y(tileSize * dims[0], 0);
+  std::vector<unsigned int> label_tile(tileSize * tileSize, 0);
 
   bool firstPass = true;
   std::vector<unsigned int> setIdToFinalLabel;
   for (unsigned int pass = 0; pass < 2; ++pass) {
-    std::fill(buffer_t_y, buffer_t_y + 512 * dims[0], 0);
+    std::fill(buffer_t_y.begin(), buffer_t_y.end(), 0);
     unsigned int curLabel = 0;
-    for (unsigned long long t_y = 0; t_y < dims[1]; t_y += 512) {
-      std::fill(buffer_t_x, buffer_t_x + 512, 0);
-      for (unsigned long long t_x = 0; t_x < dims[0]; t_x += 512) {
-        img->getRawRegion<float>(static_cast<unsigned long long>(t_x*downsample), static_cast<unsigned long long>(t_y*downsample), 512, 512, this->_processedLevel, tile);
-        std::fill(label_tile, label_tile + 512 * 512, 0);
-        for (int y = 0; y < 512; ++y) {
-          for (int x = 0; x < 512; ++x) {
-            unsigned int curVal = tile[y * 512 + x] > _threshold;
-            if (curVal == 1) {
-              unsigned int leftVal = 0;
-              unsigned int topVal = 0;
-              if (x == 0) {
-                leftVal = buffer_t_x[y];
-              }
-              else {
-                leftVal = label_tile[y * 512 + x - 1];
-              }
-              if (y == 0) {
-                topVal = buffer_t_y[t_x + x];
+    img->forEachTile<float>(this->_processedLevel, [&](const TileView<float>& tile) {
+      if (tile.x == 0) {
+        std::fill(buffer_t_x.begin(), buffer_t_x.end(), 0);
+      }
+      std::fill(label_tile.begin(), label_tile.end(), 0);
+      for (int y = 0; y < tileSize; ++y) {
+        for (int x = 0; x < tileSize; ++x) {
+          unsigned int curVal = x < tile.width && y < tile.height && tile.at(x, y) > _threshold;
+          if (curVal == 1) {
+            unsigned int leftVal = 0;
+            unsigned int topVal = 0;
+            if (x == 0) {
+              leftVal = buffer_t_x[y];
+            }
+            else {
+              leftVal = label_tile[y * tileSize + x - 1];
+            }
+            if (y == 0) {
+              topVal = buffer_t_y[tile.x + x];
+            }
+            else {
+              topVal = label_tile[(y - 1) * tileSize + x];
+            }
+            if (leftVal == 0 && topVal == 0) {
+              dset.addElements(1);
+              curLabel++;
+              if (firstPass) {
+                label_tile[y * tileSize + x] = curLabel;
               }
               else {
-                topVal = label_tile[(y - 1) * 512 + x];
-              }
-              if (leftVal == 0 && topVal == 0) {
-                dset.addElements(1);
-                curLabel++;
-                if (firstPass) {
-                  label_tile[y * 512 + x] = curLabel;
-                }
-                else {
-                  label_tile[y * 512 + x] = setIdToFinalLabel[dset.findSet(curLabel)];
-                }
+                label_tile[y * tileSize + x] = setIdToFinalLabel[dset.findSet(curLabel)];
               }
-              else {
-                unsigned int minLabel = std::min(leftVal, topVal) > 0 ? std::min(leftVal, topVal) : std::max(leftVal, topVal);
-                label_tile[y * 512 + x] = minLabel;
-                if (firstPass) {
-                  if (topVal > 0 && leftVal > 0) {
-                    dset.set_union(dset.findSet(leftVal), dset.findSet(topVal));
-                  }
+            }
+            else {
+              unsigned int minLabel = std::min(leftVal, topVal) > 0 ? std::min(leftVal, topVal) : std::max(leftVal, topVal);
+              label_tile[y * tileSize + x] = minLabel;
+              if (firstPass) {
+                if (topVal > 0 && leftVal > 0) {
+                  dset.set_union(dset.findSet(leftVal), dset.findSet(topVal));
                 }
               }
             }
-            if (x == 511) {
-              buffer_t_x[y] = label_tile[y * 512 + x];
-            }
-            if (y == 511) {
-              buffer_t_y[t_x + x] = label_tile[y * 512 + x];
-            }
           }
-        }
-        if (!firstPass) {
-          writer.writeBaseImagePart(reinterpret_cast<void*>(label_tile));
+          if (x == tileSize - 1) {
+            buffer_t_x[y] = label_tile[y * tileSize + x];
+          }
+          if (y == tileSize - 1) {
+            buffer_t_y[tile.x + x] = label_tile[y * tileSize + x];
+          }
         }
       }
-    }
+      if (!firstPass) {
+        writer.writeBaseImagePart(reinterpret_cast<void*>(label_tile.data()));
+      }
+    }, options);
     firstPass = false;
     std::set<unsigned int> set_indices;
     setIdToFinalLabel.resize(dset.numElements());
@@ -264,9 +261,5 @@ bool ConnectedComponentsWholeSlideFilter::process() const {
   }
 
   writer.finishImage();
-  delete[] buffer_t_x;
-  delete[] buffer_t_y;
-  delete[] tile;
-  delete[] label_tile;
   return true;
 }
\ No newline at end of file
@@ -51,7 +51,6 @@ bool LabelStatisticsWholeSlideFilter::process() {
   _labelStats.clear();
   std::shared_ptr<MultiResolutionImage> img = _input.lock();
   std::vector<unsigned long long> dims = img->getLevelDimensions(this->_processedLevel);
-  double downsample = img->getLevelDownsample(this->_processedLevel);
 
   std::ofstream csvfile;
   if (!_outPath.empty()) {
@@ -62,26 +61,22 @@ bool LabelStatisticsWholeSlideFilter::process() {
     }
   }
 
-  unsigned int* tile = new unsigned int[512 * 512];
-  for (unsigned long long t_y = 0; t_y < dims[1]; t_y += 512) {
-    for (unsigned long long t_x = 0; t_x < dims[0]; t_x += 512) {
-      img->getRawRegion<unsigned int>(static_cast<unsigned long long>(t_x*downsample), static_cast<unsigned long long>(t_y*downsample), 512, 512, this->_processedLevel, tile);
-      for (unsigned int y = 0; y < 512; ++y) {
-        for (unsigned int x = 0; x < 512; ++x) {
-          unsigned int curVal = tile[y * 512 + x];
-          if (curVal > 0) {
-            if (curVal > _labelStats.size()) {
-              _labelStats.resize(curVal, std::vector<float>(3, 0.0));
-            }
-            std::vector<float>& loc = _labelStats[curVal - 1];
-            loc[0] += (t_x + x);
-            loc[1] += (t_y + y);
-            loc[2] += 1;
+  img->forEachTile<unsigned int>(this->_processedLevel, [&](const TileView<unsigned int>& tile) {
+    for (unsigned int y = 0; y < tile.height; ++y) {
+      for (unsigned int x = 0; x < tile.width; ++x) {
+        unsigned int curVal = tile.at(x, y);
+        if (curVal > 0) {
+          if (curVal > _labelStats.size()) {
+            _labelStats.resize(curVal, std::vector<float>(3, 0.0));
           }
+          std::vector<float>& loc = _labelStats[curVal - 1];
+          loc[0] += (tile.x + x);
+          loc[1] += (tile.y + y);
+          loc[2] += 1;
         }
       }
     }
-  }
+  });
   if (csvfile.is_open()) {
     csvfile << "Label,CoGX,CoGY,Area\n";
   }
@@ -98,7 +93,5 @@ bool LabelStatisticsWholeSlideFilter::process() {
   if (csvfile.is_open()) {
     csvfile.close();
   }
-
-  delete[] tile;
   return true;
 }
\ No newline at end of file
@@ -91,8 +91,11 @@ bool ThresholdWholeSlideFilter::process() {
   }
   writer.setCompression(pathology::Compression::LZW);
   writer.setDataType(pathology::DataType::UChar);
-  writer.setInterpolation(pathology::Interpolation::NearestNeighbor);
-  writer.setTileSize(512);
+  writer.setInterpolation(pathology::Interpolation::Mode);
+  // Follow the tile grid of the input, so every input tile is decoded once
+  TileIterationOptions options;
+  unsigned int tileSize = img->getOutputTileSize(this->_processedLevel, options);
+  writer.setTileSize(tileSize);
   std::vector<double> spacing = img->getSpacing();
   if (!spacing.empty()) {
     spacing[0] *= downsample;
@@ -106,41 +109,29 @@ bool ThresholdWholeSlideFilter::process() {
   writer.setProgressMonitor(_monitor);
   writer.writeImageInformation(dims[0], dims[1]);
 
-  float* tile = new float[512 * 512 * img->getSamplesPerPixel()];
-  unsigned char* out_tile = new unsigned char[512 * 512 * outSamplesPerPixel];
-  for (unsigned long long t_y = 0; t_y < dims[1]; t_y += 512) {
-    for (unsigned long long t_x = 0; t_x < dims[0]; t_x += 512) {
-      img->getRawRegion<float>(static_cast<unsigned long long>(t_x*downsample), static_cast<unsigned long long>(t_y*downsample), 512, 512, this->_processedLevel, tile);
-      for (unsigned int y = 0; y < 512; ++y) {
-        for (unsigned int x = 0; x < 512; ++x) {
-          for (unsigned int c = 0; c < img->getSamplesPerPixel(); ++c) {
-            if (c == _component) {
-              float curVal = tile[y * 512 * inSamplesPerPixel + x * inSamplesPerPixel + c];
-              if (curVal >= _lowerThreshold && curVal < _upperThreshold) {
-                out_tile[y * 512 + x] = 1;
-              }
-              else {
-                out_tile[y * 512 + x] = 0;
-              }
+  std::vector<unsigned char> out_tile(tileSize * tileSize * outSamplesPerPixel);
+  img->forEachTile<float>(this->_processedLevel, [&](const TileView<float>& tile) {
+    std::fill(out_tile.begin(), out_tile.end(), 0);
+    for (unsigned int y = 0; y < tile.height; ++y) {
+      for (unsigned int x = 0; x < tile.width; ++x) {
+        for (unsigned int c = 0; c < inSamplesPerPixel; ++c) {
+          if (c == _component) {
+            float curVal = tile.at(x, y, c);
+            if (curVal >= _lowerThreshold && curVal < _upperThreshold) {
+              out_tile[y * tileSize + x] = 1;
             }
-            else if (_component < 0) {
-              float curVal = tile[y * 512 * inSamplesPerPixel + x * inSamplesPerPixel + c];
-              if (curVal >= _lowerThreshold && curVal < _upperThreshold) {
-                out_tile[y * 512 * inSamplesPerPixel + x * inSamplesPerPixel + c] = 1;
-              }
-              else {
-                out_tile[y * 512 * inSamplesPerPixel + x * inSamplesPerPixel + c] = 0;
-              }
+          }
+          else if (_component < 0) {
+            float curVal = tile.at(x, y, c);
+            if (curVal >= _lowerThreshold && curVal < _upperThreshold) {
+              out_tile[y * tileSize * inSamplesPerPixel + x * inSamplesPerPixel + c] = 1;
             }
           }
         }
       }
-      writer.writeBaseImagePart(reinterpret_cast<void*>(out_tile));
     }
-  }
+    writer.writeBaseImagePart(reinterpret_cast<void*>(out_tile.data()));
+  }, options);
   writer.finishImage();
-
-  delete[] tile;
-  delete[] out_tile;
   return true;
 }
\ No newline at end of file
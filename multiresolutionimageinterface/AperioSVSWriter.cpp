@@ -10,6 +10,7 @@ extern "C" {
 using namespace pathology;
 
 int AperioSVSWriter::finishImage() {
+  finishBaseImage();
   if (getDataType() == UInt32) {
     writePyramidToDisk<unsigned int>();
     writeThumbnail<unsigned int>();
@@ -19,6 +19,10 @@ class MULTIRESOLUTIONIMAGEINTERFACE_EXPORT AperioSVSWriter : public MultiResolut
 private:
   template <typename T> void writeThumbnail();
 
+protected:
+  //! The thumbnail is made from the temporary file of the lowest level
+  bool buildsPyramidWhileWriting() const { return false; }
+
 public:
   int finishImage();
   void setSpacing(std::vector<double>& spacing);
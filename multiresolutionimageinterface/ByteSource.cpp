@@ -0,0 +1,185 @@
+#include "ByteSource.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+  // Positional reads (pread, or ReadFile with an explicit offset on Windows) on a single descriptor
+  class FileByteSource : public ByteSource {
+  public:
+#ifdef _WIN32
+    FileByteSource(HANDLE file, const unsigned long long& size) : _file(file), _size(size) {}
+    ~FileByteSource() { CloseHandle(_file); }
+#else
+    FileByteSource(int file, const unsigned long long& size) : _file(file), _size(size) {}
+    ~FileByteSource() { close(_file); }
+#endif
+
+    unsigned long long read(const unsigned long long& offset, const unsigned long long& size, void* buffer) const {
+      unsigned long long total = 0;
+      while (total < size && offset + total < _size) {
+#ifdef _WIN32
+        OVERLAPPED position = {};
+        position.Offset = static_cast<DWORD>((offset + total) & 0xFFFFFFFF);
+        position.OffsetHigh = static_cast<DWORD>((offset + total) >> 32);
+        DWORD chunk = static_cast<DWORD>(std::min<unsigned long long>(size - total, 1 << 30));
+        DWORD bytesRead = 0;
+        if (!ReadFile(_file, static_cast<char*>(buffer) + total, chunk, &bytesRead, &position) || bytesRead == 0) {
+          break;
+        }
+#else
+        ssize_t bytesRead = pread(_file, static_cast<char*>(buffer) + total, size - total, offset + total);
+        if (bytesRead <= 0) {
+          break;
+        }
+#endif
+        total += bytesRead;
+      }
+      return total;
+    }
+
+    unsigned long long size() const {
+      return _size;
+    }
+
+  private:
+#ifdef _WIN32
+    HANDLE _file;
+#else
+    int _file;
+#endif
+    unsigned long long _size;
+  };
+
+  // The whole file mapped read-only into the address space; reads are copies from the mapping and
+  // decoders can use data() directly. Pages are faulted in on first access, so no I/O happens up front.
+  class MappedByteSource : public ByteSource {
+  public:
+#ifdef _WIN32
+    MappedByteSource(HANDLE file, HANDLE mapping, const unsigned char* view, const unsigned long long& size) : _file(file), _mapping(mapping), _view(view), _size(size) {}
+    ~MappedByteSource() {
+      UnmapViewOfFile(_view);
+      CloseHandle(_mapping);
+      CloseHandle(_file);
+    }
+#else
+    MappedByteSource(const unsigned char* view, const unsigned long long& size) : _view(view), _size(size) {}
+    ~MappedByteSource() { munmap(const_cast<unsigned char*>(_view), _size); }
+#endif
+
+    unsigned long long read(const unsigned long long& offset, const unsigned long long& size, void* buffer) const {
+      if (offset >= _size) {
+        return 0;
+      }
+      unsigned long long count = std::min(size, _size - offset);
+      std::memcpy(buffer, _view + offset, count);
+      return count;
+    }
+
+    unsigned long long size() const {
+      return _size;
+    }
+
+    const unsigned char* data() const {
+      return _view;
+    }
+
+    void adviseAccessPattern(const AccessPattern& pattern) {
+#ifndef _WIN32
+      // Random access stops the kernel from reading ahead around every tile, sequential access
+      // increases read-ahead and lets pages behind the reader be dropped early
+      int advice = MADV_NORMAL;
+      if (pattern == RandomAccess) {
+        advice = MADV_RANDOM;
+      }
+      else if (pattern == SequentialAccess) {
+        advice = MADV_SEQUENTIAL;
+      }
+      madvise(const_cast<unsigned char*>(_view), _size, advice);
+#endif
+    }
+
+  private:
+#ifdef _WIN32
+    HANDLE _file;
+    HANDLE _mapping;
+#endif
+    const unsigned char* _view;
+    unsigned long long _size;
+  };
+
+  std::atomic<bool> memoryMappingEnabled(false);
+
+}
+
+ByteSource::~ByteSource() {
+}
+
+std::unique_ptr<ByteSource> ByteSource::open(const std::string& filePath) {
+  return open(filePath, memoryMappingEnabled);
+}
+
+void ByteSource::setMemoryMappingEnabled(bool enabled) {
+  memoryMappingEnabled = enabled;
+}
+
+bool ByteSource::getMemoryMappingEnabled() {
+  return memoryMappingEnabled;
+}
+
+std::unique_ptr<ByteSource> ByteSource::open(const std::string& filePath, bool memoryMapped) {
+#ifdef _WIN32
+  int wchars_num = MultiByteToWideChar(CP_UTF8, 0, filePath.c_str(), -1, NULL, 0);
+  wchar_t* w_filePath = new wchar_t[wchars_num];
+  MultiByteToWideChar(CP_UTF8, 0, filePath.c_str(), -1, w_filePath, wchars_num);
+  HANDLE file = CreateFileW(w_filePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+  delete[] w_filePath;
+  LARGE_INTEGER fileSize;
+  if (file == INVALID_HANDLE_VALUE) {
+    return std::unique_ptr<ByteSource>();
+  }
+  if (!GetFileSizeEx(file, &fileSize)) {
+    CloseHandle(file);
+    return std::unique_ptr<ByteSource>();
+  }
+  if (memoryMapped && fileSize.QuadPart > 0 && static_cast<unsigned long long>(fileSize.QuadPart) <= static_cast<SIZE_T>(-1)) {
+    HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping) {
+      void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      if (view) {
+        return std::unique_ptr<ByteSource>(new MappedByteSource(file, mapping, static_cast<const unsigned char*>(view), fileSize.QuadPart));
+      }
+      CloseHandle(mapping);
+    }
+  }
+  return std::unique_ptr<ByteSource>(new FileByteSource(file, fileSize.QuadPart));
+#else
+  int file = ::open(filePath.c_str(), O_RDONLY);
+  if (file < 0) {
+    return std::unique_ptr<ByteSource>();
+  }
+  struct stat fileInfo;
+  if (fstat(file, &fileInfo) != 0) {
+    close(file);
+    return std::unique_ptr<ByteSource>();
+  }
+  if (memoryMapped && fileInfo.st_size > 0 && static_cast<unsigned long long>(fileInfo.st_size) <= static_cast<size_t>(-1)) {
+    void* view = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_SHARED, file, 0);
+    if (view != MAP_FAILED) {
+      // The mapping keeps the file referenced, the descriptor is no longer needed
+      close(file);
+      return std::unique_ptr<ByteSource>(new MappedByteSource(static_cast<const unsigned char*>(view), fileInfo.st_size));
+    }
+  }
+  return std::unique_ptr<ByteSource>(new FileByteSource(file, fileInfo.st_size));
+#endif
+}
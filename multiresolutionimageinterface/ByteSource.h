@@ -0,0 +1,45 @@
+#ifndef _ByteSource
+#define _ByteSource
+#include <memory>
+#include <string>
+#include "multiresolutionimageinterface_export.h"
+
+//! Random access to the bytes of a file. Reads do not share a file position, so a single source can
+//! be used by multiple threads at the same time. Files can either be read with positional reads or
+//! be mapped into memory, in which case data() gives direct access to the contents without copies.
+class MULTIRESOLUTIONIMAGEINTERFACE_EXPORT ByteSource {
+
+public:
+  //! Expected order of reads, passed on to the operating system for mapped files
+  enum AccessPattern {
+    NormalAccess,
+    RandomAccess,
+    SequentialAccess
+  };
+
+  virtual ~ByteSource();
+
+  //! Opens the file for reading, returns an empty pointer if it cannot be opened. The file is mapped
+  //! into memory when memory mapping is enabled; if mapping fails positional reads are used instead.
+  static std::unique_ptr<ByteSource> open(const std::string& filePath);
+  static std::unique_ptr<ByteSource> open(const std::string& filePath, bool memoryMapped);
+
+  //! Whether open() maps files into memory, disabled by default. Only enable this for local files:
+  //! accessing a mapped file that is truncated or on a network share that disappears crashes the process.
+  static void setMemoryMappingEnabled(bool enabled);
+  static bool getMemoryMappingEnabled();
+
+  //! Reads size bytes starting at offset into buffer, returns the number of bytes that were read
+  virtual unsigned long long read(const unsigned long long& offset, const unsigned long long& size, void* buffer) const = 0;
+
+  //! Size of the file in bytes
+  virtual unsigned long long size() const = 0;
+
+  //! Contents of the file if it is mapped into memory, NULL otherwise
+  virtual const unsigned char* data() const { return NULL; }
+
+  //! Hints how the file will be read, only has an effect for mapped files
+  virtual void adviseAccessPattern(const AccessPattern& pattern) {}
+};
+
+#endif
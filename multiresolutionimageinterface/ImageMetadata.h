@@ -0,0 +1,25 @@
+#ifndef _ImageMetadata
+#define _ImageMetadata
+
+#include <map>
+#include <string>
+#include <vector>
+#include "core/PathologyEnums.h"
+
+//! What is known about an image without opening it for reading: no pixel data is read and no decoders,
+//! file handles or caches are set up. Levels are the ones stored in the file, without the levels a
+//! MultiResolutionImage generates for images that have a single one.
+struct ImageMetadata {
+  ImageMetadata() : samplesPerPixel(0), colorType(pathology::InvalidColorType), dataType(pathology::InvalidDataType) {}
+
+  std::string factoryName;
+  std::string fileType;
+  std::vector<std::vector<unsigned long long> > levelDimensions;
+  std::vector<double> spacing;
+  unsigned int samplesPerPixel;
+  pathology::ColorType colorType;
+  pathology::DataType dataType;
+  std::map<std::string, std::string> properties;
+};
+
+#endif
@@ -0,0 +1,116 @@
+#include "ImageStatistics.h"
+
+namespace {
+  const char* codecNames[NumberOfDecodeCodecs] = { "Raw", "Deflate", "LZW", "JPEG", "JPEG2000", "Other" };
+}
+
+unsigned long long DurationHistogram::percentile(const double& fraction) const {
+  unsigned long long seen = 0;
+  for (unsigned int i = 0; i < buckets.size(); ++i) {
+    seen += buckets[i];
+    if (seen > 0 && seen >= fraction * count) {
+      return 2ULL << i;
+    }
+  }
+  return 0;
+}
+
+void ImageStatisticsCollector::AtomicHistogram::record(const unsigned long long& microseconds) {
+  unsigned int bucket = 0;
+  for (unsigned long long remaining = microseconds >> 1; remaining > 0 && bucket < numberOfBuckets - 1; remaining >>= 1) {
+    ++bucket;
+  }
+  buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+  totalMicroseconds.fetch_add(microseconds, std::memory_order_relaxed);
+}
+
+void ImageStatisticsCollector::AtomicHistogram::fill(DurationHistogram& histogram) const {
+  histogram.buckets.resize(numberOfBuckets);
+  for (unsigned int i = 0; i < numberOfBuckets; ++i) {
+    histogram.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+  }
+  histogram.count = count.load(std::memory_order_relaxed);
+  histogram.totalMicroseconds = totalMicroseconds.load(std::memory_order_relaxed);
+}
+
+void ImageStatisticsCollector::AtomicHistogram::reset() {
+  for (unsigned int i = 0; i < numberOfBuckets; ++i) {
+    buckets[i] = 0;
+  }
+  count = 0;
+  totalMicroseconds = 0;
+}
+
+ImageStatisticsCollector::ImageStatisticsCollector() :
+  _requestsInFlight(0),
+  _requestsQueued(0)
+{
+  reset();
+}
+
+void ImageStatisticsCollector::recordBytesRead(const unsigned long long& bytes) {
+  _bytesRead.fetch_add(bytes, std::memory_order_relaxed);
+  _numberOfReads.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ImageStatisticsCollector::recordDecode(const DecodeCodec& codec, const unsigned long long& microseconds) {
+  if (codec < NumberOfDecodeCodecs) {
+    _decodeTimes[codec].record(microseconds);
+  }
+}
+
+void ImageStatisticsCollector::recordLockWait(const unsigned long long& microseconds) {
+  _lockWaits.record(microseconds);
+}
+
+void ImageStatisticsCollector::requestQueued() {
+  _requestsQueued.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ImageStatisticsCollector::requestDequeued() {
+  _requestsQueued.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void ImageStatisticsCollector::requestStarted() {
+  unsigned long long inFlight = _requestsInFlight.fetch_add(1, std::memory_order_relaxed) + 1;
+  unsigned long long peak = _peakRequestsInFlight.load(std::memory_order_relaxed);
+  while (inFlight > peak && !_peakRequestsInFlight.compare_exchange_weak(peak, inFlight, std::memory_order_relaxed)) {
+  }
+}
+
+void ImageStatisticsCollector::requestFinished() {
+  _requestsInFlight.fetch_sub(1, std::memory_order_relaxed);
+  _requestsCompleted.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ImageStatisticsCollector::fillStatistics(ImageStatistics& statistics) const {
+  statistics.bytesRead = _bytesRead.load(std::memory_order_relaxed);
+  statistics.numberOfReads = _numberOfReads.load(std::memory_order_relaxed);
+  statistics.decoding.clear();
+  for (unsigned int codec = 0; codec < NumberOfDecodeCodecs; ++codec) {
+    if (_decodeTimes[codec].count.load(std::memory_order_relaxed) > 0) {
+      DecodeStatistics decode;
+      decode.codec = codecNames[codec];
+      _decodeTimes[codec].fill(decode.decodeTime);
+      statistics.decoding.push_back(decode);
+    }
+  }
+  _lockWaits.fill(statistics.lockWait);
+  statistics.requestsInFlight = _requestsInFlight.load(std::memory_order_relaxed);
+  statistics.peakRequestsInFlight = _peakRequestsInFlight.load(std::memory_order_relaxed);
+  statistics.requestsQueued = _requestsQueued.load(std::memory_order_relaxed);
+  statistics.requestsCompleted = _requestsCompleted.load(std::memory_order_relaxed);
+}
+
+void ImageStatisticsCollector::reset() {
+  // Requests in flight and queued are current state rather than counts, they are left alone
+  _bytesRead = 0;
+  _numberOfReads = 0;
+  for (unsigned int codec = 0; codec < NumberOfDecodeCodecs; ++codec) {
+    _decodeTimes[codec].reset();
+  }
+  _lockWaits.reset();
+  _peakRequestsInFlight = _requestsInFlight.load();
+  _requestsCompleted = 0;
+}
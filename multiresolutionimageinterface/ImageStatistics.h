@@ -0,0 +1,156 @@
+#ifndef IMAGESTATISTICS_H
+#define IMAGESTATISTICS_H
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "multiresolutionimageinterface_export.h"
+#include "TileCache.h"
+
+//! Counts of durations in buckets that double in width: bucket i holds the durations of at least 2^i and
+//! less than 2^(i+1) microseconds, the first bucket also holds everything shorter
+struct DurationHistogram {
+  std::vector<unsigned long long> buckets;
+  unsigned long long count;
+  unsigned long long totalMicroseconds;
+
+  double mean() const { return count > 0 ? static_cast<double>(totalMicroseconds) / count : 0.; }
+
+  //! Upper bound in microseconds of the bucket which holds the given fraction (e.g. 0.99) of the durations
+  unsigned long long percentile(const double& fraction) const;
+};
+
+//! Time spent decoding tiles of one codec
+struct DecodeStatistics {
+  std::string codec;
+  DurationHistogram decodeTime;
+};
+
+//! Snapshot of the counters of a MultiResolutionImage, see MultiResolutionImage::getStatistics
+struct ImageStatistics {
+  //! Decoded and encoded tile caches, including hits and misses per level
+  TileCacheStatistics cache;
+  TileCacheStatistics encodedCache;
+
+  //! Bytes of pixel data read from the file (or touched in the mapping) and the number of reads
+  unsigned long long bytesRead;
+  unsigned long long numberOfReads;
+
+  //! One entry for every codec that decoded at least one tile
+  std::vector<DecodeStatistics> decoding;
+
+  //! Time readers spent blocked on locks of the image: the read handles, tiles another thread was
+  //! decoding and closing or reopening the image
+  DurationHistogram lockWait;
+
+  //! Region reads that are running, the most that ran at the same time, asynchronous reads waiting for a
+  //! worker and region reads that finished
+  unsigned long long requestsInFlight;
+  unsigned long long peakRequestsInFlight;
+  unsigned long long requestsQueued;
+  unsigned long long requestsCompleted;
+};
+
+//! Codecs for which decode times are kept apart
+enum DecodeCodec {
+  RawDecoding,
+  DeflateDecoding,
+  LZWDecoding,
+  JPEGDecoding,
+  JPEG2000Decoding,
+  OtherDecoding,
+  NumberOfDecodeCodecs
+};
+
+//! Collects the counters behind ImageStatistics. Everything is a relaxed atomic counter, so recording is
+//! cheap enough to stay enabled; only blocking waits and decodes are timed.
+class MULTIRESOLUTIONIMAGEINTERFACE_EXPORT ImageStatisticsCollector {
+public :
+  ImageStatisticsCollector();
+
+  void recordBytesRead(const unsigned long long& bytes);
+  void recordDecode(const DecodeCodec& codec, const unsigned long long& microseconds);
+  void recordLockWait(const unsigned long long& microseconds);
+
+  void requestQueued();
+  void requestDequeued();
+  void requestStarted();
+  void requestFinished();
+
+  //! Fills everything except the cache statistics
+  void fillStatistics(ImageStatistics& statistics) const;
+  void reset();
+
+  //! Acquires lock, only timing the acquisition if it is contended
+  template <typename Lock> void lock(Lock& lock) {
+    if (!lock.try_lock()) {
+      Stopwatch stopwatch;
+      lock.lock();
+      recordLockWait(stopwatch.elapsedMicroseconds());
+    }
+  }
+
+  class Stopwatch {
+  public :
+    Stopwatch() : _start(std::chrono::steady_clock::now()) {}
+    unsigned long long elapsedMicroseconds() const {
+      return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _start).count();
+    }
+
+  private :
+    std::chrono::steady_clock::time_point _start;
+  };
+
+  //! Records the lifetime of the object as the decode time of a tile
+  class DecodeTimer {
+  public :
+    DecodeTimer(ImageStatisticsCollector* collector, const DecodeCodec& codec) : _collector(collector), _codec(codec) {}
+    ~DecodeTimer() {
+      if (_collector) {
+        _collector->recordDecode(_codec, _stopwatch.elapsedMicroseconds());
+      }
+    }
+
+  private :
+    ImageStatisticsCollector* _collector;
+    DecodeCodec _codec;
+    Stopwatch _stopwatch;
+  };
+
+  //! Counts a region read as in flight for the lifetime of the object
+  class RequestScope {
+  public :
+    explicit RequestScope(ImageStatisticsCollector* collector) : _collector(collector) { _collector->requestStarted(); }
+    ~RequestScope() { _collector->requestFinished(); }
+
+  private :
+    ImageStatisticsCollector* _collector;
+  };
+
+private :
+  static const unsigned int numberOfBuckets = 24;
+
+  struct AtomicHistogram {
+    std::atomic<unsigned long long> buckets[numberOfBuckets];
+    std::atomic<unsigned long long> count;
+    std::atomic<unsigned long long> totalMicroseconds;
+
+    void record(const unsigned long long& microseconds);
+    void fill(DurationHistogram& histogram) const;
+    void reset();
+  };
+
+  ImageStatisticsCollector(const ImageStatisticsCollector& other);
+  ImageStatisticsCollector& operator=(const ImageStatisticsCollector& other);
+
+  std::atomic<unsigned long long> _bytesRead;
+  std::atomic<unsigned long long> _numberOfReads;
+  AtomicHistogram _decodeTimes[NumberOfDecodeCodecs];
+  AtomicHistogram _lockWaits;
+  std::atomic<unsigned long long> _requestsInFlight;
+  std::atomic<unsigned long long> _peakRequestsInFlight;
+  std::atomic<unsigned long long> _requestsQueued;
+  std::atomic<unsigned long long> _requestsCompleted;
+};
+
+#endif
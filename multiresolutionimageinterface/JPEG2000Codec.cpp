@@ -6,6 +6,7 @@
 #include <cstring>
 #include <vector>
 #include <sstream>
+#include <algorithm>
 
 using namespace std;
 
@@ -120,12 +121,14 @@ static void opj_memory_stream_do_nothing(void * p_user_data)
   OPJ_ARG_NOT_USED(p_user_data);
 }
 
-//Create a stream to use memory as the input or output.
+//Create a stream to use memory as the input or output. Its buffer is never larger than the memory
+//itself, the default chunk of 1 MB would be allocated for every tile that is decoded.
 opj_stream_t* opj_stream_create_default_memory_stream(opj_memory_stream* p_memoryStream, OPJ_BOOL is_read_stream)
 {
   opj_stream_t* l_stream;
+  const OPJ_SIZE_T chunkSize = std::max<OPJ_SIZE_T>(std::min<OPJ_SIZE_T>(p_memoryStream->size, OPJ_J2K_STREAM_CHUNK_SIZE), 1);
 
-  if (!(l_stream = opj_stream_default_create(is_read_stream))) {
+  if (!(l_stream = opj_stream_create(chunkSize, is_read_stream))) {
     return (NULL);
   }
 
@@ -144,72 +147,139 @@ opj_stream_t* opj_stream_create_default_memory_stream(opj_memory_stream* p_memor
 }
 
 
-JPEG2000Codec::JPEG2000Codec()
+JPEG2000Codec::JPEG2000Codec() : _numberOfThreads(1)
 {
 }
 
 JPEG2000Codec::~JPEG2000Codec() {
 }
 
+unsigned int JPEG2000Codec::getNumberOfThreads() const {
+  return _numberOfThreads;
+}
+
+void JPEG2000Codec::setNumberOfThreads(const unsigned int& numberOfThreads) {
+  _numberOfThreads = numberOfThreads > 0 ? numberOfThreads : 1;
+}
+
+//Creates a decompressor for the codestream, with our callbacks.
+static opj_codec_t* create_decoder(const opj_dparameters_t& parameters)
+{
+  opj_codec_t* decoder = opj_create_decompress(OPJ_CODEC_J2K);
+  opj_set_info_handler(decoder, info_callback, NULL);
+  opj_set_warning_handler(decoder, warning_callback, NULL);
+  opj_set_error_handler(decoder, error_callback, NULL);
+  opj_dparameters_t decodeParameters = parameters;
+  opj_setup_decoder(decoder, &decodeParameters);
+  return decoder;
+}
+
+unsigned int JPEG2000Codec::getNumberOfResolutions(const unsigned char* encoded, const unsigned int& inSize)
+{
+  opj_memory_stream headerStream;
+  headerStream.data = const_cast<OPJ_UINT8*>(encoded);
+  headerStream.size = inSize;
+  headerStream.offset = 0;
+  opj_stream_t* l_stream = opj_stream_create_default_memory_stream(&headerStream, OPJ_TRUE);
+  opj_dparameters_t decodeParameters;
+  opj_set_default_decoder_parameters(&decodeParameters);
+  opj_codec_t* decoder = create_decoder(decodeParameters);
+
+  unsigned int resolutions = 0;
+  opj_image_t* headerImage = NULL;
+  if (opj_read_header(l_stream, decoder, &headerImage)) {
+    opj_codestream_info_v2_t* info = opj_get_cstr_info(decoder);
+    if (info && info->m_default_tile_info.tccp_info) {
+      resolutions = info->m_default_tile_info.tccp_info[0].numresolutions;
+    }
+    opj_destroy_cstr_info(&info);
+  }
+  opj_image_destroy(headerImage);
+  opj_stream_destroy(l_stream);
+  opj_destroy_codec(decoder);
+  return resolutions;
+}
+
 void JPEG2000Codec::decode(unsigned char* buf, const unsigned int& inSize, const unsigned int& outSize)
 {
-  //Kind of Openjpeg Stuff (shound be)
-  opj_memory_stream decodeStream;
-  // OpenJPEG stuff.
-  opj_image_t			*decompImage = NULL;
-  opj_stream_t		*l_stream = NULL;
+  unsigned int width = 0, height = 0;
+  if (!decode(buf, inSize, buf, outSize, DecodeParameters(), width, height)) {
+    std::fill(buf, buf + outSize, 0);
+  }
+}
 
-  //Set up the input buffer as a stream
-  decodeStream.data = (OPJ_UINT8 *)buf;
+bool JPEG2000Codec::decode(const unsigned char* encoded, const unsigned int& inSize, unsigned char* buf, const unsigned int& outSize,
+  const DecodeParameters& parameters, unsigned int& width, unsigned int& height) const
+{
+  width = 0;
+  height = 0;
+  //Set up the input buffer as a stream, it is only read from.
+  opj_memory_stream decodeStream;
+  decodeStream.data = const_cast<OPJ_UINT8*>(encoded);
   decodeStream.size = inSize;
   decodeStream.offset = 0;
-    //Open the memory as a stream.
-  l_stream = opj_stream_create_default_memory_stream(&decodeStream, OPJ_TRUE);
+  opj_stream_t* l_stream = opj_stream_create_default_memory_stream(&decodeStream, OPJ_TRUE);
 
+  //OpenJPEG cannot reuse a codec or stream for another codestream, so every decode needs new ones. Its
+  //thread pool belongs to the codec as well, callers decoding tiles in parallel should pass threads = 1.
   opj_dparameters_t decodeParameters;
   opj_set_default_decoder_parameters(&decodeParameters);
-  opj_codec_t* decoder = opj_create_decompress(OPJ_CODEC_FORMAT::OPJ_CODEC_J2K);//Bad openjpeg, can't be reused!
-  //Catch events using our callbacks and give a local context.
-  opj_set_info_handler(decoder, info_callback, NULL);
-  opj_set_warning_handler(decoder, warning_callback, NULL);
-  opj_set_error_handler(decoder, error_callback, NULL);
-
-  //Setup the decoder decoding parameters using user parameters.
-  opj_setup_decoder(decoder, &decodeParameters);
-#if OPJ_VERSION_MAJOR >= 2 && OPJ_VERSION_MINOR >= 3
-  opj_codec_set_threads(decoder, 4);
+  opj_codec_t* decoder = create_decoder(decodeParameters);
+#if OPJ_VERSION_MAJOR > 2 || (OPJ_VERSION_MAJOR == 2 && OPJ_VERSION_MINOR >= 3)
+  const unsigned int threads = parameters.threads > 0 ? parameters.threads : _numberOfThreads;
+  if (threads > 1) {
+    opj_codec_set_threads(decoder, threads);
+  }
 #endif
 
-  // Read the main header of the codestream, if necessary the JP2 boxes, and create decompImage.
-  OPJ_BOOL headerSucces = opj_read_header(l_stream, decoder, &decompImage);
-  OPJ_BOOL decodeSucces = opj_decode(decoder, l_stream, decompImage);
-  OPJ_BOOL decompressSuccess = opj_end_decompress(decoder, l_stream);
-  
+  // Read the main header, then restrict the resolution and area before decoding the tile data.
+  opj_image_t* decompImage = NULL;
+  bool success = opj_read_header(l_stream, decoder, &decompImage) != 0;
+  if (success && parameters.reduce > 0) {
+    success = opj_set_decoded_resolution_factor(decoder, parameters.reduce) != 0;
+  }
+  if (success && parameters.width > 0 && parameters.height > 0) {
+    const OPJ_INT32 x0 = decompImage->x0 + parameters.x, y0 = decompImage->y0 + parameters.y;
+    const OPJ_INT32 x1 = std::min<OPJ_INT32>(x0 + parameters.width, decompImage->x1), y1 = std::min<OPJ_INT32>(y0 + parameters.height, decompImage->y1);
+    success = x0 < x1 && y0 < y1 && opj_set_decode_area(decoder, decompImage, x0, y0, x1, y1) != 0;
+  }
+  success = success && opj_decode(decoder, l_stream, decompImage) && opj_end_decompress(decoder, l_stream);
+
   //Done with the input stream and the decoder.
   opj_stream_destroy(l_stream);
   opj_destroy_codec(decoder);
+  if (!success || !decompImage || decompImage->numcomps == 0) {
+    opj_image_destroy(decompImage);
+    return false;
+  }
 
   //Get the total uncompressed length.
-  int prec_jpc = decompImage->comps[0].prec; //Need it at the end
-  int bytes_jpc= (prec_jpc + 7) / 8;// Bytes or words.
-  int stream_len = (decompImage->comps[0].w * decompImage->comps[0].h);
-
-  OPJ_INT32 ** compPointers = new OPJ_INT32*[decompImage->numcomps];
-  for (unsigned int cmp = 0; cmp < decompImage->numcomps; cmp++) {
-    compPointers[cmp] = decompImage->comps[cmp].data;
+  const unsigned int bytes_jpc = (decompImage->comps[0].prec + 7) / 8;// Bytes or words.
+  const unsigned long long stream_len = static_cast<unsigned long long>(decompImage->comps[0].w) * decompImage->comps[0].h;
+  if (stream_len * decompImage->numcomps * bytes_jpc > outSize) {
+    opj_image_destroy(decompImage);
+    return false;
+  }
+  for (unsigned int cmp = 1; cmp < decompImage->numcomps; cmp++) {
+    if (decompImage->comps[cmp].w != decompImage->comps[0].w || decompImage->comps[cmp].h != decompImage->comps[0].h) {
+      opj_image_destroy(decompImage);
+      return false;
+    }
   }
-  std::fill(buf, buf + outSize, 0);
-  for (int index = 0; index < stream_len; index++) {
+  width = decompImage->comps[0].w;
+  height = decompImage->comps[0].h;
+
+  //Interleave the components, samples are stored little-endian.
+  for (unsigned long long index = 0; index < stream_len; index++) {
     for (unsigned int cmp = 0; cmp < decompImage->numcomps; cmp++) {
-      for (int byteCnt = 0; byteCnt < bytes_jpc; byteCnt++)
-      {
-        *(buf)++ |= (unsigned char)((*compPointers[cmp] >> (8 * byteCnt)) & 0xFF);
+      const OPJ_INT32 value = decompImage->comps[cmp].data[index];
+      for (unsigned int byteCnt = 0; byteCnt < bytes_jpc; byteCnt++) {
+        *buf++ = (unsigned char)((value >> (8 * byteCnt)) & 0xFF);
       }
-      *compPointers[cmp]++;
     }
   }
   opj_image_destroy(decompImage);
-  delete[] compPointers;
+  return true;
 }
 
 void JPEG2000Codec::encode(char* data, unsigned int& size, const unsigned int& tileSize, const unsigned int& rate, const unsigned int& nrComponents, const pathology::DataType& dataType, const pathology::ColorType& colorSpace) const
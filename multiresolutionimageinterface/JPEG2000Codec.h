@@ -13,9 +13,44 @@ public:
   JPEG2000Codec();
   ~JPEG2000Codec();
 
+  //! Restricts what is decoded. reduce discards that many of the highest resolution levels, which halves
+  //! the size of the decoded image for each of them. A region (x, y, width and height in pixels of the full
+  //! resolution image, a width or height of 0 means the whole image) only decodes the code blocks that it
+  //! covers. threads is the number of threads OpenJPEG uses within the decode, 0 uses the codec's setting.
+  struct DecodeParameters {
+    DecodeParameters() : reduce(0), x(0), y(0), width(0), height(0), threads(0) {}
+    unsigned int reduce;
+    unsigned int x;
+    unsigned int y;
+    unsigned int width;
+    unsigned int height;
+    unsigned int threads;
+  };
+
   void encode(char* data, unsigned int& size, const unsigned int& tileSize, const unsigned int& rate, const unsigned int& nrComponents, const pathology::DataType& dataType, const pathology::ColorType& colorSpace) const;
+
+  //! Decodes the codestream in buf in place, the decoded samples are interleaved
   void decode(unsigned char* buf, const unsigned int& inSize, const unsigned int& outSize);
 
+  //! Decodes the codestream in encoded into buf, interleaved and with rows of the decoded width, which is
+  //! returned in width and height together with the decoded height. Returns false if the codestream cannot
+  //! be decoded as requested (for instance when it has fewer resolution levels than reduce asks for) or the
+  //! result does not fit in outSize. encoded and buf may be the same buffer.
+  bool decode(const unsigned char* encoded, const unsigned int& inSize, unsigned char* buf, const unsigned int& outSize,
+    const DecodeParameters& parameters, unsigned int& width, unsigned int& height) const;
+
+  //! Returns the number of resolution levels of a codestream, reduce can be at most one less; 0 if the
+  //! header cannot be read
+  static unsigned int getNumberOfResolutions(const unsigned char* encoded, const unsigned int& inSize);
+
+  //! Gets/Sets the number of threads OpenJPEG uses within a single decode when the parameters do not say.
+  //! Callers that already decode several tiles in parallel should pass 1 for each of them.
+  unsigned int getNumberOfThreads() const;
+  void setNumberOfThreads(const unsigned int& numberOfThreads);
+
+private:
+  unsigned int _numberOfThreads;
+
 };
 
 #endif
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include <fstream>
 #include <iostream>
 #include <cmath>
+#include <algorithm>
 #include "core/filetools.h"
 #include "core/stringconversion.h"
 #include "core/PathologyEnums.h"
@@ -13,10 +14,12 @@ using namespace pathology;
 const char LIFImage::LIF_MAGIC_BYTE = 0x70;
 const char LIFImage::LIF_MEMORY_BYTE = 0x2a;
 
-LIFImage::LIFImage() : MultiResolutionImage(), _lastChannel(0), _alternateCenter(false), _selectedSeries(-1), _fileSize(0), _fileName("") {
+LIFImage::LIFImage() : MultiResolutionImage(), _lastChannel(0), _alternateCenter(false), _selectedSeries(-1), _fileSize(0), _fileName(""),
+  _fieldWidth(0), _fieldHeight(0), _bytesPerSample(0), _rowBytes(0), _planeBytes(0), _zPlaneStride(0), _channelPlaneStride(0), _interleavedChannels(false) {
 }
 
 LIFImage::~LIFImage() {
+  stopAsyncReads();
   cleanup();
 }
 
@@ -32,6 +35,8 @@ void LIFImage::cleanup() {
   _physicalSizeYs.clear();
   _fieldPosX.clear();
   _fieldPosY.clear();
+  _fieldX.clear();
+  _fieldY.clear();
 
   _descriptions.clear();
   _microscopeModels.clear();
@@ -73,6 +78,19 @@ void LIFImage::cleanup() {
   _dimensionOrder.clear();
   _seriesDimensions.clear();
   _imageCount.clear();
+  _offsets.clear();
+
+  _fields.clear();
+  _fieldWidth = 0;
+  _fieldHeight = 0;
+  _bytesPerSample = 0;
+  _rowBytes = 0;
+  _planeBytes = 0;
+  _zPlaneStride = 0;
+  _channelPlaneStride = 0;
+  _interleavedChannels = false;
+  _numberOfZPlanes = 1;
+  _currentZPlaneIndex = 0;
 
   MultiResolutionImage::cleanup();
 }
@@ -169,22 +187,32 @@ bool LIFImage::initializeType(const std::string& imagePath) {
     pugi::xml_document doc;
     doc.load(xml.c_str());    
     translateMetaData(doc);
-    // Set the internals
+    if (_selectedSeries < 0 || !buildPlaneIndex()) {
+      return false;
+    }
+    // Set the internals, a tile scan is the size of its stitched fields
     _numberOfLevels = 1;
+    unsigned long long width = 0, height = 0;
+    for (std::vector<Field>::const_iterator it = _fields.begin(); it != _fields.end(); ++it) {
+      width = std::max(width, static_cast<unsigned long long>(it->x + _fieldWidth));
+      height = std::max(height, static_cast<unsigned long long>(it->y + _fieldHeight));
+    }
     std::vector<unsigned long long> dims;
-    dims.push_back(_seriesDimensions[_selectedSeries]["x"]);
-    dims.push_back(_seriesDimensions[_selectedSeries]["y"]);
-    dims.push_back(_seriesDimensions[_selectedSeries]["x"]);
+    dims.push_back(width);
+    dims.push_back(height);
+    dims.push_back(width);
     _spacing.clear();
-    if (!_physicalSizeXs.empty() && !_physicalSizeYs.empty()) {
-      _spacing.push_back(_physicalSizeXs[0]);
-      _spacing.push_back(_physicalSizeYs[0]);
+    const int imageNr = getTileIndex(_selectedSeries);
+    if (imageNr < _physicalSizeXs.size() && imageNr < _physicalSizeYs.size()) {
+      _spacing.push_back(_physicalSizeXs[imageNr]);
+      _spacing.push_back(_physicalSizeYs[imageNr]);
     }
     _levelDimensions.push_back(dims);
     _colorType = _colorTypes[_selectedSeries];
     _dataType = _dataTypes[_selectedSeries];
     _samplesPerPixel = _seriesDimensions[_selectedSeries]["c"];
-    _isValid = true;
+    // Pixel data is read from the file for as long as the image is open
+    _isValid = openByteSource(imagePath);
     _fileType = "lif";
 
     return _isValid;
@@ -234,6 +262,10 @@ void LIFImage::translateMetaData(pugi::xml_document& doc) {
   _channelNames = std::vector<std::vector<std::string> > (images.size(), std::vector<std::string>());
   _exWaves = std::vector<std::vector<double> >(images.size(), std::vector<double>());
   _imageNames = std::vector<std::string>(images.size(), "");
+  _fieldPosX = std::vector<std::vector<double> >(images.size(), std::vector<double>());
+  _fieldPosY = std::vector<std::vector<double> >(images.size(), std::vector<double>());
+  _fieldX = std::vector<std::vector<int> >(images.size(), std::vector<int>());
+  _fieldY = std::vector<std::vector<int> >(images.size(), std::vector<int>());
 
   int imageNr = 0;
   for (pugi::xpath_node_set::const_iterator it = images.begin(); it != images.end(); ++it) {
@@ -276,16 +308,137 @@ void LIFImage::translateMetaData(pugi::xml_document& doc) {
   _dataTypes = _newDataTypes;
   _imageCount = _newImageCount;
 
-  // Determine which series to use:
-  int index = 0;
-  int maxPixels = 0;
-  for (std::vector<std::map<std::string, unsigned long long> >::iterator it = _seriesDimensions.begin(); it != _seriesDimensions.end(); ++it, ++index) {
-    unsigned long long nPixels = (*it)["x"] * (*it)["y"];
-    if (nPixels > maxPixels) {
-      _selectedSeries = index;
-      maxPixels = nPixels;
+  // Determine which series to use: the largest image, where a tile scan counts as its stitched fields
+  int series = 0;
+  unsigned long long maxPixels = 0;
+  for (int imageNr = 0; imageNr < _tileCount.size() && series < _seriesDimensions.size(); series += _tileCount[imageNr], ++imageNr) {
+    const unsigned long long fieldWidth = _seriesDimensions[series]["x"], fieldHeight = _seriesDimensions[series]["y"];
+    std::vector<Field> fields = placeFields(imageNr, fieldWidth, fieldHeight);
+    unsigned long long width = 0, height = 0;
+    for (std::vector<Field>::const_iterator it = fields.begin(); it != fields.end(); ++it) {
+      width = std::max(width, static_cast<unsigned long long>(it->x + fieldWidth));
+      height = std::max(height, static_cast<unsigned long long>(it->y + fieldHeight));
+    }
+    if (width * height > maxPixels) {
+      _selectedSeries = series;
+      maxPixels = width * height;
+    }
+  }
+}
+
+std::vector<LIFImage::Field> LIFImage::placeFields(const int& imageNr, const unsigned long long& width, const unsigned long long& height) const {
+  const Field origin = {0, 0, 0};
+  const unsigned int count = _tileCount[imageNr];
+  std::vector<Field> fields(count, origin);
+  if (count < 2) {
+    return std::vector<Field>(1, origin);
+  }
+  const std::vector<int>& gridX = _fieldX[imageNr];
+  const std::vector<int>& gridY = _fieldY[imageNr];
+  const std::vector<double>& posX = _fieldPosX[imageNr];
+  const std::vector<double>& posY = _fieldPosY[imageNr];
+  const bool hasGrid = gridX.size() == count && gridY.size() == count;
+  const bool hasPositions = posX.size() == count && posY.size() == count && imageNr < _physicalSizeXs.size() &&
+    _physicalSizeXs[imageNr] > 0 && _physicalSizeYs[imageNr] > 0;
+  if (hasPositions) {
+    // Stage positions are in meters and include the overlap between the fields; the stage axes may run
+    // opposite to the image axes, which the grid indices tell
+    double signX = 1., signY = 1.;
+    for (unsigned int i = 1; hasGrid && i < count; ++i) {
+      if (gridX[i] != gridX[0] && (posX[i] - posX[0]) * (gridX[i] - gridX[0]) < 0) {
+        signX = -1.;
+      }
+      if (gridY[i] != gridY[0] && (posY[i] - posY[0]) * (gridY[i] - gridY[0]) < 0) {
+        signY = -1.;
+      }
+    }
+    double minX = signX * posX[0], minY = signY * posY[0];
+    for (unsigned int i = 1; i < count; ++i) {
+      minX = std::min(minX, signX * posX[i]);
+      minY = std::min(minY, signY * posY[i]);
+    }
+    for (unsigned int i = 0; i < count; ++i) {
+      fields[i].x = static_cast<long long>(std::floor((signX * posX[i] - minX) * 1000000. / _physicalSizeXs[imageNr] + 0.5));
+      fields[i].y = static_cast<long long>(std::floor((signY * posY[i] - minY) * 1000000. / _physicalSizeYs[imageNr] + 0.5));
+    }
+  }
+  else if (hasGrid) {
+    const int minX = *std::min_element(gridX.begin(), gridX.end()), minY = *std::min_element(gridY.begin(), gridY.end());
+    for (unsigned int i = 0; i < count; ++i) {
+      fields[i].x = (gridX[i] - minX) * static_cast<long long>(width);
+      fields[i].y = (gridY[i] - minY) * static_cast<long long>(height);
     }
   }
+  else {
+    // Without a layout only the first field is shown, as before
+    return std::vector<Field>(1, origin);
+  }
+  return fields;
+}
+
+bool LIFImage::buildPlaneIndex() {
+  const int imageNr = getTileIndex(_selectedSeries);
+  if (imageNr < 0 || imageNr >= _offsets.size()) {
+    return false;
+  }
+  std::map<std::string, unsigned long long>& dims = _seriesDimensions[_selectedSeries];
+  _fieldWidth = dims["x"];
+  _fieldHeight = dims["y"];
+  _bytesPerSample = 4;
+  if (_dataTypes[_selectedSeries] == UInt16) {
+    _bytesPerSample = 2;
+  } else if (_dataTypes[_selectedSeries] == UChar) {
+    _bytesPerSample = 1;
+  }
+  // RGB images store their channels interleaved, the others have a plane per channel
+  _interleavedChannels = _colorTypes[_selectedSeries] == RGB;
+  const unsigned long long pixelBytes = _bytesPerSample * (_interleavedChannels ? dims["c"] : 1);
+  const unsigned long long planeSize = _fieldWidth * _fieldHeight * pixelBytes;
+  const unsigned long long imageCount = _imageCount[_selectedSeries];
+  const unsigned long long tileCount = _tileCount[imageNr];
+  if (planeSize == 0 || imageCount == 0) {
+    return false;
+  }
+
+  // Rows are padded when the width is not a multiple of 4, by whatever the planes leave of the block
+  const unsigned long long offset = _offsets[imageNr];
+  const unsigned long long nextOffset = imageNr + 1 < _offsets.size() ? _offsets[imageNr + 1] : _fileSize;
+  unsigned long long rowPadding = 0;
+  if ((_fieldWidth % 4) != 0 && nextOffset > offset + planeSize * imageCount * tileCount) {
+    rowPadding = (nextOffset - offset - planeSize * imageCount * tileCount) / (_fieldHeight * imageCount * tileCount);
+  }
+  _rowBytes = _fieldWidth * pixelBytes + rowPadding;
+  _planeBytes = _rowBytes * _fieldHeight;
+
+  // The planes of a field follow the dimension order
+  unsigned long long stride = 1;
+  _zPlaneStride = 0;
+  _channelPlaneStride = 0;
+  const std::string& order = _dimensionOrder[_selectedSeries];
+  for (unsigned int i = 2; i < order.size(); ++i) {
+    const std::string axis(1, order[i]);
+    if (axis == "c" && _interleavedChannels) {
+      continue;
+    }
+    if (axis == "z") {
+      _zPlaneStride = stride;
+    }
+    else if (axis == "c") {
+      _channelPlaneStride = stride;
+    }
+    stride *= std::max(dims[axis], 1ULL);
+  }
+
+  // The fields of a tile scan follow each other, each with all its planes
+  _fields = placeFields(imageNr, _fieldWidth, _fieldHeight);
+  for (unsigned int i = 0; i < _fields.size(); ++i) {
+    _fields[i].offset = offset + i * imageCount * _planeBytes;
+  }
+  if (_fields.back().offset + imageCount * _planeBytes > _fileSize) {
+    return false;
+  }
+  _numberOfZPlanes = std::max(dims["z"], 1ULL);
+  return true;
 }
 
 int LIFImage::getTileIndex(int index) {
@@ -299,88 +452,97 @@ int LIFImage::getTileIndex(int index) {
   return -1;
 }
 
-void* LIFImage::readDataFromImage(const long long& startX, const long long& startY, const unsigned long long& width, 
-    const unsigned long long& height, const unsigned int& level) {
-
-    int index = getTileIndex(_selectedSeries);
-    if (index < 0) {
-      return NULL;
-    }
-    unsigned int nrChannels = _seriesDimensions[_selectedSeries]["c"];
-    unsigned long long offset = _offsets[index];
-    int bytes = 4;
-    if (_dataTypes[_selectedSeries] == UInt16) {
-      bytes = 2;
-    } else if (_dataTypes[_selectedSeries] == UChar) {
-      bytes = 1;
-    }
-    int bpp = bytes;
+void LIFImage::readDataIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride) {
+    readZPlaneIntoBuffer(startX, startY, width, height, level, _currentZPlaneIndex, data, dataType, rowStride);
+}
 
-    long planeSize = _seriesDimensions[_selectedSeries]["x"] * _seriesDimensions[_selectedSeries]["y"] * bpp;
-    unsigned long long nextOffset = index + 1 < _offsets.size() ? _offsets[index + 1] : _fileSize;
-    int bytesToSkip = (int) (nextOffset - offset - planeSize * _imageCount[_selectedSeries]);
-    bytesToSkip /= _seriesDimensions[_selectedSeries]["y"];
-    if ((_seriesDimensions[_selectedSeries]["x"] % 4) == 0) {
-      bytesToSkip = 0;
+void LIFImage::readZPlaneIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, const unsigned int& zPlane, void* data, const pathology::DataType& dataType,
+    const unsigned long long& rowStride) {
+    if (level != 0 || _fields.empty() || !_source || zPlane >= _numberOfZPlanes) {
+      return;
     }
-
-    if (offset + (planeSize + bytesToSkip * _seriesDimensions[_selectedSeries]["y"]) >= _fileSize) {
-       return NULL;
+    const unsigned int nrChannels = _samplesPerPixel;
+    unsigned char* destination = static_cast<unsigned char*>(data);
+    const unsigned long long destinationRowBytes = rowStride * bytesPerSample(dataType);
+    const unsigned long long destinationPixelBytes = nrChannels * bytesPerSample(dataType);
+    // Parts of the region outside the fields are black
+    for (unsigned long long y = 0; y < height; ++y) {
+      fillSamples(destination + y * destinationRowBytes, dataType, width * nrChannels, 0);
     }
 
-    std::ifstream in;
-    in.open(_fileName.c_str(), std::ios::in | std::ios::binary);
-    in.seekg(offset);
-
-    int tile = _selectedSeries;
-    for (int i=0; i<index; i++) {
-      tile -= _tileCount[i];
-    }
-
-    char* buf = new char[width*height*bpp*nrChannels];
-    in.seekg((tile * planeSize * _imageCount[_selectedSeries]), std::ios::cur);
-    in.seekg(bytesToSkip * _seriesDimensions[_selectedSeries]["y"], std::ios::cur);
-
-    if (bytesToSkip == 0) {
-      int seriesWidth = _seriesDimensions[_selectedSeries]["x"];
-      for (int channel=0; channel < nrChannels; channel++) {
-        in.seekg(startY * seriesWidth * bpp, std::ios::cur);
-        for (int row=0; row < height; row++) {
-          in.seekg(startX * bpp, std::ios::cur);
-          in.read(buf + channel * width * height * bpp + row * width * bpp, width * bpp);
-          if (row < height - 1 || channel < nrChannels - 1) {
-            // no need to skip bytes after reading final row of final channel
-            in.seekg(bpp * (seriesWidth - width - startX), std::ios::cur);
-          }
+    // Only the rows of the fields that cover the region are read, with positional reads (copies from the
+    // mapping for memory-mapped files) on the file that stays open for the lifetime of the image
+    const unsigned long long pixelBytes = _bytesPerSample * (_interleavedChannels ? nrChannels : 1);
+    const unsigned int planes = _interleavedChannels ? 1 : nrChannels;
+    std::vector<char> buf;
+    unsigned long long bytesRead = 0;
+    for (std::vector<Field>::const_iterator field = _fields.begin(); field != _fields.end(); ++field) {
+      const long long x0 = std::max(startX, field->x), x1 = std::min(startX + static_cast<long long>(width), field->x + static_cast<long long>(_fieldWidth));
+      const long long y0 = std::max(startY, field->y), y1 = std::min(startY + static_cast<long long>(height), field->y + static_cast<long long>(_fieldHeight));
+      if (x0 >= x1 || y0 >= y1) {
+        continue;
+      }
+      const unsigned long long columns = x1 - x0, rows = y1 - y0;
+      const unsigned long long runBytes = columns * pixelBytes;
+      buf.resize(planes * rows * runBytes);
+      for (unsigned int plane = 0; plane < planes; ++plane) {
+        const unsigned long long position = field->offset + (zPlane * _zPlaneStride + plane * _channelPlaneStride) * _planeBytes +
+          (y0 - field->y) * _rowBytes + (x0 - field->x) * pixelBytes;
+        char* planeBuf = buf.data() + plane * rows * runBytes;
+        if (runBytes == _rowBytes) {
+          // Whole rows without padding follow each other in the file
+          _source->read(position, rows * runBytes, planeBuf);
         }
-        if (channel < nrChannels - 1) {
-          // no need to skip bytes after reading final channel
-          in.seekg(seriesWidth * bpp * (_seriesDimensions[_selectedSeries]["y"] - startY - height), std::ios::cur);
+        else {
+          for (unsigned long long row = 0; row < rows; ++row) {
+            _source->read(position + row * _rowBytes, runBytes, planeBuf + row * runBytes);
+          }
         }
+        bytesRead += rows * runBytes;
       }
-    }
-    else {
-      in.seekg(startY * (_seriesDimensions[_selectedSeries]["x"] * bpp + bytesToSkip));
-      for (int row=0; row < height; row++) {
-        in.seekg(startX * bpp, std::ios::cur);
-        in.read(buf + (row * width * bpp), width * bpp);
-        in.seekg(bpp * (_seriesDimensions[_selectedSeries]["x"] - width - startX) + bytesToSkip, std::ios::cur);
+
+      // Change planar to interleaved while writing to the destination
+      unsigned char* output = destination + (y0 - startY) * destinationRowBytes + (x0 - startX) * destinationPixelBytes;
+      const unsigned long long rowSamples = _interleavedChannels ? columns * nrChannels : columns;
+      if (_bytesPerSample == 1) {
+        interleaveInto<unsigned char>(buf.data(), rowSamples, rows, planes, output, dataType, rowStride);
+      }
+      else if (_bytesPerSample == 2) {
+        interleaveInto<unsigned short>(buf.data(), rowSamples, rows, planes, output, dataType, rowStride);
+      }
+      else if (_dataTypes[_selectedSeries] == Float) {
+        interleaveInto<float>(buf.data(), rowSamples, rows, planes, output, dataType, rowStride);
+      }
+      else {
+        interleaveInto<unsigned int>(buf.data(), rowSamples, rows, planes, output, dataType, rowStride);
       }
     }
-    in.close();
+    _statistics->recordBytesRead(bytesRead);
+}
 
-    // Change planar to interleaved 
-    char* interLeavedbuf = new char[width*height*bpp*nrChannels];
-    for (unsigned int i = 0; i < width*height; ++i) {
+template <typename T> void LIFImage::interleaveInto(const char* planar, const unsigned long long& width, const unsigned long long& height, const unsigned int& nrChannels,
+  void* data, const pathology::DataType& dataType, const unsigned long long& rowStride) const {
+  const T* planarSamples = reinterpret_cast<const T*>(planar);
+  unsigned char* destination = static_cast<unsigned char*>(data);
+  const unsigned long long destinationRowBytes = rowStride * bytesPerSample(dataType);
+  if (nrChannels == 1) {
+    // Nothing to interleave, rows are converted straight from the plane
+    for (unsigned long long y = 0; y < height; ++y) {
+      convertSamples(planarSamples + y * width, destination + y * destinationRowBytes, dataType, width);
+    }
+    return;
+  }
+  std::vector<T> row(width * nrChannels);
+  for (unsigned long long y = 0; y < height; ++y) {
+    for (unsigned long long x = 0; x < width; ++x) {
       for (unsigned int c = 0; c < nrChannels; ++c) {
-        unsigned int cStride = width*height*bpp*c;
-        for (unsigned int b = 0; b < bpp; ++b) {
-          interLeavedbuf[i*bpp*nrChannels+c*bpp+b] = buf[i*bpp + cStride + b];
-        }
+        row[x * nrChannels + c] = planarSamples[c * width * height + y * width + x];
       }
     }
-    delete[] buf;
-    return interLeavedbuf;
+    convertSamples(row.data(), destination + y * destinationRowBytes, dataType, row.size());
+  }
 }
 
 void LIFImage::translateImageNames(pugi::xpath_node& imageNode, int imageNr) {
@@ -424,11 +586,17 @@ void LIFImage::translateAttachmentNodes(pugi::xpath_node&  imageNode, int imageN
         std::string posX = tileNode.node().attribute("PosX").value();
         std::string posY = tileNode.node().attribute("PosY").value();
         if (!posX.empty()) {
-          _fieldPosX.push_back(core::fromstring<double>(posX));
+          _fieldPosX[imageNr].push_back(core::fromstring<double>(posX));
         }
         if (!posY.empty()) {
-          _fieldPosY.push_back(core::fromstring<double>(posY));
-        }      
+          _fieldPosY[imageNr].push_back(core::fromstring<double>(posY));
+        }
+        std::string fieldX = tileNode.node().attribute("FieldX").value();
+        std::string fieldY = tileNode.node().attribute("FieldY").value();
+        if (!fieldX.empty() && !fieldY.empty()) {
+          _fieldX[imageNr].push_back(core::fromstring<int>(fieldX));
+          _fieldY[imageNr].push_back(core::fromstring<int>(fieldY));
+        }
       }
     }
   }
@@ -488,7 +656,7 @@ void LIFImage::translateImageNodes(pugi::xpath_node&  imageNode, int imageNr)
         } else {
           _colorTypes[imageNr] = Indexed;
         }
-        if (_colorType == RGB) {
+        if (_colorTypes[imageNr] == RGB) {
           nBytes /= 3;
         }
         if (nBytes == 1) {
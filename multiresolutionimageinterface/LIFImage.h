@@ -22,8 +22,11 @@ protected :
 
   void cleanup();
   
-  void* readDataFromImage(const long long& startX, const long long& startY, const unsigned long long& width, 
-    const unsigned long long& height, const unsigned int& level);
+  void readDataIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride);
+  void readZPlaneIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, const unsigned int& zPlane, void* data, const pathology::DataType& dataType,
+    const unsigned long long& rowStride);
 
   double getMinValue(int channel = -1) { return 0.; } // Not yet implemented
   double getMaxValue(int channel = -1) { return 3072; } // Not yet implemented
@@ -42,8 +45,11 @@ private :
   std::vector<std::string> _lutNames;
   std::vector<double> _physicalSizeXs;
   std::vector<double> _physicalSizeYs;
-  std::vector<double> _fieldPosX;
-  std::vector<double> _fieldPosY;
+  //! Stage positions (in meters) and grid indices of the fields of the tile scans, per image
+  std::vector<std::vector<double> > _fieldPosX;
+  std::vector<std::vector<double> > _fieldPosY;
+  std::vector<std::vector<int> > _fieldX;
+  std::vector<std::vector<int> > _fieldY;
 
   std::vector<std::string> _descriptions, _microscopeModels, _serialNumber;
   std::vector<double> _pinholes, _zooms, _zSteps, _tSteps, _lensNA;
@@ -72,6 +78,23 @@ private :
   std::vector<unsigned int> _imageCount;
   std::vector<unsigned long long> _offsets;
 
+  //! Layout of the pixel data of the selected image, computed when the file is opened. A tile scan is
+  //! stitched into one image, with every field at its own position; an image without one has one field.
+  struct Field {
+    unsigned long long offset;
+    long long x;
+    long long y;
+  };
+  std::vector<Field> _fields;
+  unsigned long long _fieldWidth;
+  unsigned long long _fieldHeight;
+  unsigned int _bytesPerSample;
+  unsigned long long _rowBytes;
+  unsigned long long _planeBytes;
+  unsigned long long _zPlaneStride;
+  unsigned long long _channelPlaneStride;
+  bool _interleavedChannels;
+
   void translateMetaData(pugi::xml_document& doc);
   void translateImageNames(pugi::xpath_node& imageNode, int imageNr);
   void translateImageNodes(pugi::xpath_node& imageNode, int imageNr);
@@ -82,6 +105,10 @@ private :
   void translateLaserLines(pugi::xpath_node& imageNode, int imageNr) {};
   void translateDetectors(pugi::xpath_node& imageNode, int imageNr) {};
   int getTileIndex(int index);
+  bool buildPlaneIndex();
+  std::vector<Field> placeFields(const int& imageNr, const unsigned long long& width, const unsigned long long& height) const;
+  template <typename T> void interleaveInto(const char* planar, const unsigned long long& width, const unsigned long long& height, const unsigned int& nrChannels,
+    void* data, const pathology::DataType& dataType, const unsigned long long& rowStride) const;
 
 };
 
@@ -19,8 +19,7 @@ MultiResolutionImage* LIFImageFactory::readImage(const std::string& fileName) co
 }
 
 bool LIFImageFactory::canReadImage(const std::string& fileName) const {
-  LIFImage* img = new LIFImage();
-  bool canOpen = img->initialize(fileName);
-  delete img;
-  return canOpen;
+  // LIF files are made of blocks that start with the 0x70 test value, followed by 0x2A for the XML header
+  std::string header = readFileHeader(fileName, 9);
+  return header.size() == 9 && (header[0] == 0x70 || header[3] == 0x70) && header[8] == 0x2A;
 }
\ No newline at end of file
@@ -1,131 +1,44 @@
 #include "MultiResolutionImage.h"
+#include "TaskExecutor.h"
+#include "TileCacheManager.h"
+#include "VirtualPyramid.h"
 #include "boost/thread.hpp"
+#include <atomic>
 #include <cmath>
+#include <exception>
+#include <numeric>
+#include <unordered_map>
 
 using namespace pathology;
 
-// Subsequent specialization to not re-copy data when datatypes are the same
-template <> void MultiResolutionImage::getRawRegion(const long long& startX, const long long& startY, const unsigned long long& width, 
-  const unsigned long long& height, const unsigned int& level, float*& data) {
-    if (level >= getNumberOfLevels()) {
-      return;
-    }
-    unsigned int nrSamples = getSamplesPerPixel();
-    if (this->getDataType()==pathology::Float) {
-      delete[] data;
-      data = (float*)readDataFromImage(startX, startY, width, height, level);
-    }
-    else if (this->getDataType()==pathology::UChar) {
-      unsigned char * temp = (unsigned char*)readDataFromImage(startX, startY, width, height, level);
-      std::copy(temp, temp + width*height*nrSamples, data);
-      delete[] temp;
-    }
-    else if (this->getDataType()==pathology::UInt16) {
-      unsigned short * temp = (unsigned short*)readDataFromImage(startX, startY, width, height, level);
-      std::copy(temp, temp + width*height*nrSamples, data);
-      delete[] temp;
-    }
-    else if (this->getDataType()==pathology::UInt32) {
-      unsigned int * temp = (unsigned int*)readDataFromImage(startX, startY, width, height, level);
-      std::copy(temp, temp + width*height*nrSamples, data);
-      delete[] temp;
-    }
-}
-
-template <> void MultiResolutionImage::getRawRegion(const long long& startX, const long long& startY, const unsigned long long& width, 
-  const unsigned long long& height, const unsigned int& level, unsigned char*& data) {
-    if (level >= getNumberOfLevels()) {
-      return;
-    }
-    unsigned int nrSamples = getSamplesPerPixel();
-    if (this->getDataType()==pathology::Float) {
-      float * temp = (float*)readDataFromImage(startX, startY, width, height, level);
-      std::copy(temp, temp + width*height*nrSamples, data);
-      delete[] temp;
-    }
-    else if (this->getDataType()==pathology::UChar) {
-      delete[] data;
-      data = (unsigned char*)readDataFromImage(startX, startY, width, height, level);
-    }
-    else if (this->getDataType()==pathology::UInt16) {
-      unsigned short * temp = (unsigned short*)readDataFromImage(startX, startY, width, height, level);
-      std::copy(temp, temp + width*height*nrSamples, data);
-      delete[] temp;
-    }
-    else if (this->getDataType()==pathology::UInt32) {
-      unsigned int * temp = (unsigned int*)readDataFromImage(startX, startY, width, height, level);
-      std::copy(temp, temp + width*height*nrSamples, data);
-      delete[] temp;
-    }
-}
-
-template <> void MultiResolutionImage::getRawRegion(const long long& startX, const long long& startY, const unsigned long long& width, 
-  const unsigned long long& height, const unsigned int& level, unsigned short*& data) {
-    if (level >= getNumberOfLevels()) {
-      return;
-    }
-    unsigned int nrSamples = getSamplesPerPixel();
-    if (this->getDataType()==pathology::Float) {
-      float* temp = (float*)readDataFromImage(startX, startY, width, height, level);
-      std::copy(temp, temp + width*height*nrSamples, data);
-      delete[] temp;
-    }
-    else if (this->getDataType()==pathology::UChar) {
-      unsigned char * temp = (unsigned char*)readDataFromImage(startX, startY, width, height, level);
-      std::copy(temp, temp + width*height*nrSamples, data);
-      delete[] temp;
-    }
-    else if (this->getDataType()==pathology::UInt16) {
-      delete[] data;
-      data = (unsigned short*)readDataFromImage(startX, startY, width, height, level);
-    }
-    else if (this->getDataType()==pathology::UInt32) {
-      unsigned int* temp = (unsigned int*)readDataFromImage(startX, startY, width, height, level);
-      std::copy(temp, temp + width*height*nrSamples, data);
-      delete[] temp;
-    }
-}
-
-template <> void MultiResolutionImage::getRawRegion(const long long& startX, const long long& startY, const unsigned long long& width, 
-  const unsigned long long& height, const unsigned int& level, unsigned int*& data) {
-    if (level >= getNumberOfLevels()) {
-      return;
-    }
-    unsigned int nrSamples = getSamplesPerPixel();
-    if (this->getDataType()==pathology::Float) {
-      float * temp = (float*)readDataFromImage(startX, startY, width, height, level);
-      std::copy(temp, temp + width*height*nrSamples, data);
-      delete[] temp;
-    }
-    else if (this->getDataType()==pathology::UChar) {
-      unsigned char * temp = (unsigned char*)readDataFromImage(startX, startY, width, height, level);
-      std::copy(temp, temp + width*height*nrSamples, data);
-      delete[] temp;
-    }
-    else if (this->getDataType()==pathology::UInt16) {
-      unsigned short * temp = (unsigned short*)readDataFromImage(startX, startY, width, height, level);
-      std::copy(temp, temp + width*height*nrSamples, data);
-      delete[] temp;
-    }
-    else if (this->getDataType()==pathology::UInt32) {
-      delete[] data;
-      data = (unsigned int*)readDataFromImage(startX, startY, width, height, level);
-    }
-}
-
 MultiResolutionImage::MultiResolutionImage() :
   ImageSource(),
-  _cacheSize(0),
   _cache(),
+  _encodedCache(),
+  _zPlanePrefetchRadius(1),
+  _accessPattern(ByteSource::NormalAccess),
   _levelDimensions(),
   _numberOfLevels(0),
-  _filePath(),
-  _fileType(),
   _numberOfZPlanes(1),
-  _currentZPlaneIndex(0)
+  _currentZPlaneIndex(0),
+  _cacheSize(0),
+  _encodedCacheSize(0),
+  _resampledCacheSize(0),
+  _virtualPyramidCacheSize(128 * 1024 * 1024),
+  _zPlaneCacheSize(128 * 1024 * 1024),
+  _cacheWeight(1.0),
+  _cacheReplacementPolicy(LRUReplacement),
+  _fileType(),
+  _filePath()
 {
   _cacheMutex.reset(new boost::mutex());
   _openCloseMutex.reset(new boost::shared_mutex());
+  _executorMutex.reset(new boost::mutex());
+  _statistics.reset(new ImageStatisticsCollector());
+  _resampledCache.reset(new TileCache<std::vector<unsigned char> >());
+  _virtualPyramidCache.reset(new TileCache<std::vector<unsigned char> >(_virtualPyramidCacheSize));
+  _zPlaneCache.reset(new TileCache<std::vector<unsigned char> >(_zPlaneCacheSize));
+  _asyncReadsStopped = false;
 }
 
 int MultiResolutionImage::getNumberOfZPlanes() const {
@@ -133,7 +46,14 @@ int MultiResolutionImage::getNumberOfZPlanes() const {
 }
 void MultiResolutionImage::setCurrentZPlaneIndex(const unsigned int& zPlaneIndex) {
   boost::unique_lock<boost::shared_mutex> l(*_openCloseMutex);
+  const unsigned int previousZPlaneIndex = _currentZPlaneIndex;
   zPlaneIndex < _numberOfZPlanes ? _currentZPlaneIndex = zPlaneIndex : _currentZPlaneIndex = _numberOfZPlanes - 1;
+  if (_currentZPlaneIndex != previousZPlaneIndex) {
+    // The planes around the new focus are prefetched by the next read
+    boost::lock_guard<boost::mutex> cacheLock(*_cacheMutex);
+    _zPlanePrefetchToken.cancel();
+    _zPlanePrefetchToken = CancellationToken();
+  }
 }
 
 unsigned int MultiResolutionImage::getCurrentZPlaneIndex() const {
@@ -142,7 +62,7 @@ unsigned int MultiResolutionImage::getCurrentZPlaneIndex() const {
 
 const int MultiResolutionImage::getNumberOfLevels() const {
   if (_isValid) {
-  return _numberOfLevels;
+  return _numberOfLevels + static_cast<int>(_virtualLevelDimensions.size());
   }
   else {
     return -1;
@@ -163,35 +83,71 @@ const std::vector<unsigned long long> MultiResolutionImage::getDimensions() cons
 
 bool MultiResolutionImage::initialize(const std::string& imagePath) {
   _filePath = imagePath;
-  return initializeType(imagePath);
+  if (!initializeType(imagePath)) {
+    return false;
+  }
+  createVirtualPyramid();
+  return true;
+}
+
+void MultiResolutionImage::createVirtualPyramid() {
+  if (!_isValid || _numberOfLevels != 1 || bytesPerSample(_dataType) == 0) {
+    return;
+  }
+  const unsigned int samplesPerPixel = _samplesPerPixel;
+  const pathology::DataType dataType = _dataType;
+  std::shared_ptr<VirtualPyramid> pyramid = std::make_shared<VirtualPyramid>(_levelDimensions[0], samplesPerPixel, dataType, _virtualPyramidCache,
+    [this, samplesPerPixel, dataType](const long long& x, const long long& y, const unsigned long long& width, const unsigned long long& height,
+      const unsigned int& zPlane, void* data) {
+      readZPlaneIntoBuffer(x, y, width, height, 0, zPlane, data, dataType, width * samplesPerPixel);
+    },
+    [this](const unsigned long long& count, const std::function<void(unsigned long long)>& work) {
+      runInParallel(count, work);
+    },
+    [this](const long long& x, const long long& y, const unsigned long long& width, const unsigned long long& height, const unsigned int& scaleShift, void* data) {
+      return readScaledDataIntoBuffer(x, y, width, height, scaleShift, data);
+    });
+  if (pyramid->getLevelDimensions().empty()) {
+    return;
+  }
+  {
+    boost::lock_guard<boost::mutex> l(*_cacheMutex);
+    _virtualPyramid = pyramid;
+    _virtualLevelDimensions = pyramid->getLevelDimensions();
+  }
+  updateCacheSizes();
 }
 
 const std::vector<unsigned long long> MultiResolutionImage::getLevelDimensions(const unsigned int& level) const {
   std::vector<unsigned long long> dims;
   if (_isValid && (level < getNumberOfLevels())) {
-    return _levelDimensions[level];
+    return level < _numberOfLevels ? _levelDimensions[level] : _virtualLevelDimensions[level - _numberOfLevels];
   }
   return dims;
 }
 
 const double MultiResolutionImage::getLevelDownsample(const unsigned int& level) const {
   if (_isValid && (level < getNumberOfLevels())) {
-    return static_cast<float>(_levelDimensions[0][0])/_levelDimensions[level][0];
+    return static_cast<float>(_levelDimensions[0][0])/getLevelDimensions(level)[0];
   }
   else {
     return -1.0;
   }
 }
 
+const std::vector<unsigned int> MultiResolutionImage::getLevelTileSize(const unsigned int& level) const {
+  return std::vector<unsigned int>();
+}
+
 const int MultiResolutionImage::getBestLevelForDownSample(const double& downsample) const {
   if (_isValid) {
     float previousDownsample = 1.0;
     if (downsample < 1.0) {
       return 0;
     }
-    for (int i = 1; i < _levelDimensions.size(); ++i) {
-      double currentDownSample = (double)_levelDimensions[0][0]/(double)_levelDimensions[i][0];
-      double previousDownSample = (double)_levelDimensions[0][0] / (double)_levelDimensions[i-1][0];
+    for (int i = 1; i < getNumberOfLevels(); ++i) {
+      double currentDownSample = (double)_levelDimensions[0][0]/(double)getLevelDimensions(i)[0];
+      double previousDownSample = (double)_levelDimensions[0][0] / (double)getLevelDimensions(i-1)[0];
       if (downsample<currentDownSample) {
         
         if (std::abs(currentDownSample - downsample) > std::abs(previousDownSample - downsample)) {
@@ -212,6 +168,7 @@ const int MultiResolutionImage::getBestLevelForDownSample(const double& downsamp
 }
 
 MultiResolutionImage::~MultiResolutionImage() {
+  stopAsyncReads();
   boost::unique_lock<boost::shared_mutex> l(*_openCloseMutex);
   cleanup();
 }
@@ -231,44 +188,989 @@ void MultiResolutionImage::cleanup() {
   _isValid = false;
   _fileType = "";
   _filePath = "";
+  _source.reset();
+  {
+    boost::lock_guard<boost::mutex> l(*_cacheMutex);
+    clearResampledTiles();
+    _virtualPyramid.reset();
+    _virtualLevelDimensions.clear();
+    // Clones may still use the generated tiles, so the cache is dropped instead of cleared
+    if (_virtualPyramidCache.use_count() == 1) {
+      TileCacheManager::getInstance().unregisterCache(_virtualPyramidCache.get());
+      _virtualPyramidCache->clear();
+    }
+    else {
+      _virtualPyramidCache.reset(new TileCache<std::vector<unsigned char> >(_virtualPyramidCacheSize, _cacheReplacementPolicy));
+    }
+    TileCacheManager::getInstance().unregisterCache(_zPlaneCache.get());
+    _zPlaneCache->clear();
+    _zPlanePrefetchToken.cancel();
+    _zPlanePrefetchToken = CancellationToken();
+  }
+}
+
+void MultiResolutionImage::setAccessPattern(const ByteSource::AccessPattern& pattern) {
+  boost::unique_lock<boost::shared_mutex> l(*_openCloseMutex);
+  _accessPattern = pattern;
+  if (_source) {
+    _source->adviseAccessPattern(pattern);
+  }
+}
+
+ByteSource::AccessPattern MultiResolutionImage::getAccessPattern() const {
+  return _accessPattern;
+}
+
+bool MultiResolutionImage::openByteSource(const std::string& filePath) {
+  _source = ByteSource::open(filePath);
+  if (!_source) {
+    return false;
+  }
+  if (_accessPattern != ByteSource::NormalAccess) {
+    _source->adviseAccessPattern(_accessPattern);
+  }
+  return true;
 }
 
 const unsigned long long MultiResolutionImage::getCacheSize() {
-  unsigned long long cacheSize = 0;
-  _cacheMutex->lock();
+  boost::lock_guard<boost::mutex> l(*_cacheMutex);
   if (_cache && _isValid) {
-    if (_dataType == UInt32) {
-      cacheSize = (std::static_pointer_cast<TileCache<unsigned int> >(_cache))->maxCacheSize();
+    return _cache->maxCacheSize();
+  }
+  return _cacheSize;
+}
+
+void MultiResolutionImage::setCacheSize(const unsigned long long cacheSize) {
+  {
+    boost::lock_guard<boost::mutex> l(*_cacheMutex);
+    _cacheSize = cacheSize;
+    clearResampledTiles();
+  }
+  updateCacheSizes();
+}
+
+double MultiResolutionImage::getCacheWeight() {
+  boost::lock_guard<boost::mutex> l(*_cacheMutex);
+  return _cacheWeight;
+}
+
+void MultiResolutionImage::setCacheWeight(const double& weight) {
+  {
+    boost::lock_guard<boost::mutex> l(*_cacheMutex);
+    _cacheWeight = weight;
+  }
+  updateCacheSizes();
+}
+
+CacheReplacementPolicy MultiResolutionImage::getCacheReplacementPolicy() {
+  boost::lock_guard<boost::mutex> l(*_cacheMutex);
+  return _cacheReplacementPolicy;
+}
+
+void MultiResolutionImage::setCacheReplacementPolicy(const CacheReplacementPolicy& policy) {
+  boost::lock_guard<boost::mutex> l(*_cacheMutex);
+  _cacheReplacementPolicy = policy;
+  if (_cache) {
+    _cache->setReplacementPolicy(policy);
+  }
+  if (_encodedCache) {
+    _encodedCache->setReplacementPolicy(policy);
+  }
+  _resampledCache->setReplacementPolicy(policy);
+  _virtualPyramidCache->setReplacementPolicy(policy);
+  _zPlaneCache->setReplacementPolicy(policy);
+}
+
+void MultiResolutionImage::updateCacheSizes() {
+  boost::lock_guard<boost::mutex> l(*_cacheMutex);
+  if (!_isValid) {
+    return;
+  }
+  TileCacheManager& manager = TileCacheManager::getInstance();
+  if (_cache) {
+    if (manager.isEnabled() || manager.isRegistered(_cache.get())) {
+      manager.registerCache(_cache.get(), _filePath, _cacheWeight, _cacheSize == 0);
     }
-    else if (_dataType == UInt16) {
-      cacheSize = (std::static_pointer_cast<TileCache<unsigned short> >(_cache))->maxCacheSize();
+    if (_cacheSize > 0 || !manager.isRegistered(_cache.get())) {
+      _cache->setMaxCacheSize(_cacheSize);
     }
-    else if (_dataType == UChar) {
-      cacheSize = (std::static_pointer_cast<TileCache<unsigned char> >(_cache))->maxCacheSize();
+  }
+  // The encoded tier only shares the budget when it was given a size, it never follows the budget
+  if (_encodedCache) {
+    if (_encodedCacheSize > 0 && (manager.isEnabled() || manager.isRegistered(_encodedCache.get()))) {
+      manager.registerCache(_encodedCache.get(), _filePath + " (encoded)", _cacheWeight, false);
     }
-    else if (_dataType == Float) {
-      cacheSize = (std::static_pointer_cast<TileCache<float> >(_cache))->maxCacheSize();
+    else {
+      manager.unregisterCache(_encodedCache.get());
     }
-  _cacheMutex->unlock();
+    _encodedCache->setMaxCacheSize(_encodedCacheSize);
+  }
+  if (_resampledCacheSize > 0 && (manager.isEnabled() || manager.isRegistered(_resampledCache.get()))) {
+    manager.registerCache(_resampledCache.get(), _filePath + " (resampled)", _cacheWeight, false);
+  }
+  else {
+    manager.unregisterCache(_resampledCache.get());
+  }
+  _resampledCache->setMaxCacheSize(_resampledCacheSize);
+  if (_virtualPyramid && (manager.isEnabled() || manager.isRegistered(_virtualPyramidCache.get()))) {
+    manager.registerCache(_virtualPyramidCache.get(), _filePath + " (virtual pyramid)", _cacheWeight, false);
   }
-  return cacheSize;
+  else {
+    manager.unregisterCache(_virtualPyramidCache.get());
+  }
+  _virtualPyramidCache->setMaxCacheSize(_virtualPyramidCacheSize);
+  if (_numberOfZPlanes > 1 && (manager.isEnabled() || manager.isRegistered(_zPlaneCache.get()))) {
+    manager.registerCache(_zPlaneCache.get(), _filePath + " (z-planes)", _cacheWeight, false);
+  }
+  else {
+    manager.unregisterCache(_zPlaneCache.get());
+  }
+  _zPlaneCache->setMaxCacheSize(_zPlaneCacheSize);
 }
 
-void MultiResolutionImage::setCacheSize(const unsigned long long cacheSize) {
-  _cacheMutex->lock();
-  if (_cache && _isValid) {
-    if (_dataType == UInt32) {
-      (std::static_pointer_cast<TileCache<unsigned int> >(_cache))->setMaxCacheSize(cacheSize);
+const unsigned long long MultiResolutionImage::getEncodedCacheSize() {
+  boost::lock_guard<boost::mutex> l(*_cacheMutex);
+  if (_encodedCache && _isValid) {
+    return _encodedCache->maxCacheSize();
+  }
+  return _encodedCacheSize;
+}
+
+void MultiResolutionImage::setEncodedCacheSize(const unsigned long long cacheSize) {
+  {
+    boost::lock_guard<boost::mutex> l(*_cacheMutex);
+    _encodedCacheSize = cacheSize;
+  }
+  updateCacheSizes();
+}
+
+const unsigned long long MultiResolutionImage::getResampledCacheSize() {
+  boost::lock_guard<boost::mutex> l(*_cacheMutex);
+  return _resampledCacheSize;
+}
+
+void MultiResolutionImage::setResampledCacheSize(const unsigned long long cacheSize) {
+  {
+    boost::lock_guard<boost::mutex> l(*_cacheMutex);
+    _resampledCacheSize = cacheSize;
+    _resampledCache->setMaxCacheSize(cacheSize);
+    clearResampledTiles();
+  }
+  updateCacheSizes();
+}
+
+void MultiResolutionImage::clearResampledTiles() {
+  _resampledCache->clear();
+  _resampledLevels.clear();
+}
+
+const unsigned long long MultiResolutionImage::getVirtualPyramidCacheSize() {
+  boost::lock_guard<boost::mutex> l(*_cacheMutex);
+  return _virtualPyramidCacheSize;
+}
+
+void MultiResolutionImage::setVirtualPyramidCacheSize(const unsigned long long cacheSize) {
+  {
+    boost::lock_guard<boost::mutex> l(*_cacheMutex);
+    _virtualPyramidCacheSize = cacheSize;
+    _virtualPyramidCache->setMaxCacheSize(cacheSize);
+  }
+  updateCacheSizes();
+}
+
+const unsigned long long MultiResolutionImage::getZPlaneCacheSize() {
+  boost::lock_guard<boost::mutex> l(*_cacheMutex);
+  return _zPlaneCacheSize;
+}
+
+void MultiResolutionImage::setZPlaneCacheSize(const unsigned long long cacheSize) {
+  {
+    boost::lock_guard<boost::mutex> l(*_cacheMutex);
+    _zPlaneCacheSize = cacheSize;
+    _zPlaneCache->setMaxCacheSize(cacheSize);
+  }
+  updateCacheSizes();
+}
+
+unsigned int MultiResolutionImage::getZPlanePrefetchRadius() {
+  boost::lock_guard<boost::mutex> l(*_cacheMutex);
+  return _zPlanePrefetchRadius;
+}
+
+void MultiResolutionImage::setZPlanePrefetchRadius(const unsigned int& radius) {
+  boost::lock_guard<boost::mutex> l(*_cacheMutex);
+  _zPlanePrefetchRadius = radius;
+}
+
+bool MultiResolutionImage::setVirtualPyramidSidecar(const std::string& sidecarPath) {
+  std::shared_ptr<VirtualPyramid> pyramid;
+  {
+    boost::lock_guard<boost::mutex> l(*_cacheMutex);
+    pyramid = _virtualPyramid;
+  }
+  if (!pyramid) {
+    return false;
+  }
+  if (sidecarPath.empty()) {
+    pyramid->closeSidecar();
+    return true;
+  }
+  return pyramid->openSidecar(sidecarPath);
+}
+
+std::string MultiResolutionImage::getVirtualPyramidSidecar() {
+  boost::lock_guard<boost::mutex> l(*_cacheMutex);
+  return _virtualPyramid ? _virtualPyramid->getSidecarPath() : std::string();
+}
+
+bool MultiResolutionImage::isVirtualLevel(const unsigned int& level) const {
+  return _isValid && level >= _numberOfLevels && level < getNumberOfLevels();
+}
+
+TileCacheStatistics MultiResolutionImage::getCacheStatistics() {
+  boost::lock_guard<boost::mutex> l(*_cacheMutex);
+  if (_cache) {
+    return _cache->getStatistics();
+  }
+  TileCacheStatistics statistics = {0, 0, 0, 0, _cacheSize, 0};
+  return statistics;
+}
+
+TileCacheStatistics MultiResolutionImage::getEncodedCacheStatistics() {
+  boost::lock_guard<boost::mutex> l(*_cacheMutex);
+  if (_encodedCache) {
+    return _encodedCache->getStatistics();
+  }
+  TileCacheStatistics statistics = {0, 0, 0, 0, _encodedCacheSize, 0};
+  return statistics;
+}
+
+void MultiResolutionImage::resetCacheStatistics() {
+  boost::lock_guard<boost::mutex> l(*_cacheMutex);
+  if (_cache) {
+    _cache->resetStatistics();
+  }
+  if (_encodedCache) {
+    _encodedCache->resetStatistics();
+  }
+}
+
+ImageStatistics MultiResolutionImage::getStatistics() {
+  ImageStatistics statistics;
+  statistics.cache = getCacheStatistics();
+  statistics.encodedCache = getEncodedCacheStatistics();
+  _statistics->fillStatistics(statistics);
+  return statistics;
+}
+
+void MultiResolutionImage::resetStatistics() {
+  resetCacheStatistics();
+  _statistics->reset();
+}
+
+void MultiResolutionImage::readRegionIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+  const unsigned long long& height, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride) {
+  ImageStatisticsCollector::RequestScope request(_statistics.get());
+  readLevelIntoBuffer(startX, startY, width, height, level, data, dataType, rowStride);
+}
+
+void MultiResolutionImage::readLevelIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+  const unsigned long long& height, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride) {
+  const unsigned int zPlane = _currentZPlaneIndex;
+  readPlaneIntoBuffer(startX, startY, width, height, level, zPlane, data, dataType, rowStride);
+  if (_numberOfZPlanes > 1) {
+    prefetchZPlanes(startX, startY, width, height, level, zPlane);
+  }
+}
+
+void MultiResolutionImage::readPlaneIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+  const unsigned long long& height, const unsigned int& level, const unsigned int& zPlane, void* data, const pathology::DataType& dataType,
+  const unsigned long long& rowStride) {
+  if (level < _numberOfLevels) {
+    if (_numberOfZPlanes < 2 || _zPlaneCacheSize == 0) {
+      readZPlaneIntoBuffer(startX, startY, width, height, level, zPlane, data, dataType, rowStride);
+      return;
+    }
+    // Composed of the cached tiles of the plane, the ones that are not cached yet are read in parallel
+    const std::vector<unsigned long long>& dimensions = _levelDimensions[level];
+    const long long levelWidth = static_cast<long long>(dimensions[0]), levelHeight = static_cast<long long>(dimensions[1]);
+    const double levelDownsample = getLevelDownsample(level);
+    const long long x = static_cast<long long>(std::floor(startX / levelDownsample + 0.5));
+    const long long y = static_cast<long long>(std::floor(startY / levelDownsample + 0.5));
+    const long long x0 = std::max(x, 0LL), y0 = std::max(y, 0LL);
+    const long long x1 = std::min(x + static_cast<long long>(width), levelWidth), y1 = std::min(y + static_cast<long long>(height), levelHeight);
+    const unsigned long long samplesPerPixel = _samplesPerPixel;
+    const unsigned int sampleSize = bytesPerSample(dataType);
+    // Parts of the region outside the level are black, like the readers leave them
+    for (unsigned long long row = 0; row < height; ++row) {
+      fillSamples(static_cast<unsigned char*>(data) + row * rowStride * sampleSize, dataType, width * samplesPerPixel, 0);
+    }
+    if (x0 >= x1 || y0 >= y1) {
+      return;
     }
-    else if (_dataType == UInt16) {
-      (std::static_pointer_cast<TileCache<unsigned short> >(_cache))->setMaxCacheSize(cacheSize);
+    const long long tileSize = zPlaneTileSize;
+    const long long firstTileX = x0 / tileSize, firstTileY = y0 / tileSize;
+    const long long numberOfTilesX = (x1 - 1) / tileSize - firstTileX + 1, numberOfTilesY = (y1 - 1) / tileSize - firstTileY + 1;
+    const unsigned int pixelBytes = _samplesPerPixel * bytesPerSample(_dataType);
+    const pathology::DataType tileType = _dataType;
+    unsigned char* destination = static_cast<unsigned char*>(data);
+    runInParallel(numberOfTilesX * numberOfTilesY, [&](unsigned long long index) {
+      const long long tileX = firstTileX + static_cast<long long>(index % numberOfTilesX);
+      const long long tileY = firstTileY + static_cast<long long>(index / numberOfTilesX);
+      std::shared_ptr<std::vector<unsigned char> > tile = getZPlaneTile(level, zPlane, tileX, tileY);
+      const long long tileWidth = std::min(tileSize, levelWidth - tileX * tileSize);
+      const long long tileX0 = std::max(x0, tileX * tileSize), tileX1 = std::min(x1, tileX * tileSize + tileWidth);
+      const long long tileY0 = std::max(y0, tileY * tileSize), tileY1 = std::min(y1, (tileY + 1) * tileSize);
+      for (long long row = tileY0; row < tileY1; ++row) {
+        const unsigned char* source = tile->data() + ((row - tileY * tileSize) * tileWidth + (tileX0 - tileX * tileSize)) * pixelBytes;
+        unsigned char* target = destination + ((row - y) * rowStride + (tileX0 - x) * samplesPerPixel) * sampleSize;
+        core::convertSamples(source, tileType, target, dataType, (tileX1 - tileX0) * samplesPerPixel);
+      }
+    });
+    return;
+  }
+  // The pyramid reads level 0 through readZPlaneIntoBuffer, which takes the open/close lock itself
+  std::shared_ptr<VirtualPyramid> pyramid;
+  {
+    boost::lock_guard<boost::mutex> l(*_cacheMutex);
+    pyramid = _virtualPyramid;
+  }
+  if (!pyramid) {
+    return;
+  }
+  const double levelDownsample = getLevelDownsample(level);
+  const long long levelStartX = static_cast<long long>(std::floor(startX / levelDownsample + 0.5));
+  const long long levelStartY = static_cast<long long>(std::floor(startY / levelDownsample + 0.5));
+  pyramid->readRegion(level - _numberOfLevels + 1, levelStartX, levelStartY, width, height, zPlane, data, dataType, rowStride);
+}
+
+std::shared_ptr<std::vector<unsigned char> > MultiResolutionImage::getZPlaneTile(const unsigned int& level, const unsigned int& zPlane, const long long& tileX, const long long& tileY) {
+  const TileKey key = makeTileKey(level, zPlane, tileX, tileY);
+  const bool cached = zPlane < maxTileKeyZPlanes;
+  std::shared_ptr<std::vector<unsigned char> > tile;
+  unsigned int size = 0;
+  if (cached && _zPlaneCache->get(key, tile, size)) {
+    return tile;
+  }
+  const std::vector<unsigned long long>& dimensions = _levelDimensions[level];
+  const unsigned long long width = std::min(static_cast<unsigned long long>(zPlaneTileSize), dimensions[0] - tileX * zPlaneTileSize);
+  const unsigned long long height = std::min(static_cast<unsigned long long>(zPlaneTileSize), dimensions[1] - tileY * zPlaneTileSize);
+  tile = std::make_shared<std::vector<unsigned char> >(width * height * _samplesPerPixel * bytesPerSample(_dataType));
+  const double levelDownsample = getLevelDownsample(level);
+  readZPlaneIntoBuffer(std::llround(tileX * zPlaneTileSize * levelDownsample), std::llround(tileY * zPlaneTileSize * levelDownsample), width, height,
+    level, zPlane, tile->data(), _dataType, width * _samplesPerPixel);
+  if (cached) {
+    _zPlaneCache->set(key, tile, static_cast<unsigned int>(tile->size()));
+  }
+  return tile;
+}
+
+void MultiResolutionImage::prefetchZPlanes(const long long& startX, const long long& startY, const unsigned long long& width,
+  const unsigned long long& height, const unsigned int& level, const unsigned int& zPlane) {
+  if (width == 0 || height == 0 || level >= getNumberOfLevels()) {
+    return;
+  }
+  // Stored levels fill the z-plane cache, generated levels the cache of the virtual pyramid; both are
+  // prefetched along a grid of zPlaneTileSize, which is also the tile size of the pyramid
+  const std::vector<unsigned long long> dimensions = getLevelDimensions(level);
+  const double levelDownsample = getLevelDownsample(level);
+  const long long tileSize = zPlaneTileSize;
+  const long long x0 = std::max(static_cast<long long>(std::floor(startX / levelDownsample + 0.5)), 0LL);
+  const long long y0 = std::max(static_cast<long long>(std::floor(startY / levelDownsample + 0.5)), 0LL);
+  const long long x1 = std::min(x0 + static_cast<long long>(width), static_cast<long long>(dimensions[0]));
+  const long long y1 = std::min(y0 + static_cast<long long>(height), static_cast<long long>(dimensions[1]));
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+  std::vector<std::pair<unsigned int, std::vector<TileKey> > > planes;
+  CancellationToken token;
+  {
+    boost::lock_guard<boost::mutex> l(*_cacheMutex);
+    if (_zPlanePrefetchRadius == 0 || (level < _numberOfLevels && _zPlaneCacheSize == 0)) {
+      return;
+    }
+    token = _zPlanePrefetchToken;
+    // Nearer planes are queued first
+    for (unsigned int distance = 1; distance <= _zPlanePrefetchRadius; ++distance) {
+      for (int side = -1; side <= 1; side += 2) {
+        const long long plane = static_cast<long long>(zPlane) + side * static_cast<long long>(distance);
+        if (plane < 0 || plane >= static_cast<long long>(std::min(_numberOfZPlanes, maxTileKeyZPlanes))) {
+          continue;
+        }
+        std::vector<TileKey> keys;
+        for (long long tileY = y0 / tileSize; tileY <= (y1 - 1) / tileSize; ++tileY) {
+          for (long long tileX = x0 / tileSize; tileX <= (x1 - 1) / tileSize; ++tileX) {
+            const TileKey key = makeTileKey(level, static_cast<unsigned int>(plane), tileX, tileY);
+            if (_zPlanePrefetchesQueued.insert(key).second) {
+              keys.push_back(key);
+            }
+          }
+        }
+        if (!keys.empty()) {
+          planes.push_back(std::make_pair(static_cast<unsigned int>(plane), keys));
+        }
+      }
+    }
+  }
+  TaskExecutor* executor = planes.empty() ? NULL : getExecutor();
+  for (unsigned int i = 0; i < planes.size(); ++i) {
+    const unsigned int plane = planes[i].first;
+    const std::vector<TileKey> keys = planes[i].second;
+    if (!executor) {
+      boost::lock_guard<boost::mutex> l(*_cacheMutex);
+      for (std::vector<TileKey>::const_iterator key = keys.begin(); key != keys.end(); ++key) {
+        _zPlanePrefetchesQueued.erase(*key);
+      }
+      continue;
+    }
+    // Below the priority of the reads the viewer asks for, the planes furthest away last
+    const int priority = -1 - static_cast<int>(plane > zPlane ? plane - zPlane : zPlane - plane);
+    executor->post([this, plane, keys, level, token, dimensions, levelDownsample, tileSize]() {
+      std::vector<unsigned char> buffer;
+      for (std::vector<TileKey>::const_iterator key = keys.begin(); key != keys.end(); ++key) {
+        {
+          boost::lock_guard<boost::mutex> l(*_cacheMutex);
+          _zPlanePrefetchesQueued.erase(*key);
+        }
+        if (token.isCancelled() || _asyncReadsStopped) {
+          continue;
+        }
+        const long long tileX = static_cast<long long>(tileXOfTileKey(*key)), tileY = static_cast<long long>(tileYOfTileKey(*key));
+        try {
+          if (level < _numberOfLevels) {
+            getZPlaneTile(level, plane, tileX, tileY);
+          }
+          else {
+            const unsigned long long tileWidth = std::min(static_cast<unsigned long long>(tileSize), dimensions[0] - tileX * tileSize);
+            const unsigned long long tileHeight = std::min(static_cast<unsigned long long>(tileSize), dimensions[1] - tileY * tileSize);
+            buffer.resize(tileWidth * tileHeight * _samplesPerPixel * bytesPerSample(_dataType));
+            readPlaneIntoBuffer(std::llround(tileX * tileSize * levelDownsample), std::llround(tileY * tileSize * levelDownsample), tileWidth, tileHeight,
+              level, plane, buffer.data(), _dataType, tileWidth * _samplesPerPixel);
+          }
+        }
+        catch (...) {
+          // A tile that cannot be prefetched is read again when the plane is viewed
+        }
+      }
+    }, priority);
+  }
+}
+
+void MultiResolutionImage::readZStack(const long long& startX, const long long& startY, const unsigned long long& width, const unsigned long long& height,
+  const unsigned int& level, const unsigned int& firstZPlane, const unsigned int& numberOfZPlanes, void* data, const pathology::DataType& dataType) {
+  if (!_isValid || bytesPerSample(dataType) == 0 || firstZPlane >= _numberOfZPlanes) {
+    return;
+  }
+  ImageStatisticsCollector::RequestScope request(_statistics.get());
+  const unsigned int count = std::min(numberOfZPlanes, _numberOfZPlanes - firstZPlane);
+  const unsigned long long planeBytes = width * height * _samplesPerPixel * bytesPerSample(dataType);
+  unsigned char* destination = static_cast<unsigned char*>(data);
+  runInParallel(count, [&](unsigned long long index) {
+    readPlaneIntoBuffer(startX, startY, width, height, level, firstZPlane + static_cast<unsigned int>(index), destination + index * planeBytes,
+      dataType, width * _samplesPerPixel);
+  });
+}
+
+void MultiResolutionImage::readRegionAtDownsample(const long long& startX, const long long& startY, const unsigned long long& width, const unsigned long long& height,
+  const double& downsample, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride, const core::ResamplingFilter& filter) {
+  if (!_isValid || width == 0 || height == 0) {
+    return;
+  }
+  ImageStatisticsCollector::RequestScope request(_statistics.get());
+
+  // The source is the level with the largest downsample that does not exceed the requested one, so the
+  // resampling never has to make up detail that a finer level has
+  const double tolerance = 1e-6;
+  unsigned int level = 0;
+  for (int i = 1; i < getNumberOfLevels(); ++i) {
+    if (getLevelDownsample(i) <= downsample * (1. + tolerance)) {
+      level = i;
+    }
+  }
+  const double levelDownsample = getLevelDownsample(level);
+  const double levelX = startX / levelDownsample, levelY = startY / levelDownsample;
+  if (std::abs(downsample / levelDownsample - 1.) < tolerance && std::abs(levelX - std::floor(levelX + 0.5)) < tolerance &&
+    std::abs(levelY - std::floor(levelY + 0.5)) < tolerance) {
+    readLevelIntoBuffer(startX, startY, width, height, level, data, dataType, rowStride);
+    return;
+  }
+
+  // Resampled tiles are cached per combination of downsample, filter and data type; when all levels of
+  // the keys are taken, other combinations are resampled without the cache
+  int cacheLevel = -1;
+  {
+    boost::lock_guard<boost::mutex> l(*_cacheMutex);
+    if (_resampledCacheSize > 0) {
+      for (unsigned int i = 0; i < _resampledLevels.size() && cacheLevel < 0; ++i) {
+        if (_resampledLevels[i].downsample == downsample && _resampledLevels[i].filter == filter && _resampledLevels[i].dataType == dataType) {
+          cacheLevel = i;
+        }
+      }
+      if (cacheLevel < 0 && _resampledLevels.size() < 256) {
+        ResampledLevel resampledLevel = {downsample, filter, dataType};
+        _resampledLevels.push_back(resampledLevel);
+        cacheLevel = static_cast<int>(_resampledLevels.size()) - 1;
+      }
+    }
+  }
+  if (cacheLevel >= 0) {
+    readResampledTiles(static_cast<long long>(std::floor(startX / downsample + 0.5)), static_cast<long long>(std::floor(startY / downsample + 0.5)),
+      width, height, downsample, level, cacheLevel, data, dataType, rowStride, filter);
+  }
+  else {
+    resampleRegion(startX / downsample, startY / downsample, width, height, downsample, level, data, dataType, rowStride, filter);
+  }
+}
+
+void MultiResolutionImage::resampleRegion(const double& outputX, const double& outputY, const unsigned long long& width, const unsigned long long& height,
+  const double& downsample, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride,
+  const core::ResamplingFilter& filter) {
+  const double levelDownsample = getLevelDownsample(level);
+  const double scale = downsample / levelDownsample;
+  const std::vector<unsigned long long> levelDimensions = getLevelDimensions(level);
+
+  // Only the part of the level the filter reaches is read, clipped to the level
+  const double sourceX = outputX * scale, sourceY = outputY * scale;
+  const double support = core::getResamplingSupport(filter, scale);
+  const long long left = std::max(static_cast<long long>(std::floor(sourceX - support)), 0LL);
+  const long long top = std::max(static_cast<long long>(std::floor(sourceY - support)), 0LL);
+  const long long right = std::min(static_cast<long long>(std::ceil(sourceX + width * scale + support)), static_cast<long long>(levelDimensions[0]));
+  const long long bottom = std::min(static_cast<long long>(std::ceil(sourceY + height * scale + support)), static_cast<long long>(levelDimensions[1]));
+  const unsigned long long windowWidth = right > left ? right - left : 0;
+  const unsigned long long windowHeight = bottom > top ? bottom - top : 0;
+
+  const unsigned int samplesPerPixel = getSamplesPerPixel();
+  const pathology::DataType sourceType = _dataType != InvalidDataType ? _dataType : dataType;
+  core::resample(sourceType, samplesPerPixel, windowWidth, windowHeight, [&](const unsigned long long& firstRow, const unsigned long long& numberOfRows, void* rows) {
+    readLevelIntoBuffer(std::llround(left * levelDownsample), std::llround((top + firstRow) * levelDownsample), windowWidth, numberOfRows, level,
+      rows, sourceType, windowWidth * samplesPerPixel);
+  }, sourceX - left, sourceY - top, scale, scale, data, dataType, width, height, rowStride, filter);
+}
+
+void MultiResolutionImage::readResampledTiles(const long long& outputX, const long long& outputY, const unsigned long long& width, const unsigned long long& height,
+  const double& downsample, const unsigned int& level, const unsigned int& cacheLevel, void* data, const pathology::DataType& dataType,
+  const unsigned long long& rowStride, const core::ResamplingFilter& filter) {
+  const long long tileSize = 256;
+  const unsigned int samplesPerPixel = getSamplesPerPixel();
+  const unsigned long long pixelBytes = samplesPerPixel * bytesPerSample(dataType);
+  const unsigned long long tileBytes = tileSize * tileSize * pixelBytes;
+  const long long firstTileX = (outputX >= 0 ? outputX : outputX - tileSize + 1) / tileSize;
+  const long long firstTileY = (outputY >= 0 ? outputY : outputY - tileSize + 1) / tileSize;
+  const long long endX = outputX + static_cast<long long>(width), endY = outputY + static_cast<long long>(height);
+  const long long numberOfTilesX = (endX - firstTileX * tileSize + tileSize - 1) / tileSize;
+  const long long numberOfTilesY = (endY - firstTileY * tileSize + tileSize - 1) / tileSize;
+  const unsigned int zPlane = _currentZPlaneIndex;
+  unsigned char* destination = static_cast<unsigned char*>(data);
+
+  // Tiles which are not cached yet are resampled in parallel
+  runInParallel(numberOfTilesX * numberOfTilesY, [&](unsigned long long index) {
+    const long long tileX = firstTileX + static_cast<long long>(index % numberOfTilesX);
+    const long long tileY = firstTileY + static_cast<long long>(index / numberOfTilesX);
+    const TileKey key = makeTileKey(cacheLevel, zPlane, tileX, tileY);
+    std::shared_ptr<std::vector<unsigned char> > tile;
+    unsigned int cachedSize = 0;
+    const bool cached = zPlane < maxTileKeyZPlanes;
+    if (!cached || !_resampledCache->get(key, tile, cachedSize)) {
+      tile = std::make_shared<std::vector<unsigned char> >(tileBytes);
+      resampleRegion(static_cast<double>(tileX * tileSize), static_cast<double>(tileY * tileSize), tileSize, tileSize, downsample, level,
+        &(*tile)[0], dataType, tileSize * samplesPerPixel, filter);
+      if (cached) {
+        _resampledCache->set(key, tile, tileBytes);
+      }
+    }
+    const long long x0 = std::max(outputX, tileX * tileSize), x1 = std::min(endX, (tileX + 1) * tileSize);
+    const long long y0 = std::max(outputY, tileY * tileSize), y1 = std::min(endY, (tileY + 1) * tileSize);
+    for (long long y = y0; y < y1; ++y) {
+      const unsigned char* source = &(*tile)[0] + ((y - tileY * tileSize) * tileSize + (x0 - tileX * tileSize)) * pixelBytes;
+      std::copy(source, source + (x1 - x0) * pixelBytes, destination + ((y - outputY) * rowStride + (x0 - outputX) * samplesPerPixel) * bytesPerSample(dataType));
+    }
+  });
+}
+
+unsigned int MultiResolutionImage::bytesPerSample(const pathology::DataType& dataType) {
+  if (dataType == UChar) {
+    return sizeof(unsigned char);
+  }
+  else if (dataType == UInt16) {
+    return sizeof(unsigned short);
+  }
+  else if (dataType == UInt32) {
+    return sizeof(unsigned int);
+  }
+  else if (dataType == Float) {
+    return sizeof(float);
+  }
+  return 0;
+}
+
+void MultiResolutionImage::fillSamples(void* destination, const pathology::DataType& destinationType, const unsigned long long& count, const double& value) {
+  if (destinationType == UChar) {
+    std::fill(static_cast<unsigned char*>(destination), static_cast<unsigned char*>(destination) + count, static_cast<unsigned char>(value));
+  }
+  else if (destinationType == UInt16) {
+    std::fill(static_cast<unsigned short*>(destination), static_cast<unsigned short*>(destination) + count, static_cast<unsigned short>(value));
+  }
+  else if (destinationType == UInt32) {
+    std::fill(static_cast<unsigned int*>(destination), static_cast<unsigned int*>(destination) + count, static_cast<unsigned int>(value));
+  }
+  else if (destinationType == Float) {
+    std::fill(static_cast<float*>(destination), static_cast<float*>(destination) + count, static_cast<float>(value));
+  }
+}
+
+TaskExecutor* MultiResolutionImage::getExecutor() {
+  boost::lock_guard<boost::mutex> l(*_executorMutex);
+  if (_asyncReadsStopped) {
+    return NULL;
+  }
+  if (!_executor) {
+    _executor.reset(new TaskExecutor());
+  }
+  return _executor.get();
+}
+
+void MultiResolutionImage::stopAsyncReads() {
+  std::unique_ptr<TaskExecutor> executor;
+  {
+    boost::lock_guard<boost::mutex> l(*_executorMutex);
+    _asyncReadsStopped = true;
+    executor.swap(_executor);
+  }
+  // Queued reads see _asyncReadsStopped and return without reading; destroying the executor waits for
+  // them. The lock is not held here, so running tasks can still call getExecutor.
+  executor.reset();
+}
+
+std::future<bool> MultiResolutionImage::readRegionAsync(const RegionRequest& request, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride,
+  const int& priority, const CancellationToken& token) {
+  std::shared_ptr<std::promise<bool> > promise = std::make_shared<std::promise<bool> >();
+  std::future<bool> result = promise->get_future();
+  TaskExecutor* executor = getExecutor();
+  if (!executor || !data || bytesPerSample(dataType) == 0) {
+    promise->set_value(false);
+    return result;
+  }
+  CacheAccessHint hint = TileCacheBase::getAccessHint();
+  _statistics->requestQueued();
+  executor->post([this, promise, request, data, dataType, rowStride, token, hint]() {
+    ScopedCacheAccessHint scopedHint(hint);
+    _statistics->requestDequeued();
+    if (token.isCancelled() || _asyncReadsStopped || request.level >= getNumberOfLevels()) {
+      promise->set_value(false);
+      return;
+    }
+    try {
+      readRegionIntoBuffer(request.startX, request.startY, request.width, request.height, request.level, data, dataType, rowStride);
+      promise->set_value(true);
+    }
+    catch (...) {
+      promise->set_exception(std::current_exception());
+    }
+  }, priority);
+  return result;
+}
+
+void MultiResolutionImage::readRegionAsync(const RegionRequest& request, const pathology::DataType& dataType, const std::function<void(const void*)>& callback,
+  const int& priority, const CancellationToken& token) {
+  TaskExecutor* executor = getExecutor();
+  if (!executor || bytesPerSample(dataType) == 0) {
+    return;
+  }
+  CacheAccessHint hint = TileCacheBase::getAccessHint();
+  _statistics->requestQueued();
+  executor->post([this, request, dataType, callback, token, hint]() {
+    ScopedCacheAccessHint scopedHint(hint);
+    _statistics->requestDequeued();
+    if (token.isCancelled() || _asyncReadsStopped || request.level >= getNumberOfLevels()) {
+      return;
+    }
+    unsigned long long rowStride = request.width * getSamplesPerPixel();
+    std::vector<unsigned char> data;
+    try {
+      data.resize(request.height * rowStride * bytesPerSample(dataType));
+      readRegionIntoBuffer(request.startX, request.startY, request.width, request.height, request.level, data.data(), dataType, rowStride);
+    }
+    catch (...) {
+      // There is no caller to rethrow to, a NULL buffer tells the callback the read failed
+      callback(NULL);
+      return;
+    }
+    callback(data.data());
+  }, priority);
+}
+
+void MultiResolutionImage::readRegions(const std::vector<RegionRequest>& requests, const std::vector<void*>& outputs, const pathology::DataType& dataType) {
+  if (outputs.size() != requests.size()) {
+    return;
+  }
+  readRegionBatch(requests, dataType,
+    [&outputs](unsigned int index) { return static_cast<unsigned char*>(outputs[index]); },
+    [](unsigned int index, unsigned char* data) {});
+}
+
+void MultiResolutionImage::readRegions(const std::vector<RegionRequest>& requests, const pathology::DataType& dataType, const std::function<void(unsigned int, const void*)>& callback) {
+  unsigned long long samples = getSamplesPerPixel();
+  unsigned int sampleSize = bytesPerSample(dataType);
+  readRegionBatch(requests, dataType,
+    [&requests, samples, sampleSize](unsigned int index) { return new unsigned char[requests[index].width * requests[index].height * samples * sampleSize](); },
+    [&callback](unsigned int index, unsigned char* data) {
+      try {
+        callback(index, data);
+      }
+      catch (...) {
+        delete[] data;
+        throw;
+      }
+      delete[] data;
+    });
+}
+
+namespace {
+  // The tiles shared by the requests of a batch are decoded once and held while the regions are filled, as
+  // long as they fit in this many bytes; otherwise the regions are read through the tile cache
+  const unsigned long long maxBatchTileByteSize = 256 * 1024 * 1024;
+
+  long long toLevelCoordinate(const long long& coordinate, const double& downsample) {
+    return static_cast<long long>(std::floor(coordinate / downsample + 0.5));
+  }
+
+  struct BatchTile {
+    unsigned int level;
+    unsigned long long tileX;
+    unsigned long long tileY;
+    std::shared_ptr<void> data;
+  };
+}
+
+void MultiResolutionImage::readRegionBatch(const std::vector<RegionRequest>& requests, const pathology::DataType& dataType,
+  const std::function<unsigned char*(unsigned int)>& bufferFor, const std::function<void(unsigned int, unsigned char*)>& done) {
+  if (requests.empty() || !_isValid || bytesPerSample(dataType) == 0) {
+    return;
+  }
+  const unsigned long long samples = getSamplesPerPixel();
+  const unsigned int sampleSize = bytesPerSample(dataType);
+  const pathology::DataType tileType = getDataType();
+  const unsigned int tileSampleSize = bytesPerSample(tileType);
+
+  // Tiles of the level a request covers, clipped to the level; false if the level has no tile grid
+  auto tileRange = [this](const RegionRequest& request, long long& levelX, long long& levelY, long long& firstTileX, long long& firstTileY,
+    long long& lastTileX, long long& lastTileY) {
+    std::vector<unsigned int> tileSize = getLevelTileSize(request.level);
+    if (tileSize.size() < 2 || tileSize[0] == 0 || tileSize[1] == 0 || request.width == 0 || request.height == 0) {
+      return false;
+    }
+    const std::vector<unsigned long long> dimensions = getLevelDimensions(request.level);
+    const double downsample = getLevelDownsample(request.level);
+    levelX = toLevelCoordinate(request.startX, downsample);
+    levelY = toLevelCoordinate(request.startY, downsample);
+    const long long lastX = std::min(levelX + static_cast<long long>(request.width), static_cast<long long>(dimensions[0])) - 1;
+    const long long lastY = std::min(levelY + static_cast<long long>(request.height), static_cast<long long>(dimensions[1])) - 1;
+    firstTileX = std::max(levelX, 0LL) / tileSize[0];
+    firstTileY = std::max(levelY, 0LL) / tileSize[1];
+    lastTileX = lastX < 0 ? -1 : lastX / tileSize[0];
+    lastTileY = lastY < 0 ? -1 : lastY / tileSize[1];
+    return true;
+  };
+
+  // Every tile touched by the requests is decoded once, in parallel
+  std::vector<BatchTile> tiles;
+  std::unordered_map<TileKey, unsigned int> tileIndex;
+  unsigned long long tileBytes = 0;
+  for (unsigned int i = 0; i < requests.size() && tileBytes <= maxBatchTileByteSize; ++i) {
+    const RegionRequest& request = requests[i];
+    long long levelX, levelY, firstTileX, firstTileY, lastTileX, lastTileY;
+    if (request.level >= getNumberOfLevels() || !tileRange(request, levelX, levelY, firstTileX, firstTileY, lastTileX, lastTileY)) {
+      continue;
+    }
+    std::vector<unsigned int> tileSize = getLevelTileSize(request.level);
+    for (long long tileY = firstTileY; tileY <= lastTileY; ++tileY) {
+      for (long long tileX = firstTileX; tileX <= lastTileX; ++tileX) {
+        if (tileIndex.insert(std::make_pair(makeTileKey(request.level, 0, tileX, tileY), static_cast<unsigned int>(tiles.size()))).second) {
+          BatchTile tile = { request.level, static_cast<unsigned long long>(tileX), static_cast<unsigned long long>(tileY), std::shared_ptr<void>() };
+          tiles.push_back(tile);
+          tileBytes += static_cast<unsigned long long>(tileSize[0]) * tileSize[1] * samples * tileSampleSize;
+        }
+      }
+    }
+  }
+  if (tileBytes > maxBatchTileByteSize || tileSampleSize == 0) {
+    tiles.clear();
+    tileIndex.clear();
+  }
+  runInParallel(tiles.size(), [&](unsigned long long index) {
+    tiles[index].data = readNativeTile(tiles[index].level, tiles[index].tileX, tiles[index].tileY);
+  });
+
+  // Composes a region from the decoded tiles, false if one of them is missing (e.g. the reader does not
+  // keep decoded tiles), in which case the region is read as usual
+  auto fillFromTiles = [&](const RegionRequest& request, unsigned char* data) {
+    long long levelX, levelY, firstTileX, firstTileY, lastTileX, lastTileY;
+    if (tiles.empty() || !tileRange(request, levelX, levelY, firstTileX, firstTileY, lastTileX, lastTileY)) {
+      return false;
+    }
+    for (long long tileY = firstTileY; tileY <= lastTileY; ++tileY) {
+      for (long long tileX = firstTileX; tileX <= lastTileX; ++tileX) {
+        std::unordered_map<TileKey, unsigned int>::const_iterator tile = tileIndex.find(makeTileKey(request.level, 0, tileX, tileY));
+        if (tile == tileIndex.end() || !tiles[tile->second].data) {
+          return false;
+        }
+      }
+    }
+    const std::vector<unsigned long long> dimensions = getLevelDimensions(request.level);
+    const std::vector<unsigned int> tileSize = getLevelTileSize(request.level);
+    const unsigned long long rowBytes = request.width * samples * sampleSize;
+    if (levelX < 0 || levelY < 0 || levelX + request.width > dimensions[0] || levelY + request.height > dimensions[1]) {
+      for (unsigned long long y = 0; y < request.height; ++y) {
+        fillSamples(data + y * rowBytes, dataType, request.width * samples, 0);
+      }
+    }
+    for (long long tileY = firstTileY; tileY <= lastTileY; ++tileY) {
+      for (long long tileX = firstTileX; tileX <= lastTileX; ++tileX) {
+        const unsigned char* tile = static_cast<const unsigned char*>(tiles[tileIndex.find(makeTileKey(request.level, 0, tileX, tileY))->second].data.get());
+        const long long x0 = std::max(levelX, tileX * tileSize[0]);
+        const long long x1 = std::min(std::min(levelX + static_cast<long long>(request.width), (tileX + 1) * tileSize[0]), static_cast<long long>(dimensions[0]));
+        const long long y0 = std::max(levelY, tileY * tileSize[1]);
+        const long long y1 = std::min(std::min(levelY + static_cast<long long>(request.height), (tileY + 1) * tileSize[1]), static_cast<long long>(dimensions[1]));
+        for (long long y = y0; y < y1; ++y) {
+          const unsigned char* source = tile + ((y - tileY * tileSize[1]) * tileSize[0] + (x0 - tileX * tileSize[0])) * samples * tileSampleSize;
+          unsigned char* target = data + (y - levelY) * rowBytes + (x0 - levelX) * samples * sampleSize;
+          core::convertSamples(source, tileType, target, dataType, (x1 - x0) * samples);
+        }
+      }
+    }
+    return true;
+  };
+
+  runInParallel(requests.size(), [&](unsigned long long index) {
+    const RegionRequest& request = requests[index];
+    unsigned char* data = bufferFor(static_cast<unsigned int>(index));
+    if (request.level < getNumberOfLevels() && !fillFromTiles(request, data)) {
+      readRegionIntoBuffer(request.startX, request.startY, request.width, request.height, request.level, data, dataType, request.width * samples);
+    }
+    done(static_cast<unsigned int>(index), data);
+  });
+}
+
+void MultiResolutionImage::runInParallel(const unsigned long long& count, const std::function<void(unsigned long long)>& work) {
+  // Indices are claimed one at a time by the calling thread and by helpers posted to the executor. The
+  // caller always takes part, so nested calls finish even when every worker is busy. Helpers which
+  // start after all indices have been claimed only touch the shared state, so they may outlive this call.
+  struct ParallelState {
+    std::atomic<unsigned long long> next;
+    unsigned long long finished;
+    std::exception_ptr error;
+    boost::mutex mutex;
+    boost::condition_variable allFinished;
+  };
+  std::shared_ptr<ParallelState> state = std::make_shared<ParallelState>();
+  state->next = 0;
+  state->finished = 0;
+  // Helpers read with the cache access hint of the caller
+  CacheAccessHint hint = TileCacheBase::getAccessHint();
+  std::function<void()> claimAndRun = [state, count, &work, hint]() {
+    ScopedCacheAccessHint scopedHint(hint);
+    for (unsigned long long index = state->next++; index < count; index = state->next++) {
+      std::exception_ptr error;
+      try {
+        work(index);
+      }
+      catch (...) {
+        // A failing index does not prevent the others from finishing, the caller rethrows the first error
+        error = std::current_exception();
+      }
+      boost::lock_guard<boost::mutex> l(state->mutex);
+      if (error && !state->error) {
+        state->error = error;
+      }
+      if (++state->finished == count) {
+        state->allFinished.notify_all();
+      }
     }
-    else if (_dataType == UChar) {
-      (std::static_pointer_cast<TileCache<unsigned char> >(_cache))->setMaxCacheSize(cacheSize);
+  };
+  TaskExecutor* executor = count > 1 ? getExecutor() : NULL;
+  if (executor) {
+    unsigned long long numberOfHelpers = std::min(static_cast<unsigned long long>(executor->getNumberOfThreads()), count - 1);
+    for (unsigned long long i = 0; i < numberOfHelpers; ++i) {
+      executor->post(claimAndRun);
     }
-    else if (_dataType == Float) {
-      (std::static_pointer_cast<TileCache<float> >(_cache))->setMaxCacheSize(cacheSize);
+  }
+  claimAndRun();
+  boost::unique_lock<boost::mutex> l(state->mutex);
+  while (state->finished < count) {
+    state->allFinished.wait(l);
+  }
+  if (state->error) {
+    std::rethrow_exception(state->error);
+  }
+}
+
+std::shared_ptr<void> MultiResolutionImage::readNativeTile(const unsigned int& level, const unsigned long long& tileX, const unsigned long long& tileY) {
+  return std::shared_ptr<void>();
+}
+
+unsigned int MultiResolutionImage::getOutputTileSize(const unsigned int& level, TileIterationOptions& options) const {
+  const std::vector<unsigned int> nativeTileSize = getLevelTileSize(level);
+  if (nativeTileSize.size() >= 2 && nativeTileSize[0] > 0 && nativeTileSize[0] == nativeTileSize[1] && nativeTileSize[0] % 16 == 0) {
+    options.tileSize = 0;
+    return nativeTileSize[0];
+  }
+  options.tileSize = 512;
+  return options.tileSize;
+}
+
+void MultiResolutionImage::forEachTile(const unsigned int& level, const pathology::DataType& dataType, const std::function<void(const long long&, const long long&,
+  const unsigned long long&, const unsigned long long&, const void*, const unsigned long long&)>& callback, const TileIterationOptions& options) {
+  if (!_isValid || level >= getNumberOfLevels() || bytesPerSample(dataType) == 0) {
+    return;
+  }
+  std::vector<unsigned long long> levelDimensions = getLevelDimensions(level);
+  std::vector<unsigned int> tileSize = getLevelTileSize(level);
+  bool nativeGrid = options.tileSize == 0 && tileSize.size() >= 2 && tileSize[0] > 0 && tileSize[1] > 0;
+  if (!nativeGrid) {
+    unsigned int size = options.tileSize > 0 ? options.tileSize : 512;
+    tileSize = std::vector<unsigned int>(2, size);
+  }
+  // Views straight into the decoded tiles are only possible when nothing has to be converted or added
+  bool viewNativeTiles = nativeGrid && options.halo == 0 && dataType == getDataType();
+  const unsigned long long samples = getSamplesPerPixel();
+  const unsigned int sampleSize = bytesPerSample(dataType);
+  const unsigned long long numberOfTilesX = (levelDimensions[0] + tileSize[0] - 1) / tileSize[0];
+  const unsigned long long numberOfTilesY = (levelDimensions[1] + tileSize[1] - 1) / tileSize[1];
+  const double downsample = getLevelDownsample(level);
+  ScopedCacheAccessHint scopedHint(options.cacheAccessHint);
+
+  auto visitTile = [&](unsigned long long index, std::vector<unsigned char>& buffer) {
+    unsigned long long tileX = index % numberOfTilesX;
+    unsigned long long tileY = index / numberOfTilesX;
+    long long x = tileX * tileSize[0];
+    long long y = tileY * tileSize[1];
+    unsigned long long width = std::min(static_cast<unsigned long long>(tileSize[0]), levelDimensions[0] - x);
+    unsigned long long height = std::min(static_cast<unsigned long long>(tileSize[1]), levelDimensions[1] - y);
+    if (viewNativeTiles) {
+      std::shared_ptr<void> tile = readNativeTile(level, tileX, tileY);
+      if (tile) {
+        callback(x, y, width, height, tile.get(), tileSize[0] * samples);
+        return;
+      }
+    }
+    const unsigned long long halo = options.halo;
+    const unsigned long long rowStride = (width + 2 * halo) * samples;
+    buffer.resize((height + 2 * halo) * rowStride * sampleSize);
+    readRegionIntoBuffer(std::llround((x - static_cast<long long>(halo)) * downsample), std::llround((y - static_cast<long long>(halo)) * downsample),
+      width + 2 * halo, height + 2 * halo, level, buffer.data(), dataType, rowStride);
+    callback(x, y, width, height, buffer.data() + (halo * rowStride + halo * samples) * sampleSize, rowStride);
+  };
+
+  if (options.parallel) {
+    runInParallel(numberOfTilesX * numberOfTilesY, [&visitTile](unsigned long long index) {
+      std::vector<unsigned char> buffer;
+      visitTile(index, buffer);
+    });
+  }
+  else {
+    std::vector<unsigned char> buffer;
+    for (unsigned long long index = 0; index < numberOfTilesX * numberOfTilesY; ++index) {
+      visitTile(index, buffer);
     }
-  _cacheMutex->unlock();
   }
 }
@@ -2,9 +2,19 @@
 #define _MultiResolutionImage
 #include <string>
 #include <memory>
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <stdexcept>
+#include <unordered_set>
 #include "multiresolutionimageinterface_export.h"
 #include "TileCache.h"
+#include "ImageStatistics.h"
+#include "TaskExecutor.h"
+#include "ByteSource.h"
 #include "core/PathologyEnums.h"
+#include "core/PixelConversion.h"
+#include "core/Resampling.h"
 #include "core/ImageSource.h"
 #include "core/Patch.h"
 
@@ -12,12 +22,70 @@ namespace boost {
   class mutex;
   class shared_mutex;
 }
+class VirtualPyramid;
+
+//! A region to be read by MultiResolutionImage::readRegions; coordinates follow getRawRegion,
+//! so startX and startY are in level 0 pixels and width and height in pixels of the level
+struct RegionRequest {
+  RegionRequest() : startX(0), startY(0), width(0), height(0), level(0) {}
+  RegionRequest(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level) :
+    startX(startX), startY(startY), width(width), height(height), level(level) {}
+
+  long long startX;
+  long long startY;
+  unsigned long long width;
+  unsigned long long height;
+  unsigned int level;
+};
+
+//! Read-only view of a tile handed to the callback of MultiResolutionImage::forEachTile. x and y are the
+//! level coordinates of the first pixel of the tile and width and height its size, clipped to the level.
+//! data points at pixel (x, y); the halo pixels around the tile are at negative offsets and beyond width
+//! and height. The view only lives as long as the callback.
+template <typename T>
+struct TileView {
+  long long x;
+  long long y;
+  unsigned long long width;
+  unsigned long long height;
+  unsigned int halo;
+  unsigned int samplesPerPixel;
+  unsigned long long rowStride;
+  const T* data;
+
+  //! Sample c of the pixel at (px, py) relative to the tile, px and py can range from -halo to size + halo
+  const T& at(const long long& px, const long long& py, const unsigned int& c = 0) const {
+    return data[py * static_cast<long long>(rowStride) + px * samplesPerPixel + c];
+  }
+};
+
+//! Options for MultiResolutionImage::forEachTile
+struct TileIterationOptions {
+  TileIterationOptions() : halo(0), parallel(false), tileSize(0), cacheAccessHint(ScanCacheAccess) {}
+
+  //! Number of pixels of context around every tile, pixels outside the level are 0
+  unsigned int halo;
+
+  //! Calls back from the worker threads of the image in no particular order instead of row by row
+  bool parallel;
+
+  //! Size of the tiles, 0 means the native tile grid of the level (or 512 if the level is not tiled)
+  unsigned int tileSize;
+
+  //! By default the tiles read during the iteration are admitted cold, so a whole-slide pass does not
+  //! evict the tiles that are being viewed; use NormalCacheAccess if the tiles are visited again soon
+  CacheAccessHint cacheAccessHint;
+};
 
 class MULTIRESOLUTIONIMAGEINTERFACE_EXPORT MultiResolutionImage : public ImageSource {
 
 public :
   MultiResolutionImage();
   virtual ~MultiResolutionImage();
+
+  //! Returns a second image on the same file for use by another thread, which shares the tile caches and
+  //! decoder handles with this one but not its decoder state. Readers that do not support this return NULL.
   ImageSource* clone();
 
   //! Load the image, returns whether a valid image is obtained
@@ -26,18 +94,97 @@ public :
   //! Actually initialization implementataiton
   virtual bool initializeType(const std::string& imagePath) = 0;
 
-  //! Support for slides with multiple z-planes
+  //! Support for slides with multiple z-planes. Changing the current plane cancels the background reads
+  //! of the planes around the previous one.
   int getNumberOfZPlanes() const;
   void setCurrentZPlaneIndex(const unsigned int& zPlaneIndex);
   unsigned int getCurrentZPlaneIndex() const;
 
+  //! Gets/Sets the maximum size of the cache for the tiles of the stored levels of images with more than
+  //! one z-plane. Tiles are cached per plane, so focusing back to a plane does not read it again.
+  const unsigned long long getZPlaneCacheSize();
+  void setZPlaneCacheSize(const unsigned long long cacheSize);
+
+  //! Gets/Sets the number of planes on either side of the current one of which the tiles are read in the
+  //! background after a region of the current plane was read, so focusing up or down finds them in the
+  //! cache. It is 1 by default, 0 turns prefetching off; images with a single z-plane never prefetch.
+  unsigned int getZPlanePrefetchRadius();
+  void setZPlanePrefetchRadius(const unsigned int& radius);
+
   //! Get a stored data property (e.g. objective magnification")
   virtual std::string getProperty(const std::string& propertyName) { return std::string(); };
 
-  //! Gets/Sets the maximum size of the cache
+  //! Names of all stored data properties that getProperty can return
+  virtual std::vector<std::string> getPropertyNames() { return std::vector<std::string>(); };
+
+  //! Gets/Sets the maximum size of the cache. When the TileCacheManager has a budget, a size of 0 means
+  //! the cache only follows the shared budget. Setting it also drops the cached resampled tiles.
   virtual const unsigned long long getCacheSize();
   virtual void setCacheSize(const unsigned long long cacheSize);
 
+  //! Gets/Sets the maximum number of decoder handles that are opened on the file, each of which decodes
+  //! for one thread at a time, and the number of seconds after which an unused one is closed again.
+  //! Readers that decode through a single handle ignore these.
+  virtual unsigned int getMaxNumberOfReadHandles() const { return 1; }
+  virtual void setMaxNumberOfReadHandles(const unsigned int& maxNumberOfReadHandles) {}
+  virtual double getReadHandleIdleTimeout() const { return 0.; }
+  virtual void setReadHandleIdleTimeout(const double& seconds) {}
+
+  //! Gets/Sets the weight of the caches of this image in the shared budget of the TileCacheManager; an
+  //! image with weight 2 gets to keep twice as many bytes as one with weight 1
+  double getCacheWeight();
+  void setCacheWeight(const double& weight);
+
+  //! Gets/Sets the replacement policy of the decoded and encoded tile caches (LRU by default)
+  CacheReplacementPolicy getCacheReplacementPolicy();
+  void setCacheReplacementPolicy(const CacheReplacementPolicy& policy);
+
+  //! Gets/Sets the maximum size of the encoded tile cache. It keeps compressed tiles as they are stored
+  //! in the file, so a tile that dropped out of the decoded cache can be decoded again without reading
+  //! from disk. A compressed tile is typically 10-20 times smaller than the decoded one, so this tier
+  //! keeps a much larger part of the slide in memory. Only readers that decode tiles themselves use it,
+  //! and only for files that are read with positional reads: memory-mapped files are decoded in place.
+  const unsigned long long getEncodedCacheSize();
+  void setEncodedCacheSize(const unsigned long long cacheSize);
+
+  //! Gets/Sets the maximum size of the cache for tiles resampled by getRegionAtDownsample and
+  //! getRegionAtSpacing. It is empty by default; when it has a size, regions at downsamples between the
+  //! levels are composed of cached resampled tiles and their start is rounded to whole output pixels.
+  //! Setting it drops the tiles cached so far, which frees the keys of downsamples no longer in use.
+  const unsigned long long getResampledCacheSize();
+  void setResampledCacheSize(const unsigned long long cacheSize);
+
+  //! Images stored without a pyramid get downsampled levels generated from level 0 on demand. They are
+  //! reported as the levels after the stored one and can be read like any other level. Gets/Sets the
+  //! maximum size of the cache for their tiles.
+  const unsigned long long getVirtualPyramidCacheSize();
+  void setVirtualPyramidCacheSize(const unsigned long long cacheSize);
+
+  //! Stores the generated tiles of the virtual levels in a file, so they are not generated again when
+  //! the image is opened later. An empty path stops writing to it. Returns false if the image has no
+  //! virtual levels or the file cannot be opened.
+  bool setVirtualPyramidSidecar(const std::string& sidecarPath);
+  std::string getVirtualPyramidSidecar();
+
+  //! Whether the level is generated from level 0 instead of stored in the file
+  bool isVirtualLevel(const unsigned int& level) const;
+
+  //! Hit and miss counts and usage of the decoded and encoded tile caches
+  TileCacheStatistics getCacheStatistics();
+  TileCacheStatistics getEncodedCacheStatistics();
+  void resetCacheStatistics();
+
+  //! Cache hits and misses per level, bytes read from the file, decode times per codec, time spent waiting
+  //! on locks and region reads in flight, counted since the image was opened or resetStatistics was called
+  ImageStatistics getStatistics();
+  void resetStatistics();
+
+  //! Tells the reader how the image will be accessed: randomly when viewing, sequentially when
+  //! processing the slide tile by tile. For memory-mapped files this is passed on to the operating
+  //! system so it reads ahead accordingly.
+  void setAccessPattern(const ByteSource::AccessPattern& pattern);
+  ByteSource::AccessPattern getAccessPattern() const;
+
   //! Gets the number of levels in the slide pyramid
   virtual const int getNumberOfLevels() const;
   
@@ -50,6 +197,10 @@ public :
   //! Get the downsampling factor of the given level relative to the base level
   virtual const double getLevelDownsample(const unsigned int& level) const;
 
+  //! Gets the size of the tiles in which the given level is stored, empty if the level is not tiled
+  //! or the reader does not know
+  virtual const std::vector<unsigned int> getLevelTileSize(const unsigned int& level) const;
+
   //! Gets the level corresponding to the closest downsample factor given the requested downsample factor
   virtual const int getBestLevelForDownSample(const double& downsample) const;
 
@@ -89,8 +240,9 @@ public :
     return patch;
   }
 
-  //! Obtains pixel data for a requested region. The user is responsible for allocating
-  //! enough memory for the data to fit the array and clearing the memory. Please note that in case of int32 ARGB data,  
+  //! Obtains pixel data for a requested region. If data is NULL, an array of width * height * samples per
+  //! pixel is allocated with new[], which the user has to delete[]; otherwise the user is responsible for
+  //! allocating enough memory for the data to fit the array. Please note that in case of int32 ARGB data,  
   //! like in OpenSlide, the order of the colors depends on the endianness of your machine (Windows typically BGRA)
   template <typename T> 
   void getRawRegion(const long long& startX, const long long& startY, const unsigned long long& width, 
@@ -98,35 +250,185 @@ public :
       if (level >= getNumberOfLevels()) {
         return;
       }
-      unsigned int nrSamples = getSamplesPerPixel();
-      if (this->getDataType()==pathology::Float) {
-        float * temp = (float*)readDataFromImage(startX, startY, width, height, level);
-        std::copy(temp, temp + width*height*nrSamples, data);
-        delete[] temp;
-      }
-      else if (this->getDataType()==pathology::UChar) {
-        unsigned char * temp = (unsigned char*)readDataFromImage(startX, startY, width, height, level);
-        std::copy(temp, temp + width*height*nrSamples, data);
-        delete[] temp;
-      }
-      else if (this->getDataType()==pathology::UInt16) {
-        unsigned short * temp = (unsigned short*)readDataFromImage(startX, startY, width, height, level);
-        std::copy(temp, temp + width*height*nrSamples, data);
-        delete[] temp;
-      }
-      else if (this->getDataType()==pathology::UInt32) {
-        unsigned int * temp = (unsigned int*)readDataFromImage(startX, startY, width, height, level);
-        std::copy(temp, temp + width*height*nrSamples, data);
-        delete[] temp;
+      if (!data) {
+        data = new T[width * height * getSamplesPerPixel()];
       }
+      getRawRegion<T>(startX, startY, width, height, level, data, width * getSamplesPerPixel());
+    }
+
+  //! Same as above, but consecutive rows in data are rowStride elements (not bytes) apart, so a region can
+  //! be read directly into part of a larger buffer. The pixels are decoded straight into data and converted
+  //! to T in the same pass. Throws std::invalid_argument if data is NULL.
+  template <typename T>
+  void getRawRegion(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, T* data, const unsigned long long& rowStride) {
+    if (!data) {
+      throw std::invalid_argument("getRawRegion needs a buffer to read the region into");
+    }
+    if (level >= getNumberOfLevels()) {
+      return;
     }
+    readRegionIntoBuffer(startX, startY, width, height, level, data, dataTypeOf<T>(), rowStride);
+  }
+
+  //! Reads the same region of numberOfZPlanes consecutive planes starting at firstZPlane in one call, the
+  //! planes are read in parallel. data holds the planes one after the other, each with rows of width
+  //! pixels; planes beyond the last one of the image are left untouched. The current plane is not changed.
+  template <typename T>
+  void getRawRegionZStack(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, const unsigned int& firstZPlane, const unsigned int& numberOfZPlanes, T* data) {
+    if (level >= getNumberOfLevels() || !data) {
+      return;
+    }
+    readZStack(startX, startY, width, height, level, firstZPlane, numberOfZPlanes, data, dataTypeOf<T>());
+  }
+
+  //! Reads a region at any downsample of level 0, e.g. 3 for a resolution in between two levels. startX
+  //! and startY are in level 0 pixels, width and height in pixels of the result. The region is resampled
+  //! with filter from the closest level with at least the requested resolution; the level is read in
+  //! strips, so no buffer for the whole source region is needed. Downsamples of a level are read directly.
+  template <typename T>
+  void getRegionAtDownsample(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const double& downsample, T* data, const core::ResamplingFilter& filter = core::AreaResampling) {
+    if (!data || downsample <= 0) {
+      return;
+    }
+    readRegionAtDownsample(startX, startY, width, height, downsample, data, dataTypeOf<T>(), width * getSamplesPerPixel(), filter);
+  }
+
+  //! Same as above at a pixel spacing in microns, returns false if the spacing of the image is not known
+  template <typename T>
+  bool getRegionAtSpacing(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const double& spacing, T* data, const core::ResamplingFilter& filter = core::AreaResampling) {
+    std::vector<double> imageSpacing = getSpacing();
+    if (imageSpacing.empty() || imageSpacing[0] <= 0 || spacing <= 0) {
+      return false;
+    }
+    getRegionAtDownsample(startX, startY, width, height, spacing / imageSpacing[0], data, filter);
+    return true;
+  }
+
+  //! Reads a batch of regions, outputs[i] receives requests[i] and must be able to hold width * height *
+  //! samples per pixel values. Every tile touched by the requests is decoded once, also when requests
+  //! overlap, and the regions are filled in parallel on a pool of worker threads owned by the image. An
+  //! exception thrown while reading is rethrown once all requests have been handled.
+  template <typename T>
+  void readRegions(const std::vector<RegionRequest>& requests, const std::vector<T*>& outputs) {
+    std::vector<void*> buffers(outputs.begin(), outputs.end());
+    readRegions(requests, buffers, dataTypeOf<T>());
+  }
+  void readRegions(const std::vector<RegionRequest>& requests, const std::vector<void*>& outputs, const pathology::DataType& dataType);
+
+  //! Same as above, but the image allocates the buffers and calls callback(index, data) as soon as request
+  //! index is filled, which may be from a worker thread. data is only valid during the callback. An exception
+  //! thrown by callback is rethrown once all requests have been handled.
+  template <typename T>
+  void readRegions(const std::vector<RegionRequest>& requests, const std::function<void(unsigned int, const T*)>& callback) {
+    readRegions(requests, dataTypeOf<T>(), [&callback](unsigned int index, const void* data) { callback(index, static_cast<const T*>(data)); });
+  }
+  void readRegions(const std::vector<RegionRequest>& requests, const pathology::DataType& dataType, const std::function<void(unsigned int, const void*)>& callback);
+
+  //! Reads a region in the background on the worker threads of the image. data must stay valid until the
+  //! returned future is ready, which holds false if the read was cancelled (through token or because the
+  //! image was destroyed) before it started. Reads with a higher priority are started first.
+  template <typename T>
+  std::future<bool> getRawRegionAsync(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, T* data, const int& priority = 0, const CancellationToken& token = CancellationToken()) {
+    return readRegionAsync(RegionRequest(startX, startY, width, height, level), data, dataTypeOf<T>(), width * getSamplesPerPixel(), priority, token);
+  }
+
+  //! Same as above, but the image allocates the buffer and calls callback(data) from a worker thread once
+  //! the region has been read; data is only valid during the callback. If the read fails, callback is
+  //! called with NULL. Cancelled reads do not call back.
+  template <typename T>
+  void getRawRegionAsync(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, const std::function<void(const T*)>& callback, const int& priority = 0,
+    const CancellationToken& token = CancellationToken()) {
+    readRegionAsync(RegionRequest(startX, startY, width, height, level), dataTypeOf<T>(),
+      [callback](const void* data) { callback(static_cast<const T*>(data)); }, priority, token);
+  }
+
+  //! Walks over a level tile by tile, by default along the native tile grid so that every tile is decoded
+  //! once, and calls callback with a view of each tile. If T is the data type of the image, no halo is
+  //! requested and the reader supports it, the view points straight into the decoded tile.
+  template <typename T>
+  void forEachTile(const unsigned int& level, const std::function<void(const TileView<T>&)>& callback, const TileIterationOptions& options = TileIterationOptions()) {
+    unsigned int samplesPerPixel = getSamplesPerPixel();
+    forEachTile(level, dataTypeOf<T>(), [&callback, &options, samplesPerPixel](const long long& x, const long long& y, const unsigned long long& width,
+      const unsigned long long& height, const void* data, const unsigned long long& rowStride) {
+      TileView<T> view;
+      view.x = x;
+      view.y = y;
+      view.width = width;
+      view.height = height;
+      view.halo = options.halo;
+      view.samplesPerPixel = samplesPerPixel;
+      view.rowStride = rowStride;
+      view.data = static_cast<const T*>(data);
+      callback(view);
+    }, options);
+  }
+
+  //! Tile size for writing one output tile per tile visited by forEachTile: the native tile size of the
+  //! level if it is square and a multiple of 16, as TIFF tiles have to be, in which case options.tileSize
+  //! is left at 0 so forEachTile walks the native grid. Otherwise options.tileSize is set to 512.
+  unsigned int getOutputTileSize(const unsigned int& level, TileIterationOptions& options) const;
+
+  //! Returns the pathology::DataType corresponding to T, InvalidDataType if there is none
+  template <typename T> static pathology::DataType dataTypeOf();
 
 protected :
 
   //! To make MultiResolutionImage thread-safe
   std::unique_ptr<boost::shared_mutex> _openCloseMutex;
   std::unique_ptr<boost::mutex> _cacheMutex;
-  std::shared_ptr<void> _cache;
+  std::shared_ptr<TileCacheBase> _cache;
+  std::shared_ptr<TileCache<std::vector<unsigned char> > > _encodedCache;
+  std::shared_ptr<TileCache<std::vector<unsigned char> > > _resampledCache;
+  std::shared_ptr<TileCache<std::vector<unsigned char> > > _virtualPyramidCache;
+  std::shared_ptr<TileCache<std::vector<unsigned char> > > _zPlaneCache;
+
+  //! Tiles of the planes around the current one that are queued for prefetching, keyed like the tiles of
+  //! the z-plane cache, and the token that cancels them when the current plane changes
+  std::unordered_set<TileKey> _zPlanePrefetchesQueued;
+  CancellationToken _zPlanePrefetchToken;
+  unsigned int _zPlanePrefetchRadius;
+  static const unsigned int zPlaneTileSize = 512;
+
+  //! Generated levels of images with a single stored level, empty otherwise
+  std::shared_ptr<VirtualPyramid> _virtualPyramid;
+  std::vector<std::vector<unsigned long long> > _virtualLevelDimensions;
+
+  //! Downsample, filter and data type of the resampled tiles in the cache, the index is the level in their keys
+  struct ResampledLevel {
+    double downsample;
+    core::ResamplingFilter filter;
+    pathology::DataType dataType;
+  };
+  std::vector<ResampledLevel> _resampledLevels;
+
+  //! Worker threads for batched and asynchronous reads, created on first use
+  std::unique_ptr<TaskExecutor> _executor;
+  std::unique_ptr<boost::mutex> _executorMutex;
+  std::atomic<bool> _asyncReadsStopped;
+
+  //! Always present, readers record their reads, decodes and lock waits in it
+  std::unique_ptr<ImageStatisticsCollector> _statistics;
+
+  //! Returns the executor, NULL once stopAsyncReads has been called
+  TaskExecutor* getExecutor();
+
+  //! Cancels the asynchronous reads that did not start yet and waits for the running ones. Readers call
+  //! this at the start of their destructor, before the state the reads depend on is torn down.
+  void stopAsyncReads();
+
+  //! The file the pixel data is read from, kept open (or mapped) for the lifetime of the image and its
+  //! clones. Readers that do not go through a third-party library open it with openByteSource.
+  std::shared_ptr<ByteSource> _source;
+  ByteSource::AccessPattern _accessPattern;
+
+  //! Opens _source for the given file and applies the current access pattern, returns false if it fails
+  bool openByteSource(const std::string& filePath);
 
   // Aditional properties of a multi-resolution image
   std::vector<std::vector<unsigned long long> > _levelDimensions;
@@ -136,33 +438,139 @@ protected :
 
   // Properties of the loaded slide
   unsigned long long _cacheSize;
+  unsigned long long _encodedCacheSize;
+  unsigned long long _resampledCacheSize;
+  unsigned long long _virtualPyramidCacheSize;
+  unsigned long long _zPlaneCacheSize;
+  double _cacheWeight;
+  CacheReplacementPolicy _cacheReplacementPolicy;
   std::string _fileType;
   std::string _filePath;
 
   // Cleans up internals
   virtual void cleanup();
 
-  // Reads the actual data from the image
-  virtual void* readDataFromImage(const long long& startX, const long long& startY, const unsigned long long& width, 
-    const unsigned long long& height, const unsigned int& level) = 0;
+  // Reads the actual data from the image into data, which has rows of rowStride samples of type dataType
+  virtual void readDataIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride) = 0;
+
+  //! Reads a region of the given z-plane instead of the current one. Readers of images with more than one
+  //! z-plane override this, the default reads the current plane through readDataIntoBuffer.
+  virtual void readZPlaneIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, const unsigned int& zPlane, void* data, const pathology::DataType& dataType,
+    const unsigned long long& rowStride) {
+    readDataIntoBuffer(startX, startY, width, height, level, data, dataType, rowStride);
+  }
+
+  //! Reads a region of level 0 downsampled by 2^scaleShift in the data type of the image, with rows of width
+  //! pixels; startX, startY, width and height are in pixels of the downsampled image. Readers that can decode
+  //! reduced resolutions directly override this to speed up the virtual pyramid, the default returns false.
+  virtual bool readScaledDataIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& scaleShift, void* data) { return false; }
+
+  //! Calls readDataIntoBuffer, counting the read as a request in flight
+  void readRegionIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride);
+
+  //! Reads from the current z-plane and prefetches the planes around it
+  void readLevelIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride);
+
+  //! Reads from the virtual pyramid for generated levels, from the z-plane cache for stored levels of
+  //! images with more than one z-plane and through readZPlaneIntoBuffer otherwise
+  void readPlaneIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, const unsigned int& zPlane, void* data, const pathology::DataType& dataType,
+    const unsigned long long& rowStride);
+
+  //! Returns tile (tileX, tileY) of stored level and z-plane from the z-plane cache, reading it if needed.
+  //! Tiles are zPlaneTileSize pixels in the data type of the image, clipped to the level.
+  std::shared_ptr<std::vector<unsigned char> > getZPlaneTile(const unsigned int& level, const unsigned int& zPlane, const long long& tileX, const long long& tileY);
+
+  //! Queues reads of the tiles covering the region on the planes within the prefetch radius of zPlane
+  void prefetchZPlanes(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, const unsigned int& zPlane);
+
+  void readZStack(const long long& startX, const long long& startY, const unsigned long long& width, const unsigned long long& height,
+    const unsigned int& level, const unsigned int& firstZPlane, const unsigned int& numberOfZPlanes, void* data, const pathology::DataType& dataType);
+
+  //! Creates the virtual pyramid if the image has a single stored level that does not fit in one tile
+  void createVirtualPyramid();
+
+  //! Helpers for readers to write (part of) a row into the caller's buffer, converting to its data type
+  static unsigned int bytesPerSample(const pathology::DataType& dataType);
+  template <typename T> static void convertSamples(const T* source, void* destination, const pathology::DataType& destinationType, const unsigned long long& count) {
+    // The sample types of the interface go through the vectorized kernels of core
+    const pathology::DataType sourceType = dataTypeOf<T>();
+    if (sourceType != pathology::InvalidDataType) {
+      core::convertSamples(source, sourceType, destination, destinationType, count);
+    }
+    else if (destinationType == pathology::UChar) {
+      std::copy(source, source + count, static_cast<unsigned char*>(destination));
+    }
+    else if (destinationType == pathology::UInt16) {
+      std::copy(source, source + count, static_cast<unsigned short*>(destination));
+    }
+    else if (destinationType == pathology::UInt32) {
+      std::copy(source, source + count, static_cast<unsigned int*>(destination));
+    }
+    else if (destinationType == pathology::Float) {
+      std::copy(source, source + count, static_cast<float*>(destination));
+    }
+  }
+  static void fillSamples(void* destination, const pathology::DataType& destinationType, const unsigned long long& count, const double& value);
+
+  //! Returns tile (tileX, tileY) of the level, decoded in the data type of the image with rows of tile width
+  //! samples. Readers which do not keep decoded tiles around return an empty pointer.
+  virtual std::shared_ptr<void> readNativeTile(const unsigned int& level, const unsigned long long& tileX, const unsigned long long& tileY);
+
+  void forEachTile(const unsigned int& level, const pathology::DataType& dataType, const std::function<void(const long long&, const long long&,
+    const unsigned long long&, const unsigned long long&, const void*, const unsigned long long&)>& callback, const TileIterationOptions& options);
+
+  void readRegionAtDownsample(const long long& startX, const long long& startY, const unsigned long long& width, const unsigned long long& height,
+    const double& downsample, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride, const core::ResamplingFilter& filter);
+
+  //! Resamples the region starting at output pixel (outputX, outputY) of the image at the given downsample from level
+  void resampleRegion(const double& outputX, const double& outputY, const unsigned long long& width, const unsigned long long& height,
+    const double& downsample, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride,
+    const core::ResamplingFilter& filter);
+
+  //! Same as above, composed of tiles of the resampled cache
+  void readResampledTiles(const long long& outputX, const long long& outputY, const unsigned long long& width, const unsigned long long& height,
+    const double& downsample, const unsigned int& level, const unsigned int& cacheLevel, void* data, const pathology::DataType& dataType,
+    const unsigned long long& rowStride, const core::ResamplingFilter& filter);
+
+  //! Calls work(index) for every index below count, spread over the calling thread and the executor. If
+  //! work throws, the other indices still run and the first exception is rethrown on the calling thread.
+  void runInParallel(const unsigned long long& count, const std::function<void(unsigned long long)>& work);
+
+  //! Fills the requests in parallel, calling done(index, buffer) for each
+  void readRegionBatch(const std::vector<RegionRequest>& requests, const pathology::DataType& dataType,
+    const std::function<unsigned char*(unsigned int)>& bufferFor, const std::function<void(unsigned int, unsigned char*)>& done);
+
+  std::future<bool> readRegionAsync(const RegionRequest& request, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride,
+    const int& priority, const CancellationToken& token);
+  void readRegionAsync(const RegionRequest& request, const pathology::DataType& dataType, const std::function<void(const void*)>& callback,
+    const int& priority, const CancellationToken& token);
 
   template <typename T> void createCache() {
     if (_isValid) {
-      _cache.reset(new TileCache<T>(_cacheSize));
+      _cache.reset(new TileCache<T>(_cacheSize, _cacheReplacementPolicy));
+      _encodedCache.reset(new TileCache<std::vector<unsigned char> >(_encodedCacheSize, _cacheReplacementPolicy));
+      updateCacheSizes();
     }
   }
-};
 
-template <> void MULTIRESOLUTIONIMAGEINTERFACE_EXPORT MultiResolutionImage::getRawRegion(const long long& startX, const long long& startY, const unsigned long long& width,
-  const unsigned long long& height, const unsigned int& level, unsigned char*& data);
+  //! Applies the cache sizes and weight, registering the caches with the TileCacheManager when it has a budget
+  void updateCacheSizes();
 
-template <> void MULTIRESOLUTIONIMAGEINTERFACE_EXPORT MultiResolutionImage::getRawRegion(const long long& startX, const long long& startY, const unsigned long long& width,
-  const unsigned long long& height, const unsigned int& level, unsigned short*& data);
-
-template <> void MULTIRESOLUTIONIMAGEINTERFACE_EXPORT MultiResolutionImage::getRawRegion(const long long& startX, const long long& startY, const unsigned long long& width,
-  const unsigned long long& height, const unsigned int& level, unsigned int*& data);
+  //! Empties the resampled tile cache and forgets the downsamples it was keyed by, _cacheMutex must be held
+  void clearResampledTiles();
+};
 
-template <> void MULTIRESOLUTIONIMAGEINTERFACE_EXPORT MultiResolutionImage::getRawRegion(const long long& startX, const long long& startY, const unsigned long long& width,
-  const unsigned long long& height, const unsigned int& level, float*& data);
+template <typename T> pathology::DataType MultiResolutionImage::dataTypeOf() { return pathology::InvalidDataType; }
+template <> inline pathology::DataType MultiResolutionImage::dataTypeOf<unsigned char>() { return pathology::UChar; }
+template <> inline pathology::DataType MultiResolutionImage::dataTypeOf<unsigned short>() { return pathology::UInt16; }
+template <> inline pathology::DataType MultiResolutionImage::dataTypeOf<unsigned int>() { return pathology::UInt32; }
+template <> inline pathology::DataType MultiResolutionImage::dataTypeOf<float>() { return pathology::Float; }
 
 #endif
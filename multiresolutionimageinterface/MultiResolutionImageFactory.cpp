@@ -2,6 +2,7 @@
 #include "MultiResolutionImage.h"
 #include "core/filetools.h"
 #include "core/stringconversion.h"
+#include <fstream>
 
 #ifdef HAS_MULTIRESOLUTIONIMAGEINTERFACE_VSI_SUPPORT
 #include "VSIImage.h"
@@ -55,18 +56,26 @@ bool MultiResolutionImageFactory::operator<(const MultiResolutionImageFactory& o
   return this->_priority < other._priority;
 }
 
+std::vector<MultiResolutionImageFactory*> MultiResolutionImageFactory::factoriesFor(const std::string& fileName) {
+  std::vector<MultiResolutionImageFactory*> suitableFactoriesByPriority;
+  std::string extension = core::extractFileExtension(fileName);
+  for (auto it = registry().begin(); it != registry().end(); ++it) {
+    const std::set<std::string>& supportedExtensions = it->second.first;
+    if (std::find(supportedExtensions.begin(), supportedExtensions.end(), extension) != supportedExtensions.end()) {
+      suitableFactoriesByPriority.push_back(it->second.second);
+    }
+  }
+  std::sort(suitableFactoriesByPriority.begin(), suitableFactoriesByPriority.end(), [](MultiResolutionImageFactory* a, MultiResolutionImageFactory* b) {return (*a) < (*b);});
+  // Factories are only tried on files that look like theirs, instead of letting each of them open the file
+  suitableFactoriesByPriority.erase(std::remove_if(suitableFactoriesByPriority.begin(), suitableFactoriesByPriority.end(),
+    [&fileName](MultiResolutionImageFactory* factory) {return !factory->canReadImage(fileName);}), suitableFactoriesByPriority.end());
+  return suitableFactoriesByPriority;
+}
+
 MultiResolutionImage* MultiResolutionImageFactory::openImage(const std::string& fileName, const std::string factoryName) {
   MultiResolutionImageFactory::registerExternalFileFormats();  
   if (factoryName == "default") {
-    std::vector<MultiResolutionImageFactory*> suitableFactoriesByPriority;
-    for (auto it = registry().begin(); it != registry().end(); ++it) {
-      std::string extension = core::extractFileExtension(fileName);
-      const std::set<std::string>& supportedExtensions = it->second.first;
-      if (std::find(supportedExtensions.begin(), supportedExtensions.end(), extension) != supportedExtensions.end()) {
-        suitableFactoriesByPriority.push_back(it->second.second);
-      }
-    }
-    std::sort(suitableFactoriesByPriority.begin(), suitableFactoriesByPriority.end(), [](MultiResolutionImageFactory* a, MultiResolutionImageFactory* b) {return (*a) < (*b);});
+    std::vector<MultiResolutionImageFactory*> suitableFactoriesByPriority = factoriesFor(fileName);
     for (auto it = suitableFactoriesByPriority.begin(); it != suitableFactoriesByPriority.end(); ++it) {
       MultiResolutionImage* img = MultiResolutionImageFactory::openImageWithFactory(fileName, *it);
       if (img) {
@@ -83,6 +92,73 @@ MultiResolutionImage* MultiResolutionImageFactory::openImage(const std::string&
   return NULL;
 }
 
+bool MultiResolutionImageFactory::openImageMetadata(const std::string& fileName, ImageMetadata& metadata, const std::string factoryName) {
+  MultiResolutionImageFactory::registerExternalFileFormats();
+  std::vector<MultiResolutionImageFactory*> factories;
+  if (factoryName == "default") {
+    factories = factoriesFor(fileName);
+  }
+  else {
+    auto requestedFactory = registry().find(factoryName);
+    if (requestedFactory != registry().end()) {
+      factories.push_back(requestedFactory->second.second);
+    }
+  }
+  for (auto it = factories.begin(); it != factories.end(); ++it) {
+    metadata = ImageMetadata();
+    if ((*it)->readImageMetadata(fileName, metadata)) {
+      metadata.factoryName = (*it)->_factoryName;
+      return true;
+    }
+  }
+  metadata = ImageMetadata();
+  return false;
+}
+
+bool MultiResolutionImageFactory::readImageMetadata(const std::string& fileName, ImageMetadata& metadata) const {
+  MultiResolutionImage* img = openImageWithFactory(fileName, this);
+  if (!img) {
+    return false;
+  }
+  copyImageMetadata(*img, metadata);
+  delete img;
+  return true;
+}
+
+void MultiResolutionImageFactory::copyImageMetadata(MultiResolutionImage& image, ImageMetadata& metadata) {
+  metadata.fileType = image.getFileType();
+  for (int level = 0; level < image.getNumberOfLevels(); ++level) {
+    if (!image.isVirtualLevel(level)) {
+      metadata.levelDimensions.push_back(image.getLevelDimensions(level));
+    }
+  }
+  metadata.spacing = image.getSpacing();
+  metadata.samplesPerPixel = image.getSamplesPerPixel();
+  metadata.colorType = image.getColorType();
+  metadata.dataType = image.getDataType();
+  std::vector<std::string> propertyNames = image.getPropertyNames();
+  for (auto it = propertyNames.begin(); it != propertyNames.end(); ++it) {
+    metadata.properties[*it] = image.getProperty(*it);
+  }
+}
+
+std::string MultiResolutionImageFactory::readFileHeader(const std::string& fileName, const unsigned int& size) {
+  std::ifstream file(fileName.c_str(), std::ios::in | std::ios::binary);
+  std::string header(size, '\0');
+  if (!file.good()) {
+    return std::string();
+  }
+  file.read(&header[0], size);
+  header.resize(static_cast<size_t>(file.gcount()));
+  return header;
+}
+
+bool MultiResolutionImageFactory::hasTIFFSignature(const std::string& header) {
+  // Classic TIFF has version 42, BigTIFF 43, in either byte order
+  return header.size() >= 4 && ((header.compare(0, 2, "II") == 0 && (header[2] == 42 || header[2] == 43) && header[3] == 0) ||
+    (header.compare(0, 2, "MM") == 0 && header[2] == 0 && (header[3] == 42 || header[3] == 43)));
+}
+
 MultiResolutionImage* MultiResolutionImageFactory::openImageWithFactory(const std::string& fileName, const MultiResolutionImageFactory* factory)
 {
   MultiResolutionImage* img = factory->readImage(fileName);
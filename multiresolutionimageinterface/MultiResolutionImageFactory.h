@@ -6,6 +6,7 @@
 #include <vector>
 #include <set>
 #include "multiresolutionimageinterface_export.h"
+#include "ImageMetadata.h"
 
 class MultiResolutionImage;
 
@@ -14,6 +15,10 @@ class MULTIRESOLUTIONIMAGEINTERFACE_EXPORT MultiResolutionImageFactory {
 public:
   MultiResolutionImageFactory(const std::string& factoryName, const std::set<std::string>& supported_extensions, const unsigned int priority);
   static MultiResolutionImage* openImage(const std::string& fileName, const std::string factoryName = std::string("default"));
+
+  //! Fills metadata without opening the image for reading, using the first factory (by priority) that
+  //! recognizes the file and can read it. Returns false if none can.
+  static bool openImageMetadata(const std::string& fileName, ImageMetadata& metadata, const std::string factoryName = std::string("default"));
   static void registerExternalFileFormats();
   static std::vector<std::pair<std::string, std::set<std::string> > > getLoadedFactoriesAndSupportedExtensions();
   static std::set<std::string> getAllSupportedExtensions();
@@ -24,9 +29,22 @@ protected:
   static FactoryMap& registry();
   static void addSupportedExtensions(const std::set<std::string>& extensions);
   static MultiResolutionImage* openImageWithFactory(const std::string& fileName, const MultiResolutionImageFactory* factory);
+  static std::vector<MultiResolutionImageFactory*> factoriesFor(const std::string& fileName);
   virtual MultiResolutionImage* readImage(const std::string& fileName) const = 0;
+
+  //! Tells from the first bytes of the file whether it is worth trying this factory, without opening the
+  //! image; it may accept files that readImage then rejects, but not the other way around
   virtual bool canReadImage(const std::string& fileName) const = 0;
 
+  //! Fills metadata, the default opens the image and copies what it reports. Factories that can parse the
+  //! headers themselves should do so.
+  virtual bool readImageMetadata(const std::string& fileName, ImageMetadata& metadata) const;
+  static void copyImageMetadata(MultiResolutionImage& image, ImageMetadata& metadata);
+
+  //! Returns the first size bytes of a file, fewer if it is shorter and none if it cannot be read
+  static std::string readFileHeader(const std::string& fileName, const unsigned int& size = 16);
+  static bool hasTIFFSignature(const std::string& header);
+
 private:
   static bool _externalFormatsRegistered;
   static std::set<std::string> _allSupportedExtensions;
@@ -15,4 +15,8 @@ MultiResolutionImageReader::~MultiResolutionImageReader() {
 
 MultiResolutionImage* MultiResolutionImageReader::open(const std::string& fileName, const std::string factoryName) { 
   return MultiResolutionImageFactory::openImage(fileName, factoryName);
+}
+
+bool MultiResolutionImageReader::openMetadata(const std::string& fileName, ImageMetadata& metadata, const std::string factoryName) {
+  return MultiResolutionImageFactory::openImageMetadata(fileName, metadata, factoryName);
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #define _MultiResolutionImageReader
 #include "multiresolutionimageinterface_export.h"
 #include <string>
+#include "ImageMetadata.h"
 
 class MultiResolutionImage;
 
@@ -15,6 +16,10 @@ public:
   //! Opens the slide file and keeps a reference to it
   MultiResolutionImage* open(const std::string& fileName, const std::string factoryName = std::string("default"));
 
+  //! Reads the dimensions, spacing, levels and properties of the slide file without opening it for
+  //! reading pixels; returns false if no file format can read it
+  bool openMetadata(const std::string& fileName, ImageMetadata& metadata, const std::string factoryName = std::string("default"));
+
 };
 
 #endif
\ No newline at end of file
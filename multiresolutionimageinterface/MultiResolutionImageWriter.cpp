@@ -1,11 +1,16 @@
 #include "MultiResolutionImageWriter.h"
 #include "MultiResolutionImage.h"
+#include "TaskExecutor.h"
 #include <iostream>
 #include <sstream>
 #include <cmath>
 #include <math.h>
 #include <algorithm>
 #include <chrono>
+#include <cstdio>
+#include <deque>
+#include <limits>
+#include <boost/thread.hpp>
 
 extern "C" {
 #include "tiffio.h"
@@ -14,22 +19,506 @@ extern "C" {
 #include "JPEG2000Codec.h"
 #include "core/ProgressMonitor.h"
 #include "core/PathologyEnums.h"
+#include "core/Resampling.h"
 
 using namespace std;
 using namespace pathology;
 
+namespace {
+
+	//! Output of a TIFF that is only written to, which keeps the bytes that are written while capturing is
+	//! set and only tracks the position otherwise
+	struct TIFFCapture {
+		TIFFCapture() : capturing(false), offset(0), size(0) {}
+		bool capturing;
+		std::vector<unsigned char> captured;
+		toff_t offset;
+		toff_t size;
+	};
+
+	tmsize_t captureRead(thandle_t handle, void* buffer, tmsize_t size) {
+		return 0;
+	}
+
+	tmsize_t captureWrite(thandle_t handle, void* buffer, tmsize_t size) {
+		TIFFCapture* capture = static_cast<TIFFCapture*>(handle);
+		if (capture->capturing) {
+			const unsigned char* bytes = static_cast<const unsigned char*>(buffer);
+			capture->captured.insert(capture->captured.end(), bytes, bytes + size);
+		}
+		capture->offset += size;
+		capture->size = std::max(capture->size, capture->offset);
+		return size;
+	}
+
+	toff_t captureSeek(thandle_t handle, toff_t offset, int whence) {
+		TIFFCapture* capture = static_cast<TIFFCapture*>(handle);
+		if (whence == SEEK_SET) {
+			capture->offset = offset;
+		}
+		else if (whence == SEEK_CUR) {
+			capture->offset += offset;
+		}
+		else {
+			capture->offset = capture->size + offset;
+		}
+		return capture->offset;
+	}
+
+	int captureClose(thandle_t handle) {
+		return 0;
+	}
+
+	toff_t captureSize(thandle_t handle) {
+		return static_cast<TIFFCapture*>(handle)->size;
+	}
+
+	int captureMap(thandle_t handle, void** base, toff_t* size) {
+		return 0;
+	}
+
+	void captureUnmap(thandle_t handle, void* base, toff_t size) {
+	}
+
+	unsigned int bytesPerSample(const DataType& dataType) {
+		if (dataType == UInt32 || dataType == Float) {
+			return 4;
+		}
+		else if (dataType == UInt16) {
+			return 2;
+		}
+		return 1;
+	}
+
+}
+
+//! Base tiles go from the producer to the compression threads and from there to the writer thread, which
+//! is the only one that writes to the file. The number of tiles in between is bounded, so a producer that
+//! is faster than the compression does not fill up memory.
+class MultiResolutionImageWriter::CompressionPipeline {
+public:
+	CompressionPipeline(MultiResolutionImageWriter* writer, const unsigned int& numberOfThreads, const unsigned int& maxTilesInFlight) :
+		_writer(writer), _maxTilesInFlight(std::max(maxTilesInFlight, 1u)), _tilesInFlight(0), _finishing(false),
+		_workers(new TaskExecutor(numberOfThreads))
+	{
+		_writerThread = boost::thread(&CompressionPipeline::writeTiles, this);
+	}
+
+	~CompressionPipeline() {
+		finish();
+	}
+
+	//! Copies the tile and queues it for compression, waits while the pipeline is full
+	void submit(const void* tile, const unsigned long long& tileBytes, const unsigned int& pos) {
+		const unsigned char* bytes = static_cast<const unsigned char*>(tile);
+		std::shared_ptr<std::vector<unsigned char> > copy = std::make_shared<std::vector<unsigned char> >(bytes, bytes + tileBytes);
+		{
+			boost::unique_lock<boost::mutex> l(_mutex);
+			while (_tilesInFlight >= _maxTilesInFlight) {
+				_tileDone.wait(l);
+			}
+			++_tilesInFlight;
+		}
+		_workers->post([this, copy, pos]() { compress(copy, pos); });
+	}
+
+	//! Runs work on the compression threads, counted against the same bound as the base tiles
+	void post(const std::function<void()>& work) {
+		if (!_workers) {
+			work();
+			return;
+		}
+		{
+			boost::unique_lock<boost::mutex> l(_mutex);
+			while (_tilesInFlight >= _maxTilesInFlight) {
+				_tileDone.wait(l);
+			}
+			++_tilesInFlight;
+		}
+		_workers->post([this, work]() {
+			try {
+				work();
+			}
+			catch (...) {
+			}
+			{
+				boost::lock_guard<boost::mutex> l(_mutex);
+				--_tilesInFlight;
+			}
+			_tileDone.notify_all();
+		});
+	}
+
+	//! Waits until every submitted tile has been written
+	void finish() {
+		if (!_workers) {
+			return;
+		}
+		// Destroying the executor waits for the queued compressions, after which the writer runs dry
+		_workers.reset();
+		{
+			boost::lock_guard<boost::mutex> l(_mutex);
+			_finishing = true;
+		}
+		_tileCompressed.notify_all();
+		_writerThread.join();
+	}
+
+private:
+	struct CompressedTile {
+		unsigned int pos;
+		std::vector<unsigned char> data;
+	};
+
+	void compress(const std::shared_ptr<std::vector<unsigned char> >& tile, const unsigned int& pos) {
+		const unsigned int nrSamples = _writer->getNumberOfSamples();
+		std::vector<double> minValues(nrSamples, std::numeric_limits<double>::max()), maxValues(nrSamples, std::numeric_limits<double>::lowest());
+		auto startMinMax = std::chrono::steady_clock::now();
+		_writer->updateMinMax(tile->data(), nrSamples, minValues.data(), maxValues.data());
+		auto startCompression = std::chrono::steady_clock::now();
+		CompressedTile compressed;
+		compressed.pos = pos;
+		bool valid = false;
+		try {
+			valid = _writer->compressTile(tile->data(), compressed.data);
+		}
+		catch (...) {
+			// A tile that cannot be compressed is left out, like a tile libtiff fails to write
+		}
+		auto endCompression = std::chrono::steady_clock::now();
+		{
+			boost::lock_guard<boost::mutex> l(_mutex);
+			for (unsigned int i = 0; i < nrSamples; ++i) {
+				_writer->_min_vals[i] = std::min(_writer->_min_vals[i], minValues[i]);
+				_writer->_max_vals[i] = std::max(_writer->_max_vals[i], maxValues[i]);
+			}
+			_writer->_totalMinMaxTime += std::chrono::duration<double, milli>(startCompression - startMinMax).count();
+			if (_writer->getCompression() == JPEG2000) {
+				_writer->_jpeg2kCompressionTime += std::chrono::duration<double, milli>(endCompression - startCompression).count();
+			}
+			else {
+				_writer->_totalBaseWritingTime += std::chrono::duration<double, milli>(endCompression - startCompression).count();
+			}
+			if (valid) {
+				_compressed.push_back(std::move(compressed));
+			}
+			else {
+				--_tilesInFlight;
+			}
+		}
+		if (valid) {
+			_tileCompressed.notify_one();
+		}
+		else {
+			_tileDone.notify_all();
+		}
+	}
+
+	void writeTiles() {
+		boost::unique_lock<boost::mutex> l(_mutex);
+		while (true) {
+			while (_compressed.empty() && !_finishing) {
+				_tileCompressed.wait(l);
+			}
+			if (_compressed.empty()) {
+				return;
+			}
+			CompressedTile tile = std::move(_compressed.front());
+			_compressed.pop_front();
+			l.unlock();
+			auto startTileWrite = std::chrono::steady_clock::now();
+			TIFFWriteRawTile(_writer->_tiff, tile.pos, tile.data.data(), tile.data.size());
+			if (_writer->_monitor) {
+				++(*_writer->_monitor);
+			}
+			auto endTileWrite = std::chrono::steady_clock::now();
+			l.lock();
+			_writer->_totalBaseWritingTime += std::chrono::duration<double, milli>(endTileWrite - startTileWrite).count();
+			--_tilesInFlight;
+			_tileDone.notify_all();
+		}
+	}
+
+	MultiResolutionImageWriter* _writer;
+	unsigned int _maxTilesInFlight;
+	unsigned int _tilesInFlight;
+	bool _finishing;
+	std::deque<CompressedTile> _compressed;
+	boost::mutex _mutex;
+	boost::condition_variable _tileCompressed;
+	boost::condition_variable _tileDone;
+	std::unique_ptr<TaskExecutor> _workers;
+	boost::thread _writerThread;
+};
+
+//! Every base tile is downsampled into a band that holds one row of tiles of the first level. When the
+//! last tile that contributes to the row comes in, the tiles of the row are compressed (on the compression
+//! threads if there are any), kept in memory until finishImage writes them after the base image, and
+//! passed on to the band of the next level in the same way. The base tiles have to come in order, row by
+//! row; the first one that does not stops the streaming, as do compressed tiles that exceed the budget.
+class MultiResolutionImageWriter::StreamingPyramid {
+public:
+	StreamingPyramid(MultiResolutionImageWriter* writer, const unsigned long long& width, const unsigned long long& height) :
+		_writer(writer), _tileSize(writer->_tileSize), _nrSamples(writer->getNumberOfSamples()), _downsample(writer->_downsamplePerLevel),
+		_baseTilesX((width + writer->_tileSize - 1) / writer->_tileSize), _baseTilesY((height + writer->_tileSize - 1) / writer->_tileSize),
+		_nextPos(0), _valid(_downsample > 1 && writer->_maxStreamedPyramidSize > 0),
+		_tiles(std::make_shared<CompressedTiles>(writer->_maxStreamedPyramidSize))
+	{
+		const unsigned int numberOfLevels = writer->getNumberOfPyramidLevels(width);
+		const unsigned long long bandBytes = static_cast<unsigned long long>(_tileSize) * _tileSize * _nrSamples * bytesPerSample(writer->_dType);
+		for (unsigned int i = 1; i <= numberOfLevels && _valid; ++i) {
+			Level level;
+			level.width = (unsigned long long)(width / pow(_downsample, (double)i));
+			level.height = (unsigned long long)(height / pow(_downsample, (double)i));
+			if (level.width == 0 || level.height == 0) {
+				break;
+			}
+			level.tilesX = (level.width + _tileSize - 1) / _tileSize;
+			level.tilesY = (level.height + _tileSize - 1) / _tileSize;
+			level.band.resize(level.tilesX * bandBytes);
+			level.bandRow = -1;
+			_tiles->addLevel(level.tilesX * level.tilesY);
+			_levels.push_back(level);
+		}
+	}
+
+	//! False if the streaming stopped or the tiles did not fit the budget, finishImage then builds the pyramid from the file
+	bool isValid() const {
+		return _valid && !_tiles->discarded();
+	}
+
+	unsigned int getNumberOfLevels() const {
+		return _levels.size();
+	}
+
+	//! Dimensions and compressed tiles of level i, the first level below the base image is 0
+	unsigned long long getLevelWidth(const unsigned int& i) const {
+		return _levels[i].width;
+	}
+
+	unsigned long long getLevelHeight(const unsigned int& i) const {
+		return _levels[i].height;
+	}
+
+	unsigned long long getNumberOfLevelTiles(const unsigned int& i) const {
+		return _levels[i].tilesX * _levels[i].tilesY;
+	}
+
+	//! Moves compressed tile number tile of level i out of the pyramid, false if it was not stored. Only
+	//! called once the compression threads are done.
+	bool takeLevelTile(const unsigned int& i, const unsigned long long& tile, std::vector<unsigned char>& compressed) {
+		return _tiles->take(i, tile, compressed);
+	}
+
+	void addBaseTile(const void* tile, const unsigned int& pos) {
+		if (!_valid) {
+			return;
+		}
+		if (pos != _nextPos || pos >= _baseTilesX * _baseTilesY || _tiles->discarded()) {
+			// Out of order or over the budget, finishImage builds the pyramid from the file instead. Compression
+			// threads may still be storing tiles, which are dropped from here on.
+			_valid = false;
+			for (unsigned int i = 0; i < _levels.size(); ++i) {
+				std::vector<unsigned char>().swap(_levels[i].band);
+			}
+			_tiles->discard();
+			return;
+		}
+		++_nextPos;
+		const unsigned long long tileX = pos % _baseTilesX, tileY = pos / _baseTilesX;
+		if (_writer->_dType == UInt32) {
+			addTile(0, tileX, tileY, static_cast<const unsigned int*>(tile));
+		}
+		else if (_writer->_dType == UInt16) {
+			addTile(0, tileX, tileY, static_cast<const unsigned short*>(tile));
+		}
+		else if (_writer->_dType == Float) {
+			addTile(0, tileX, tileY, static_cast<const float*>(tile));
+		}
+		else {
+			addTile(0, tileX, tileY, static_cast<const unsigned char*>(tile));
+		}
+	}
+
+	//! Completes the rows that did not get all their tiles, e.g. because the base image was not written entirely
+	void flush() {
+		for (unsigned int i = 0; i < _levels.size() && _valid; ++i) {
+			if (_levels[i].bandRow < 0) {
+				continue;
+			}
+			if (_writer->_dType == UInt32) {
+				completeRow<unsigned int>(i);
+			}
+			else if (_writer->_dType == UInt16) {
+				completeRow<unsigned short>(i);
+			}
+			else if (_writer->_dType == Float) {
+				completeRow<float>(i);
+			}
+			else {
+				completeRow<unsigned char>(i);
+			}
+		}
+	}
+
+private:
+	//! Compressed tiles of all levels, which the compression threads store at the same time. When they would
+	//! take more than maxBytes, or the streaming stops, all tiles are released and later ones are dropped.
+	class CompressedTiles {
+	public:
+		CompressedTiles(const unsigned long long& maxBytes) :
+			_maxBytes(maxBytes), _bytes(0), _discarded(false)
+		{
+		}
+
+		void addLevel(const unsigned long long& numberOfTiles) {
+			_levels.push_back(std::vector<std::vector<unsigned char> >(numberOfTiles));
+		}
+
+		bool discarded() {
+			boost::lock_guard<boost::mutex> l(_mutex);
+			return _discarded;
+		}
+
+		void discard() {
+			boost::lock_guard<boost::mutex> l(_mutex);
+			release();
+		}
+
+		void store(const unsigned int& level, const unsigned long long& tile, std::vector<unsigned char>& compressed) {
+			boost::lock_guard<boost::mutex> l(_mutex);
+			if (_discarded) {
+				return;
+			}
+			if (compressed.size() > _maxBytes - _bytes) {
+				release();
+				return;
+			}
+			_bytes += compressed.size();
+			_levels[level][tile].swap(compressed);
+		}
+
+		bool take(const unsigned int& level, const unsigned long long& tile, std::vector<unsigned char>& compressed) {
+			boost::lock_guard<boost::mutex> l(_mutex);
+			if (_discarded || _levels[level][tile].empty()) {
+				return false;
+			}
+			compressed.clear();
+			compressed.swap(_levels[level][tile]);
+			_bytes -= compressed.size();
+			return true;
+		}
+
+	private:
+		void release() {
+			_discarded = true;
+			_bytes = 0;
+			for (unsigned int i = 0; i < _levels.size(); ++i) {
+				std::vector<std::vector<unsigned char> >(_levels[i].size()).swap(_levels[i]);
+			}
+		}
+
+		boost::mutex _mutex;
+		std::vector<std::vector<std::vector<unsigned char> > > _levels;
+		unsigned long long _maxBytes;
+		unsigned long long _bytes;
+		bool _discarded;
+	};
+
+	struct Level {
+		unsigned long long width;
+		unsigned long long height;
+		unsigned long long tilesX;
+		unsigned long long tilesY;
+		std::vector<unsigned char> band;
+		long long bandRow;
+	};
+
+	//! Adds tile (tileX, tileY) of the level above level i (the base image for level 0) to the band of level i
+	template <typename T> void addTile(const unsigned int& i, const unsigned long long& tileX, const unsigned long long& tileY, const T* tile) {
+		Level& level = _levels[i];
+		const unsigned long long inputTilesX = i == 0 ? _baseTilesX : _levels[i - 1].tilesX;
+		const unsigned long long inputTilesY = i == 0 ? _baseTilesY : _levels[i - 1].tilesY;
+		const unsigned long long column = tileX / _downsample, row = tileY / _downsample;
+		if (column < level.tilesX && row < level.tilesY) {
+			const unsigned int dsSize = _tileSize / _downsample;
+			const unsigned long long rowSamples = level.tilesX * _tileSize * _nrSamples;
+			const unsigned long long offsetX = column * _tileSize + (tileX % _downsample) * dsSize, offsetY = (tileY % _downsample) * dsSize;
+			T* band = reinterpret_cast<T*>(level.band.data());
+			T* dsTile = _writer->downscaleTile(const_cast<T*>(tile), _tileSize, _nrSamples);
+			for (unsigned int y = 0; y < dsSize; ++y) {
+				std::copy(dsTile + y * dsSize * _nrSamples, dsTile + (y + 1) * dsSize * _nrSamples, band + (offsetY + y) * rowSamples + offsetX * _nrSamples);
+			}
+			_TIFFfree(dsTile);
+			level.bandRow = row;
+		}
+		if (tileX == inputTilesX - 1 && (tileY % _downsample == _downsample - 1 || tileY == inputTilesY - 1) && level.bandRow >= 0) {
+			completeRow<T>(i);
+		}
+	}
+
+	//! Cuts the band of level i into tiles, which are passed on to the next level and compressed
+	template <typename T> void completeRow(const unsigned int& i) {
+		Level& level = _levels[i];
+		const unsigned long long rowSamples = level.tilesX * _tileSize * _nrSamples;
+		const unsigned long long tileSamples = static_cast<unsigned long long>(_tileSize) * _tileSize * _nrSamples;
+		const T* band = reinterpret_cast<const T*>(level.band.data());
+		for (unsigned long long column = 0; column < level.tilesX; ++column) {
+			std::shared_ptr<std::vector<unsigned char> > tile = std::make_shared<std::vector<unsigned char> >(tileSamples * sizeof(T));
+			T* tileData = reinterpret_cast<T*>(tile->data());
+			for (unsigned int y = 0; y < _tileSize; ++y) {
+				const T* source = band + y * rowSamples + column * _tileSize * _nrSamples;
+				std::copy(source, source + _tileSize * _nrSamples, tileData + y * _tileSize * _nrSamples);
+			}
+			if (i + 1 < _levels.size()) {
+				addTile(i + 1, column, level.bandRow, tileData);
+			}
+			const unsigned long long tileNr = level.bandRow * level.tilesX + column;
+			std::shared_ptr<CompressedTiles> tiles = _tiles;
+			MultiResolutionImageWriter* writer = _writer;
+			std::function<void()> compress = [writer, tile, tiles, i, tileNr]() {
+				std::vector<unsigned char> compressed;
+				if (writer->compressTile(tile->data(), compressed) && !compressed.empty()) {
+					tiles->store(i, tileNr, compressed);
+				}
+			};
+			if (_writer->_compressionPipeline) {
+				_writer->_compressionPipeline->post(compress);
+			}
+			else {
+				compress();
+			}
+		}
+		std::fill(level.band.begin(), level.band.end(), 0);
+		level.bandRow = -1;
+	}
+
+	MultiResolutionImageWriter* _writer;
+	unsigned int _tileSize;
+	unsigned int _nrSamples;
+	unsigned int _downsample;
+	unsigned long long _baseTilesX;
+	unsigned long long _baseTilesY;
+	unsigned long long _nextPos;
+	bool _valid;
+	std::shared_ptr<CompressedTiles> _tiles;
+	std::vector<Level> _levels;
+};
+
 MultiResolutionImageWriter::MultiResolutionImageWriter() : _tiff(NULL),
 _codec(LZW), _quality(30), _tileSize(512), _pos(0), _numberOfIndexedColors(0),
 _interpolation(pathology::Linear), _monitor(NULL), _cType(pathology::InvalidColorType),
 _dType(pathology::InvalidDataType), _min_vals(NULL), _max_vals(NULL), _jpeg2000Codec(NULL),
 _totalWritingTime(0), _totalReadingTime(0), _jpeg2kCompressionTime(0), _totalBaseWritingTime(0),
 _totalDownsamplingtime(0), _totalPyramidTime(0), _totalMinMaxTime(0), _downsamplePerLevel(2),
-_maxPyramidLevels(-1)
+_maxPyramidLevels(-1), _numberOfCompressionThreads(0), _maxNumberOfTilesInFlight(0),
+_maxStreamedPyramidSize(1024ULL * 1024 * 1024)
 {
 	TIFFSetWarningHandler(NULL);
 }
 
 MultiResolutionImageWriter::~MultiResolutionImageWriter() {
+	finishBaseImage();
 	if (_tiff) {
 		TIFFClose(_tiff);
 		_tiff = NULL;
@@ -86,27 +575,30 @@ void MultiResolutionImageWriter::writeImageToFile(MultiResolutionImage* img, con
 		}
 		setSpacing(spacing);
 		if (writeImageInformation(dims[0], dims[1]) == 0) {
-			for (int y = 0; y < dims[1]; y += _tileSize) {
-				for (int x = 0; x < dims[0]; x += _tileSize) {
-					auto startReadingTime = std::chrono::steady_clock::now();
-					unsigned char* data = new unsigned char[_tileSize * _tileSize * cDepth * (nrBits / 8)];
-					if (_dType == pathology::UInt32) {
-						img->getRawRegion(x, y, _tileSize, _tileSize, 0, (unsigned int*&)data);
+			// With compression threads the tiles are read in batches, which the image reads in parallel, so
+			// reading keeps up with the compression
+			const unsigned int batchSize = _compressionPipeline ? _numberOfCompressionThreads : 1;
+			std::vector<std::vector<unsigned char> > tiles(batchSize, std::vector<unsigned char>(_tileSize * _tileSize * cDepth * (nrBits / 8)));
+			std::vector<RegionRequest> requests;
+			for (unsigned long long y = 0; y < dims[1]; y += _tileSize) {
+				for (unsigned long long x = 0; x < dims[0]; x += _tileSize) {
+					requests.push_back(RegionRequest(x, y, _tileSize, _tileSize, 0));
+					if (requests.size() < batchSize && (x + _tileSize < dims[0] || y + _tileSize < dims[1])) {
+						continue;
 					}
-					else if (_dType == pathology::UInt16) {
-						img->getRawRegion(x, y, _tileSize, _tileSize, 0, (unsigned short*&)data);
-					}
-					else if (_dType == pathology::Float) {
-						img->getRawRegion(x, y, _tileSize, _tileSize, 0, (float*&)data);
-					}
-					else if (_dType == pathology::UChar) {
-						img->getRawRegion(x, y, _tileSize, _tileSize, 0, data);
+					auto startReadingTime = std::chrono::steady_clock::now();
+					std::vector<void*> outputs;
+					for (unsigned int i = 0; i < requests.size(); ++i) {
+						std::fill(tiles[i].begin(), tiles[i].end(), 0);
+						outputs.push_back(tiles[i].data());
 					}
+					img->readRegions(requests, outputs, _dType);
 					auto endReadingTime = std::chrono::steady_clock::now();
 					_totalReadingTime += std::chrono::duration<double, milli>(endReadingTime - startReadingTime).count();
-					writeBaseImagePart((void*)data);
-					delete[] data;
-					data = NULL;
+					for (unsigned int i = 0; i < requests.size(); ++i) {
+						writeBaseImagePart(tiles[i].data());
+					}
+					requests.clear();
 				}
 			}
 			finishImage();
@@ -133,6 +625,10 @@ int MultiResolutionImageWriter::openFile(const std::string& fileName) {
 }
 
 int MultiResolutionImageWriter::writeImageInformation(const unsigned long long& sizeX, const unsigned long long& sizeY) {
+	if (_tileSize % _downsamplePerLevel != 0) {
+		cerr << "The downsample per level does not divide the tile size" << endl;
+		return -1;
+	}
 	if (_tiff) {
 		unsigned int cDepth = 1;
 		if (_cType == RGB) {
@@ -159,6 +655,19 @@ int MultiResolutionImageWriter::writeImageInformation(const unsigned long long&
 		if (_codec == JPEG2000) {
 			_jpeg2000Codec = new JPEG2000Codec();
 		}
+		finishBaseImage();
+		if (_numberOfCompressionThreads > 0) {
+			if (_codec == JPEG) {
+				// Tiles are compressed in handles of their own, so every tile carries its JPEG tables
+				TIFFSetField(_tiff, TIFFTAG_JPEGTABLESMODE, 0);
+			}
+			const unsigned int maxTilesInFlight = _maxNumberOfTilesInFlight > 0 ? _maxNumberOfTilesInFlight : 4 * _numberOfCompressionThreads;
+			_compressionPipeline.reset(new CompressionPipeline(this, _numberOfCompressionThreads, maxTilesInFlight));
+		}
+		_streamingPyramid.reset();
+		if (buildsPyramidWhileWriting()) {
+			_streamingPyramid.reset(new StreamingPyramid(this, sizeX, sizeY));
+		}
 		_totalWritingTime = 0;
 		_totalReadingTime = 0;
 		_totalMinMaxTime = 0;
@@ -183,80 +692,106 @@ void MultiResolutionImageWriter::writeBaseImagePartToLocation(void* data, const
 	writeBaseImagePartToTIFFTile(data, pos);
 }
 
-void MultiResolutionImageWriter::writeBaseImagePartToTIFFTile(void* data, unsigned int pos) {
-	unsigned int cDepth = 1;
+unsigned int MultiResolutionImageWriter::getNumberOfSamples() const {
 	if (_cType == RGB) {
-		cDepth = 3;
+		return 3;
 	}
 	else if (_cType == RGBA) {
-		cDepth = 4;
+		return 4;
 	}
 	else if (_cType == Indexed) {
-		if (_numberOfIndexedColors == 0) {
-			return;
-		}
-		cDepth = _numberOfIndexedColors;
+		return _numberOfIndexedColors;
 	}
-	unsigned int npixels = _tileSize * _tileSize * cDepth;
+	return 1;
+}
 
-	//Determine min/max of tile part
-	auto startMinMax = std::chrono::steady_clock::now();
-	if (_dType == pathology::UInt32) {
-		unsigned int* temp = (unsigned int*)data;
-		for (unsigned int i = 0; i < _tileSize * _tileSize * cDepth; i += cDepth) {
-			for (unsigned int j = 0; j < cDepth; ++j) {
-				double val = temp[i + j];
-				if (val > _max_vals[j]) {
-					_max_vals[j] = val;
-				}
-				if (val < _min_vals[j]) {
-					_min_vals[j] = val;
-				}
+template <typename T> void MultiResolutionImageWriter::updateMinMax(const T* tile, const unsigned int& nrSamples, double* minValues, double* maxValues) const {
+	for (unsigned int i = 0; i < _tileSize * _tileSize * nrSamples; i += nrSamples) {
+		for (unsigned int j = 0; j < nrSamples; ++j) {
+			double val = tile[i + j];
+			if (val > maxValues[j]) {
+				maxValues[j] = val;
+			}
+			if (val < minValues[j]) {
+				minValues[j] = val;
 			}
 		}
 	}
+}
+
+void MultiResolutionImageWriter::updateMinMax(const void* tile, const unsigned int& nrSamples, double* minValues, double* maxValues) const {
+	if (_dType == pathology::UInt32) {
+		updateMinMax(static_cast<const unsigned int*>(tile), nrSamples, minValues, maxValues);
+	}
 	else if (_dType == pathology::UInt16) {
-		unsigned short* temp = (unsigned short*)data;
-		for (unsigned int i = 0; i < _tileSize * _tileSize * cDepth; i += cDepth) {
-			for (unsigned int j = 0; j < cDepth; ++j) {
-				double val = temp[i + j];
-				if (val > _max_vals[j]) {
-					_max_vals[j] = val;
-				}
-				if (val < _min_vals[j]) {
-					_min_vals[j] = val;
-				}
-			}
-		}
+		updateMinMax(static_cast<const unsigned short*>(tile), nrSamples, minValues, maxValues);
 	}
 	else if (_dType == pathology::Float) {
-		float* temp = (float*)data;
-		for (unsigned int i = 0; i < _tileSize * _tileSize * cDepth; i += cDepth) {
-			for (unsigned int j = 0; j < cDepth; ++j) {
-				double val = temp[i + j];
-				if (val > _max_vals[j]) {
-					_max_vals[j] = val;
-				}
-				if (val < _min_vals[j]) {
-					_min_vals[j] = val;
-				}
-			}
-		}
+		updateMinMax(static_cast<const float*>(tile), nrSamples, minValues, maxValues);
 	}
 	else if (_dType == pathology::UChar) {
-		unsigned char* temp = (unsigned char*)data;
-		for (unsigned int i = 0; i < _tileSize * _tileSize * cDepth; i += cDepth) {
-			for (unsigned int j = 0; j < cDepth; ++j) {
-				double val = temp[i + j];
-				if (val > _max_vals[j]) {
-					_max_vals[j] = val;
-				}
-				if (val < _min_vals[j]) {
-					_min_vals[j] = val;
-				}
-			}
-		}
+		updateMinMax(static_cast<const unsigned char*>(tile), nrSamples, minValues, maxValues);
+	}
+}
+
+bool MultiResolutionImageWriter::compressTile(void* tile, std::vector<unsigned char>& compressed) {
+	const unsigned int nrSamples = getNumberOfSamples();
+	const tmsize_t tileBytes = static_cast<tmsize_t>(_tileSize) * _tileSize * nrSamples * bytesPerSample(_dType);
+	const unsigned char* bytes = static_cast<const unsigned char*>(tile);
+	if (_codec == RAW) {
+		compressed.assign(bytes, bytes + tileBytes);
+		return true;
+	}
+	else if (_codec == JPEG2000) {
+		unsigned int size = static_cast<unsigned int>(tileBytes);
+		_jpeg2000Codec->encode(static_cast<char*>(tile), size, _tileSize, getJPEGQuality(), nrSamples, getDataType(), getColorType());
+		compressed.assign(bytes, bytes + size);
+		return size > 0;
+	}
+
+	// libtiff compresses inside the handle a tile is written to, so the tile is written to a TIFF of its own
+	// in memory with the tags of the base directory, and the bytes written for the tile are taken from it
+	TIFFCapture capture;
+	TIFF* encoder = TIFFClientOpen("tile", "w", &capture, captureRead, captureWrite, captureSeek, captureClose, captureSize, captureMap, captureUnmap);
+	if (!encoder) {
+		return false;
+	}
+	setPyramidTags(encoder, _tileSize, _tileSize);
+	if (_codec == JPEG) {
+		TIFFSetField(encoder, TIFFTAG_JPEGTABLESMODE, 0);
+	}
+	capture.capturing = true;
+	tmsize_t written = TIFFWriteEncodedTile(encoder, 0, tile, tileBytes);
+	capture.capturing = false;
+	TIFFClose(encoder);
+	compressed.swap(capture.captured);
+	return written > 0 && !compressed.empty();
+}
+
+void MultiResolutionImageWriter::finishBaseImage() {
+	if (_compressionPipeline) {
+		_compressionPipeline->finish();
+		_compressionPipeline.reset();
 	}
+}
+
+void MultiResolutionImageWriter::writeBaseImagePartToTIFFTile(void* data, unsigned int pos) {
+	unsigned int cDepth = getNumberOfSamples();
+	if (cDepth == 0) {
+		return;
+	}
+	unsigned int npixels = _tileSize * _tileSize * cDepth;
+	if (_streamingPyramid) {
+		_streamingPyramid->addBaseTile(data, pos);
+	}
+	if (_compressionPipeline) {
+		_compressionPipeline->submit(data, static_cast<unsigned long long>(npixels) * bytesPerSample(_dType), pos);
+		return;
+	}
+
+	//Determine min/max of tile part
+	auto startMinMax = std::chrono::steady_clock::now();
+	updateMinMax(data, cDepth, _min_vals, _max_vals);
 	auto endMinMax = std::chrono::steady_clock::now();
 	_totalMinMaxTime += std::chrono::duration<double, milli>(endMinMax - startMinMax).count();
 
@@ -316,6 +851,11 @@ void MultiResolutionImageWriter::writeBaseImagePartToTIFFTile(void* data, unsign
 }
 
 int MultiResolutionImageWriter::finishImage() {	
+	// The last rows of the streaming pyramid may still go to the compression threads
+	if (_streamingPyramid) {
+		_streamingPyramid->flush();
+	}
+	finishBaseImage();
 	if (TIFFGetField(_tiff, TIFFTAG_TILEOFFSETS) == 0) {
 		std::cout << "No valid tiles have been written to the base image, cannot finish image." << std::endl;
 		return -1;
@@ -332,7 +872,10 @@ int MultiResolutionImageWriter::finishImage() {
 		_max_vals = NULL;
 	}
 	auto startPyramidTime = std::chrono::steady_clock::now();
-	if (getDataType() == UInt32) {
+	if (_streamingPyramid && _streamingPyramid->isValid()) {
+		writeStreamedPyramid();
+	}
+	else if (getDataType() == UInt32) {
 		if (writePyramidToDisk<unsigned int>() < 0) {
 			std::cout << "Writing pyramid to disk failed, TIFF file is still valid for further analysis." << std::endl;
 			return -1;
@@ -361,6 +904,7 @@ int MultiResolutionImageWriter::finishImage() {
 	}
 	auto endPyramidTime = std::chrono::steady_clock::now();
 	_totalPyramidTime += std::chrono::duration<double, milli>(endPyramidTime - startPyramidTime).count();
+	_streamingPyramid.reset();
 	for (std::vector<std::string>::const_iterator it = _levelFiles.begin(); it != _levelFiles.end(); ++it) {
 		for (int i = 0; i < 5; ++i) {
 			if (remove(it->c_str()) == 0) {
@@ -373,39 +917,65 @@ int MultiResolutionImageWriter::finishImage() {
 	_levelFiles.clear();
 	_fileName = "";
 	_pos = 0;
-	std::cout << "Total time was " << _totalReadingTime + _totalBaseWritingTime + _totalPyramidTime + _jpeg2kCompressionTime << std::endl;
-	std::cout << "Total reading time was " << _totalReadingTime << std::endl;
-	std::cout << "Total base writing time was " << _totalBaseWritingTime << std::endl;
-	std::cout << "Total pyramid downsampling time was " << _totalDownsamplingtime << std::endl;
-	std::cout << "Total pyramid writing time was " << _totalPyramidTime << std::endl;
-	std::cout << "Total time determining min/max was " << _totalMinMaxTime << std::endl;
-	if (_codec == pathology::Compression::JPEG2000) {
-		std::cout << "Total JPEG2000 encoding time was " << _jpeg2kCompressionTime << std::endl;
-	}
 	return 0;
 }
 
-template <typename T> int MultiResolutionImageWriter::writePyramidToDisk() {
-
-	//! First get the overall image width and height;
-	unsigned long w = 0, h = 0, nrsamples = 0, nrbits = 0;
-	// TIFF idiosyncracy, when setting resolution tags one uses doubles,
-	// getting them requires floats
+void MultiResolutionImageWriter::writeStreamedPyramid() {
+	// Spacing of the levels follows from the base image like in writePyramidToDisk
 	float spacingX = 0, spacingY = 0;
 	std::vector<double> spacing;
-	TIFFGetField(_tiff, TIFFTAG_IMAGEWIDTH, &w);
-	TIFFGetField(_tiff, TIFFTAG_IMAGELENGTH, &h);
-	TIFFGetField(_tiff, TIFFTAG_SAMPLESPERPIXEL, &nrsamples);
-	TIFFGetField(_tiff, TIFFTAG_BITSPERSAMPLE, &nrbits);
 	if (TIFFGetField(_tiff, TIFFTAG_XRESOLUTION, &spacingX) == 1) {
 		if (TIFFGetField(_tiff, TIFFTAG_YRESOLUTION, &spacingY) == 1) {
 			spacing.push_back(1. / (spacingX / (10000.)));
 			spacing.push_back(1. / (spacingY / (10000.)));
 		}
 	}
-	// Determine the amount of pyramid levels
+	TIFFWriteDirectory(_tiff);
+	const unsigned int numberOfLevels = _streamingPyramid->getNumberOfLevels();
+	for (unsigned int i = 0; i < numberOfLevels; ++i) {
+		if (_monitor) {
+			_monitor->setProgress((_monitor->maximumProgress() / 2.) + ((static_cast<float>(i) + 1.0) / static_cast<float>(numberOfLevels)) * (_monitor->maximumProgress() / 2.));
+		}
+		setPyramidTags(_tiff, _streamingPyramid->getLevelWidth(i), _streamingPyramid->getLevelHeight(i));
+		TIFFSetField(_tiff, TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
+		if (_codec == JPEG) {
+			// The tiles were compressed in handles of their own and carry their JPEG tables
+			TIFFSetField(_tiff, TIFFTAG_JPEGTABLESMODE, 0);
+		}
+		std::vector<unsigned char> compressed;
+		const unsigned long long numberOfTiles = _streamingPyramid->getNumberOfLevelTiles(i);
+		for (unsigned long long tile = 0; tile < numberOfTiles; ++tile) {
+			if (_streamingPyramid->takeLevelTile(i, tile, compressed)) {
+				TIFFWriteRawTile(_tiff, static_cast<ttile_t>(tile), compressed.data(), compressed.size());
+			}
+		}
+		if (!spacing.empty()) {
+			spacing[0] *= _downsamplePerLevel;
+			spacing[1] *= _downsamplePerLevel;
+		}
+		setSpacing(spacing);
+		TIFFWriteDirectory(_tiff);
+	}
+}
+
+std::string MultiResolutionImageWriter::getTemporaryLevelFilePath(const unsigned int& level, const std::string& extension) const {
+#ifdef WIN32
+	size_t found = _fileName.find_last_of("/\\");
+#else 
+	size_t found = _fileName.find_last_of("/");
+#endif
+	string tmpPth = _fileName.substr(0, found + 1);
+	string fileName = _fileName.substr(found + 1);
+	size_t dotLoc = fileName.find_last_of(".");
+	string baseName = fileName.substr(0, dotLoc);
+	std::stringstream ssm;
+	ssm << tmpPth << "temp" << baseName << "Level" << level << extension;
+	return ssm.str();
+}
+
+unsigned int MultiResolutionImageWriter::getNumberOfPyramidLevels(const unsigned long long& width) const {
 	unsigned int pyramidlevels = 1;
-	unsigned int lowestwidth = w;
+	unsigned int lowestwidth = width;
 	if (_maxPyramidLevels < 0) {
 		while (lowestwidth > 1024) {
 			lowestwidth /= _downsamplePerLevel;
@@ -418,36 +988,44 @@ template <typename T> int MultiResolutionImageWriter::writePyramidToDisk() {
 	}
 	else {
 		pyramidlevels = _maxPyramidLevels;
-		lowestwidth /= pow(_downsamplePerLevel, pyramidlevels);
 	}
-	// Setup the image directory for the thumbnail
-	unsigned int lowestheight = (unsigned int)(h / pow(_downsamplePerLevel, (double)pyramidlevels));
+	return pyramidlevels;
+}
+
+template <typename T> int MultiResolutionImageWriter::writePyramidToDisk() {
+
+	//! First get the overall image width and height;
+	unsigned long w = 0, h = 0, nrsamples = 0, nrbits = 0;
+	// TIFF idiosyncracy, when setting resolution tags one uses doubles,
+	// getting them requires floats
+	float spacingX = 0, spacingY = 0;
+	std::vector<double> spacing;
+	TIFFGetField(_tiff, TIFFTAG_IMAGEWIDTH, &w);
+	TIFFGetField(_tiff, TIFFTAG_IMAGELENGTH, &h);
+	TIFFGetField(_tiff, TIFFTAG_SAMPLESPERPIXEL, &nrsamples);
+	TIFFGetField(_tiff, TIFFTAG_BITSPERSAMPLE, &nrbits);
+	if (TIFFGetField(_tiff, TIFFTAG_XRESOLUTION, &spacingX) == 1) {
+		if (TIFFGetField(_tiff, TIFFTAG_YRESOLUTION, &spacingY) == 1) {
+			spacing.push_back(1. / (spacingX / (10000.)));
+			spacing.push_back(1. / (spacingY / (10000.)));
+		}
+	}
+	// Determine the amount of pyramid levels
+	unsigned int pyramidlevels = getNumberOfPyramidLevels(w);
 
 	// Write temporary image to store previous level (LibTiff does not allow to go back and forth between
 	// empty directories
-#ifdef WIN32
-	size_t found = _fileName.find_last_of("/\\");
-#else 
-	size_t found = _fileName.find_last_of("/");
-#endif
-	string tmpPth = _fileName.substr(0, found + 1);
-	string fileName = _fileName.substr(found + 1);
-	size_t dotLoc = fileName.find_last_of(".");
-	string baseName = fileName.substr(0, dotLoc);
 	for (unsigned int level = 1; level <= pyramidlevels; ++level) {
 		if (_monitor) {
 			_monitor->setProgress((_monitor->maximumProgress() / 2.) + (static_cast<float>(level) / static_cast<float>(pyramidlevels))* (_monitor->maximumProgress() / 4.));
 		}
 		TIFF* prevLevelTiff = _tiff;
 		if (level != 1) {
-			std::stringstream ssm;
-			ssm << tmpPth << "temp" << baseName << "Level" << level - 1 << ".tif";
-			prevLevelTiff = TIFFOpen(ssm.str().c_str(), "r");
-		}
-		std::stringstream ssm;
-		ssm << tmpPth << "temp" << baseName << "Level" << level << ".tif";
-		TIFF* levelTiff = TIFFOpen(ssm.str().c_str(), "w8");
-		_levelFiles.push_back(ssm.str());
+			prevLevelTiff = TIFFOpen(getTemporaryLevelFilePath(level - 1, ".tif").c_str(), "r");
+		}
+		const std::string levelFile = getTemporaryLevelFilePath(level, ".tif");
+		TIFF* levelTiff = TIFFOpen(levelFile.c_str(), "w8");
+		_levelFiles.push_back(levelFile);
 		unsigned int levelw = (unsigned int)(w / pow(_downsamplePerLevel, (double)level));
 		unsigned int levelh = (unsigned int)(h / pow(_downsamplePerLevel, (double)level));
 		unsigned int prevLevelw = (unsigned int)(w / pow(_downsamplePerLevel, (double)level - 1));
@@ -674,29 +1252,18 @@ void MultiResolutionImageWriter::setTempPyramidTags(TIFF* levelTiff, const unsig
 template <typename T> T* MultiResolutionImageWriter::downscaleTile(T* inTile, unsigned int tileSize, unsigned int nrSamples) {
 	auto startDownscaleTime = std::chrono::steady_clock::now();
 	unsigned int dsSize = tileSize / _downsamplePerLevel;
-	unsigned int npixels = dsSize * dsSize * nrSamples;
 	T* dsTile = (T*)_TIFFmalloc(dsSize * dsSize * nrSamples * sizeof(T));
-	int rowOrg = 0, colOrg = 0;
-	for (unsigned long long y = 0; y < dsSize; ++y) {
-		for (unsigned long long x = 0; x < dsSize; ++x) {
-			for (unsigned long long s = 0; s < nrSamples; ++s) {
-				unsigned int index = (_downsamplePerLevel * y * tileSize * nrSamples) + (_downsamplePerLevel * x * nrSamples) + s;
-				unsigned int dsIndex = (y * dsSize * nrSamples) + (x * nrSamples) + s;
-				if (_interpolation == pathology::Linear) {
-					float interVal = 0;
-					for (int j = 0; j < _downsamplePerLevel; ++j) {
-						for (int i = 0; i < _downsamplePerLevel; ++i) {
-							interVal += (*(inTile + index + j * (tileSize * nrSamples) + i * nrSamples) / ((float)_downsamplePerLevel * _downsamplePerLevel));
-						}
-					}
-					*(dsTile + dsIndex) = (T)interVal;
-				}
-				else {
-					*(dsTile + dsIndex) = (T)(*(inTile + index));
-				}
-			}
-		}
+	core::ResamplingFilter filter = core::AreaResampling;
+	if (_interpolation == pathology::NearestNeighbor) {
+		filter = core::NearestResampling;
+	}
+	else if (_interpolation == pathology::Lanczos) {
+		filter = core::LanczosResampling;
+	}
+	else if (_interpolation == pathology::Mode) {
+		filter = core::ModeResampling;
 	}
+	core::downsample(inTile, _dType, nrSamples, tileSize, tileSize, tileSize * nrSamples, _downsamplePerLevel, dsTile, dsSize * nrSamples, filter);
 	auto endDownscaleTime = std::chrono::steady_clock::now();
 	_totalDownsamplingtime += std::chrono::duration<double, milli>(endDownscaleTime - startDownscaleTime).count();
 	return dsTile;
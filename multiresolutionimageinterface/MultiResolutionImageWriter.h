@@ -2,6 +2,7 @@
 #ifndef _MultiResolutionImageWriter
 #define _MultiResolutionImageWriter
 #include "multiresolutionimageinterface_export.h"
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -92,8 +93,52 @@ protected:
   template <typename T> T* downscaleTile(T* inTile, unsigned int tileSize, unsigned int nrSamples);
   template <typename T> int writePyramidToDisk();
   template <typename T> int incorporatePyramid();
+
+  //! Number of pyramid levels below the base image for an image of the given width
+  unsigned int getNumberOfPyramidLevels(const unsigned long long& width) const;
+
+  //! Path of the temporary file of a pyramid level, next to the file that is written
+  std::string getTemporaryLevelFilePath(const unsigned int& level, const std::string& extension) const;
+
+  //! Builds the pyramid levels while the base tiles are written, see buildsPyramidWhileWriting
+  class StreamingPyramid;
+  std::unique_ptr<StreamingPyramid> _streamingPyramid;
+
+  //! Whether the pyramid is built from the base tiles as they are written, keeping one row of tiles per
+  //! level and the compressed tiles of every level in memory, which finishImage writes after the base
+  //! image. Otherwise, when the base tiles were not written in order or when the compressed tiles exceed
+  //! getMaxStreamedPyramidSize, finishImage writes every level to a temporary TIFF file and reads it back
+  //! for the next one. Writers that need those files return false.
+  virtual bool buildsPyramidWhileWriting() const { return true; }
+
+  //! Completes the base directory and writes the levels of the streaming pyramid after it
+  void writeStreamedPyramid();
   void writeBaseImagePartToTIFFTile(void* data, unsigned int pos);
 
+  //! Number of samples per pixel of the base image, 0 for indexed images without a number of colors
+  unsigned int getNumberOfSamples() const;
+
+  //! Adds the values of a base tile to the per-channel minima and maxima
+  template <typename T> void updateMinMax(const T* tile, const unsigned int& nrSamples, double* minValues, double* maxValues) const;
+  void updateMinMax(const void* tile, const unsigned int& nrSamples, double* minValues, double* maxValues) const;
+
+  //! Compresses a base tile the way the base directory is set up, into the bytes TIFFWriteRawTile expects;
+  //! tile may be changed in the process. Only reads the writer's settings, so compression threads call it
+  //! at the same time.
+  bool compressTile(void* tile, std::vector<unsigned char>& compressed);
+
+  //! Waits until all submitted base tiles have been written and stops the compression threads. Called by
+  //! finishImage before the base directory is completed.
+  void finishBaseImage();
+
+  //! Compresses base tiles (and tiles of the streaming pyramid) on worker threads and writes the base tiles
+  //! to _tiff from a single writer thread
+  class CompressionPipeline;
+  std::unique_ptr<CompressionPipeline> _compressionPipeline;
+  unsigned int _numberOfCompressionThreads;
+  unsigned int _maxNumberOfTilesInFlight;
+  unsigned long long _maxStreamedPyramidSize;
+
   //! Temporary storage for the levelFiles
   std::vector<std::string> _levelFiles;
   JPEG2000Codec* _jpeg2000Codec;
@@ -131,7 +176,9 @@ public:
   const pathology::Compression getCompression() const 
   {return _codec;}
 
-  //! Sets the interpolation
+  //! Sets the interpolation used to downsample the pyramid levels. Linear and Area average the blocks of
+  //! pixels, Lanczos is sharper but only sees the pixels of one tile and Mode keeps the most frequent value
+  //! of every block, for label images.
   void setInterpolation(const pathology::Interpolation& interpolation) 
   {_interpolation = interpolation;}
 
@@ -149,14 +196,20 @@ public:
       _maxPyramidLevels = maxNrPyramidLevels;
   }
 
-  //! Get the maximum number of pyramid levels (-1 means determine automatically)
+  //! Get the downsample between consecutive pyramid levels (2 by default)
   const int getDownsamplePerLevel() const {
       return _downsamplePerLevel;
   }
 
-  //! Set the maximum number of pyramid levels (-1 means determine automatically)
-  void setDownsamplePerLevel(const int downsamplePerLevel) {
+  //! Set the downsample between consecutive pyramid levels. Tiles are downsampled one at a time, so the
+  //! factor has to divide the tile size (set the tile size first); returns -1 and keeps the current
+  //! factor otherwise.
+  const int setDownsamplePerLevel(const int downsamplePerLevel) {
+      if (downsamplePerLevel < 2 || _tileSize % downsamplePerLevel != 0) {
+        return -1;
+      }
       _downsamplePerLevel = downsamplePerLevel;
+      return 0;
   }
 
   //! Sets the datatype
@@ -217,6 +270,48 @@ public:
   const float getJPEGQuality() const 
   {{return _quality;}} 
 
+  //! Gets/Sets the number of threads that compress the tiles of the base image, which has to be set before
+  //! writeImageInformation. With 0 (the default) writeBaseImagePart compresses and writes the tile before it
+  //! returns; otherwise it copies the tile and returns as soon as there is room in the queue, and a single
+  //! thread writes the compressed tiles to the file as they come in.
+  unsigned int getNumberOfCompressionThreads() const {
+    return _numberOfCompressionThreads;
+  }
+
+  void setNumberOfCompressionThreads(const unsigned int& numberOfThreads) {
+    _numberOfCompressionThreads = numberOfThreads;
+  }
+
+  //! Gets/Sets the maximum number of tiles that are being compressed or waiting to be written, which bounds
+  //! the memory the compression threads use. 0 (the default) allows four tiles per compression thread.
+  unsigned int getMaxNumberOfTilesInFlight() const {
+    return _maxNumberOfTilesInFlight;
+  }
+
+  void setMaxNumberOfTilesInFlight(const unsigned int& maxNumberOfTiles) {
+    _maxNumberOfTilesInFlight = maxNumberOfTiles;
+  }
+
+  //! Gets/Sets the maximum number of bytes of compressed pyramid tiles that are kept in memory while the
+  //! base image is written (1 GB by default). Larger pyramids are built from the base image by finishImage
+  //! instead; 0 always does so.
+  unsigned long long getMaxStreamedPyramidSize() const {
+    return _maxStreamedPyramidSize;
+  }
+
+  void setMaxStreamedPyramidSize(const unsigned long long& maxSize) {
+    _maxStreamedPyramidSize = maxSize;
+  }
+
+  //! Time in milliseconds spent in the stages of writing the current or last image; the counters are
+  //! reset by writeImageInformation
+  unsigned int getReadingTime() const { return _totalReadingTime; }
+  unsigned int getMinMaxTime() const { return _totalMinMaxTime; }
+  unsigned int getJPEG2000CompressionTime() const { return _jpeg2kCompressionTime; }
+  unsigned int getBaseWritingTime() const { return _totalBaseWritingTime; }
+  unsigned int getDownsamplingTime() const { return _totalDownsamplingtime; }
+  unsigned int getPyramidTime() const { return _totalPyramidTime; }
+
   void setProgressMonitor(ProgressMonitor* monitor);
 
 };
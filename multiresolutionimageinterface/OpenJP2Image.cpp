@@ -9,6 +9,7 @@ OpenJP2Image::OpenJP2Image() : MultiResolutionImage(), _stream(NULL) {
 }
 
 OpenJP2Image::~OpenJP2Image() {
+  stopAsyncReads();
   boost::unique_lock<boost::shared_mutex> l(*_openCloseMutex);
   cleanup();
   MultiResolutionImage::cleanup();
@@ -48,31 +49,24 @@ double OpenJP2Image::getMaxValue(int channel) {
 void OpenJP2Image::cleanup() {  
 }
 
-void* OpenJP2Image::readDataFromImage(const long long& startX, const long long& startY, const unsigned long long& width, 
-    const unsigned long long& height, const unsigned int& level) {
+void OpenJP2Image::readDataIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride) {
   if (getDataType()==UInt32) {
-    unsigned int* temp = FillRequestedRegion<unsigned int>(startX, startY, width, height, level, _samplesPerPixel);
-    return (void*)temp;
+    FillRequestedRegion<unsigned int>(startX, startY, width, height, level, _samplesPerPixel, data, dataType, rowStride);
   }
   else if (getDataType()==UInt16) {
-    unsigned short* temp = FillRequestedRegion<unsigned short>(startX, startY, width, height, level, _samplesPerPixel);
-    return (void*)temp;
+    FillRequestedRegion<unsigned short>(startX, startY, width, height, level, _samplesPerPixel, data, dataType, rowStride);
   }
   else if (getDataType()==Float) {
-    float* temp = FillRequestedRegion<float>(startX, startY, width, height, level, _samplesPerPixel);
-    return (void*)temp;
+    FillRequestedRegion<float>(startX, startY, width, height, level, _samplesPerPixel, data, dataType, rowStride);
   }
   else if (getDataType()==UChar) {
-    unsigned char* temp = FillRequestedRegion<unsigned char>(startX, startY, width, height, level, _samplesPerPixel);
-    return (void*)temp;
-  }
-  else {
-    return NULL;
+    FillRequestedRegion<unsigned char>(startX, startY, width, height, level, _samplesPerPixel, data, dataType, rowStride);
   }
 }
 
-template <typename T> T* OpenJP2Image::FillRequestedRegion(const long long& startX, const long long& startY, const unsigned long long& width,
-                                                           const unsigned long long& height, const unsigned int& level, unsigned int nrSamples)
+template <typename T> void OpenJP2Image::FillRequestedRegion(const long long& startX, const long long& startY, const unsigned long long& width,
+                                                             const unsigned long long& height, const unsigned int& level, unsigned int nrSamples,
+                                                             void* data, const pathology::DataType& dataType, const unsigned long long& rowStride)
 {
-  return NULL;
 }
\ No newline at end of file
@@ -22,11 +22,11 @@ public:
 protected :
   void cleanup();
   
-  void* readDataFromImage(const long long& startX, const long long& startY, const unsigned long long& width, 
-    const unsigned long long& height, const unsigned int& level);
+  void readDataIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride);
 
-  template <typename T> T* FillRequestedRegion(const  long long& startX, const long long& startY, const unsigned long long& width, 
-    const unsigned long long& height, const unsigned int& level, unsigned int nrSamples);
+  template <typename T> void FillRequestedRegion(const  long long& startX, const long long& startY, const unsigned long long& width, 
+    const unsigned long long& height, const unsigned int& level, unsigned int nrSamples, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride);
 
   std::vector<std::vector<unsigned int> > _tileSizesPerLevel;
 
@@ -19,8 +19,9 @@ MultiResolutionImage* OpenJP2ImageFactory::readImage(const std::string& fileName
 }
 
 bool OpenJP2ImageFactory::canReadImage(const std::string& fileName) const {
-  OpenJP2Image* img = new OpenJP2Image();
-  bool canOpen = img->initialize(fileName);
-  delete img;
-  return canOpen;
+  // Either a JP2 file, which starts with the signature box, or a bare codestream with SOC and SIZ markers
+  static const std::string jp2Signature("\x00\x00\x00\x0C\x6A\x50\x20\x20\x0D\x0A\x87\x0A", 12);
+  static const std::string codestreamSignature("\xFF\x4F\xFF\x51", 4);
+  std::string header = readFileHeader(fileName, 12);
+  return header == jp2Signature || header.compare(0, 4, codestreamSignature) == 0;
 }
\ No newline at end of file
@@ -1,14 +1,17 @@
 #include "OpenSlideImage.h"
+#include "ReaderHandlePool.h"
 #include <boost/thread.hpp>
 #include "openslide.h" 
+#include "core/PixelConversion.h"
 #include <sstream>
 
 using namespace pathology;
 
-OpenSlideImage::OpenSlideImage() : MultiResolutionImage(), _slide(NULL), _bg_r(255), _bg_g(255), _bg_b(255) {
+OpenSlideImage::OpenSlideImage() : MultiResolutionImage(), _slide(NULL), _maxNumberOfHandles(1), _handleIdleTimeout(60.), _hasCacheSize(false), _bg_r(255), _bg_g(255), _bg_b(255) {
 }
 
 OpenSlideImage::~OpenSlideImage() {
+  stopAsyncReads();
   boost::unique_lock<boost::shared_mutex> l(*_openCloseMutex);
   cleanup();
   MultiResolutionImage::cleanup();
@@ -16,9 +19,23 @@ OpenSlideImage::~OpenSlideImage() {
 
 // We are using OpenSlides caching system instead of our own.
 void OpenSlideImage::setCacheSize(const unsigned long long cacheSize) {
+  boost::unique_lock<boost::shared_mutex> l(*_openCloseMutex);
+  {
+    boost::lock_guard<boost::mutex> cacheLock(*_cacheMutex);
+    _cacheSize = cacheSize;
+  }
+  _hasCacheSize = true;
+  applyCacheSize();
+}
+
+// Every handle has a cache of its own, so each gets an equal part of the cache size. The first handle is also
+// read from outside the pool, so it is resized right away.
+void OpenSlideImage::applyCacheSize() {
 #ifdef CUSTOM_OPENSLIDE
-  if (_slide) {
-    openslide_set_cache_size(_slide, cacheSize);
+  if (_handles && _hasCacheSize) {
+    const unsigned long long handleCacheSize = _cacheSize / _handles->getMaxNumberOfHandles();
+    openslide_set_cache_size(_slide, handleCacheSize);
+    _handles->setHandleSetup([handleCacheSize](openslide_t* slide) { openslide_set_cache_size(slide, handleCacheSize); });
   }
 #endif
 }
@@ -80,6 +97,16 @@ bool OpenSlideImage::initializeType(const std::string& imagePath) {
         _bg_g = ((bg_color >> 8) & 0xff);
         _bg_b = (bg_color & 0xff);
       }
+      _handles = std::make_shared<ReaderHandlePool<openslide_t> >(_slide, [imagePath]() -> openslide_t* {
+        openslide_t* slide = openslide_open(imagePath.c_str());
+        if (slide && openslide_get_error(slide)) {
+          openslide_close(slide);
+          return NULL;
+        }
+        return slide;
+      }, [](openslide_t* slide) { openslide_close(slide); }, _maxNumberOfHandles);
+      _handles->setIdleTimeout(_handleIdleTimeout);
+      applyCacheSize();
       _isValid = true;
     }
     else {
@@ -101,43 +128,112 @@ std::string OpenSlideImage::getProperty(const std::string& propertyName) {
   return propertyValue;
 }
 
-void* OpenSlideImage::readDataFromImage(const long long& startX, const long long& startY, const unsigned long long& width, 
-    const unsigned long long& height, const unsigned int& level) {
+std::vector<std::string> OpenSlideImage::getPropertyNames() {
+  std::vector<std::string> propertyNames;
+  if (_slide) {
+    for (const char* const* name = openslide_get_property_names(_slide); *name; ++name) {
+      propertyNames.push_back(*name);
+    }
+  }
+  return propertyNames;
+}
+
+void OpenSlideImage::readDataIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride) {
   
   if (!_isValid) {
-    return NULL;
+    return;
   }
 
   boost::shared_lock<boost::shared_mutex> l(*_openCloseMutex);
   unsigned int* temp = new unsigned int[width*height];
-  openslide_read_region(_slide, temp, startX, startY, level, width, height);
-
-  unsigned char* rgb = new unsigned char[width*height*3];
-  unsigned char* bgra = (unsigned char*)temp;
-  for (unsigned long long i = 0, j = 0; i < width*height*4; i+=4, j+=3) {
-    if (bgra[i + 3] == 255) {
-      rgb[j] = bgra[i + 2];
-      rgb[j + 1] = bgra[i + 1];
-      rgb[j + 2] = bgra[i];
-    }
-    else if (bgra[i + 3] == 0) {
-      rgb[j] = _bg_r;
-      rgb[j + 1] = _bg_g;
-      rgb[j + 2] = _bg_b;
-    }
-    else {
-      rgb[j] = (255. * bgra[i + 2]) / bgra[i + 3];
-      rgb[j + 1] = (255. * bgra[i + 1]) / bgra[i + 3];
-      rgb[j + 2] = (255. * bgra[i]) / bgra[i + 3];
+  if (_handles->getMaxNumberOfHandles() > 1) {
+    ReaderHandlePool<openslide_t>::Lease slide(*_handles, _statistics.get());
+    openslide_read_region(slide.get(), temp, startX, startY, level, width, height);
+  }
+  else {
+    openslide_read_region(_slide, temp, startX, startY, level, width, height);
+  }
+
+  // Un-premultiply straight into the destination, other data types go through a single row buffer
+  unsigned char* destination = static_cast<unsigned char*>(data);
+  const unsigned long long destinationRowBytes = rowStride * bytesPerSample(dataType);
+  unsigned char* rowBuffer = dataType != UChar ? new unsigned char[width * 3] : NULL;
+  const unsigned char background[3] = {_bg_r, _bg_g, _bg_b};
+  for (unsigned long long y = 0; y < height; ++y) {
+    const unsigned char* bgra = reinterpret_cast<const unsigned char*>(temp + y * width);
+    unsigned char* rgb = rowBuffer ? rowBuffer : destination + y * destinationRowBytes;
+    core::unpremultiplyBGRAToRGB(bgra, rgb, width, background);
+    if (rowBuffer) {
+      convertSamples(rowBuffer, destination + y * destinationRowBytes, dataType, width * 3);
     }
   }
+  delete[] rowBuffer;
   delete[] temp;
-  return rgb;
 }
 
 void OpenSlideImage::cleanup() {
-  if (_slide) {
+  // The pool closes the handles once the clones sharing it are gone as well
+  if (_handles) {
+    _handles.reset();
+  }
+  else if (_slide) {
     openslide_close(_slide);
-    _slide = NULL;
+  }
+  _slide = NULL;
+}
+
+ImageSource* OpenSlideImage::clone() {
+  boost::shared_lock<boost::shared_mutex> l(*_openCloseMutex);
+  if (!_isValid) {
+    return NULL;
+  }
+  OpenSlideImage* image = new OpenSlideImage();
+  image->_filePath = _filePath;
+  image->_fileType = _fileType;
+  image->_levelDimensions = _levelDimensions;
+  image->_numberOfLevels = _numberOfLevels;
+  image->_spacing = _spacing;
+  image->_samplesPerPixel = _samplesPerPixel;
+  image->_colorType = _colorType;
+  image->_dataType = _dataType;
+  image->_errorState = _errorState;
+  image->_bg_r = _bg_r;
+  image->_bg_g = _bg_g;
+  image->_bg_b = _bg_b;
+  image->_slide = _slide;
+  image->_handles = _handles;
+  image->_maxNumberOfHandles = _maxNumberOfHandles;
+  image->_handleIdleTimeout = _handleIdleTimeout;
+  image->_cacheSize = _cacheSize;
+  image->_hasCacheSize = _hasCacheSize;
+  image->_isValid = true;
+  return image;
+}
+
+unsigned int OpenSlideImage::getMaxNumberOfReadHandles() const {
+  boost::shared_lock<boost::shared_mutex> l(*_openCloseMutex);
+  return _handles ? _handles->getMaxNumberOfHandles() : _maxNumberOfHandles;
+}
+
+void OpenSlideImage::setMaxNumberOfReadHandles(const unsigned int& maxNumberOfReadHandles) {
+  boost::unique_lock<boost::shared_mutex> l(*_openCloseMutex);
+  _maxNumberOfHandles = std::max(maxNumberOfReadHandles, 1u);
+  if (_handles) {
+    _handles->setMaxNumberOfHandles(_maxNumberOfHandles);
+    applyCacheSize();
+  }
+}
+
+double OpenSlideImage::getReadHandleIdleTimeout() const {
+  boost::shared_lock<boost::shared_mutex> l(*_openCloseMutex);
+  return _handles ? _handles->getIdleTimeout() : _handleIdleTimeout;
+}
+
+void OpenSlideImage::setReadHandleIdleTimeout(const double& seconds) {
+  boost::unique_lock<boost::shared_mutex> l(*_openCloseMutex);
+  _handleIdleTimeout = std::max(seconds, 0.);
+  if (_handles) {
+    _handles->setIdleTimeout(_handleIdleTimeout);
   }
 }
\ No newline at end of file
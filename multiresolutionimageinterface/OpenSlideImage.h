@@ -6,6 +6,7 @@
 
 struct _openslide;
 typedef struct _openslide openslide_t;
+template <typename H> class ReaderHandlePool;
 
 class OPENSLIDEFILEFORMAT_EXPORT OpenSlideImage : public MultiResolutionImage {
 
@@ -18,18 +19,44 @@ public:
   double getMaxValue(int channel = -1) { return 255.; }
 
   std::string getProperty(const std::string& propertyName);
+  std::vector<std::string> getPropertyNames();
   std::string getOpenSlideErrorState();
 
+  //! Returns a second image on the same slide that shares the OpenSlide handles (and so their caches)
+  //! with this one, NULL if this image is not valid
+  ImageSource* clone();
+
+  //! OpenSlide handles can be used by several threads at once, so by default all reads go through the
+  //! first one. With more than one handle every handle reads for a single thread at a time, which helps
+  //! for formats where OpenSlide serializes reads; each handle keeps a cache of its own, so the cache size
+  //! is divided over the maximum number of handles.
+  unsigned int getMaxNumberOfReadHandles() const;
+  void setMaxNumberOfReadHandles(const unsigned int& maxNumberOfReadHandles);
+  double getReadHandleIdleTimeout() const;
+  void setReadHandleIdleTimeout(const double& seconds);
+
+  //! Sets the size of OpenSlide's own tile cache (only with a CUSTOM_OPENSLIDE build), shared by the clones
   void setCacheSize(const unsigned long long cacheSize);
 
 protected :
   void cleanup();
+
+  //! Gives every read handle its part of the cache size, called with the open/close mutex held
+  void applyCacheSize();
   
-  void* readDataFromImage(const long long& startX, const long long& startY, const unsigned long long& width, 
-    const unsigned long long& height, const unsigned int& level);
+  void readDataIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride);
 
   openslide_t* _slide;
 
+  //! Owns _slide once the slide is opened, shared with the clones of this image
+  std::shared_ptr<ReaderHandlePool<openslide_t> > _handles;
+  unsigned int _maxNumberOfHandles;
+  double _handleIdleTimeout;
+
+  //! Whether setCacheSize was called, otherwise the handles keep OpenSlide's default cache
+  bool _hasCacheSize;
+
 private:
 
   std::string _errorState;
@@ -1,5 +1,6 @@
 #include "OpenSlideImageFactory.h"
 #include "OpenSlideImage.h"
+#include "openslide.h"
 
 OpenSlideImageFactory::OpenSlideImageFactory() : MultiResolutionImageFactory("OpenSlide Formats", { "svs", "tif", "tiff", "mrxs", "vms", "vmu", "ndpi", "scn", "svslide", "bif" }, 1) {
 }
@@ -16,11 +17,19 @@ MultiResolutionImage* OpenSlideImageFactory::readImage(const std::string& fileNa
   }
 }
 
+bool OpenSlideImageFactory::readImageMetadata(const std::string& fileName, ImageMetadata& metadata) const {
+  // OpenSlide reads all headers when the slide is opened, but this skips the caches and generated levels
+  OpenSlideImage img;
+  if (!img.initializeType(fileName)) {
+    return false;
+  }
+  copyImageMetadata(img, metadata);
+  return true;
+}
+
 bool OpenSlideImageFactory::canReadImage(const std::string& fileName) const {
-  OpenSlideImage* img = new OpenSlideImage();
-  bool canOpen = img->initialize(fileName);
-  delete img;
-  return canOpen;
+  // OpenSlide only looks at the headers of the file to detect its vendor
+  return openslide_detect_vendor(fileName.c_str()) != NULL;
 }
 
 void filetypeLoad()
@@ -11,6 +11,7 @@ public:
 private:
   MultiResolutionImage* readImage(const std::string& fileName) const;
   bool canReadImage(const std::string& fileName) const;
+  bool readImageMetadata(const std::string& fileName, ImageMetadata& metadata) const;
 };
 
 extern "C" {
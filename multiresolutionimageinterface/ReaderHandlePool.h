@@ -0,0 +1,219 @@
+#ifndef _ReaderHandlePool
+#define _ReaderHandlePool
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include "ImageStatistics.h"
+
+//! Pool of decoder handles on a single file (e.g. libtiff or OpenSlide handles). A handle is used by one
+//! thread at a time; when all open handles are in use a new one is opened, up to the maximum, otherwise
+//! the thread waits for one to be released. Handles that stay idle for longer than the idle timeout are
+//! closed again the next time the pool is used, except for the first one, which is kept for metadata.
+//! Images share the pool with their clones through a shared_ptr; the last one to go closes the handles.
+template <typename H>
+class ReaderHandlePool {
+public:
+  typedef std::function<H*()> Opener;
+  typedef std::function<void(H*)> Closer;
+  typedef std::function<void(H*)> Setup;
+
+  //! Takes ownership of first, which must be a valid handle; open returns NULL if it cannot open another one
+  ReaderHandlePool(H* first, const Opener& open, const Closer& close, const unsigned int& maxNumberOfHandles) :
+    _first(first), _open(open), _close(close), _numberOfHandles(1), _maxNumberOfHandles(std::max(maxNumberOfHandles, 1u)),
+    _idleTimeout(std::chrono::seconds(60)), _setupGeneration(0)
+  {
+    _idleHandles.push_back(std::make_pair(first, std::chrono::steady_clock::now()));
+  }
+
+  //! All handles must have been released
+  ~ReaderHandlePool() {
+    for (auto it = _idleHandles.begin(); it != _idleHandles.end(); ++it) {
+      _close(it->first);
+    }
+  }
+
+  //! The handle the pool was created with, which stays open as long as the pool exists
+  H* first() const { return _first; }
+
+  //! Takes a handle from the pool, opening a new one if allowed; the time spent waiting for another
+  //! thread to release one is recorded in statistics
+  H* acquire(ImageStatisticsCollector* statistics = NULL) {
+    boost::unique_lock<boost::mutex> l(_mutex);
+    closeExpiredHandles(l);
+    ImageStatisticsCollector::Stopwatch waiting;
+    bool waited = false;
+    while (_idleHandles.empty()) {
+      if (_numberOfHandles < _maxNumberOfHandles) {
+        // Reserve the slot and open the file without holding the lock
+        ++_numberOfHandles;
+        l.unlock();
+        H* handle = _open();
+        l.lock();
+        if (handle) {
+          return setUp(handle, l);
+        }
+        // Could not open an additional handle (e.g. file descriptor limit), stick to the current ones
+        --_numberOfHandles;
+        _maxNumberOfHandles = _numberOfHandles;
+      }
+      else {
+        _handleReleased.wait(l);
+        waited = true;
+      }
+    }
+    if (waited && statistics) {
+      statistics->recordLockWait(waiting.elapsedMicroseconds());
+    }
+    // The most recently used handle is taken, so surplus ones end up idle for long enough to be closed
+    H* handle = _idleHandles.back().first;
+    _idleHandles.pop_back();
+    return setUp(handle, l);
+  }
+
+  void release(H* handle) {
+    {
+      boost::lock_guard<boost::mutex> l(_mutex);
+      _idleHandles.push_back(std::make_pair(handle, std::chrono::steady_clock::now()));
+    }
+    _handleReleased.notify_one();
+  }
+
+  //! Acquires a handle for as long as the lease exists, so it is released again if a read throws
+  class Lease {
+  public:
+    Lease(ReaderHandlePool& pool, ImageStatisticsCollector* statistics = NULL) : _pool(pool), _handle(pool.acquire(statistics)) {}
+    ~Lease() { _pool.release(_handle); }
+    H* get() const { return _handle; }
+
+  private:
+    Lease(const Lease& other);
+    Lease& operator=(const Lease& other);
+
+    ReaderHandlePool& _pool;
+    H* _handle;
+  };
+
+  //! Gets/Sets the maximum number of open handles, surplus idle handles are closed right away
+  unsigned int getMaxNumberOfHandles() const {
+    boost::lock_guard<boost::mutex> l(_mutex);
+    return _maxNumberOfHandles;
+  }
+
+  void setMaxNumberOfHandles(const unsigned int& maxNumberOfHandles) {
+    std::vector<H*> surplus;
+    {
+      boost::lock_guard<boost::mutex> l(_mutex);
+      _maxNumberOfHandles = std::max(maxNumberOfHandles, 1u);
+      for (auto it = _idleHandles.begin(); it != _idleHandles.end() && _numberOfHandles > _maxNumberOfHandles;) {
+        if (it->first != _first) {
+          surplus.push_back(it->first);
+          _setupGenerations.erase(it->first);
+          it = _idleHandles.erase(it);
+          --_numberOfHandles;
+        }
+        else {
+          ++it;
+        }
+      }
+    }
+    closeHandles(surplus);
+  }
+
+  //! Number of handles that are currently open, idle or in use
+  unsigned int getNumberOfHandles() const {
+    boost::lock_guard<boost::mutex> l(_mutex);
+    return _numberOfHandles;
+  }
+
+  //! Gets/Sets the time after which an idle handle is closed, 0 closes handles as soon as the pool is used again
+  double getIdleTimeout() const {
+    boost::lock_guard<boost::mutex> l(_mutex);
+    return std::chrono::duration_cast<std::chrono::duration<double> >(_idleTimeout).count();
+  }
+
+  void setIdleTimeout(const double& seconds) {
+    boost::lock_guard<boost::mutex> l(_mutex);
+    _idleTimeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(std::max(seconds, 0.)));
+  }
+
+  //! Sets a function that configures a handle (e.g. the size of its cache), which is applied to every handle
+  //! by the thread that acquires it next, so it never runs on a handle that is in use. Replaces the previous one.
+  void setHandleSetup(const Setup& setup) {
+    boost::lock_guard<boost::mutex> l(_mutex);
+    _setup = setup;
+    ++_setupGeneration;
+  }
+
+  //! Closes the handles that have been idle for longer than the idle timeout
+  void closeIdleHandles() {
+    boost::unique_lock<boost::mutex> l(_mutex);
+    closeExpiredHandles(l);
+  }
+
+private:
+  ReaderHandlePool(const ReaderHandlePool& other);
+  ReaderHandlePool& operator=(const ReaderHandlePool& other);
+
+  //! Idle handles are ordered by release time, so expired ones are at the front. Closing a handle can take
+  //! a while (e.g. OpenSlide drops its cache), so it is done without holding the lock.
+  void closeExpiredHandles(boost::unique_lock<boost::mutex>& l) {
+    const std::chrono::steady_clock::time_point expired = std::chrono::steady_clock::now() - _idleTimeout;
+    std::vector<H*> closing;
+    for (auto it = _idleHandles.begin(); it != _idleHandles.end() && it->second <= expired;) {
+      if (it->first != _first) {
+        closing.push_back(it->first);
+        _setupGenerations.erase(it->first);
+        it = _idleHandles.erase(it);
+        --_numberOfHandles;
+      }
+      else {
+        ++it;
+      }
+    }
+    if (!closing.empty()) {
+      l.unlock();
+      closeHandles(closing);
+      l.lock();
+    }
+  }
+
+  //! Applies the current setup to a handle that has just been taken, without holding the lock
+  H* setUp(H* handle, boost::unique_lock<boost::mutex>& l) {
+    unsigned int& generation = _setupGenerations[handle];
+    if (generation != _setupGeneration) {
+      generation = _setupGeneration;
+      Setup setup = _setup;
+      l.unlock();
+      if (setup) {
+        setup(handle);
+      }
+    }
+    return handle;
+  }
+
+  void closeHandles(const std::vector<H*>& handles) {
+    for (auto it = handles.begin(); it != handles.end(); ++it) {
+      _close(*it);
+    }
+  }
+
+  H* _first;
+  Opener _open;
+  Closer _close;
+  std::vector<std::pair<H*, std::chrono::steady_clock::time_point> > _idleHandles;
+  unsigned int _numberOfHandles;
+  unsigned int _maxNumberOfHandles;
+  std::chrono::steady_clock::duration _idleTimeout;
+  Setup _setup;
+  unsigned int _setupGeneration;
+  std::unordered_map<H*, unsigned int> _setupGenerations;
+  mutable boost::mutex _mutex;
+  boost::condition_variable _handleReleased;
+};
+
+#endif
@@ -5,15 +5,52 @@
 #endif
 #include "tiffio.h"
 #include "JPEG2000Codec.h"
+#include "ByteSource.h"
+#include "ReaderHandlePool.h"
 #include "core/PathologyEnums.h"
+#include "core/PixelConversion.h"
 #include <boost/thread.hpp>
+#include <atomic>
+#include <csetjmp>
+#include <cstdio>
+#include <set>
+#include <jpeglib.h>
+#include <zlib.h>
 
 using namespace pathology;
 
-TIFFImage::TIFFImage() : MultiResolutionImage(), _tiff(NULL), _jp2000(NULL) {
+struct TIFFImage::TilesInFlight {
+  boost::mutex mutex;
+  boost::condition_variable decoded;
+  std::set<TileKey> keys;
+
+  //! Takes a key that was inserted into keys out again when it goes out of scope, also if the decode throws
+  class Entry {
+  public:
+    Entry(TilesInFlight& tiles, const TileKey& key) : _tiles(tiles), _key(key) {}
+    ~Entry() {
+      {
+        boost::lock_guard<boost::mutex> l(_tiles.mutex);
+        _tiles.keys.erase(_key);
+      }
+      _tiles.decoded.notify_all();
+    }
+
+  private:
+    TilesInFlight& _tiles;
+    TileKey _key;
+  };
+};
+
+TIFFImage::TIFFImage() : MultiResolutionImage(), _tiff(NULL), _byteSwapped(false), _metadataOnly(false), _jp2000(NULL), _jp2000Resolutions(0),
+  _maxNumberOfHandles(std::max(boost::thread::hardware_concurrency(), 1u)),
+  _handleIdleTimeout(60.),
+  _tilesInFlight(std::make_shared<TilesInFlight>())
+{
 }
 
 TIFFImage::~TIFFImage() {
+  stopAsyncReads();
   boost::unique_lock<boost::shared_mutex> l(*_openCloseMutex);
   cleanup();
   MultiResolutionImage::cleanup();
@@ -23,15 +60,8 @@ bool TIFFImage::initializeType(const std::string& imagePath) {
   boost::unique_lock<boost::shared_mutex> l(*_openCloseMutex);
   cleanup();
 
-#ifdef _WIN32
-  int wchars_num = MultiByteToWideChar(CP_UTF8, 0, imagePath.c_str(), -1, NULL, 0);
-  wchar_t* w_imagePath = new wchar_t[wchars_num];
-  MultiByteToWideChar(CP_UTF8, 0, imagePath.c_str(), -1, w_imagePath, wchars_num);
-  _tiff = TIFFOpenW(w_imagePath, "rm");
-  delete[] w_imagePath;
-#else
-  _tiff = TIFFOpen(imagePath.c_str(), "rm");
-#endif
+  // With O the tile offsets are loaded on demand, which a metadata-only open never asks for
+  _tiff = openHandle(imagePath, _metadataOnly ? "rmO" : "rm");
 
   if (_tiff) {
     const char* img_desc = NULL;
@@ -105,6 +135,7 @@ bool TIFFImage::initializeType(const std::string& imagePath) {
     unsigned int x = 0, y = 0;
     unsigned int tileW = 0, tileH = 0;
     unsigned int dir = 0;
+    std::shared_ptr<std::vector<LevelIndex> > levelIndex = std::make_shared<std::vector<LevelIndex> >();
     for (int level = 0; level < TIFFNumberOfDirectories(_tiff); ++level) {
       TIFFSetDirectory(_tiff, level);
       if (TIFFIsTiled(_tiff) == 1) {
@@ -120,6 +151,30 @@ bool TIFFImage::initializeType(const std::string& imagePath) {
         levelTileSize.push_back(tileH);
         _levelDimensions.push_back(tmp);
         _tileSizesPerLevel.push_back(levelTileSize);
+
+        LevelIndex index;
+        index.directory = level;
+        index.codec = 0;
+        index.photometric = 0;
+        index.predictor = PREDICTOR_NONE;
+        index.numberOfTilesX = tileW > 0 ? (x + tileW - 1) / tileW : 0;
+        TIFFGetField(_tiff, TIFFTAG_COMPRESSION, &index.codec);
+        TIFFGetField(_tiff, TIFFTAG_PHOTOMETRIC, &index.photometric);
+        TIFFGetField(_tiff, TIFFTAG_PREDICTOR, &index.predictor);
+        // The tile offsets of a large slide take most of the time to open it
+        unsigned long long* offsets = NULL;
+        unsigned long long* byteCounts = NULL;
+        unsigned int numberOfTiles = TIFFNumberOfTiles(_tiff);
+        if (!_metadataOnly && TIFFGetField(_tiff, TIFFTAG_TILEOFFSETS, &offsets) && TIFFGetField(_tiff, TIFFTAG_TILEBYTECOUNTS, &byteCounts)) {
+          index.tileOffsets.assign(offsets, offsets + numberOfTiles);
+          index.tileByteCounts.assign(byteCounts, byteCounts + numberOfTiles);
+        }
+        unsigned int tablesSize = 0;
+        unsigned char* tables = NULL;
+        if (!_metadataOnly && TIFFGetField(_tiff, TIFFTAG_JPEGTABLES, &tablesSize, &tables) && tablesSize > 4) {
+          index.jpegTables.assign(tables, tables + tablesSize);
+        }
+        levelIndex->push_back(index);
         if (level > 0) {
           if (width > x) {
             width = x;
@@ -134,6 +189,7 @@ bool TIFFImage::initializeType(const std::string& imagePath) {
         _numberOfLevels -= 1;
       }
     }
+    _levelIndex = levelIndex;
 
     TIFFSetDirectory(_tiff, 0);
     if (dType == SAMPLEFORMAT_IEEEFP) {
@@ -220,6 +276,27 @@ bool TIFFImage::initializeType(const std::string& imagePath) {
     TIFFSetField(_tiff, TIFFTAG_PERSAMPLE, PERSAMPLE_MERGED);
 
     _fileType = "tif";
+    // The pool owns _tiff from here on, further handles are opened when threads decode concurrently
+    _handles = std::make_shared<ReaderHandlePool<TIFF> >(_tiff, [imagePath]() { return openHandle(imagePath, "rm"); },
+      [](TIFF* handle) { TIFFClose(handle); }, _maxNumberOfHandles);
+    _handles->setIdleTimeout(_handleIdleTimeout);
+    if (_metadataOnly) {
+      _isValid = true;
+      return _isValid;
+    }
+    _jp2000 = new JPEG2000Codec();
+    _jp2000->setNumberOfThreads(std::min(std::max(boost::thread::hardware_concurrency(), 1u), 4u));
+    // Without a byte source every tile is decoded through libtiff
+    openByteSource(imagePath);
+    const LevelIndex& baseIndex = _levelIndex->front();
+    if (baseIndex.codec == 33005 && !baseIndex.tileByteCounts.empty()) {
+      std::shared_ptr<std::vector<unsigned char> > buffer;
+      const unsigned char* encoded = encodedTileData(0, 0, buffer);
+      if (encoded) {
+        _jp2000Resolutions = JPEG2000Codec::getNumberOfResolutions(encoded, static_cast<unsigned int>(baseIndex.tileByteCounts[0]));
+      }
+    }
+    _byteSwapped = TIFFIsByteSwapped(_tiff) != 0;
     _isValid = true;
   }
   else {
@@ -242,6 +319,12 @@ bool TIFFImage::initializeType(const std::string& imagePath) {
   return _isValid;
 }
 
+bool TIFFImage::initializeMetadata(const std::string& imagePath) {
+  _filePath = imagePath;
+  _metadataOnly = true;
+  return initializeType(imagePath);
+}
+
 double TIFFImage::getMinValue(int channel) {
   if (!_minValues.empty() && channel > 0 && channel < _minValues.size()) {
     return _minValues[channel];
@@ -266,68 +349,285 @@ double TIFFImage::getMaxValue(int channel) {
   }
 }
 
+TIFF* TIFFImage::openHandle(const std::string& imagePath, const char* mode) {
+  TIFF* handle = NULL;
+#ifdef _WIN32
+  int wchars_num = MultiByteToWideChar(CP_UTF8, 0, imagePath.c_str(), -1, NULL, 0);
+  wchar_t* w_imagePath = new wchar_t[wchars_num];
+  MultiByteToWideChar(CP_UTF8, 0, imagePath.c_str(), -1, w_imagePath, wchars_num);
+  handle = TIFFOpenW(w_imagePath, mode);
+  delete[] w_imagePath;
+#else
+  handle = TIFFOpen(imagePath.c_str(), mode);
+#endif
+  return handle;
+}
+
+const std::vector<unsigned int> TIFFImage::getLevelTileSize(const unsigned int& level) const {
+  if (_isValid && level < _tileSizesPerLevel.size()) {
+    return _tileSizesPerLevel[level];
+  }
+  return std::vector<unsigned int>();
+}
+
+unsigned int TIFFImage::getMaxNumberOfReadHandles() const {
+  boost::shared_lock<boost::shared_mutex> l(*_openCloseMutex);
+  return _handles ? _handles->getMaxNumberOfHandles() : _maxNumberOfHandles;
+}
+
+void TIFFImage::setMaxNumberOfReadHandles(const unsigned int& maxNumberOfReadHandles) {
+  boost::unique_lock<boost::shared_mutex> l(*_openCloseMutex);
+  _maxNumberOfHandles = std::max(maxNumberOfReadHandles, 1u);
+  if (_handles) {
+    _handles->setMaxNumberOfHandles(_maxNumberOfHandles);
+  }
+}
+
+double TIFFImage::getReadHandleIdleTimeout() const {
+  boost::shared_lock<boost::shared_mutex> l(*_openCloseMutex);
+  return _handles ? _handles->getIdleTimeout() : _handleIdleTimeout;
+}
+
+void TIFFImage::setReadHandleIdleTimeout(const double& seconds) {
+  boost::unique_lock<boost::shared_mutex> l(*_openCloseMutex);
+  _handleIdleTimeout = std::max(seconds, 0.);
+  if (_handles) {
+    _handles->setIdleTimeout(_handleIdleTimeout);
+  }
+}
+
+ImageSource* TIFFImage::clone() {
+  boost::shared_lock<boost::shared_mutex> l(*_openCloseMutex);
+  if (!_isValid || _metadataOnly) {
+    return NULL;
+  }
+  TIFFImage* image = new TIFFImage();
+  image->_filePath = _filePath;
+  image->_fileType = _fileType;
+  image->_levelDimensions = _levelDimensions;
+  image->_numberOfLevels = _numberOfLevels;
+  image->_numberOfZPlanes = _numberOfZPlanes;
+  image->_currentZPlaneIndex = _currentZPlaneIndex;
+  image->_spacing = _spacing;
+  image->_samplesPerPixel = _samplesPerPixel;
+  image->_colorType = _colorType;
+  image->_dataType = _dataType;
+  image->_accessPattern = _accessPattern;
+  image->_tiff = _tiff;
+  image->_tileSizesPerLevel = _tileSizesPerLevel;
+  image->_levelIndex = _levelIndex;
+  image->_byteSwapped = _byteSwapped;
+  image->_minValues = _minValues;
+  image->_maxValues = _maxValues;
+  image->_jp2000Resolutions = _jp2000Resolutions;
+  image->_jp2000 = new JPEG2000Codec();
+  image->_jp2000->setNumberOfThreads(_jp2000->getNumberOfThreads());
+  image->_maxNumberOfHandles = _maxNumberOfHandles;
+  image->_handleIdleTimeout = _handleIdleTimeout;
+
+  // Everything that depends only on the file is shared, so a tile decoded by one image is a hit for the other
+  image->_handles = _handles;
+  image->_source = _source;
+  image->_tilesInFlight = _tilesInFlight;
+  {
+    boost::lock_guard<boost::mutex> cacheLock(*_cacheMutex);
+    image->_cacheSize = _cacheSize;
+    image->_encodedCacheSize = _encodedCacheSize;
+    image->_resampledCacheSize = _resampledCacheSize;
+    image->_virtualPyramidCacheSize = _virtualPyramidCacheSize;
+    image->_cacheWeight = _cacheWeight;
+    image->_cacheReplacementPolicy = _cacheReplacementPolicy;
+    image->_cache = _cache;
+    image->_encodedCache = _encodedCache;
+    image->_virtualPyramidCache = _virtualPyramidCache;
+  }
+  image->_resampledCache->setReplacementPolicy(image->_cacheReplacementPolicy);
+  image->_resampledCache->setMaxCacheSize(image->_resampledCacheSize);
+  image->_isValid = true;
+  l.unlock();
+
+  // The generated levels read through the image that owns them, so the clone gets its own on the shared cache
+  image->createVirtualPyramid();
+  return image;
+}
+
 void TIFFImage::cleanup() {
   _tileSizesPerLevel.clear();
-  if (_tiff) {
+  _levelIndex.reset();
+  _source.reset();
+  _byteSwapped = false;
+  // The pool closes the handles once the clones sharing it are gone as well; before the pool is created
+  // _tiff is still owned here
+  if (_handles) {
+    _handles.reset();
+  }
+  else if (_tiff) {
     TIFFClose(_tiff);
-    _tiff = NULL;
   }
+  _tiff = NULL;
+  _tilesInFlight = std::make_shared<TilesInFlight>();
   if (_jp2000) {
     delete _jp2000;
     _jp2000 = NULL;
   }
+  _jp2000Resolutions = 0;
 }
 
-void* TIFFImage::readDataFromImage(const long long& startX, const long long& startY, const unsigned long long& width,
-  const unsigned long long& height, const unsigned int& level) {
+void TIFFImage::readDataIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+  const unsigned long long& height, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride) {
+  if (_metadataOnly) {
+    return;
+  }
   if (getDataType() == UInt32) {
-    unsigned int* temp = FillRequestedRegionFromTIFF<unsigned int>(startX, startY, width, height, level, _samplesPerPixel);
-    return (void*)temp;
+    FillRequestedRegionFromTIFF<unsigned int>(startX, startY, width, height, level, _samplesPerPixel, data, dataType, rowStride);
   }
   else if (getDataType() == UInt16) {
-    unsigned short* temp = FillRequestedRegionFromTIFF<unsigned short>(startX, startY, width, height, level, _samplesPerPixel);
-    return (void*)temp;
+    FillRequestedRegionFromTIFF<unsigned short>(startX, startY, width, height, level, _samplesPerPixel, data, dataType, rowStride);
   }
   else if (getDataType() == Float) {
-    float* temp = FillRequestedRegionFromTIFF<float>(startX, startY, width, height, level, _samplesPerPixel);
-    return (void*)temp;
+    FillRequestedRegionFromTIFF<float>(startX, startY, width, height, level, _samplesPerPixel, data, dataType, rowStride);
   }
   else if (getDataType() == UChar) {
-    unsigned char* temp = FillRequestedRegionFromTIFF<unsigned char>(startX, startY, width, height, level, _samplesPerPixel);
-    return (void*)temp;
+    FillRequestedRegionFromTIFF<unsigned char>(startX, startY, width, height, level, _samplesPerPixel, data, dataType, rowStride);
   }
-  else {
+}
+
+bool TIFFImage::readScaledDataIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+  const unsigned long long& height, const unsigned int& scaleShift, void* data) {
+  // OpenJPEG discards resolution levels, the tiles have to divide evenly so the reduced tiles line up
+  if (_jp2000Resolutions == 0 || scaleShift == 0 || scaleShift >= _jp2000Resolutions || _byteSwapped ||
+      (_dataType != UChar && _dataType != UInt16) || (_tileSizesPerLevel[0][0] >> scaleShift) << scaleShift != _tileSizesPerLevel[0][0] ||
+      (_tileSizesPerLevel[0][1] >> scaleShift) << scaleShift != _tileSizesPerLevel[0][1]) {
+    return false;
+  }
+  boost::shared_lock<boost::shared_mutex> l(*_openCloseMutex, boost::defer_lock);
+  _statistics->lock(l);
+  const LevelIndex& index = (*_levelIndex)[0];
+  const long long tileW = _tileSizesPerLevel[0][0] >> scaleShift, tileH = _tileSizesPerLevel[0][1] >> scaleShift;
+  const long long levelW = static_cast<long long>((_levelDimensions[0][0] + (1ULL << scaleShift) - 1) >> scaleShift);
+  const long long levelH = static_cast<long long>((_levelDimensions[0][1] + (1ULL << scaleShift) - 1) >> scaleShift);
+  const long long firstX = std::max(startX, 0LL), firstY = std::max(startY, 0LL);
+  const long long endX = std::min(startX + static_cast<long long>(width), levelW), endY = std::min(startY + static_cast<long long>(height), levelH);
+  if (firstX >= endX || firstY >= endY) {
+    return false;
+  }
+  std::vector<std::pair<long long, long long> > tiles;
+  for (long long row = firstY / tileH; row <= (endY - 1) / tileH; ++row) {
+    for (long long col = firstX / tileW; col <= (endX - 1) / tileW; ++col) {
+      tiles.push_back(std::make_pair(col, row));
+    }
+  }
+
+  // Tiles are decoded in parallel, a single tile uses the threads of the codec instead
+  const unsigned long long pixelBytes = _samplesPerPixel * bytesPerSample(_dataType);
+  unsigned char* destination = static_cast<unsigned char*>(data);
+  std::atomic<bool> decoded(true);
+  runInParallel(tiles.size(), [&](unsigned long long i) {
+    const long long tileX = tiles[i].first * tileW, tileY = tiles[i].second * tileH;
+    const long long x0 = std::max(firstX, tileX), x1 = std::min(endX, tileX + tileW);
+    const long long y0 = std::max(firstY, tileY), y1 = std::min(endY, tileY + tileH);
+    const unsigned long long tileNr = tiles[i].second * index.numberOfTilesX + tiles[i].first;
+    std::shared_ptr<std::vector<unsigned char> > buffer;
+    const unsigned char* encoded = encodedTileData(0, tileNr, buffer);
+    if (!encoded) {
+      decoded = false;
+      return;
+    }
+    // Only the code blocks covering the requested part of the tile are decoded
+    JPEG2000Codec::DecodeParameters parameters;
+    parameters.reduce = scaleShift;
+    parameters.x = static_cast<unsigned int>((x0 - tileX) << scaleShift);
+    parameters.y = static_cast<unsigned int>((y0 - tileY) << scaleShift);
+    parameters.width = static_cast<unsigned int>((x1 - x0) << scaleShift);
+    parameters.height = static_cast<unsigned int>((y1 - y0) << scaleShift);
+    parameters.threads = tiles.size() == 1 ? 0 : 1;
+    std::vector<unsigned char> region((x1 - x0) * (y1 - y0) * pixelBytes);
+    unsigned int decodedWidth = 0, decodedHeight = 0;
+    {
+      ImageStatisticsCollector::DecodeTimer timer(_statistics.get(), JPEG2000Decoding);
+      if (!_jp2000->decode(encoded, static_cast<unsigned int>(index.tileByteCounts[tileNr]), region.data(), static_cast<unsigned int>(region.size()),
+          parameters, decodedWidth, decodedHeight) || decodedWidth != x1 - x0 || decodedHeight != y1 - y0) {
+        decoded = false;
+        return;
+      }
+    }
+    for (long long y = y0; y < y1; ++y) {
+      std::copy(region.begin() + (y - y0) * decodedWidth * pixelBytes, region.begin() + (y - y0 + 1) * decodedWidth * pixelBytes,
+        destination + ((y - startY) * width + (x0 - startX)) * pixelBytes);
+    }
+  });
+  return decoded;
+}
+
+bool TIFFImage::readEncodedTile(const unsigned int& level, const unsigned long long& tileNr, std::vector<unsigned char>& encoded) const {
+  const LevelIndex& index = (*_levelIndex)[level];
+  std::shared_ptr<std::vector<unsigned char> > buffer;
+  const unsigned char* tileData = encodedTileData(level, tileNr, buffer);
+  if (!tileData) {
+    return false;
+  }
+  // The tables without their EOI marker followed by the tile without its SOI marker form a complete stream
+  const unsigned long long byteCount = index.tileByteCounts[tileNr];
+  unsigned long long tablesSize = index.jpegTables.empty() ? 0 : index.jpegTables.size() - 2;
+  unsigned long long skip = index.jpegTables.empty() ? 0 : 2;
+  if (byteCount < skip) {
+    return false;
+  }
+  encoded.resize(tablesSize + byteCount - skip);
+  std::copy(index.jpegTables.begin(), index.jpegTables.begin() + tablesSize, encoded.begin());
+  std::copy(tileData + skip, tileData + byteCount, encoded.begin() + tablesSize);
+  return true;
+}
+
+const unsigned char* TIFFImage::encodedTileData(const unsigned int& level, const unsigned long long& tileNr, std::shared_ptr<std::vector<unsigned char> >& buffer) const {
+  const LevelIndex& index = (*_levelIndex)[level];
+  if (!_source || tileNr >= index.tileOffsets.size()) {
+    return NULL;
+  }
+  const unsigned long long offset = index.tileOffsets[tileNr], byteCount = index.tileByteCounts[tileNr];
+  if (byteCount == 0 || offset > _source->size() || byteCount > _source->size() - offset) {
     return NULL;
   }
+  if (_source->data()) {
+    // The mapping already holds the tile in memory, copying it into the cache would only double it
+    _statistics->recordBytesRead(byteCount);
+    return _source->data() + offset;
+  }
+  const TileKey key = makeTileKey(level, 0, tileNr % index.numberOfTilesX, tileNr / index.numberOfTilesX);
+  unsigned int cachedSize = 0;
+  if (_encodedCache && _encodedCache->get(key, buffer, cachedSize)) {
+    return buffer->data();
+  }
+  _statistics->recordBytesRead(byteCount);
+  buffer = std::make_shared<std::vector<unsigned char> >(byteCount);
+  if (_source->read(offset, byteCount, buffer->data()) != byteCount) {
+    return NULL;
+  }
+  if (_encodedCache && byteCount <= _encodedCache->maxCacheSize()) {
+    _encodedCache->set(key, buffer, byteCount);
+  }
+  return buffer->data();
 }
 
 long long TIFFImage::getEncodedTileSize(const long long& startX, const long long& startY, const unsigned int& level) {
+  boost::shared_lock<boost::shared_mutex> l(*_openCloseMutex);
   if (_tiff && level < this->_numberOfLevels) {
     long long levelStartX = std::floor(startX / getLevelDownsample(level) + 0.5);
     long long levelStartY = std::floor(startY / getLevelDownsample(level) + 0.5);
-    TIFFSetDirectory(_tiff, level);
-    unsigned int tileNr = TIFFComputeTile(_tiff, levelStartX, levelStartY, 0, 0);
-    unsigned int total_tiles = TIFFNumberOfTiles(_tiff);
-    if (tileNr < total_tiles) {
-      unsigned long long* tbc = NULL;
-      TIFFGetField(_tiff, TIFFTAG_TILEBYTECOUNTS, &tbc);
-      unsigned long long k = tbc[tileNr];
-      if (k == 0) {
-        return -1;
-      }
-      unsigned int count = 0;
-      unsigned char* jpt;
-      if (TIFFGetField(_tiff, TIFFTAG_JPEGTABLES, &count, &jpt) != 0) {
-        if (count > 4) {
-          k = k + count;
-          k -= 2; /* don't use EOI of header or SOI of tile */
-        }
-      }
-      return k;
+    const LevelIndex& index = (*_levelIndex)[level];
+    if (levelStartX < 0 || levelStartY < 0 || levelStartX >= static_cast<long long>(_levelDimensions[level][0])) {
+      return -1;
     }
-    else {
+    unsigned long long tileNr = (levelStartY / _tileSizesPerLevel[level][1]) * index.numberOfTilesX + levelStartX / _tileSizesPerLevel[level][0];
+    if (tileNr >= index.tileByteCounts.size() || index.tileByteCounts[tileNr] == 0) {
       return -1;
     }
+    // Size including the JPEG tables if present
+    long long size = index.tileByteCounts[tileNr];
+    if (!index.jpegTables.empty()) {
+      size += index.jpegTables.size() - 2;
+    }
+    return size;
   }
   else {
     return -1;
@@ -335,78 +635,294 @@ long long TIFFImage::getEncodedTileSize(const long long& startX, const long long
 }
 
 unsigned char* TIFFImage::readEncodedDataFromImage(const long long& startX, const long long& startY, const unsigned int& level) {
-  if (_tiff) {
-    unsigned int codec = 0;
-    TIFFGetField(_tiff, TIFFTAG_COMPRESSION, &codec);
-    if (codec == 7) { // New style JPEG
-      long long levelStartX = std::floor(startX / getLevelDownsample(level) + 0.5);
-      long long levelStartY = std::floor(startY / getLevelDownsample(level) + 0.5);
-      TIFFSetDirectory(_tiff, level);
-      unsigned int tileNr = TIFFComputeTile(_tiff, levelStartX, levelStartY, 0, 0);
-      if (tileNr < TIFFNumberOfTiles(_tiff)) {
-        unsigned char table_end[2];
-        unsigned int count = 0;
-        unsigned char* jpt;
-        float* xfloatp;
-        unsigned int endOfBuffer = 0;
-        unsigned long long datasize = this->getEncodedTileSize(startX, startY, level);
-        if (datasize < 0) {
-          return NULL;
-        }
-        unsigned long long bufferoffset = 0;
-        unsigned char* buffer = new unsigned char[datasize];
-
-        if (TIFFGetField(_tiff, TIFFTAG_JPEGTABLES, &count, &jpt) != 0) {
-          if (count > 4) {
-            int retTIFFReadRawTile;
-            /* Ignore EOI marker of JpegTables */
-            _TIFFmemcpy(buffer, jpt, count - 2);
-            bufferoffset += count - 2;
-            /* Store last 2 bytes of the JpegTables */
-            table_end[0] = buffer[bufferoffset - 2];
-            table_end[1] = buffer[bufferoffset - 1];
-            endOfBuffer = bufferoffset;
-            bufferoffset -= 2;
-            retTIFFReadRawTile = TIFFReadRawTile(
-              _tiff,
-              tileNr,
-              (void*)&(((unsigned char*)buffer)[bufferoffset]),
-              -1);
-            bufferoffset += retTIFFReadRawTile;
-            /* Overwrite SOI marker of image scan with previously */
-            /* saved end of JpegTables */
-            buffer[endOfBuffer - 2] = table_end[0];
-            buffer[endOfBuffer - 1] = table_end[1];
-          }
-        }
-        else {
-          TIFFReadRawTile(
-            _tiff,
-            tileNr,
-            (void*)&(((unsigned char*)buffer)[bufferoffset]),
-            -1);
-        }
-        return buffer;
+  long long datasize = getEncodedTileSize(startX, startY, level);
+  boost::shared_lock<boost::shared_mutex> l(*_openCloseMutex);
+  if (_tiff && level < this->_numberOfLevels && datasize > 0 && (*_levelIndex)[level].codec == COMPRESSION_JPEG) {
+    long long levelStartX = std::floor(startX / getLevelDownsample(level) + 0.5);
+    long long levelStartY = std::floor(startY / getLevelDownsample(level) + 0.5);
+    unsigned long long tileNr = (levelStartY / _tileSizesPerLevel[level][1]) * (*_levelIndex)[level].numberOfTilesX + levelStartX / _tileSizesPerLevel[level][0];
+    std::vector<unsigned char> encoded;
+    if (readEncodedTile(level, tileNr, encoded)) {
+      unsigned char* buffer = new unsigned char[datasize];
+      std::fill(buffer, buffer + datasize, 0);
+      std::copy(encoded.begin(), encoded.begin() + std::min<unsigned long long>(encoded.size(), datasize), buffer);
+      return buffer;
+    }
+  }
+  return NULL;
+}
+
+namespace {
+
+  DecodeCodec decodeCodecOf(const unsigned int& compression) {
+    switch (compression) {
+    case COMPRESSION_NONE:
+      return RawDecoding;
+    case COMPRESSION_DEFLATE:
+    case COMPRESSION_ADOBE_DEFLATE:
+      return DeflateDecoding;
+    case COMPRESSION_LZW:
+      return LZWDecoding;
+    case COMPRESSION_JPEG:
+      return JPEGDecoding;
+    case 33005:
+      return JPEG2000Decoding;
+    default:
+      return OtherDecoding;
+    }
+  }
+
+  // libjpeg calls exit() on errors by default, jump back to the decoder instead
+  struct JPEGErrorManager {
+    jpeg_error_mgr manager;
+    jmp_buf jumpBuffer;
+  };
+
+  void jpegErrorExit(j_common_ptr info) {
+    longjmp(reinterpret_cast<JPEGErrorManager*>(info->err)->jumpBuffer, 1);
+  }
+
+  void jpegOutputMessage(j_common_ptr info) {
+  }
+
+  // Decodes an abbreviated TIFF JPEG stream: the tables of the level are read first as a tables-only
+  // datastream, the tile itself is then read with those tables, so the two never have to be concatenated
+  bool decodeJPEGTile(const std::vector<unsigned char>& tables, const unsigned char* encoded, const unsigned long long& encodedSize,
+    unsigned char* tile, const unsigned int& tileW, const unsigned int& tileH, const unsigned int& nrSamples, const unsigned int& photometric) {
+    jpeg_decompress_struct info;
+    JPEGErrorManager error;
+    info.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = jpegErrorExit;
+    error.manager.output_message = jpegOutputMessage;
+    if (setjmp(error.jumpBuffer)) {
+      jpeg_destroy_decompress(&info);
+      return false;
+    }
+    jpeg_create_decompress(&info);
+    if (!tables.empty()) {
+      jpeg_mem_src(&info, const_cast<unsigned char*>(tables.data()), tables.size());
+      if (jpeg_read_header(&info, FALSE) != JPEG_HEADER_TABLES_ONLY) {
+        jpeg_destroy_decompress(&info);
+        return false;
       }
-      else {
-        return NULL;
+    }
+    jpeg_mem_src(&info, const_cast<unsigned char*>(encoded), encodedSize);
+    if (jpeg_read_header(&info, TRUE) != JPEG_HEADER_OK) {
+      jpeg_destroy_decompress(&info);
+      return false;
+    }
+    // TIFF JPEG streams carry no JFIF or Adobe marker, so the color space comes from the photometric tag
+    if (photometric == PHOTOMETRIC_YCBCR) {
+      info.jpeg_color_space = JCS_YCbCr;
+      info.out_color_space = JCS_RGB;
+    }
+    else if (photometric == PHOTOMETRIC_RGB) {
+      info.jpeg_color_space = JCS_RGB;
+      info.out_color_space = JCS_RGB;
+    }
+    jpeg_start_decompress(&info);
+    if (info.output_components != static_cast<int>(nrSamples) || info.output_width != tileW || info.output_height > tileH) {
+      jpeg_destroy_decompress(&info);
+      return false;
+    }
+    while (info.output_scanline < info.output_height) {
+      JSAMPROW row = tile + info.output_scanline * tileW * nrSamples;
+      jpeg_read_scanlines(&info, &row, 1);
+    }
+    jpeg_finish_decompress(&info);
+    jpeg_destroy_decompress(&info);
+    return true;
+  }
+
+  // Undoes TIFF predictor 2, every sample was stored as the difference with the same sample of the previous pixel
+  template <typename T> void undoHorizontalDifferencing(T* tile, const unsigned int& tileW, const unsigned int& tileH, const unsigned int& nrSamples) {
+    for (unsigned int y = 0; y < tileH; ++y) {
+      T* row = tile + y * tileW * nrSamples;
+      for (unsigned int i = nrSamples; i < tileW * nrSamples; ++i) {
+        row[i] = static_cast<T>(row[i] + row[i - nrSamples]);
       }
     }
-    else {
-      return NULL;
+  }
+
+}
+
+template <typename T> bool TIFFImage::decodeTileDirect(T* tile, const unsigned long long& tileX, const unsigned long long& tileY, const unsigned int& level, unsigned int nrSamples) {
+  const LevelIndex& index = (*_levelIndex)[level];
+  const unsigned int tileW = _tileSizesPerLevel[level][0], tileH = _tileSizesPerLevel[level][1];
+  const unsigned long long tileByteSize = tileW * tileH * nrSamples * sizeof(T);
+  const unsigned long long tileNr = tileY * index.numberOfTilesX + tileX;
+  if (!_source || tileNr >= index.tileOffsets.size()) {
+    return false;
+  }
+  if (index.tileByteCounts[tileNr] == 0) {
+    // Sparse tile, nothing was written so it stays empty
+    return true;
+  }
+  const bool multiByteSamples = sizeof(T) > 1;
+  if (index.codec == COMPRESSION_NONE && !(_byteSwapped && multiByteSamples)) {
+    if (_source->read(index.tileOffsets[tileNr], std::min(index.tileByteCounts[tileNr], tileByteSize), tile) == 0) {
+      return false;
+    }
+    _statistics->recordBytesRead(std::min(index.tileByteCounts[tileNr], tileByteSize));
+  }
+  else if ((index.codec == COMPRESSION_DEFLATE || index.codec == COMPRESSION_ADOBE_DEFLATE) && !(_byteSwapped && multiByteSamples) &&
+    (index.predictor == PREDICTOR_NONE || (index.predictor == PREDICTOR_HORIZONTAL && _dataType != Float))) {
+    std::shared_ptr<std::vector<unsigned char> > buffer;
+    const unsigned char* encoded = encodedTileData(level, tileNr, buffer);
+    if (!encoded) {
+      return false;
+    }
+    ImageStatisticsCollector::DecodeTimer timer(_statistics.get(), DeflateDecoding);
+    uLongf decodedSize = tileByteSize;
+    if (uncompress(reinterpret_cast<Bytef*>(tile), &decodedSize, encoded, index.tileByteCounts[tileNr]) != Z_OK) {
+      return false;
+    }
+    if (index.predictor == PREDICTOR_HORIZONTAL) {
+      undoHorizontalDifferencing(tile, tileW, tileH, nrSamples);
     }
   }
+  else if (index.codec == COMPRESSION_JPEG && !multiByteSamples) {
+    std::shared_ptr<std::vector<unsigned char> > buffer;
+    const unsigned char* encoded = encodedTileData(level, tileNr, buffer);
+    if (!encoded) {
+      return false;
+    }
+    ImageStatisticsCollector::DecodeTimer timer(_statistics.get(), JPEGDecoding);
+    if (!decodeJPEGTile(index.jpegTables, encoded, index.tileByteCounts[tileNr], reinterpret_cast<unsigned char*>(tile), tileW, tileH, nrSamples, index.photometric)) {
+      return false;
+    }
+  }
+  else if (index.codec == 33005) {
+    std::shared_ptr<std::vector<unsigned char> > buffer;
+    const unsigned char* encoded = encodedTileData(level, tileNr, buffer);
+    if (!encoded) {
+      return false;
+    }
+    // Reader threads decode tiles concurrently, so a tile does not start threads of its own
+    ImageStatisticsCollector::DecodeTimer timer(_statistics.get(), JPEG2000Decoding);
+    JPEG2000Codec::DecodeParameters parameters;
+    parameters.threads = 1;
+    unsigned int decodedWidth = 0, decodedHeight = 0;
+    return _jp2000->decode(encoded, static_cast<unsigned int>(index.tileByteCounts[tileNr]), reinterpret_cast<unsigned char*>(tile), tileByteSize,
+      parameters, decodedWidth, decodedHeight) && decodedWidth == tileW && decodedHeight == tileH;
+  }
   else {
-    return NULL;
+    // LZW and anything unusual are left to libtiff
+    return false;
   }
+  if (_colorType == pathology::RGBA) {
+    core::swapRedAndBlue(tile, dataTypeOf<T>(), tileW * tileH);
+  }
+  return true;
 }
 
-template <typename T> T* TIFFImage::FillRequestedRegionFromTIFF(const long long& startX, const long long& startY, const unsigned long long& width,
-  const unsigned long long& height, const unsigned int& level, unsigned int nrSamples)
-{
+template <typename T> void TIFFImage::decodeTile(TIFF* handle, T* tile, const long long& tileX, const long long& tileY, const unsigned int& level, unsigned int nrSamples) {
+  unsigned int tileW = _tileSizesPerLevel[level][0], tileH = _tileSizesPerLevel[level][1];
+  const LevelIndex& index = (*_levelIndex)[level];
+  // Handles stay on the directory of their last read, only switch when needed
+  if (TIFFCurrentDirectory(handle) != index.directory) {
+    TIFFSetDirectory(handle, index.directory);
+  }
+  unsigned int codec = index.codec;
+  if (codec == COMPRESSION_JPEG && index.photometric == PHOTOMETRIC_YCBCR) {
+    TIFFSetField(handle, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+  }
+  // libtiff reads and decodes in one go, both are counted as decoding
+  const unsigned long long tileNr = (tileY / tileH) * index.numberOfTilesX + tileX / tileW;
+  if (tileNr < index.tileByteCounts.size()) {
+    _statistics->recordBytesRead(index.tileByteCounts[tileNr]);
+  }
+  ImageStatisticsCollector::DecodeTimer timer(_statistics.get(), decodeCodecOf(codec));
+  if (codec == 33005) {
+    unsigned int byteSize = tileW * tileH * nrSamples * sizeof(T);
+    unsigned int rawSize = TIFFReadRawTile(handle, TIFFComputeTile(handle, tileX, tileY, 0, 0), tile, byteSize);
+    JPEG2000Codec::DecodeParameters parameters;
+    parameters.threads = 1;
+    unsigned int decodedWidth = 0, decodedHeight = 0;
+    if (!_jp2000->decode((unsigned char*)tile, rawSize, (unsigned char*)tile, byteSize, parameters, decodedWidth, decodedHeight)) {
+      std::fill((unsigned char*)tile, (unsigned char*)tile + byteSize, 0);
+    }
+  }
+  else {
+    TIFFReadTile(handle, tile, tileX, tileY, 0, 0);
+    if (_colorType == pathology::RGBA) {
+      core::swapRedAndBlue(tile, dataTypeOf<T>(), tileW * tileH);
+    }
+  }
+}
+
+template <typename T> std::shared_ptr<T> TIFFImage::getDecodedTile(const unsigned int& level, const unsigned long long& tileX, const unsigned long long& tileY, unsigned int nrSamples) {
+  unsigned int tileW = _tileSizesPerLevel[level][0], tileH = _tileSizesPerLevel[level][1];
+  const unsigned long long tileByteSize = tileW * tileH * nrSamples * sizeof(T);
+  std::shared_ptr<TileCache<T> > cache = std::static_pointer_cast<TileCache<T> >(_cache);
+  const TileKey key = makeTileKey(level, 0, tileX, tileY);
+  unsigned int cachedTileSize = 0;
+  std::shared_ptr<T> tile;
+  if (cache->get(key, tile, cachedTileSize)) {
+    return tile;
+  }
+
+  // Another thread might already be decoding this tile, in that case wait for it to end up in the cache
+  TilesInFlight& inFlight = *_tilesInFlight;
+  boost::unique_lock<boost::mutex> inFlightLock(inFlight.mutex);
+  if (inFlight.keys.find(key) != inFlight.keys.end()) {
+    ImageStatisticsCollector::Stopwatch waiting;
+    while (inFlight.keys.find(key) != inFlight.keys.end()) {
+      inFlight.decoded.wait(inFlightLock);
+    }
+    _statistics->recordLockWait(waiting.elapsedMicroseconds());
+    // Only look again after waiting, so a tile that is decoded here counts as a single miss
+    if (cache->get(key, tile, cachedTileSize)) {
+      return tile;
+    }
+  }
+  // Waiting threads pick up the result from the cache, so only coalesce if it fits. The waiting threads
+  // are woken once the tile is cached, or decode it themselves if this decode throws.
+  std::unique_ptr<TilesInFlight::Entry> decoding;
+  if (tileByteSize <= cache->maxCacheSize()) {
+    inFlight.keys.insert(key);
+    decoding.reset(new TilesInFlight::Entry(inFlight, key));
+  }
+  inFlightLock.unlock();
+
+  tile.reset(new T[tileW * tileH * nrSamples], std::default_delete<T[]>());
+  std::fill(tile.get(), tile.get() + tileW * tileH * nrSamples, static_cast<T>(0.0));
+  if (!decodeTileDirect(tile.get(), tileX, tileY, level, nrSamples)) {
+    ReaderHandlePool<TIFF>::Lease handle(*_handles, _statistics.get());
+    decodeTile(handle.get(), tile.get(), tileX * tileW, tileY * tileH, level, nrSamples);
+  }
+  cache->set(key, tile, tileByteSize);
+  return tile;
+}
+
+std::shared_ptr<void> TIFFImage::readNativeTile(const unsigned int& level, const unsigned long long& tileX, const unsigned long long& tileY) {
   boost::shared_lock<boost::shared_mutex> l(*_openCloseMutex);
-  T* temp = new T[width * height * nrSamples];
-  std::fill(temp, temp + width * height * nrSamples, static_cast<T>(0));
+  if (!_isValid || level >= _numberOfLevels || tileX * _tileSizesPerLevel[level][0] >= _levelDimensions[level][0] ||
+      tileY * _tileSizesPerLevel[level][1] >= _levelDimensions[level][1]) {
+    return std::shared_ptr<void>();
+  }
+  if (getDataType() == UInt32) {
+    return getDecodedTile<unsigned int>(level, tileX, tileY, _samplesPerPixel);
+  }
+  else if (getDataType() == UInt16) {
+    return getDecodedTile<unsigned short>(level, tileX, tileY, _samplesPerPixel);
+  }
+  else if (getDataType() == Float) {
+    return getDecodedTile<float>(level, tileX, tileY, _samplesPerPixel);
+  }
+  else if (getDataType() == UChar) {
+    return getDecodedTile<unsigned char>(level, tileX, tileY, _samplesPerPixel);
+  }
+  return std::shared_ptr<void>();
+}
+
+template <typename T> void TIFFImage::FillRequestedRegionFromTIFF(const long long& startX, const long long& startY, const unsigned long long& width,
+  const unsigned long long& height, const unsigned int& level, unsigned int nrSamples, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride)
+{
+  boost::shared_lock<boost::shared_mutex> l(*_openCloseMutex, boost::defer_lock);
+  _statistics->lock(l);
+  unsigned char* destination = static_cast<unsigned char*>(data);
+  const unsigned long long destinationRowBytes = rowStride * bytesPerSample(dataType);
   unsigned int tileW = _tileSizesPerLevel[level][0], tileH = _tileSizesPerLevel[level][1], levelH = _levelDimensions[level][1], levelW = _levelDimensions[level][0];
 
   long long levelStartX = std::floor(startX / getLevelDownsample(level) + 0.5);
@@ -416,6 +932,34 @@ template <typename T> T* TIFFImage::FillRequestedRegionFromTIFF(const long long&
   long long finalX = levelStartX + width >= levelW ? levelW : levelStartX + width;
   long long finalY = levelStartY + height >= levelH ? levelH : levelStartY + height;
 
+  // Only the parts of the region outside of the image are not covered by tiles
+  if (levelStartX < 0 || levelStartY < 0 || levelStartX + width > levelW || levelStartY + height > levelH) {
+    for (unsigned long long y = 0; y < height; ++y) {
+      fillSamples(destination + y * destinationRowBytes, dataType, width * nrSamples, 0);
+    }
+  }
+
+  auto copyTileToRegion = [&](const T* tile, long long ix, long long iy) {
+    long long ixx = (ix - levelStartX);
+    long long iyy = (iy - levelStartY);
+    long long lxw = levelStartX + width;
+    long long ixw = ixx + tileW;
+    long long rowLength = ixw > static_cast<long long>(width) ? (tileW - (ixw - width)) * nrSamples : tileW * nrSamples;
+    long long tileDeltaX = 0;
+    if (ixx < 0) {
+      rowLength += ixx * nrSamples;
+      tileDeltaX -= ixx * nrSamples;
+      ixx = 0;
+    }
+    for (unsigned int ty = 0; ty < tileH; ++ty) {
+      if ((iyy + ty >= 0) && (ixx >= 0) && (iyy + ty < static_cast<long long>(height)) && lxw > 0) {
+        long long tids = (ty * tileW) * nrSamples;
+        unsigned char* row = destination + (ty + iyy) * destinationRowBytes + ixx * nrSamples * bytesPerSample(dataType);
+        convertSamples(tile + tids + tileDeltaX, row, dataType, rowLength);
+      }
+    }
+  };
+
   for (long long iy = startTileY; iy < finalY; iy += tileH) {
     if (iy < 0) {
       continue;
@@ -425,78 +969,8 @@ template <typename T> T* TIFFImage::FillRequestedRegionFromTIFF(const long long&
         continue;
       }
 
-      std::stringstream k;
-      k << ix * getLevelDownsample(level) << "-" << iy * getLevelDownsample(level) << "-" << level;
-      bool deleteTile = false;
-      unsigned int cachedTileSize = 0;
-      T* tile = NULL;
-      _cacheMutex->lock();
-      std::static_pointer_cast<TileCache<T>>(_cache)->get(k.str(), tile, cachedTileSize);
-      _cacheMutex->unlock();
-      if (!tile) {
-        tile = new T[tileW * tileH * getSamplesPerPixel()];
-        std::fill(tile, tile + tileW * tileH * getSamplesPerPixel(), static_cast<T>(0.0));
-        _cacheMutex->lock();
-        TIFFSetDirectory(_tiff, level);
-        unsigned int codec = 0;
-        TIFFGetField(_tiff, TIFFTAG_COMPRESSION, &codec);
-        unsigned int ycbcr = 0;
-        TIFFGetField(_tiff, TIFFTAG_PHOTOMETRIC, &ycbcr);
-        if (codec == 33005) {
-          if (!_jp2000) {
-            _jp2000 = new JPEG2000Codec();
-          }
-          unsigned int byteSize = tileW * tileH * getSamplesPerPixel() * sizeof(T);
-          unsigned int rawSize = TIFFReadRawTile(_tiff, TIFFComputeTile(_tiff, ix, iy, 0, 0), tile, byteSize);
-          _jp2000->decode((unsigned char*)tile, rawSize, byteSize);
-        }
-        else {
-          if (codec == COMPRESSION_JPEG && ycbcr == PHOTOMETRIC_YCBCR) {
-            TIFFSetField(_tiff, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
-          }
-          TIFFReadTile(_tiff, tile, ix, iy, 0, 0);
-          if (_colorType == pathology::RGBA) {
-            for (unsigned int pos = 0; pos < tileW * tileH * nrSamples; pos += 4) {
-              T b = tile[pos + 0];
-              T g = tile[pos + 1];
-              T r = tile[pos + 2];
-              T a = tile[pos + 3];
-              tile[pos + 0] = r;
-              tile[pos + 1] = g;
-              tile[pos + 2] = b;
-              tile[pos + 3] = a;
-            }
-          }
-        }
-        if (std::static_pointer_cast<TileCache<T>>(_cache)->set(k.str(), tile, tileW * tileH * getSamplesPerPixel() * sizeof(T))) {
-          deleteTile = true;
-        }
-        _cacheMutex->unlock();
-      }
-
-      long long ixx = (ix - levelStartX);
-      long long iyy = (iy - levelStartY);
-      long long lyh = levelStartY + height;
-      long long lxw = levelStartX + width;
-      long long ixw = ixx + tileW;
-      long long rowLength = ixw > static_cast<long long>(width) ? (tileW - (ixw - width)) * nrSamples : tileW * nrSamples;
-      long long tileDeltaX = 0;
-      if (ixx < 0) {
-        rowLength += ixx * nrSamples;
-        tileDeltaX -= ixx * nrSamples;
-        ixx = 0;
-      }
-      for (unsigned int ty = 0; ty < tileH; ++ty) {
-        if ((iyy + ty >= 0) && (ixx >= 0) && (iyy + ty < static_cast<long long>(height)) && lxw > 0) {
-          long long idx = (ty + iyy) * width * nrSamples + ixx * nrSamples;
-          long long tids = (ty * tileW) * nrSamples;
-          std::copy(tile + tids + tileDeltaX, tile + tids + rowLength + tileDeltaX, temp + idx);
-        }
-      }
-      if (deleteTile) {
-        delete[] tile;
-      }
+      std::shared_ptr<T> tile = getDecodedTile<T>(level, ix / tileW, iy / tileH, nrSamples);
+      copyTileToRegion(tile.get(), ix, iy);
     }
   }
-  return temp;
-}
\ No newline at end of file
+}
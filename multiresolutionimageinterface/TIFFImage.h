@@ -8,6 +8,7 @@ struct tiff;
 typedef struct tiff TIFF;
 
 class JPEG2000Codec;
+template <typename H> class ReaderHandlePool;
 
 class MULTIRESOLUTIONIMAGEINTERFACE_EXPORT TIFFImage : public MultiResolutionImage {
 
@@ -17,27 +18,98 @@ public:
   ~TIFFImage();  
   bool initializeType(const std::string& imagePath);
 
+  //! Reads only the directory headers: dimensions, spacing and pixel type are available afterwards,
+  //! but the tile index, decoders and caches are not set up, so no pixel data can be read
+  bool initializeMetadata(const std::string& imagePath);
+
+  //! Returns a second image on the same file for use by another thread. It shares the tile caches, the
+  //! tile index and the pool of libtiff handles with this image, but has its own codecs, z-plane and
+  //! statistics. Either image can be deleted first; returns NULL if this image is not valid.
+  ImageSource* clone();
+
   double getMinValue(int channel = -1);
   double getMaxValue(int channel = -1);
   long long getEncodedTileSize(const long long& startX, const long long& startY, const unsigned int& level);
   unsigned char* readEncodedDataFromImage(const long long& startX, const long long& startY, const unsigned int& level);
+  const std::vector<unsigned int> getLevelTileSize(const unsigned int& level) const;
+
+  //! The read handles are libtiff handles, shared with the clones of this image
+  unsigned int getMaxNumberOfReadHandles() const;
+  void setMaxNumberOfReadHandles(const unsigned int& maxNumberOfReadHandles);
+  double getReadHandleIdleTimeout() const;
+  void setReadHandleIdleTimeout(const double& seconds);
 
 protected :
   void cleanup();
   
-  void* readDataFromImage(const long long& startX, const long long& startY, const unsigned long long& width, 
-    const unsigned long long& height, const unsigned int& level);
+  void readDataIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride);
+
+  std::shared_ptr<void> readNativeTile(const unsigned int& level, const unsigned long long& tileX, const unsigned long long& tileY);
+
+  //! JPEG2000 tiles of level 0 are decoded at reduced resolution straight from their codestream
+  bool readScaledDataIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& scaleShift, void* data);
+
+  template <typename T> void FillRequestedRegionFromTIFF(const  long long& startX, const long long& startY, const unsigned long long& width, 
+    const unsigned long long& height, const unsigned int& level, unsigned int nrSamples, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride);
+
+  //! Returns tile (tileX, tileY) of the level from the cache, or decodes it; the caller holds _openCloseMutex
+  template <typename T> std::shared_ptr<T> getDecodedTile(const unsigned int& level, const unsigned long long& tileX, const unsigned long long& tileY, unsigned int nrSamples);
 
-  template <typename T> T* FillRequestedRegionFromTIFF(const  long long& startX, const long long& startY, const unsigned long long& width, 
-    const unsigned long long& height, const unsigned int& level, unsigned int nrSamples);
+  //! Decodes a tile from the level index with positional reads and a direct codec call, returns false
+  //! if the codec or layout is not supported that way, in which case decodeTile should be used
+  template <typename T> bool decodeTileDirect(T* tile, const unsigned long long& tileX, const unsigned long long& tileY, const unsigned int& level, unsigned int nrSamples);
+
+  //! Reads the encoded tile, prefixed with the JPEG tables of the level if there are any
+  bool readEncodedTile(const unsigned int& level, const unsigned long long& tileNr, std::vector<unsigned char>& encoded) const;
+
+  //! Returns the encoded bytes of a tile. For a memory-mapped file this points into the mapping and
+  //! buffer is left untouched; otherwise the bytes come from the encoded tile cache or are read into
+  //! buffer (which also keeps cached bytes alive) and added to the cache. Returns NULL on failure.
+  const unsigned char* encodedTileData(const unsigned int& level, const unsigned long long& tileNr, std::shared_ptr<std::vector<unsigned char> >& buffer) const;
+
+  template <typename T> void decodeTile(TIFF* handle, T* tile, const long long& tileX, const long long& tileY, const unsigned int& level, unsigned int nrSamples);
+
+  static TIFF* openHandle(const std::string& imagePath, const char* mode);
 
   TIFF* _tiff;
   std::vector<std::vector<unsigned int> > _tileSizesPerLevel;
 
+  //! Everything needed to fetch and decode the tiles of a level, gathered once in initializeType so
+  //! reads never have to switch the directory of a libtiff handle
+  struct LevelIndex {
+    unsigned int directory;
+    unsigned int codec;
+    unsigned int photometric;
+    unsigned int predictor;
+    unsigned long long numberOfTilesX;
+    std::vector<unsigned long long> tileOffsets;
+    std::vector<unsigned long long> tileByteCounts;
+    std::vector<unsigned char> jpegTables;
+  };
+  //! Built once when the file is opened and shared read-only with all clones
+  std::shared_ptr<const std::vector<LevelIndex> > _levelIndex;
+  bool _byteSwapped;
+  bool _metadataOnly;
+
   std::vector<double> _minValues;
   std::vector<double> _maxValues;
 
   JPEG2000Codec* _jp2000;
+  //! Number of resolution levels in the JPEG2000 tiles of level 0, 0 if they are not JPEG2000
+  unsigned int _jp2000Resolutions;
+
+  //! Pool of libtiff handles, _tiff is the first one; a handle is owned by a single thread while decoding.
+  //! The pool settings are kept separately so they can be set before the file is opened.
+  std::shared_ptr<ReaderHandlePool<TIFF> > _handles;
+  unsigned int _maxNumberOfHandles;
+  double _handleIdleTimeout;
+
+  //! Tiles currently being decoded by this image or its clones; other threads requesting them wait
+  //! instead of decoding them again
+  struct TilesInFlight;
+  std::shared_ptr<TilesInFlight> _tilesInFlight;
 
 };
 
@@ -21,9 +21,15 @@ MultiResolutionImage* TIFFImageFactory::readImage(const std::string& fileName) c
   }
 }
 
+bool TIFFImageFactory::readImageMetadata(const std::string& fileName, ImageMetadata& metadata) const {
+  TIFFImage img;
+  if (!img.initializeMetadata(fileName)) {
+    return false;
+  }
+  copyImageMetadata(img, metadata);
+  return true;
+}
+
 bool TIFFImageFactory::canReadImage(const std::string& fileName) const {
-  TIFFImage* img = new TIFFImage();
-  bool canOpen = img->initialize(fileName);
-  delete img;
-  return canOpen;
+  return hasTIFFSignature(readFileHeader(fileName));
 }
\ No newline at end of file
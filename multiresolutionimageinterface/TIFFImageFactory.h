@@ -12,6 +12,7 @@ private:
   static const TIFFImageFactory registerThis;
   MultiResolutionImage* readImage(const std::string& fileName) const;
   bool canReadImage(const std::string& fileName) const;
+  bool readImageMetadata(const std::string& fileName, ImageMetadata& metadata) const;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,64 @@
+#include "TaskExecutor.h"
+#include <boost/thread.hpp>
+#include <algorithm>
+
+TaskExecutor::TaskExecutor(const unsigned int& numberOfThreads) :
+  _mutex(new boost::mutex()),
+  _taskAvailable(new boost::condition_variable()),
+  _threads(new boost::thread_group()),
+  _numberOfThreads(numberOfThreads > 0 ? numberOfThreads : std::max(boost::thread::hardware_concurrency(), 1u)),
+  _stopping(false)
+{
+  for (unsigned int i = 0; i < _numberOfThreads; ++i) {
+    _threads->create_thread(boost::bind(&TaskExecutor::workerLoop, this));
+  }
+}
+
+TaskExecutor::~TaskExecutor() {
+  {
+    boost::lock_guard<boost::mutex> l(*_mutex);
+    _stopping = true;
+  }
+  _taskAvailable->notify_all();
+  _threads->join_all();
+}
+
+void TaskExecutor::post(const std::function<void()>& task, const int& priority) {
+  {
+    boost::lock_guard<boost::mutex> l(*_mutex);
+    _tasks[priority].push_back(task);
+  }
+  _taskAvailable->notify_one();
+}
+
+unsigned int TaskExecutor::getNumberOfThreads() const {
+  return _numberOfThreads;
+}
+
+void TaskExecutor::workerLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      boost::unique_lock<boost::mutex> l(*_mutex);
+      while (_tasks.empty() && !_stopping) {
+        _taskAvailable->wait(l);
+      }
+      if (_tasks.empty()) {
+        return;
+      }
+      std::map<int, std::deque<std::function<void()> > >::iterator highest = --_tasks.end();
+      task = highest->second.front();
+      highest->second.pop_front();
+      if (highest->second.empty()) {
+        _tasks.erase(highest);
+      }
+    }
+    try {
+      task();
+    }
+    catch (...) {
+      // Tasks report their own errors (see post), this only keeps an escaped exception from
+      // terminating the worker thread
+    }
+  }
+}
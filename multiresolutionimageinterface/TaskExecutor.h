@@ -0,0 +1,61 @@
+#ifndef _TaskExecutor
+#define _TaskExecutor
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include "multiresolutionimageinterface_export.h"
+
+namespace boost {
+  class mutex;
+  class condition_variable;
+  class thread_group;
+}
+
+//! Shared flag with which the owner of an asynchronous task can cancel it before it starts; copies of
+//! a token refer to the same flag
+class CancellationToken {
+public:
+  CancellationToken() : _cancelled(std::make_shared<std::atomic<bool> >(false)) {}
+
+  void cancel() { *_cancelled = true; }
+  bool isCancelled() const { return *_cancelled; }
+
+private:
+  std::shared_ptr<std::atomic<bool> > _cancelled;
+};
+
+//! Small pool of worker threads which executes posted tasks, highest priority first and in the order
+//! they were posted within a priority. Used by MultiResolutionImage to fill batched and asynchronous
+//! region reads in parallel.
+class MULTIRESOLUTIONIMAGEINTERFACE_EXPORT TaskExecutor {
+
+public:
+  //! Creates the worker threads, 0 means one thread per hardware thread
+  TaskExecutor(const unsigned int& numberOfThreads = 0);
+
+  //! Waits for the tasks that are already queued and stops the workers
+  ~TaskExecutor();
+
+  //! Queues task. Tasks have to hand their errors to whoever waits for them (e.g. through a promise);
+  //! an exception that escapes a task is dropped.
+  void post(const std::function<void()>& task, const int& priority = 0);
+
+  unsigned int getNumberOfThreads() const;
+
+private:
+  TaskExecutor(const TaskExecutor& other);
+  TaskExecutor& operator=(const TaskExecutor& other);
+
+  void workerLoop();
+
+  std::map<int, std::deque<std::function<void()> > > _tasks;
+  std::unique_ptr<boost::mutex> _mutex;
+  std::unique_ptr<boost::condition_variable> _taskAvailable;
+  std::unique_ptr<boost::thread_group> _threads;
+  unsigned int _numberOfThreads;
+  bool _stopping;
+};
+
+#endif
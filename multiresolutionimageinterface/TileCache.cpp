@@ -1 +1,380 @@
-﻿#include "TileCache.h"
\ No newline at end of file
+﻿#include "TileCache.h"
+#include "TileCacheManager.h"
+#include <boost/thread.hpp>
+#include <algorithm>
+
+namespace {
+  thread_local CacheAccessHint currentAccessHint = NormalCacheAccess;
+}
+
+// Each shard stores its entries in a slab and an open-addressing table (linear probing) maps keys to
+// slab positions. The replacement policy tracks the unpinned entries by their slab position.
+struct TileCacheBase::Shard {
+  struct Entry {
+    TileKey key;
+    std::shared_ptr<void> value;
+    unsigned int size;
+    bool pinned;
+  };
+
+  Shard(std::unique_ptr<TileCachePolicy> replacementPolicy) : policy(std::move(replacementPolicy)), count(0), unpinnedCount(0), byteSize(0) {}
+
+  static unsigned long long hash(TileKey k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+  }
+
+  // Returns the table position of the key or -1
+  int find(const TileKey& k) const {
+    if (table.empty()) {
+      return -1;
+    }
+    size_t mask = table.size() - 1;
+    size_t pos = hash(k) & mask;
+    while (table[pos] != -1) {
+      if (entries[table[pos]].key == k) {
+        return static_cast<int>(pos);
+      }
+      pos = (pos + 1) & mask;
+    }
+    return -1;
+  }
+
+  void placeInTable(int entryIndex) {
+    size_t mask = table.size() - 1;
+    size_t pos = hash(entries[entryIndex].key) & mask;
+    while (table[pos] != -1) {
+      pos = (pos + 1) & mask;
+    }
+    table[pos] = entryIndex;
+  }
+
+  void grow() {
+    std::vector<int> oldTable;
+    oldTable.swap(table);
+    table.assign(oldTable.empty() ? 64 : oldTable.size() * 2, -1);
+    for (std::vector<int>::const_iterator it = oldTable.begin(); it != oldTable.end(); ++it) {
+      if (*it != -1) {
+        placeInTable(*it);
+      }
+    }
+  }
+
+  int insert(const TileKey& k, const std::shared_ptr<void>& value, const unsigned int& size, bool pinned, const CacheAccessHint& hint) {
+    if ((count + 1) * 4 > table.size() * 3) {
+      grow();
+    }
+    int entryIndex;
+    if (!freeEntries.empty()) {
+      entryIndex = freeEntries.back();
+      freeEntries.pop_back();
+    }
+    else {
+      entryIndex = static_cast<int>(entries.size());
+      entries.push_back(Entry());
+    }
+    Entry& entry = entries[entryIndex];
+    entry.key = k;
+    entry.value = value;
+    entry.size = size;
+    entry.pinned = pinned;
+    placeInTable(entryIndex);
+    if (!pinned) {
+      policy->inserted(entryIndex, k, size, hint);
+      ++unpinnedCount;
+    }
+    ++count;
+    byteSize += size;
+    return entryIndex;
+  }
+
+  // Removes the entry at the given table position, which the policy no longer tracks, shifting back
+  // subsequent entries of the probe sequence so no tombstones are needed
+  void erase(int tablePos, EvictedEntry& removed) {
+    int entryIndex = table[tablePos];
+    Entry& entry = entries[entryIndex];
+    if (!entry.pinned) {
+      --unpinnedCount;
+    }
+    removed.key = entry.key;
+    removed.value.swap(entry.value);
+    removed.size = entry.size;
+    byteSize -= entry.size;
+    --count;
+    freeEntries.push_back(entryIndex);
+
+    size_t mask = table.size() - 1;
+    size_t hole = tablePos;
+    size_t pos = hole;
+    table[hole] = -1;
+    while (true) {
+      pos = (pos + 1) & mask;
+      if (table[pos] == -1) {
+        break;
+      }
+      size_t home = hash(entries[table[pos]].key) & mask;
+      bool reachable = hole <= pos ? (home > hole && home <= pos) : (home > hole || home <= pos);
+      if (!reachable) {
+        table[hole] = table[pos];
+        table[pos] = -1;
+        hole = pos;
+      }
+    }
+  }
+
+  void reset() {
+    entries.clear();
+    freeEntries.clear();
+    table.clear();
+    policy->clear();
+    count = 0;
+    unpinnedCount = 0;
+    byteSize = 0;
+  }
+
+  mutable boost::mutex mutex;
+  std::unique_ptr<TileCachePolicy> policy;
+  std::vector<Entry> entries;
+  std::vector<int> freeEntries;
+  std::vector<int> table;
+  size_t count;
+  size_t unpinnedCount;
+  unsigned long long byteSize;
+};
+
+TileCacheBase::TileCacheBase(const unsigned long long& cacheMaxByteSize, const unsigned int& numberOfShards, const CacheReplacementPolicy& policy) :
+  _cacheCurrentByteSize(0),
+  _cacheMaxByteSize(cacheMaxByteSize),
+  _evictions(0),
+  _policy(policy),
+  _manager(NULL)
+{
+  resetStatistics();
+  for (unsigned int i = 0; i < std::max(numberOfShards, 1u); ++i) {
+    _shards.push_back(std::unique_ptr<Shard>(new Shard(TileCachePolicy::create(policy))));
+  }
+}
+
+TileCacheBase::~TileCacheBase() {
+  leaveManager();
+}
+
+void TileCacheBase::leaveManager() {
+  TileCacheManager* manager = _manager;
+  if (manager) {
+    manager->unregisterCache(this);
+  }
+}
+
+TileCacheBase::Shard& TileCacheBase::shardForKey(const TileKey& k) const {
+  // The table uses the low bits of the hash, so select the shard on the high bits
+  return *_shards[(Shard::hash(k) >> 40) % _shards.size()];
+}
+
+bool TileCacheBase::getEntry(const TileKey& k, std::shared_ptr<void>& value, unsigned int& size) {
+  Shard& shard = shardForKey(k);
+  boost::lock_guard<boost::mutex> l(shard.mutex);
+  int pos = shard.find(k);
+  const unsigned int level = std::min(levelOfTileKey(k), numberOfCountedLevels - 1);
+  if (pos < 0) {
+    _misses[level].fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  _hits[level].fetch_add(1, std::memory_order_relaxed);
+  int entryIndex = shard.table[pos];
+  Shard::Entry& entry = shard.entries[entryIndex];
+  if (!entry.pinned && currentAccessHint != ScanCacheAccess) {
+    shard.policy->accessed(entryIndex);
+  }
+  value = entry.value;
+  size = entry.size;
+  return true;
+}
+
+int TileCacheBase::setEntry(const TileKey& k, const std::shared_ptr<void>& value, const unsigned int& size, bool pinned) {
+  if (size > _cacheMaxByteSize) {
+    return 1;
+  }
+  unsigned int shardIndex = static_cast<unsigned int>((Shard::hash(k) >> 40) % _shards.size());
+  Shard& shard = *_shards[shardIndex];
+  {
+    boost::lock_guard<boost::mutex> l(shard.mutex);
+    if (shard.find(k) >= 0) {
+      return 1;
+    }
+    shard.insert(k, value, size, pinned, currentAccessHint);
+  }
+  addToCurrentSize(size);
+  if (_cacheCurrentByteSize > _cacheMaxByteSize) {
+    std::vector<EvictedEntry> evictedEntries;
+    evictUntil(_cacheMaxByteSize, shardIndex, evictedEntries);
+    notifyEvicted(evictedEntries);
+  }
+  // Only locks the manager when the registered caches together went over the budget
+  TileCacheManager* manager = _manager;
+  if (manager) {
+    manager->enforceBudget();
+  }
+  return 0;
+}
+
+void TileCacheBase::evictUntil(const unsigned long long& targetByteSize, const unsigned int& preferredShard, std::vector<EvictedEntry>& evictedEntries) {
+  // First pass leaves one tile in each shard (typically the one that was just inserted), the second
+  // pass may evict everything that is not pinned
+  for (unsigned int pass = 0; pass < 2; ++pass) {
+    for (unsigned int i = 0; i < _shards.size() && _cacheCurrentByteSize > targetByteSize; ++i) {
+      Shard& shard = *_shards[(preferredShard + i) % _shards.size()];
+      boost::lock_guard<boost::mutex> l(shard.mutex);
+      while (_cacheCurrentByteSize > targetByteSize && shard.unpinnedCount > (pass == 0 ? 1u : 0u)) {
+        int victim = shard.policy->evict();
+        if (victim < 0) {
+          break;
+        }
+        EvictedEntry removed;
+        shard.erase(shard.find(shard.entries[victim].key), removed);
+        subtractFromCurrentSize(removed.size);
+        ++_evictions;
+        evictedEntries.push_back(removed);
+      }
+    }
+  }
+}
+
+void TileCacheBase::setMaxCacheSize(const unsigned long long& cacheMaxByteSize) {
+  _cacheMaxByteSize = cacheMaxByteSize;
+  std::vector<EvictedEntry> evictedEntries;
+  evictUntil(_cacheMaxByteSize, 0, evictedEntries);
+  notifyEvicted(evictedEntries);
+}
+
+unsigned long long TileCacheBase::evictBytes(const unsigned long long& bytes) {
+  std::vector<EvictedEntry> evictedEntries;
+  unsigned long long freed = evictBytes(bytes, evictedEntries);
+  notifyEvicted(evictedEntries);
+  return freed;
+}
+
+unsigned long long TileCacheBase::evictBytes(const unsigned long long& bytes, std::vector<EvictedEntry>& evictedEntries) {
+  unsigned long long sizeBefore = _cacheCurrentByteSize;
+  const size_t firstEvicted = evictedEntries.size();
+  evictUntil(sizeBefore > bytes ? sizeBefore - bytes : 0, 0, evictedEntries);
+  unsigned long long freed = 0;
+  for (size_t i = firstEvicted; i < evictedEntries.size(); ++i) {
+    freed += evictedEntries[i].size;
+  }
+  return freed;
+}
+
+void TileCacheBase::notifyEvicted(const std::vector<EvictedEntry>& evictedEntries) {
+  for (std::vector<EvictedEntry>::const_iterator it = evictedEntries.begin(); it != evictedEntries.end(); ++it) {
+    evicted(it->key, it->value, it->size);
+  }
+}
+
+void TileCacheBase::addToCurrentSize(const unsigned long long& bytes) {
+  _cacheCurrentByteSize += bytes;
+  TileCacheManager* manager = _manager;
+  if (manager) {
+    manager->_currentCacheSize += bytes;
+  }
+}
+
+void TileCacheBase::subtractFromCurrentSize(const unsigned long long& bytes) {
+  _cacheCurrentByteSize -= bytes;
+  TileCacheManager* manager = _manager;
+  if (manager) {
+    manager->_currentCacheSize -= bytes;
+  }
+}
+
+unsigned long long TileCacheBase::numberOfTiles() const {
+  unsigned long long nrTiles = 0;
+  for (std::vector<std::unique_ptr<Shard> >::const_iterator it = _shards.begin(); it != _shards.end(); ++it) {
+    boost::lock_guard<boost::mutex> l((*it)->mutex);
+    nrTiles += (*it)->count;
+  }
+  return nrTiles;
+}
+
+std::vector<std::shared_ptr<void> > TileCacheBase::getAllEntries() const {
+  std::vector<std::shared_ptr<void> > allEntries;
+  for (std::vector<std::unique_ptr<Shard> >::const_iterator it = _shards.begin(); it != _shards.end(); ++it) {
+    boost::lock_guard<boost::mutex> l((*it)->mutex);
+    for (std::vector<int>::const_iterator pos = (*it)->table.begin(); pos != (*it)->table.end(); ++pos) {
+      if (*pos != -1) {
+        allEntries.push_back((*it)->entries[*pos].value);
+      }
+    }
+  }
+  return allEntries;
+}
+
+void TileCacheBase::clear() {
+  for (std::vector<std::unique_ptr<Shard> >::iterator it = _shards.begin(); it != _shards.end(); ++it) {
+    boost::lock_guard<boost::mutex> l((*it)->mutex);
+    subtractFromCurrentSize((*it)->byteSize);
+    (*it)->reset();
+  }
+}
+
+TileCacheStatistics TileCacheBase::getStatistics() const {
+  TileCacheStatistics statistics;
+  statistics.hits = 0;
+  statistics.misses = 0;
+  for (unsigned int level = 0; level < numberOfCountedLevels; ++level) {
+    statistics.hitsPerLevel.push_back(_hits[level].load(std::memory_order_relaxed));
+    statistics.missesPerLevel.push_back(_misses[level].load(std::memory_order_relaxed));
+    statistics.hits += statistics.hitsPerLevel.back();
+    statistics.misses += statistics.missesPerLevel.back();
+  }
+  // Trailing levels that were never looked up are left out
+  while (!statistics.hitsPerLevel.empty() && statistics.hitsPerLevel.back() == 0 && statistics.missesPerLevel.back() == 0) {
+    statistics.hitsPerLevel.pop_back();
+    statistics.missesPerLevel.pop_back();
+  }
+  statistics.numberOfTiles = numberOfTiles();
+  statistics.currentByteSize = _cacheCurrentByteSize;
+  statistics.maxByteSize = _cacheMaxByteSize;
+  statistics.evictions = _evictions;
+  return statistics;
+}
+
+void TileCacheBase::resetStatistics() {
+  for (unsigned int level = 0; level < numberOfCountedLevels; ++level) {
+    _hits[level] = 0;
+    _misses[level] = 0;
+  }
+  _evictions = 0;
+}
+
+void TileCacheBase::setReplacementPolicy(const CacheReplacementPolicy& policy) {
+  setReplacementPolicy([policy]() { return TileCachePolicy::create(policy); });
+  _policy = policy;
+}
+
+void TileCacheBase::setReplacementPolicy(const std::function<std::unique_ptr<TileCachePolicy>()>& policyFactory) {
+  _policy = CustomReplacement;
+  for (std::vector<std::unique_ptr<Shard> >::iterator it = _shards.begin(); it != _shards.end(); ++it) {
+    Shard& shard = **it;
+    boost::lock_guard<boost::mutex> l(shard.mutex);
+    shard.policy = policyFactory();
+    // The order of the old policy is lost, cached tiles start out equal in the new one
+    for (std::vector<int>::const_iterator pos = shard.table.begin(); pos != shard.table.end(); ++pos) {
+      if (*pos != -1 && !shard.entries[*pos].pinned) {
+        shard.policy->inserted(*pos, shard.entries[*pos].key, shard.entries[*pos].size, NormalCacheAccess);
+      }
+    }
+  }
+}
+
+void TileCacheBase::setAccessHint(const CacheAccessHint& hint) {
+  currentAccessHint = hint;
+}
+
+CacheAccessHint TileCacheBase::getAccessHint() {
+  return currentAccessHint;
+}
@@ -1,122 +1,217 @@
 ﻿#ifndef TILECACHE_H
 #define TILECACHE_H
-#include <list>
-#include <map>
-#include <string>
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <vector>
+#include "multiresolutionimageinterface_export.h"
+
+//! Tiles are identified by a packed 64-bit key: 8 bits level, 16 bits z-plane, 20 bits tile column
+//! and 20 bits tile row. Building and comparing keys never allocates. Planes from maxTileKeyZPlanes on
+//! do not fit in a key; callers read them without caching.
+typedef unsigned long long TileKey;
+
+const unsigned int tileKeyLevelBits = 8;
+const unsigned int tileKeyZPlaneBits = 16;
+const unsigned int tileKeyTileBits = 20;
+static_assert(tileKeyLevelBits + tileKeyZPlaneBits + 2 * tileKeyTileBits == 64, "The fields of a tile key have to fill 64 bits");
+const unsigned int maxTileKeyZPlanes = 1u << tileKeyZPlaneBits;
+
+inline TileKey makeTileKey(const unsigned int& level, const unsigned int& zPlane, const unsigned long long& tileX, const unsigned long long& tileY) {
+  const TileKey tileMask = (1ULL << tileKeyTileBits) - 1;
+  return (static_cast<TileKey>(level & 0xFF) << (64 - tileKeyLevelBits)) | (static_cast<TileKey>(zPlane & (maxTileKeyZPlanes - 1)) << (2 * tileKeyTileBits)) |
+    ((tileX & tileMask) << tileKeyTileBits) | (tileY & tileMask);
+}
+
+inline unsigned int levelOfTileKey(const TileKey& key) { return static_cast<unsigned int>(key >> (64 - tileKeyLevelBits)); }
+inline unsigned long long tileXOfTileKey(const TileKey& key) { return (key >> tileKeyTileBits) & ((1ULL << tileKeyTileBits) - 1); }
+inline unsigned long long tileYOfTileKey(const TileKey& key) { return key & ((1ULL << tileKeyTileBits) - 1); }
+
+//! Snapshot of the usage of a cache; hits and misses are counted from construction or the last resetStatistics()
+struct TileCacheStatistics {
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long numberOfTiles;
+  unsigned long long currentByteSize;
+  unsigned long long maxByteSize;
+  unsigned long long evictions;
+
+  //! Hits and misses split by the pyramid level of the tile, levels beyond the last entry are counted in it
+  std::vector<unsigned long long> hitsPerLevel;
+  std::vector<unsigned long long> missesPerLevel;
+
+  double hitRate() const { return hits + misses > 0 ? static_cast<double>(hits) / (hits + misses) : 0.; }
+};
 
-template <typename T>
-class TileCache {
+class TileCacheManager;
+
+//! Replacement policies that come with the cache
+enum CacheReplacementPolicy {
+  LRUReplacement,        //!< Evicts the least recently used tile
+  TwoQueueReplacement,   //!< 2Q: tiles used once pass through a small FIFO queue, tiles used again move to an LRU queue
+  ARCReplacement,        //!< Adaptive replacement cache: balances recency and frequency based on recently evicted tiles
+  LevelAwareReplacement, //!< LRU in which tiles of lower-resolution levels stay longer, they are needed at every zoom level
+  CustomReplacement      //!< A policy set with a factory function
+};
+
+//! How the current thread uses the cache. Tiles stored during a scan (a whole-slide pass or a prefetch
+//! sweep) are admitted cold, they are the first candidates for eviction and lookups during the scan do
+//! not promote tiles, so a scan does not flush the tiles that are being viewed.
+enum CacheAccessHint {
+  NormalCacheAccess,
+  ScanCacheAccess
+};
+
+//! Orders the unpinned tiles of one cache shard for eviction. Tiles are identified by their entry index
+//! in the shard, which does not change while the tile is cached. All calls are made with the shard locked.
+class MULTIRESOLUTIONIMAGEINTERFACE_EXPORT TileCachePolicy {
 public :
+  virtual ~TileCachePolicy();
 
-  TileCache() :
-    _cacheMaxByteSize(0),
-    _cacheCurrentByteSize(0),
-    _LRU(),
-    _cache()
-  { 
-  }
+  virtual void inserted(const int& entry, const TileKey& key, const unsigned int& size, const CacheAccessHint& hint) = 0;
 
-  TileCache(unsigned int cacheMaxByteSize) :
-    _cacheMaxByteSize(cacheMaxByteSize),
-    _cacheCurrentByteSize(0),
-    _LRU(),
-    _cache()
-  { 
-  }
+  //! Called for cache hits outside of scans
+  virtual void accessed(const int& entry) = 0;
 
-  virtual ~TileCache()
-  {
-    for (key_iterator it = _cache.begin(); it != _cache.end(); ++it) {
-      delete[] it->second.first.first;
-    }
-  }
+  //! Chooses the tile to evict and stops tracking it, returns -1 if no tile is tracked
+  virtual int evict() = 0;
 
-  typedef std::string keyType;
-  typedef std::list<keyType> keyTypeList;
-  typedef typename std::map<keyType,std::pair<std::pair<T*, unsigned int>,std::list<keyType>::iterator> >::iterator key_iterator;  
-
-  virtual void get(const keyType& k, T*& tile, unsigned int& size) {
-    key_iterator it  = _cache.find(k);
- 
-    if (it == _cache.end()) {  
-      tile = NULL;
-      return;
-    } else { 
-        _LRU.splice( 
-        _LRU.end(), 
-        _LRU, 
-        it->second.second 
-       );  
-      tile = it->second.first.first;
-      size = it->second.first.second;
-      return; 
-    } 
-  }
+  virtual void clear() = 0;
 
-  virtual int set(const keyType& k, T* v, unsigned int size) {
-    if (_cache.find(k) != _cache.end()) {
-      return 1;
-    }
-    if (size > _cacheMaxByteSize) {
-      return 1;
-    }
-    while (_cacheCurrentByteSize + size > _cacheMaxByteSize && _cacheCurrentByteSize != 0) {
-      evict();
-    }
+  static std::unique_ptr<TileCachePolicy> create(const CacheReplacementPolicy& policy);
+};
 
-    keyTypeList::iterator it =_LRU.insert(_LRU.end(),k); 
-    _cache[k] = std::make_pair(std::make_pair(v,size),it);
-    _cacheCurrentByteSize += size;
-    return 0;
-  }
+//! Thread-safe cache for tiles. Entries are distributed over a number of independently locked
+//! shards, each of which holds an open-addressing hash table and its own instance of the replacement
+//! policy (LRU by default), so concurrent lookups of different tiles rarely contend. The byte budget is shared by all shards. Values are
+//! type-erased, use TileCache<T> to store arrays of pixel data.
+class MULTIRESOLUTIONIMAGEINTERFACE_EXPORT TileCacheBase {
+public :
+  TileCacheBase(const unsigned long long& cacheMaxByteSize = 0, const unsigned int& numberOfShards = 16, const CacheReplacementPolicy& policy = LRUReplacement);
+  virtual ~TileCacheBase();
 
-  unsigned long long currentCacheSize() const {return _cacheCurrentByteSize;}
-  unsigned long long maxCacheSize() const {return _cacheMaxByteSize;}
-  void setMaxCacheSize(const unsigned long long& cacheMaxByteSize) {
-    _cacheMaxByteSize = cacheMaxByteSize;
-    while (_cacheCurrentByteSize > _cacheMaxByteSize) {
-      evict();
-    }
-  }
+  unsigned long long currentCacheSize() const { return _cacheCurrentByteSize; }
+  unsigned long long maxCacheSize() const { return _cacheMaxByteSize; }
+  void setMaxCacheSize(const unsigned long long& cacheMaxByteSize);
 
-  virtual void clear() {
-    for (key_iterator it = _cache.begin(); it != _cache.end(); ++it) {
-      delete[] it->second.first.first;
-    }
-    _cache.clear();
-    _LRU.clear();
-    _cacheCurrentByteSize = 0;
-  }
+  //! Number of tiles currently in the cache
+  unsigned long long numberOfTiles() const;
 
-protected :
-  unsigned long long _cacheCurrentByteSize;
-  unsigned long long _cacheMaxByteSize;
+  //! Removes all tiles from the cache, without calling evicted()
+  virtual void clear();
+
+  TileCacheStatistics getStatistics() const;
+  void resetStatistics();
 
-  // _LRU is used to quickly identify the last used tiles so they can be removed from the cache,
-  // it contains an ordered list of used tiles. When a tile is used it is moved to the front of the 
-  // list
-  std::list<keyType> _LRU;
+  //! Evicts tiles until at least the given number of bytes was freed or only pinned tiles are left,
+  //! returns the number of bytes that were freed
+  unsigned long long evictBytes(const unsigned long long& bytes);
+
+  //! Replaces the replacement policy of every shard, the cached tiles are kept
+  void setReplacementPolicy(const CacheReplacementPolicy& policy);
+  void setReplacementPolicy(const std::function<std::unique_ptr<TileCachePolicy>()>& policyFactory);
+  CacheReplacementPolicy getReplacementPolicy() const { return _policy; }
+
+  //! Gets/Sets the access hint of the calling thread, see ScopedCacheAccessHint
+  static void setAccessHint(const CacheAccessHint& hint);
+  static CacheAccessHint getAccessHint();
+
+protected :
+  //! Looks up a tile and reports the access to the replacement policy, returns false if it is not cached
+  bool getEntry(const TileKey& k, std::shared_ptr<void>& value, unsigned int& size);
+
+  //! Stores a tile, returns 1 if the tile was not added (already present or too large). Pinned tiles
+  //! are never evicted, but do count towards the cache size.
+  int setEntry(const TileKey& k, const std::shared_ptr<void>& value, const unsigned int& size, bool pinned = false);
+
+  std::vector<std::shared_ptr<void> > getAllEntries() const;
+
+  //! Called for every tile that was removed to make room, after the shard locks have been released
+  virtual void evicted(const TileKey& k, const std::shared_ptr<void>& value, const unsigned int& size) {};
+
+  //! Unregisters from the TileCacheManager, waiting until other threads no longer call evicted(). Derived
+  //! classes call it first thing in their destructor, before their part of the object is gone.
+  void leaveManager();
+
+private :
+  friend class TileCacheManager;
+  struct Shard;
+  struct EvictedEntry {
+    TileKey key;
+    std::shared_ptr<void> value;
+    unsigned int size;
+  };
+
+  TileCacheBase(const TileCacheBase& other);
+  TileCacheBase& operator=(const TileCacheBase& other);
+
+  Shard& shardForKey(const TileKey& k) const;
+
+  // Evicts tiles chosen by the replacement policy until the cache is not larger than targetByteSize;
+  // the shard of the last insertion is tried first, the other shards only when it has nothing left to evict
+  void evictUntil(const unsigned long long& targetByteSize, const unsigned int& preferredShard, std::vector<EvictedEntry>& evictedEntries);
+
+  // Like evictBytes, but the caller calls notifyEvicted once it holds no locks
+  unsigned long long evictBytes(const unsigned long long& bytes, std::vector<EvictedEntry>& evictedEntries);
+  void notifyEvicted(const std::vector<EvictedEntry>& evictedEntries);
+
+  // Change the size of the cache and the running total of the manager it is registered with
+  void addToCurrentSize(const unsigned long long& bytes);
+  void subtractFromCurrentSize(const unsigned long long& bytes);
+
+  std::vector<std::unique_ptr<Shard> > _shards;
+  std::atomic<unsigned long long> _cacheCurrentByteSize;
+  std::atomic<unsigned long long> _cacheMaxByteSize;
+  // Lookups are counted per level, the totals are summed when the statistics are requested
+  static const unsigned int numberOfCountedLevels = 32;
+  std::atomic<unsigned long long> _hits[numberOfCountedLevels];
+  std::atomic<unsigned long long> _misses[numberOfCountedLevels];
+  std::atomic<unsigned long long> _evictions;
+  std::atomic<CacheReplacementPolicy> _policy;
+
+  //! Set while the cache takes part in the budget of the TileCacheManager
+  std::atomic<TileCacheManager*> _manager;
+};
 
-  // Structure of the cache is as follow: each entry has a position string as the key (x-y-level)
-  // Each value contains ((tile, size), iterator to position in _LRU)
-  std::map<keyType,std::pair<std::pair<T*, unsigned int>,keyTypeList::iterator> > _cache;
+//! Cache for tiles of pixel data of type T; tiles are shared with readers so a tile that is evicted
+//! while it is being copied stays alive until the copy is done.
+template <typename T>
+class TileCache : public TileCacheBase {
+public :
+  typedef TileKey keyType;
 
+  TileCache(const unsigned long long& cacheMaxByteSize = 0, const CacheReplacementPolicy& policy = LRUReplacement) : TileCacheBase(cacheMaxByteSize, 16, policy) {}
+  ~TileCache() { leaveManager(); }
 
-  // Removes the least recently used (LRU) tile from the cache
-  virtual void evict() {
+  bool get(const keyType& k, std::shared_ptr<T>& tile, unsigned int& size) {
+    std::shared_ptr<void> value;
+    if (getEntry(k, value, size)) {
+      tile = std::static_pointer_cast<T>(value);
+      return true;
+    }
+    tile.reset();
+    return false;
+  }
 
-    // Identify least recently used key 
-    key_iterator it =_cache.find(_LRU.front()); 
+  int set(const keyType& k, const std::shared_ptr<T>& tile, const unsigned int& size) {
+    return setEntry(k, tile, size);
+  }
+};
 
-    // Erase both elements to completely purge record 
-    _cacheCurrentByteSize -= it->second.first.second;
-    delete[] it->second.first.first;
-    _cache.erase(it); 
-    _LRU.pop_front(); 
+//! Sets the cache access hint of the calling thread for the lifetime of the object, e.g.
+//! ScopedCacheAccessHint scan(ScanCacheAccess); before a whole-slide pass
+class MULTIRESOLUTIONIMAGEINTERFACE_EXPORT ScopedCacheAccessHint {
+public :
+  explicit ScopedCacheAccessHint(const CacheAccessHint& hint) : _previousHint(TileCacheBase::getAccessHint()) {
+    TileCacheBase::setAccessHint(hint);
+  }
 
+  ~ScopedCacheAccessHint() {
+    TileCacheBase::setAccessHint(_previousHint);
   }
 
+private :
+  CacheAccessHint _previousHint;
 };
 
-#endif
\ No newline at end of file
+#endif
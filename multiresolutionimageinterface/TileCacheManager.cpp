@@ -0,0 +1,204 @@
+#include "TileCacheManager.h"
+#include <boost/thread.hpp>
+#include <algorithm>
+
+TileCacheManager::TileCacheManager() :
+  _mutex(new boost::mutex()),
+  _cachesReleased(new boost::condition_variable()),
+  _cacheMaxByteSize(0),
+  _currentCacheSize(0)
+{
+}
+
+TileCacheManager& TileCacheManager::getInstance() {
+  // Never destroyed, caches of images that outlive static destruction still unregister safely
+  static TileCacheManager* instance = new TileCacheManager();
+  return *instance;
+}
+
+void TileCacheManager::setMaxCacheSize(const unsigned long long& cacheMaxByteSize) {
+  // The caches that follow the budget are resized outside the lock, as that calls their evicted()
+  std::vector<TileCacheBase*> followers;
+  {
+    boost::lock_guard<boost::mutex> l(*_mutex);
+    _cacheMaxByteSize = cacheMaxByteSize;
+    for (std::vector<Registration>::iterator it = _caches.begin(); it != _caches.end(); ++it) {
+      if (it->followsBudget) {
+        followers.push_back(it->cache);
+      }
+    }
+    _busyCaches.insert(_busyCaches.end(), followers.begin(), followers.end());
+  }
+  for (std::vector<TileCacheBase*>::iterator it = followers.begin(); it != followers.end(); ++it) {
+    (*it)->setMaxCacheSize(cacheMaxByteSize);
+  }
+  releaseBusyCaches(followers);
+  enforceBudget();
+}
+
+unsigned long long TileCacheManager::getMaxCacheSize() const {
+  return _cacheMaxByteSize;
+}
+
+unsigned long long TileCacheManager::getCurrentCacheSize() const {
+  boost::lock_guard<boost::mutex> l(*_mutex);
+  return sumCacheSizes();
+}
+
+unsigned long long TileCacheManager::sumCacheSizes() const {
+  unsigned long long total = 0;
+  for (std::vector<Registration>::const_iterator it = _caches.begin(); it != _caches.end(); ++it) {
+    total += it->cache->currentCacheSize();
+  }
+  return total;
+}
+
+bool TileCacheManager::isEnabled() const {
+  return _cacheMaxByteSize > 0;
+}
+
+void TileCacheManager::registerCache(TileCacheBase* cache, const std::string& name, const double& weight, bool followBudget, bool evictable) {
+  if (!cache) {
+    return;
+  }
+  {
+    boost::lock_guard<boost::mutex> l(*_mutex);
+    std::vector<Registration>::iterator it = _caches.begin();
+    while (it != _caches.end() && it->cache != cache) {
+      ++it;
+    }
+    Registration registration;
+    registration.cache = cache;
+    registration.name = name;
+    registration.weight = weight > 0 ? weight : 1.0;
+    registration.followsBudget = followBudget;
+    registration.evictable = evictable;
+    if (it == _caches.end()) {
+      _caches.push_back(registration);
+    }
+    else {
+      *it = registration;
+    }
+    cache->_manager = this;
+    _currentCacheSize = sumCacheSizes();
+  }
+  // The caller owns the cache, so it cannot go away while it is resized
+  if (followBudget) {
+    cache->setMaxCacheSize(_cacheMaxByteSize);
+  }
+  enforceBudget();
+}
+
+void TileCacheManager::unregisterCache(TileCacheBase* cache) {
+  boost::unique_lock<boost::mutex> l(*_mutex);
+  // Wait until other threads are done calling into the cache
+  while (std::find(_busyCaches.begin(), _busyCaches.end(), cache) != _busyCaches.end()) {
+    _cachesReleased->wait(l);
+  }
+  for (std::vector<Registration>::iterator it = _caches.begin(); it != _caches.end(); ++it) {
+    if (it->cache == cache) {
+      _caches.erase(it);
+      cache->_manager = NULL;
+      _currentCacheSize = sumCacheSizes();
+      return;
+    }
+  }
+}
+
+bool TileCacheManager::isRegistered(const TileCacheBase* cache) const {
+  boost::lock_guard<boost::mutex> l(*_mutex);
+  for (std::vector<Registration>::const_iterator it = _caches.begin(); it != _caches.end(); ++it) {
+    if (it->cache == cache) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::vector<ManagedCacheStatistics> TileCacheManager::getStatistics() const {
+  boost::lock_guard<boost::mutex> l(*_mutex);
+  std::vector<ManagedCacheStatistics> statistics;
+  for (std::vector<Registration>::const_iterator it = _caches.begin(); it != _caches.end(); ++it) {
+    ManagedCacheStatistics cacheStatistics;
+    cacheStatistics.name = it->name;
+    cacheStatistics.weight = it->weight;
+    cacheStatistics.statistics = it->cache->getStatistics();
+    statistics.push_back(cacheStatistics);
+  }
+  return statistics;
+}
+
+void TileCacheManager::enforceBudget() {
+  if (_cacheMaxByteSize == 0 || _currentCacheSize <= _cacheMaxByteSize) {
+    return;
+  }
+  std::vector<TileCacheBase*> victims;
+  std::vector<std::vector<TileCacheBase::EvictedEntry> > evictedEntries;
+  {
+    boost::lock_guard<boost::mutex> l(*_mutex);
+    // Caches that only hold pinned tiles cannot give anything back, neither can caches that are not evictable
+    std::vector<bool> exhausted(_caches.size(), false);
+    for (unsigned int i = 0; i < _caches.size(); ++i) {
+      exhausted[i] = !_caches[i].evictable;
+    }
+    while (true) {
+      unsigned long long total = sumCacheSizes();
+      _currentCacheSize = total;
+      if (_cacheMaxByteSize == 0 || total <= _cacheMaxByteSize) {
+        break;
+      }
+
+      // The cache with the largest weighted share gives up tiles until it is down to the next largest share
+      int victim = -1;
+      double victimShare = -1., nextShare = 0.;
+      for (unsigned int i = 0; i < _caches.size(); ++i) {
+        if (exhausted[i]) {
+          continue;
+        }
+        double share = _caches[i].cache->currentCacheSize() / _caches[i].weight;
+        if (share > victimShare) {
+          nextShare = std::max(nextShare, victimShare);
+          victimShare = share;
+          victim = i;
+        }
+        else if (share > nextShare) {
+          nextShare = share;
+        }
+      }
+      if (victim < 0) {
+        break;
+      }
+      const Registration& registration = _caches[victim];
+      unsigned long long current = registration.cache->currentCacheSize();
+      unsigned long long aboveNext = current - std::min<unsigned long long>(current, static_cast<unsigned long long>(nextShare * registration.weight));
+      unsigned long long bytesToFree = std::min(total - _cacheMaxByteSize, std::max<unsigned long long>(aboveNext, 1));
+      std::vector<TileCacheBase*>::iterator known = std::find(victims.begin(), victims.end(), registration.cache);
+      if (known == victims.end()) {
+        victims.push_back(registration.cache);
+        evictedEntries.push_back(std::vector<TileCacheBase::EvictedEntry>());
+        known = victims.end() - 1;
+      }
+      if (registration.cache->evictBytes(bytesToFree, evictedEntries[known - victims.begin()]) == 0) {
+        exhausted[victim] = true;
+      }
+    }
+    _busyCaches.insert(_busyCaches.end(), victims.begin(), victims.end());
+  }
+  for (unsigned int i = 0; i < victims.size(); ++i) {
+    victims[i]->notifyEvicted(evictedEntries[i]);
+  }
+  releaseBusyCaches(victims);
+}
+
+void TileCacheManager::releaseBusyCaches(const std::vector<TileCacheBase*>& caches) {
+  if (caches.empty()) {
+    return;
+  }
+  {
+    boost::lock_guard<boost::mutex> l(*_mutex);
+    for (std::vector<TileCacheBase*>::const_iterator it = caches.begin(); it != caches.end(); ++it) {
+      _busyCaches.erase(std::find(_busyCaches.begin(), _busyCaches.end(), *it));
+    }
+  }
+  _cachesReleased->notify_all();
+}
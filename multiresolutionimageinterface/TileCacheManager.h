@@ -0,0 +1,91 @@
+#ifndef TILECACHEMANAGER_H
+#define TILECACHEMANAGER_H
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include "TileCache.h"
+#include "multiresolutionimageinterface_export.h"
+
+namespace boost {
+  class mutex;
+  class condition_variable;
+}
+
+//! Usage of a single cache that takes part in the shared budget
+struct ManagedCacheStatistics {
+  std::string name;
+  double weight;
+  TileCacheStatistics statistics;
+};
+
+//! Process-wide memory budget shared by tile caches. While a budget is set, the caches of images that
+//! are opened register themselves with the manager. When the registered caches together exceed the
+//! budget, tiles are evicted from the cache that uses the most memory relative to its weight, so each
+//! cache ends up with a share of the budget proportional to its weight. Caches without a size of their
+//! own follow the budget, a single image can use all of it when nothing else is open. A budget of 0
+//! disables the manager: images that are opened afterwards only use their own cache size.
+//! The manager keeps a running total of the registered caches, so caches only take its lock when the
+//! total went over the budget. evicted() of the caches is called after that lock has been released.
+class MULTIRESOLUTIONIMAGEINTERFACE_EXPORT TileCacheManager {
+
+public:
+  static TileCacheManager& getInstance();
+
+  //! Gets/Sets the budget in bytes, can be changed at any time
+  void setMaxCacheSize(const unsigned long long& cacheMaxByteSize);
+  unsigned long long getMaxCacheSize() const;
+
+  //! Combined size of all registered caches
+  unsigned long long getCurrentCacheSize() const;
+
+  bool isEnabled() const;
+
+  //! Adds a cache to the budget or updates its registration. A cache that follows the budget gets the
+  //! budget as its own maximum size. The tiles of a cache that is not evictable count towards the budget,
+  //! but are only evicted by the cache itself, on the threads that insert into it; the other caches make
+  //! room for them. Caches unregister themselves when they are destroyed.
+  void registerCache(TileCacheBase* cache, const std::string& name, const double& weight = 1.0, bool followBudget = true, bool evictable = true);
+  void unregisterCache(TileCacheBase* cache);
+  bool isRegistered(const TileCacheBase* cache) const;
+
+  //! Per-cache usage, in order of registration
+  std::vector<ManagedCacheStatistics> getStatistics() const;
+
+  //! Evicts tiles until the registered caches fit in the budget, called by caches after they grew.
+  //! Returns without locking while the running total is within the budget.
+  void enforceBudget();
+
+private:
+  friend class TileCacheBase;
+
+  struct Registration {
+    TileCacheBase* cache;
+    std::string name;
+    double weight;
+    bool followsBudget;
+    bool evictable;
+  };
+
+  // Sums the registered caches, called with _mutex locked
+  unsigned long long sumCacheSizes() const;
+
+  // Caches in _busyCaches are used outside the lock and are not unregistered until they are released
+  void releaseBusyCaches(const std::vector<TileCacheBase*>& caches);
+
+  TileCacheManager();
+  TileCacheManager(const TileCacheManager& other);
+  TileCacheManager& operator=(const TileCacheManager& other);
+
+  std::vector<Registration> _caches;
+  std::vector<TileCacheBase*> _busyCaches;
+  std::unique_ptr<boost::mutex> _mutex;
+  std::unique_ptr<boost::condition_variable> _cachesReleased;
+  std::atomic<unsigned long long> _cacheMaxByteSize;
+
+  //! Kept up to date by the registered caches; it can drift while caches (un)register, so it is
+  //! recomputed whenever the lock is taken
+  std::atomic<unsigned long long> _currentCacheSize;
+};
+
+#endif
@@ -0,0 +1,390 @@
+#include "TileCache.h"
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+
+namespace {
+
+  // Intrusive doubly linked lists over the entry indices of a shard; the head of a list is its next
+  // eviction candidate
+  class EntryLists {
+  public :
+    struct List {
+      int head;
+      int tail;
+      unsigned long long bytes;
+      size_t count;
+    };
+
+    struct Node {
+      TileKey key;
+      unsigned int size;
+      int prev;
+      int next;
+      int list;
+      bool cold;
+      unsigned long long priority;
+    };
+
+    explicit EntryLists(const unsigned int& numberOfLists) : _numberOfLists(numberOfLists) {
+      clear();
+    }
+
+    Node& track(const int& entry, const TileKey& key, const unsigned int& size, const bool& cold) {
+      if (static_cast<size_t>(entry) >= _nodes.size()) {
+        _nodes.resize(entry + 1);
+      }
+      Node& n = _nodes[entry];
+      n.key = key;
+      n.size = size;
+      n.prev = n.next = n.list = -1;
+      n.cold = cold;
+      n.priority = 0;
+      return n;
+    }
+
+    Node& node(const int& entry) { return _nodes[entry]; }
+    const List& list(const int& list) const { return _lists[list]; }
+
+    void pushBack(const int& list, const int& entry) {
+      Node& n = _nodes[entry];
+      List& l = _lists[list];
+      n.list = list;
+      n.prev = l.tail;
+      n.next = -1;
+      if (l.tail != -1) {
+        _nodes[l.tail].next = entry;
+      }
+      else {
+        l.head = entry;
+      }
+      l.tail = entry;
+      l.bytes += n.size;
+      ++l.count;
+    }
+
+    void pushFront(const int& list, const int& entry) {
+      Node& n = _nodes[entry];
+      List& l = _lists[list];
+      n.list = list;
+      n.prev = -1;
+      n.next = l.head;
+      if (l.head != -1) {
+        _nodes[l.head].prev = entry;
+      }
+      else {
+        l.tail = entry;
+      }
+      l.head = entry;
+      l.bytes += n.size;
+      ++l.count;
+    }
+
+    void unlink(const int& entry) {
+      Node& n = _nodes[entry];
+      List& l = _lists[n.list];
+      if (n.prev != -1) {
+        _nodes[n.prev].next = n.next;
+      }
+      else {
+        l.head = n.next;
+      }
+      if (n.next != -1) {
+        _nodes[n.next].prev = n.prev;
+      }
+      else {
+        l.tail = n.prev;
+      }
+      l.bytes -= n.size;
+      --l.count;
+      n.prev = n.next = n.list = -1;
+    }
+
+    // Unlinks and returns the head of the list, -1 if it is empty
+    int popFront(const int& list) {
+      int entry = _lists[list].head;
+      if (entry != -1) {
+        unlink(entry);
+      }
+      return entry;
+    }
+
+    void clear() {
+      List empty = {-1, -1, 0, 0};
+      _lists.assign(_numberOfLists, empty);
+      _nodes.clear();
+    }
+
+  private :
+    unsigned int _numberOfLists;
+    std::vector<List> _lists;
+    std::vector<Node> _nodes;
+  };
+
+  // Keys of recently evicted tiles, oldest first
+  class GhostList {
+  public :
+    bool erase(const TileKey& key) {
+      std::unordered_map<TileKey, std::list<TileKey>::iterator>::iterator it = _index.find(key);
+      if (it == _index.end()) {
+        return false;
+      }
+      _order.erase(it->second);
+      _index.erase(it);
+      return true;
+    }
+
+    void push(const TileKey& key) {
+      erase(key);
+      _order.push_back(key);
+      _index[key] = --_order.end();
+    }
+
+    void trim(const size_t& maxSize) {
+      while (_index.size() > maxSize) {
+        _index.erase(_order.front());
+        _order.pop_front();
+      }
+    }
+
+    size_t size() const { return _index.size(); }
+
+    void clear() {
+      _order.clear();
+      _index.clear();
+    }
+
+  private :
+    std::list<TileKey> _order;
+    std::unordered_map<TileKey, std::list<TileKey>::iterator> _index;
+  };
+
+  class LRUPolicy : public TileCachePolicy {
+  public :
+    LRUPolicy() : _lists(1) {}
+
+    void inserted(const int& entry, const TileKey& key, const unsigned int& size, const CacheAccessHint& hint) {
+      _lists.track(entry, key, size, hint == ScanCacheAccess);
+      if (hint == ScanCacheAccess) {
+        _lists.pushFront(0, entry);
+      }
+      else {
+        _lists.pushBack(0, entry);
+      }
+    }
+
+    void accessed(const int& entry) {
+      _lists.unlink(entry);
+      _lists.pushBack(0, entry);
+    }
+
+    int evict() { return _lists.popFront(0); }
+    void clear() { _lists.clear(); }
+
+  private :
+    EntryLists _lists;
+  };
+
+  // New tiles enter a FIFO queue (A1in), tiles that are used again while in it or that return shortly
+  // after being evicted from it (remembered in A1out) move to the LRU queue (Am).
+  class TwoQueuePolicy : public TileCachePolicy {
+  public :
+    TwoQueuePolicy() : _lists(2) {}
+
+    void inserted(const int& entry, const TileKey& key, const unsigned int& size, const CacheAccessHint& hint) {
+      EntryLists::Node& n = _lists.track(entry, key, size, hint == ScanCacheAccess);
+      if (n.cold) {
+        _lists.pushFront(A1in, entry);
+      }
+      else if (_a1out.erase(key)) {
+        _lists.pushBack(Am, entry);
+      }
+      else {
+        _lists.pushBack(A1in, entry);
+      }
+    }
+
+    void accessed(const int& entry) {
+      _lists.unlink(entry);
+      _lists.node(entry).cold = false;
+      _lists.pushBack(Am, entry);
+    }
+
+    int evict() {
+      const EntryLists::List& a1in = _lists.list(A1in);
+      const EntryLists::List& am = _lists.list(Am);
+      int victim = -1;
+      if (a1in.count > 0 && (am.count == 0 || a1in.bytes * 4 > a1in.bytes + am.bytes)) {
+        victim = _lists.popFront(A1in);
+        if (!_lists.node(victim).cold) {
+          _a1out.push(_lists.node(victim).key);
+        }
+      }
+      else {
+        victim = _lists.popFront(Am);
+      }
+      _a1out.trim(std::max<size_t>((a1in.count + am.count) / 2, 1));
+      return victim;
+    }
+
+    void clear() {
+      _lists.clear();
+      _a1out.clear();
+    }
+
+  private :
+    enum { A1in = 0, Am = 1 };
+    EntryLists _lists;
+    GhostList _a1out;
+  };
+
+  // ARC with the number of tiles as capacity: T1 holds tiles seen once, T2 tiles seen more than once and
+  // the target size of T1 adapts to hits in the ghost lists B1 and B2.
+  class ARCPolicy : public TileCachePolicy {
+  public :
+    ARCPolicy() : _lists(2), _target(0) {}
+
+    void inserted(const int& entry, const TileKey& key, const unsigned int& size, const CacheAccessHint& hint) {
+      EntryLists::Node& n = _lists.track(entry, key, size, hint == ScanCacheAccess);
+      double resident = static_cast<double>(residentCount());
+      if (n.cold) {
+        _lists.pushFront(T1, entry);
+      }
+      else if (_b1.erase(key)) {
+        _target = std::min(resident, _target + std::max(static_cast<double>(_b2.size()) / std::max<size_t>(_b1.size(), 1), 1.));
+        _lists.pushBack(T2, entry);
+      }
+      else if (_b2.erase(key)) {
+        _target = std::max(0., _target - std::max(static_cast<double>(_b1.size()) / std::max<size_t>(_b2.size(), 1), 1.));
+        _lists.pushBack(T2, entry);
+      }
+      else {
+        _lists.pushBack(T1, entry);
+      }
+    }
+
+    void accessed(const int& entry) {
+      _lists.unlink(entry);
+      _lists.node(entry).cold = false;
+      _lists.pushBack(T2, entry);
+    }
+
+    int evict() {
+      const EntryLists::List& t1 = _lists.list(T1);
+      const EntryLists::List& t2 = _lists.list(T2);
+      int victim = -1;
+      if (t1.count > 0 && (t2.count == 0 || t1.count > _target || _lists.node(t1.head).cold)) {
+        victim = _lists.popFront(T1);
+        if (!_lists.node(victim).cold) {
+          _b1.push(_lists.node(victim).key);
+        }
+      }
+      else {
+        victim = _lists.popFront(T2);
+        if (victim != -1) {
+          _b2.push(_lists.node(victim).key);
+        }
+      }
+      size_t resident = std::max<size_t>(residentCount(), 1);
+      _b1.trim(resident);
+      _b2.trim(resident);
+      return victim;
+    }
+
+    void clear() {
+      _lists.clear();
+      _b1.clear();
+      _b2.clear();
+      _target = 0;
+    }
+
+  private :
+    enum { T1 = 0, T2 = 1 };
+
+    size_t residentCount() const { return _lists.list(T1).count + _lists.list(T2).count; }
+
+    EntryLists _lists;
+    GhostList _b1;
+    GhostList _b2;
+    double _target;
+  };
+
+  // GreedyDual over one LRU list per level: a tile gets a credit that doubles with its level on top of
+  // the inflation value, which rises to the credit of every evicted tile. Tiles of the low-resolution
+  // levels are needed at every zoom level and cover a larger part of the slide, so they stay longer.
+  class LevelAwarePolicy : public TileCachePolicy {
+  public :
+    LevelAwarePolicy() : _lists(256), _inflation(0), _numberOfLevels(0) {}
+
+    void inserted(const int& entry, const TileKey& key, const unsigned int& size, const CacheAccessHint& hint) {
+      EntryLists::Node& n = _lists.track(entry, key, size, hint == ScanCacheAccess);
+      int level = levelOf(key);
+      _numberOfLevels = std::max(_numberOfLevels, level + 1);
+      if (n.cold) {
+        n.priority = _inflation;
+        _lists.pushFront(level, entry);
+      }
+      else {
+        n.priority = _inflation + credit(level);
+        _lists.pushBack(level, entry);
+      }
+    }
+
+    void accessed(const int& entry) {
+      EntryLists::Node& n = _lists.node(entry);
+      int level = levelOf(n.key);
+      _lists.unlink(entry);
+      n.cold = false;
+      n.priority = _inflation + credit(level);
+      _lists.pushBack(level, entry);
+    }
+
+    int evict() {
+      // Priorities within a level only increase from head to tail, so the victim is one of the heads
+      int victimLevel = -1;
+      for (int level = 0; level < _numberOfLevels; ++level) {
+        int head = _lists.list(level).head;
+        if (head != -1 && (victimLevel == -1 || _lists.node(head).priority < _lists.node(_lists.list(victimLevel).head).priority)) {
+          victimLevel = level;
+        }
+      }
+      if (victimLevel == -1) {
+        return -1;
+      }
+      int victim = _lists.popFront(victimLevel);
+      _inflation = std::max(_inflation, _lists.node(victim).priority);
+      return victim;
+    }
+
+    void clear() {
+      _lists.clear();
+      _inflation = 0;
+      _numberOfLevels = 0;
+    }
+
+  private :
+    static int levelOf(const TileKey& key) { return static_cast<int>(levelOfTileKey(key)); }
+    static unsigned long long credit(const int& level) { return 1ULL << std::min(level, 20); }
+
+    EntryLists _lists;
+    unsigned long long _inflation;
+    int _numberOfLevels;
+  };
+
+}
+
+TileCachePolicy::~TileCachePolicy() {
+}
+
+std::unique_ptr<TileCachePolicy> TileCachePolicy::create(const CacheReplacementPolicy& policy) {
+  switch (policy) {
+  case TwoQueueReplacement:
+    return std::unique_ptr<TileCachePolicy>(new TwoQueuePolicy());
+  case ARCReplacement:
+    return std::unique_ptr<TileCachePolicy>(new ARCPolicy());
+  case LevelAwareReplacement:
+    return std::unique_ptr<TileCachePolicy>(new LevelAwarePolicy());
+  default:
+    return std::unique_ptr<TileCachePolicy>(new LRUPolicy());
+  }
+}
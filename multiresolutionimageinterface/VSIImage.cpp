@@ -1,11 +1,12 @@
 #include "VSIImage.h"
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <cmath>
 #include <string>
 #include <cstring>
 #include <math.h>
 #include "core/filetools.h"
-#include "core/Box.h"
 #include "core/PathologyEnums.h"
 
 // Include DCMTK LIBJPEG for lossy and lossless JPEG compression
@@ -18,31 +19,62 @@ extern "C" {
 }
 
 #include "JPEG2000Codec.h"
+#include <boost/thread.hpp>
 
 using namespace pathology;
 using namespace std;
 
+namespace {
+
+  // Decompressors and buffers of a thread, reused for every tile it decodes
+  struct TileDecoder {
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr jerr;
+    jpeg_source_mgr source;
+    JPEG2000Codec jp2000;
+    std::vector<unsigned char> encoded;
+    std::vector<unsigned char> decoded;
+    std::vector<unsigned char> line;
+    std::vector<unsigned char> region;
+
+    TileDecoder() {
+      cinfo.err = jpeg_std_error(&jerr);
+      jpeg_create_decompress(&cinfo);
+      jp2000.setNumberOfThreads(std::min(std::max(boost::thread::hardware_concurrency(), 1u), 4u));
+    }
+    ~TileDecoder() {
+      jpeg_destroy_decompress(&cinfo);
+    }
+  };
+
+  TileDecoder& threadDecoder() {
+    thread_local TileDecoder decoder;
+    return decoder;
+  }
+
+}
+
 VSIImage::VSIImage() : MultiResolutionImage(),
-	_vsiFileName(""), _etsFile(""), _tileOffsets(), _tileCoords(),
-	_tileSizeX(0), _tileSizeY(0), _nrTilesX(0),
-	_nrTilesY(0), _compressionType(0) 
+	_vsiFileName(""), _etsFile(""), _tileOffsets(), _tileByteCounts(),
+	_tileSizeX(0), _tileSizeY(0), _compressionType(0), _jp2000Resolutions(0), _tileIndex()
 {
 }
 
 VSIImage::~VSIImage() {
+  stopAsyncReads();
   cleanup();
 }
 
 void VSIImage::cleanup() {
 	_vsiFileName = "";
 	_etsFile = "";
-	_tileCoords.clear();
+	_tileIndex.clear();
 	_tileOffsets.clear();
+	_tileByteCounts.clear();
 	_tileSizeX = 0;
 	_tileSizeY = 0;
-	_nrTilesX = 0;
-	_nrTilesY = 0;
   _compressionType = 0;
+  _jp2000Resolutions = 0;
   MultiResolutionImage::cleanup();
 }
 
@@ -82,12 +114,11 @@ bool VSIImage::initializeType(const std::string& imagePath) {
       }
 		}
 		ets.close();	
-	  _tileCoords.clear();
+	  _tileIndex.clear();
 	  _tileOffsets.clear();
+	  _tileByteCounts.clear();
 	  _tileSizeX = 0;
 	  _tileSizeY = 0;
-	  _nrTilesX = 0;
-	  _nrTilesY = 0;
     _compressionType = 0;
     _levelDimensions.clear();
 	}
@@ -95,6 +126,16 @@ bool VSIImage::initializeType(const std::string& imagePath) {
 	ets.open(_etsFile.c_str(), ios::in | ios::binary);
   parseETSFile(ets);
   ets.close();	
+  // Tiles are read from the .ets file for as long as the image is open
+  if (_isValid && !openByteSource(_etsFile)) {
+    _isValid = false;
+  }
+  // Reduced resolutions of JPEG2000 tiles are limited by the resolution levels they were encoded with
+  if (_isValid && _compressionType == 3 && !_tileOffsets.empty() && _tileOffsets[0] < _source->size()) {
+    std::vector<unsigned char> encoded(std::min<unsigned long long>(_tileByteCounts[0], _source->size() - _tileOffsets[0]));
+    _source->read(_tileOffsets[0], encoded.size(), encoded.data());
+    _jp2000Resolutions = JPEG2000Codec::getNumberOfResolutions(encoded.data(), static_cast<unsigned int>(encoded.size()));
+  }
   _fileType = "vsi";
   return _isValid;
 }
@@ -140,66 +181,64 @@ unsigned long long VSIImage::parseETSFile(std::ifstream& ets) {
   int tileDepth = *reinterpret_cast<int*>(memblock);
   bool isRGB = nrColors > 1;
 
-  // Read locations of tiles and file offsets
+  // Read locations of tiles and file offsets. The coordinates of a tile are its column, row, z-plane
+  // and resolution level; the tiles are indexed by column, row and level so a read finds them directly.
+  // The first tile stored at a position is used, as it was before.
   ets.seekg(usedChunkOffset);
+  std::vector<int> levelTilesX, levelTilesY;
+  vector<int> curTileCoords(std::max(nDims, 0));
   for (int tile = 0; tile < nUsedChunks; ++tile) {
 	  ets.seekg(4,ios::cur);
-	  vector<int> curTileCoords;
    	  for (int i=0; i<nDims; i++) {
 		  ets.read(memblock,4);
-		  curTileCoords.push_back(*reinterpret_cast<int*>(memblock));
+		  curTileCoords[i] = *reinterpret_cast<int*>(memblock);
 	  }
 	  ets.read(memblockLong,8);
 	  _tileOffsets.push_back(*reinterpret_cast<unsigned long long*>(memblockLong));
         ets.read(memblock,4);
 	  int nrBytes = *reinterpret_cast<int*>(memblock);
+	  _tileByteCounts.push_back(nrBytes);
 	  ets.seekg(4, ios::cur);
-	  _tileCoords.push_back(curTileCoords);
-  }
-  int maxX = 0;
-  int maxY = 0;
-
-  for (vector<vector<int> >::iterator t = _tileCoords.begin(); t != _tileCoords.end(); ++t) {
-	  if ((*t)[0] > maxX) {
-	  maxX = (*t)[0];
-	  }
-	  if ((*t)[1] > maxY) {
-	  maxY = (*t)[1];
-	  }
+    if (nDims < 2 || !ets) {
+      continue;
+    }
+    const int col = curTileCoords[0], row = curTileCoords[1];
+    const int level = nDims > 3 ? curTileCoords[3] : 0;
+    if (col < 0 || row < 0 || level < 0 || level > 255) {
+      continue;
+    }
+    _tileIndex.insert(std::make_pair(makeTileKey(level, 0, col, row), static_cast<unsigned int>(_tileOffsets.size() - 1)));
+    if (level >= static_cast<int>(levelTilesX.size())) {
+      levelTilesX.resize(level + 1, 0);
+      levelTilesY.resize(level + 1, 0);
+    }
+    levelTilesX[level] = std::max(levelTilesX[level], col + 1);
+    levelTilesY[level] = std::max(levelTilesY[level], row + 1);
   }
   std::vector<unsigned long long> L0Dims(2,0);
-  if (maxX > 1) {
-	  L0Dims[0] = _tileSizeX * (maxX + 1);
-  }
-  else {
-	  L0Dims[0] = _tileSizeX;
-  }
-  if (maxY > 1) {
-	  L0Dims[1] = _tileSizeY * (maxY + 1);
-  }
-  else {
-	  L0Dims[1] = _tileSizeY;
+  if (!levelTilesX.empty()) {
+	  L0Dims[0] = static_cast<unsigned long long>(_tileSizeX) * std::max(levelTilesX[0], 1);
+	  L0Dims[1] = static_cast<unsigned long long>(_tileSizeY) * std::max(levelTilesY[0], 1);
   }
   _levelDimensions.push_back(L0Dims);
 
-  if (maxY > 1) {
-	  _nrTilesY = maxY + 1;
-  }
-  else {
-	  _nrTilesY = 1;
-  }
-  if (maxX > 1) {
-	  _nrTilesX = maxX + 1;
-  }
-  else {
-	  _nrTilesX = 1;
+  // Every stored resolution level halves the one before it; the levels are used up to the first one
+  // that is missing from the file
+  for (unsigned int level = 1; level < levelTilesX.size() && levelTilesX[level] > 0; ++level) {
+    std::vector<unsigned long long> levelDims(2, 0);
+    levelDims[0] = (L0Dims[0] + (1ULL << level) - 1) >> level;
+    levelDims[1] = (L0Dims[1] + (1ULL << level) - 1) >> level;
+    if (levelDims[0] == 0 || levelDims[1] == 0) {
+      break;
+    }
+    _levelDimensions.push_back(levelDims);
   }
 
   delete[] memblock;
   delete[] memblockLong;
 
   // Set some defaults for VSI
-  _numberOfLevels = 1;
+  _numberOfLevels = static_cast<unsigned int>(_levelDimensions.size());
   _samplesPerPixel = 3;
   _colorType = RGB;
   _dataType = UChar;
@@ -212,108 +251,157 @@ unsigned long long VSIImage::parseETSFile(std::ifstream& ets) {
   return L0Dims[0]*L0Dims[1];
 }
 
-char* VSIImage::decodeTile(int no, int row, int col) const {	
-  int size = _tileSizeX*_tileSizeY*3;
-  char* buf = new char[size];
-  std::fill(buf, buf + size, 255);
-	if (no!=_tileCoords.size()) {
-		ifstream ets;
-		ets.open(_etsFile.c_str(), ios::in | ios::binary);
-		ets.seekg(_tileOffsets[no]);
-    ets.read(buf, size);
-    if (_compressionType == 0) {
-      return buf;
+const unsigned char* VSIImage::decodeTile(const unsigned int& no, const unsigned int& scaleShift, const long long& regionX, const long long& regionY,
+  const long long& regionWidth, const long long& regionHeight, const unsigned int& threads) const {
+  TileDecoder& decoder = threadDecoder();
+  const unsigned long long tileWidth = _tileSizeX >> scaleShift, tileHeight = _tileSizeY >> scaleShift;
+  const unsigned long long size = tileWidth * tileHeight * 3;
+  std::vector<unsigned char>& buf = decoder.decoded;
+  buf.resize(static_cast<unsigned long long>(_tileSizeX) * _tileSizeY * 3);
+  std::fill(buf.begin(), buf.begin() + size, 255);
+	if (no >= _tileOffsets.size() || !_source) {
+    return buf.data();
+  }
+  if (_compressionType == 0) {
+    _source->read(_tileOffsets[no], size, buf.data());
+    _statistics->recordBytesRead(size);
+    return buf.data();
+  }
+  // Compressed tiles are decoded straight from the mapping when the file is memory-mapped
+  const unsigned long long offset = _tileOffsets[no];
+  const unsigned long long byteCount = offset < _source->size() ? std::min(_tileByteCounts[no], _source->size() - offset) : 0;
+  const unsigned char* encoded = _source->data() && byteCount > 0 ? _source->data() + offset : NULL;
+  if (!encoded) {
+    decoder.encoded.resize(byteCount);
+    _source->read(offset, byteCount, decoder.encoded.data());
+    encoded = decoder.encoded.data();
+  }
+  _statistics->recordBytesRead(byteCount);
+  if (_compressionType == 3 && byteCount > 0) {
+    // Only the code blocks of the region are decoded, a whole tile goes straight into the tile buffer
+    JPEG2000Codec::DecodeParameters parameters;
+    parameters.reduce = scaleShift;
+    parameters.x = static_cast<unsigned int>(regionX << scaleShift);
+    parameters.y = static_cast<unsigned int>(regionY << scaleShift);
+    parameters.width = static_cast<unsigned int>(regionWidth << scaleShift);
+    parameters.height = static_cast<unsigned int>(regionHeight << scaleShift);
+    parameters.threads = threads;
+    const bool wholeTile = regionX == 0 && regionY == 0 && regionWidth == tileWidth && regionHeight == tileHeight;
+    const unsigned long long regionBytes = regionWidth * regionHeight * 3;
+    std::vector<unsigned char>& target = wholeTile ? buf : decoder.region;
+    if (target.size() < regionBytes) {
+      target.resize(regionBytes);
     }
-    else if (_compressionType == 3) {
-      JPEG2000Codec cod;
-      cod.decode((unsigned char*)buf, size, size);
+    unsigned int decodedWidth = 0, decodedHeight = 0;
+    ImageStatisticsCollector::DecodeTimer timer(_statistics.get(), JPEG2000Decoding);
+    if (!decoder.jp2000.decode(encoded, static_cast<unsigned int>(byteCount), target.data(), static_cast<unsigned int>(regionBytes), parameters, decodedWidth, decodedHeight) ||
+        decodedWidth != regionWidth || decodedHeight != regionHeight) {
+      std::fill(buf.begin(), buf.begin() + size, 255);
     }
-    else if (_compressionType == 2 || _compressionType == 5) {
-      jpeg_decompress_struct cinfo;
-      jpeg_error_mgr jerr; //error handling
-      jpeg_source_mgr src_mem;
-      jpeg_create_decompress(&cinfo);
-      cinfo.err = jpeg_std_error(&jerr);      
-      jpeg_mem_src(&cinfo, &src_mem, (void*)buf, size);
-      jpeg_read_header(&cinfo, true);
-      if (_compressionType == 2) {
-        cinfo.jpeg_color_space = JCS_YCbCr;
-      } else {
-        cinfo.jpeg_color_space = JCS_RGB;
+    else if (!wholeTile) {
+      for (long long y = 0; y < regionHeight; ++y) {
+        std::copy(target.begin() + y * regionWidth * 3, target.begin() + (y + 1) * regionWidth * 3, buf.begin() + ((regionY + y) * tileWidth + regionX) * 3);
       }
-      jpeg_start_decompress(&cinfo);
-      unsigned char* outBuf = new unsigned char[size];
-      unsigned char* line = outBuf;
-      while (cinfo.output_scanline < cinfo.output_height) {
-        jpeg_read_scanlines (&cinfo, &line, 1);
-        line += 3*cinfo.output_width;
+    }
+  }
+  else if ((_compressionType == 2 || _compressionType == 5) && byteCount > 0) {
+    ImageStatisticsCollector::DecodeTimer timer(_statistics.get(), JPEGDecoding);
+    jpeg_decompress_struct& cinfo = decoder.cinfo;
+    jpeg_mem_src(&cinfo, &decoder.source, (void*)encoded, byteCount);
+    jpeg_read_header(&cinfo, true);
+    if (_compressionType == 2) {
+      cinfo.jpeg_color_space = JCS_YCbCr;
+    } else {
+      cinfo.jpeg_color_space = JCS_RGB;
+    }
+    // Reduced resolutions come straight out of the DCT, without decoding the full tile first
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1 << scaleShift;
+    jpeg_start_decompress(&cinfo);
+    decoder.line.resize(static_cast<unsigned long long>(cinfo.output_width) * cinfo.output_components);
+    const unsigned long long lineBytes = std::min<unsigned long long>(cinfo.output_width, tileWidth) * 3;
+    while (cinfo.output_scanline < cinfo.output_height) {
+      const unsigned long long row = cinfo.output_scanline;
+      const bool direct = cinfo.output_width == tileWidth && cinfo.output_components == 3 && row < tileHeight;
+      JSAMPROW line = direct ? buf.data() + row * tileWidth * 3 : decoder.line.data();
+      jpeg_read_scanlines(&cinfo, &line, 1);
+      if (!direct && row < tileHeight && cinfo.output_components == 3) {
+        std::copy(line, line + lineBytes, buf.begin() + row * tileWidth * 3);
       }
-      jpeg_finish_decompress(&cinfo);
-      jpeg_destroy_decompress(&cinfo);
-      delete[] buf;
-      buf = (char*)outBuf;
     }
-	}
-	return buf;
+    jpeg_finish_decompress(&cinfo);
+  }
+	return buf.data();
 }
 
-void* VSIImage::readDataFromImage(const long long& startX, const long long& startY, const unsigned long long& width, 
-    const unsigned long long& height, const unsigned int& level) {
-    if (level!=0) {
-      return NULL;
+void VSIImage::readDataIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride) {
+    if (level >= _numberOfLevels) {
+      return;
     }
-    int dataSize = width*height*_samplesPerPixel;
-    unsigned char* data = new unsigned char[dataSize];
-    std::fill(data, data + dataSize, 255);
-    int tileRows = _nrTilesY;
-    int tileCols = _nrTilesX;
-
-    Box image = Box(startX, startY, width, height);
-    int outputRow = 0, outputCol = 0;
-    int outputRowLen = width * 3;
-
-	  Box intersection(0,0,0,0);
-    for (int row=0; row<tileRows; row++) {
-      for (int col=0; col<tileCols; col++) {
-        int width = _tileSizeX;
-        int height = _tileSizeY;
-        Box tile = Box(col * width, row * height, width, height);
-        if (!tile.intersects(image)) {
-          continue;
-        }
+    const double downsample = getLevelDownsample(level);
+    const long long levelStartX = static_cast<long long>(std::floor(startX / downsample + 0.5));
+    const long long levelStartY = static_cast<long long>(std::floor(startY / downsample + 0.5));
+    readTiles(level, 0, levelStartX, levelStartY, width, height, data, dataType, rowStride);
+}
 
-        intersection = tile.intersection(image);
-        int intersectionX = 0;
+bool VSIImage::readScaledDataIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+  const unsigned long long& height, const unsigned int& scaleShift, void* data) {
+  // libjpeg scales by 1/2, 1/4 and 1/8 and OpenJPEG by the resolution levels of the tiles, which have to
+  // divide evenly
+  const bool jpeg = (_compressionType == 2 || _compressionType == 5) && scaleShift <= 3;
+  const bool jpeg2000 = _compressionType == 3 && scaleShift < _jp2000Resolutions;
+  if ((!jpeg && !jpeg2000) || scaleShift == 0 ||
+      ((_tileSizeX >> scaleShift) << scaleShift) != _tileSizeX || ((_tileSizeY >> scaleShift) << scaleShift) != _tileSizeY) {
+    return false;
+  }
+  readTiles(0, scaleShift, startX, startY, width, height, data, UChar, width * _samplesPerPixel);
+  return true;
+}
 
-        if (tile.getStart()[0] < image.getStart()[0]) {
-          intersectionX = image.getStart()[0] - tile.getStart()[0];
-        }
+void VSIImage::readTiles(const unsigned int& level, const unsigned int& scaleShift, const long long& levelStartX, const long long& levelStartY,
+  const unsigned long long& width, const unsigned long long& height, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride) {
+    const long long tileWidth = _tileSizeX >> scaleShift, tileHeight = _tileSizeY >> scaleShift;
+    if (level >= _numberOfLevels || tileWidth == 0 || tileHeight == 0) {
+      return;
+    }
+    unsigned char* destination = static_cast<unsigned char*>(data);
+    const unsigned long long destinationRowBytes = rowStride * bytesPerSample(dataType);
+    const unsigned int sampleBytes = bytesPerSample(dataType);
+    for (unsigned long long y = 0; y < height; ++y) {
+      fillSamples(destination + y * destinationRowBytes, dataType, width * _samplesPerPixel, 255);
+    }
+    const long long levelWidth = static_cast<long long>((_levelDimensions[level][0] + (1ULL << scaleShift) - 1) >> scaleShift);
+    const long long levelHeight = static_cast<long long>((_levelDimensions[level][1] + (1ULL << scaleShift) - 1) >> scaleShift);
 
-		    int no=0;
-		    for (vector<vector<int> >::const_iterator it = _tileCoords.begin(); it != _tileCoords.end(); ++it) {
-			    if (((*it)[0] == col) && ((*it)[1] == row && ((*it)[3] == 0))) {
-				    break;
-			    }
-			    no++;
-		    }
-        char* tileBuf =  decodeTile(no, row, col);
-        int rowLen = 3 * (intersection.getSize()[0] < width ? intersection.getSize()[0] : width);
-        int outputOffset = outputRow * outputRowLen + outputCol;
-        for (int trow=0; trow<intersection.getSize()[1]; trow++) {
-          int realRow = trow + intersection.getStart()[1] - tile.getStart()[1];
-          int inputOffset = 3 * (realRow * width + intersectionX);
-          std::memcpy(data+outputOffset, tileBuf+inputOffset, rowLen);
-          outputOffset += outputRowLen;
+    // Only the tiles that intersect the request are visited, positions without a stored tile stay white
+    const long long firstX = std::max(levelStartX, 0LL), firstY = std::max(levelStartY, 0LL);
+    const long long endX = std::min(levelStartX + static_cast<long long>(width), levelWidth);
+    const long long endY = std::min(levelStartY + static_cast<long long>(height), levelHeight);
+    if (firstX >= endX || firstY >= endY) {
+      return;
+    }
+    std::vector<std::pair<unsigned int, std::pair<long long, long long> > > tiles;
+    for (long long row = firstY / tileHeight; row <= (endY - 1) / tileHeight; ++row) {
+      for (long long col = firstX / tileWidth; col <= (endX - 1) / tileWidth; ++col) {
+        std::unordered_map<TileKey, unsigned int>::const_iterator it = _tileIndex.find(makeTileKey(level, 0, col, row));
+        if (it != _tileIndex.end()) {
+          tiles.push_back(std::make_pair(it->second, std::make_pair(col, row)));
         }
-
-        outputCol += rowLen;
-		    delete[] tileBuf;
       }
+    }
 
-      if (intersection.getSize()[0] > 0 && intersection.getSize()[1] > 0) {
-        outputRow += intersection.getSize()[1];
-        outputCol = 0;
+    // The tiles are decoded in parallel, each into its own part of the destination; a single tile uses the
+    // threads of the codec instead
+    runInParallel(tiles.size(), [&](unsigned long long index) {
+      const long long tileX = tiles[index].second.first * tileWidth, tileY = tiles[index].second.second * tileHeight;
+      const long long x0 = std::max(firstX, tileX), x1 = std::min(endX, tileX + tileWidth);
+      const long long y0 = std::max(firstY, tileY), y1 = std::min(endY, tileY + tileHeight);
+      const unsigned char* tileBuf = decodeTile(tiles[index].first, scaleShift, x0 - tileX, y0 - tileY, x1 - x0, y1 - y0, tiles.size() == 1 ? 0 : 1);
+      unsigned char* output = destination + (y0 - levelStartY) * destinationRowBytes + 3 * (x0 - levelStartX) * sampleBytes;
+      for (long long y = y0; y < y1; ++y) {
+        convertSamples(tileBuf + 3 * ((y - tileY) * tileWidth + (x0 - tileX)), output, dataType, 3 * (x1 - x0));
+        output += destinationRowBytes;
       }
-    }
-  return data;
+    });
 }
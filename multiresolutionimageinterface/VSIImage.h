@@ -2,6 +2,7 @@
 #define _VSIImage
 
 #include <vector>
+#include <unordered_map>
 #include "MultiResolutionImage.h"
 #include "multiresolutionimageinterface_export.h"
 
@@ -17,8 +18,10 @@ protected :
 
   void cleanup();
   
-  void* readDataFromImage(const long long& startX, const long long& startY, const unsigned long long& width, 
-    const unsigned long long& height, const unsigned int& level);
+  void readDataIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride);
+  bool readScaledDataIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+    const unsigned long long& height, const unsigned int& scaleShift, void* data);
 
   double getMinValue(int channel = -1) { return 0.; }
   double getMaxValue(int channel = -1) { return 255.; }
@@ -27,14 +30,27 @@ private :
 	std::string _vsiFileName;
 	std::string _etsFile;
 	std::vector<unsigned long long> _tileOffsets;
-	std::vector<std::vector<int> > _tileCoords;
+	std::vector<unsigned long long> _tileByteCounts;
 	unsigned int _tileSizeX;
 	unsigned int _tileSizeY;
-	unsigned int _nrTilesX;
-	unsigned int _nrTilesY;
   unsigned int _compressionType;
-
-  char* decodeTile(int no, int row, int col) const;
+  //! Number of resolution levels in the JPEG2000 tiles, 0 for other compressions
+  unsigned int _jp2000Resolutions;
+
+  //! Index into _tileOffsets of the tile at makeTileKey(level, 0, column, row)
+  std::unordered_map<TileKey, unsigned int> _tileIndex;
+
+  //! Decodes tile no at 1/2^scaleShift of its resolution into a buffer of the calling thread, which stays
+  //! valid until the thread decodes its next tile. JPEG2000 tiles only decode the given region (in pixels
+  //! of the scaled tile) using threads threads (0 for the default of the thread's codec), other tiles are
+  //! decoded whole.
+  const unsigned char* decodeTile(const unsigned int& no, const unsigned int& scaleShift, const long long& regionX, const long long& regionY,
+    const long long& regionWidth, const long long& regionHeight, const unsigned int& threads) const;
+
+  //! Reads a region of level, downsampled by 2^scaleShift, decoding the tiles in parallel. The start is
+  //! in pixels of the downsampled level.
+  void readTiles(const unsigned int& level, const unsigned int& scaleShift, const long long& levelStartX, const long long& levelStartY,
+    const unsigned long long& width, const unsigned long long& height, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride);
   unsigned long long parseETSFile(std::ifstream& ets);
 };
 
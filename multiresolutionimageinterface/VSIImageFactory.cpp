@@ -19,8 +19,6 @@ MultiResolutionImage* VSIImageFactory::readImage(const std::string& fileName) co
 }
 
 bool VSIImageFactory::canReadImage(const std::string& fileName) const {
-  VSIImage* img = new VSIImage();
-  bool canOpen = img->initialize(fileName);
-  delete img;
-  return canOpen;
+  // The VSI file itself is a TIFF holding the overview, the slide is in the ets files next to it
+  return hasTIFFSignature(readFileHeader(fileName));
 }
\ No newline at end of file
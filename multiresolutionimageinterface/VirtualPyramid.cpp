@@ -0,0 +1,310 @@
+#include "VirtualPyramid.h"
+#include "core/PixelConversion.h"
+#include "core/Resampling.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#include <boost/thread.hpp>
+#include <zlib.h>
+
+using namespace pathology;
+
+namespace {
+
+  unsigned int bytesPerSample(const DataType& dataType) {
+    switch (dataType) {
+    case UChar:
+      return 1;
+    case UInt16:
+      return 2;
+    case UInt32:
+    case Float:
+      return 4;
+    default:
+      return 0;
+    }
+  }
+
+  // Identifies the image a sidecar belongs to; written in native byte order
+  struct SidecarHeader {
+    char magic[8];
+    unsigned long long width;
+    unsigned long long height;
+    unsigned int samplesPerPixel;
+    unsigned int dataType;
+    unsigned int tileSize;
+    unsigned int reserved;
+  };
+
+  // Precedes every tile, followed by compressedSize bytes of deflated pixel data
+  struct SidecarRecord {
+    TileKey key;
+    unsigned int rawSize;
+    unsigned int compressedSize;
+  };
+
+  // Bumped whenever the layout of the records or of TileKey changes
+  const char sidecarMagic[8] = {'A', 'S', 'A', 'P', 'V', 'P', 'Y', '2'};
+
+}
+
+// Append-only file of generated tiles with an in-memory index, built by scanning the records when the
+// file is opened. A record that was cut off (e.g. by a crash) ends the scan and is overwritten.
+class VirtualPyramid::Sidecar {
+public :
+  bool open(const std::string& path, const SidecarHeader& header) {
+    _path = path;
+    _file.open(path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    SidecarHeader existing;
+    if (_file.is_open() && _file.read(reinterpret_cast<char*>(&existing), sizeof(existing)) && std::memcmp(&existing, &header, sizeof(header)) == 0) {
+      _file.seekg(0, std::ios::end);
+      const unsigned long long fileSize = static_cast<unsigned long long>(_file.tellg());
+      _file.seekg(sizeof(header));
+      _end = sizeof(header);
+      SidecarRecord record;
+      while (_file.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+        const unsigned long long dataOffset = _end + sizeof(record);
+        if (dataOffset + record.compressedSize > fileSize) {
+          break;
+        }
+        _file.seekg(record.compressedSize, std::ios::cur);
+        Entry entry = {dataOffset, record.rawSize, record.compressedSize};
+        _index[record.key] = entry;
+        _end = dataOffset + record.compressedSize;
+      }
+      _file.clear();
+      return true;
+    }
+    // Missing or written for another image, start over
+    _file.close();
+    _file.clear();
+    _file.open(path.c_str(), std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!_file.is_open() || !_file.write(reinterpret_cast<const char*>(&header), sizeof(header))) {
+      return false;
+    }
+    _end = sizeof(header);
+    return true;
+  }
+
+  ~Sidecar() {
+    if (_file.is_open()) {
+      _file.flush();
+    }
+  }
+
+  const std::string& path() const { return _path; }
+
+  std::shared_ptr<std::vector<unsigned char> > read(const TileKey& key) {
+    std::vector<unsigned char> compressed;
+    Entry entry;
+    {
+      boost::lock_guard<boost::mutex> l(_mutex);
+      std::unordered_map<TileKey, Entry>::const_iterator it = _index.find(key);
+      if (it == _index.end()) {
+        return std::shared_ptr<std::vector<unsigned char> >();
+      }
+      entry = it->second;
+      compressed.resize(entry.compressedSize);
+      _file.seekg(entry.offset);
+      if (!_file.read(reinterpret_cast<char*>(compressed.data()), entry.compressedSize)) {
+        _file.clear();
+        return std::shared_ptr<std::vector<unsigned char> >();
+      }
+    }
+    std::shared_ptr<std::vector<unsigned char> > tile = std::make_shared<std::vector<unsigned char> >(entry.rawSize);
+    uLongf rawSize = entry.rawSize;
+    if (uncompress(tile->data(), &rawSize, compressed.data(), entry.compressedSize) != Z_OK || rawSize != entry.rawSize) {
+      return std::shared_ptr<std::vector<unsigned char> >();
+    }
+    return tile;
+  }
+
+  void write(const TileKey& key, const std::vector<unsigned char>& tile) {
+    // Fast compression, the tiles are written while the user waits for them
+    std::vector<unsigned char> compressed(compressBound(tile.size()));
+    uLongf compressedSize = compressed.size();
+    if (compress2(compressed.data(), &compressedSize, tile.data(), tile.size(), 1) != Z_OK) {
+      return;
+    }
+    boost::lock_guard<boost::mutex> l(_mutex);
+    if (_index.count(key)) {
+      return;
+    }
+    SidecarRecord record = {key, static_cast<unsigned int>(tile.size()), static_cast<unsigned int>(compressedSize)};
+    _file.seekp(_end);
+    _file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    _file.write(reinterpret_cast<const char*>(compressed.data()), compressedSize);
+    if (!_file) {
+      _file.clear();
+      return;
+    }
+    Entry entry = {_end + sizeof(record), record.rawSize, record.compressedSize};
+    _index[key] = entry;
+    _end = entry.offset + entry.compressedSize;
+  }
+
+private :
+  struct Entry {
+    unsigned long long offset;
+    unsigned int rawSize;
+    unsigned int compressedSize;
+  };
+
+  std::string _path;
+  std::fstream _file;
+  unsigned long long _end;
+  std::unordered_map<TileKey, Entry> _index;
+  boost::mutex _mutex;
+};
+
+VirtualPyramid::VirtualPyramid(const std::vector<unsigned long long>& baseDimensions, const unsigned int& samplesPerPixel, const DataType& dataType,
+  const std::shared_ptr<TileCache<std::vector<unsigned char> > >& cache, const BaseReader& readBase, const ParallelRunner& runInParallel,
+  const ScaledReader& readScaled) :
+  _baseDimensions(baseDimensions),
+  _samplesPerPixel(samplesPerPixel),
+  _dataType(dataType),
+  _bytesPerPixel(samplesPerPixel * bytesPerSample(dataType)),
+  _cache(cache),
+  _readBase(readBase),
+  _readScaled(readScaled),
+  _runInParallel(runInParallel)
+{
+  std::vector<unsigned long long> dimensions = baseDimensions;
+  while (dimensions.size() >= 2 && std::max(dimensions[0], dimensions[1]) > tileSize && _levelDimensions.size() < 32) {
+    dimensions[0] = (dimensions[0] + 1) / 2;
+    dimensions[1] = (dimensions[1] + 1) / 2;
+    _levelDimensions.push_back(dimensions);
+  }
+}
+
+VirtualPyramid::~VirtualPyramid() {
+}
+
+std::vector<unsigned long long> VirtualPyramid::dimensionsOf(const unsigned int& level) const {
+  return level == 0 ? _baseDimensions : _levelDimensions[level - 1];
+}
+
+bool VirtualPyramid::openSidecar(const std::string& path) {
+  SidecarHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, sidecarMagic, sizeof(sidecarMagic));
+  header.width = _baseDimensions[0];
+  header.height = _baseDimensions[1];
+  header.samplesPerPixel = _samplesPerPixel;
+  header.dataType = _dataType;
+  header.tileSize = tileSize;
+  std::shared_ptr<Sidecar> sidecar = std::make_shared<Sidecar>();
+  if (!sidecar->open(path, header)) {
+    return false;
+  }
+  std::atomic_store(&_sidecar, sidecar);
+  return true;
+}
+
+void VirtualPyramid::closeSidecar() {
+  std::atomic_store(&_sidecar, std::shared_ptr<Sidecar>());
+}
+
+std::string VirtualPyramid::getSidecarPath() const {
+  std::shared_ptr<Sidecar> sidecar = std::atomic_load(&_sidecar);
+  return sidecar ? sidecar->path() : std::string();
+}
+
+void VirtualPyramid::readRegion(const unsigned int& level, const long long& x, const long long& y, const unsigned long long& width, const unsigned long long& height,
+  const unsigned int& zPlane, void* data, const DataType& dataType, const unsigned long long& rowStride) {
+  if (level == 0 || level > _levelDimensions.size() || _bytesPerPixel == 0) {
+    return;
+  }
+  const std::vector<unsigned long long>& dimensions = _levelDimensions[level - 1];
+  const long long levelWidth = static_cast<long long>(dimensions[0]), levelHeight = static_cast<long long>(dimensions[1]);
+  const long long startX = std::max(x, 0LL), startY = std::max(y, 0LL);
+  const long long endX = std::min(x + static_cast<long long>(width), levelWidth), endY = std::min(y + static_cast<long long>(height), levelHeight);
+  if (startX >= endX || startY >= endY) {
+    return;
+  }
+  const long long firstTileX = startX / tileSize, firstTileY = startY / tileSize;
+  const long long numberOfTilesX = (endX - 1) / tileSize - firstTileX + 1, numberOfTilesY = (endY - 1) / tileSize - firstTileY + 1;
+  unsigned char* destination = static_cast<unsigned char*>(data);
+  const unsigned int destinationSampleSize = bytesPerSample(dataType);
+
+  // Tiles that have to be generated are generated in parallel
+  _runInParallel(numberOfTilesX * numberOfTilesY, [&](unsigned long long index) {
+    const long long tileX = firstTileX + static_cast<long long>(index % numberOfTilesX);
+    const long long tileY = firstTileY + static_cast<long long>(index / numberOfTilesX);
+    std::shared_ptr<std::vector<unsigned char> > tile = getTile(level, zPlane, tileX, tileY);
+    if (!tile) {
+      return;
+    }
+    const long long tileWidth = std::min(static_cast<long long>(tileSize), levelWidth - tileX * tileSize);
+    const long long x0 = std::max(startX, tileX * tileSize), x1 = std::min(endX, tileX * tileSize + tileWidth);
+    const long long y0 = std::max(startY, tileY * tileSize), y1 = std::min(endY, (tileY + 1) * tileSize);
+    for (long long row = y0; row < y1; ++row) {
+      const unsigned char* source = tile->data() + ((row - tileY * tileSize) * tileWidth + (x0 - tileX * tileSize)) * _bytesPerPixel;
+      unsigned char* target = destination + ((row - y) * rowStride + (x0 - x) * _samplesPerPixel) * destinationSampleSize;
+      core::convertSamples(source, _dataType, target, dataType, (x1 - x0) * _samplesPerPixel);
+    }
+  });
+}
+
+std::shared_ptr<std::vector<unsigned char> > VirtualPyramid::getTile(const unsigned int& level, const unsigned int& zPlane, const long long& tileX, const long long& tileY) {
+  // Planes that do not fit in a tile key are generated every time
+  if (zPlane >= maxTileKeyZPlanes) {
+    return generateTile(level, zPlane, tileX, tileY);
+  }
+  const TileKey key = makeTileKey(level, zPlane, tileX, tileY);
+  std::shared_ptr<std::vector<unsigned char> > tile;
+  unsigned int size = 0;
+  if (_cache->get(key, tile, size)) {
+    return tile;
+  }
+  std::shared_ptr<Sidecar> sidecar = std::atomic_load(&_sidecar);
+  if (sidecar) {
+    tile = sidecar->read(key);
+  }
+  if (!tile) {
+    tile = generateTile(level, zPlane, tileX, tileY);
+    if (sidecar) {
+      sidecar->write(key, *tile);
+    }
+  }
+  _cache->set(key, tile, static_cast<unsigned int>(tile->size()));
+  return tile;
+}
+
+std::shared_ptr<std::vector<unsigned char> > VirtualPyramid::generateTile(const unsigned int& level, const unsigned int& zPlane, const long long& tileX, const long long& tileY) {
+  const std::vector<unsigned long long> dimensions = dimensionsOf(level), sourceDimensions = dimensionsOf(level - 1);
+  const unsigned long long width = std::min(static_cast<unsigned long long>(tileSize), dimensions[0] - tileX * tileSize);
+  const unsigned long long height = std::min(static_cast<unsigned long long>(tileSize), dimensions[1] - tileY * tileSize);
+  std::shared_ptr<std::vector<unsigned char> > tile = std::make_shared<std::vector<unsigned char> >(width * height * _bytesPerPixel);
+
+  // Readers that decode reduced resolutions directly (JPEG with DCT scaling) skip the levels below; they
+  // only store a single z-plane
+  if (_readScaled && zPlane == 0 && _readScaled(tileX * tileSize, tileY * tileSize, width, height, level, tile->data())) {
+    return tile;
+  }
+  const long long sourceX = 2 * tileX * tileSize, sourceY = 2 * tileY * tileSize;
+  const unsigned long long sourceWidth = std::min(2 * width, sourceDimensions[0] - sourceX);
+  const unsigned long long sourceHeight = std::min(2 * height, sourceDimensions[1] - sourceY);
+  std::vector<unsigned char> source(sourceWidth * sourceHeight * _bytesPerPixel);
+  {
+    // The tiles below are only needed for this tile, they should not push out the tiles that are viewed
+    ScopedCacheAccessHint scan(ScanCacheAccess);
+    if (level == 1) {
+      _readBase(sourceX, sourceY, sourceWidth, sourceHeight, zPlane, source.data());
+    }
+    else {
+      readRegion(level - 1, sourceX, sourceY, sourceWidth, sourceHeight, zPlane, source.data(), _dataType, sourceWidth * _samplesPerPixel);
+    }
+  }
+  if (sourceWidth == 2 * width && sourceHeight == 2 * height) {
+    core::downsample(source.data(), _dataType, _samplesPerPixel, sourceWidth, sourceHeight, sourceWidth * _samplesPerPixel, 2,
+      tile->data(), width * _samplesPerPixel, core::AreaResampling);
+  }
+  else {
+    // Odd sizes at the right and bottom edges leave the last pixels with less than 2x2 source pixels
+    core::resample(source.data(), _dataType, _samplesPerPixel, sourceWidth, sourceHeight, sourceWidth * _samplesPerPixel, 0., 0., 2., 2.,
+      tile->data(), _dataType, width, height, width * _samplesPerPixel, core::AreaResampling);
+  }
+  return tile;
+}
@@ -0,0 +1,72 @@
+#ifndef VIRTUALPYRAMID_H
+#define VIRTUALPYRAMID_H
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "TileCache.h"
+#include "core/PathologyEnums.h"
+
+//! Downsampled levels generated on demand from level 0, for images that are stored without a pyramid.
+//! Every generated level is half the size of the one below it and is made of tiles that average 2x2 pixels
+//! of the tiles below them, so a tile of the top level reads level 0 only once. Generated tiles are kept in
+//! a tile cache and, if a sidecar file is opened, stored in it so later sessions do not generate them again.
+class VirtualPyramid {
+public :
+  //! Reads a region of the given z-plane of level 0 in the data type of the image, with rows of width pixels
+  typedef std::function<void(const long long&, const long long&, const unsigned long long&, const unsigned long long&, const unsigned int&, void*)> BaseReader;
+
+  //! Reads a region of level 0 downsampled by 2^scaleShift, with x, y, width and height in pixels of the
+  //! downsampled image, or returns false if the reader cannot decode at that scale directly
+  typedef std::function<bool(const long long&, const long long&, const unsigned long long&, const unsigned long long&, const unsigned int&, void*)> ScaledReader;
+
+  //! Calls work(index) for every index below count, possibly in parallel
+  typedef std::function<void(const unsigned long long&, const std::function<void(unsigned long long)>&)> ParallelRunner;
+
+  static const unsigned int tileSize = 512;
+
+  VirtualPyramid(const std::vector<unsigned long long>& baseDimensions, const unsigned int& samplesPerPixel, const pathology::DataType& dataType,
+    const std::shared_ptr<TileCache<std::vector<unsigned char> > >& cache, const BaseReader& readBase, const ParallelRunner& runInParallel,
+    const ScaledReader& readScaled = ScaledReader());
+  ~VirtualPyramid();
+
+  //! Dimensions of the generated levels, the first entry is level 1. Levels are added until the image
+  //! fits in a single tile; an image that already does gets none.
+  const std::vector<std::vector<unsigned long long> >& getLevelDimensions() const { return _levelDimensions; }
+
+  //! Reads a region of generated level (1 or higher), x and y are in pixels of the level. Pixels outside
+  //! the level are left untouched.
+  void readRegion(const unsigned int& level, const long long& x, const long long& y, const unsigned long long& width, const unsigned long long& height,
+    const unsigned int& zPlane, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride);
+
+  //! Opens (or creates) a sidecar file for the generated tiles. A file that was written for an image with
+  //! other dimensions or pixel type is started over. Returns false if the file cannot be opened.
+  bool openSidecar(const std::string& path);
+  void closeSidecar();
+  std::string getSidecarPath() const;
+
+private :
+  class Sidecar;
+
+  VirtualPyramid(const VirtualPyramid& other);
+  VirtualPyramid& operator=(const VirtualPyramid& other);
+
+  std::vector<unsigned long long> dimensionsOf(const unsigned int& level) const;
+
+  //! Returns the tile from the cache or the sidecar, or generates it from the level below
+  std::shared_ptr<std::vector<unsigned char> > getTile(const unsigned int& level, const unsigned int& zPlane, const long long& tileX, const long long& tileY);
+  std::shared_ptr<std::vector<unsigned char> > generateTile(const unsigned int& level, const unsigned int& zPlane, const long long& tileX, const long long& tileY);
+
+  std::vector<unsigned long long> _baseDimensions;
+  std::vector<std::vector<unsigned long long> > _levelDimensions;
+  unsigned int _samplesPerPixel;
+  pathology::DataType _dataType;
+  unsigned int _bytesPerPixel;
+  std::shared_ptr<TileCache<std::vector<unsigned char> > > _cache;
+  BaseReader _readBase;
+  ScaledReader _readScaled;
+  ParallelRunner _runInParallel;
+  std::shared_ptr<Sidecar> _sidecar;
+};
+
+#endif
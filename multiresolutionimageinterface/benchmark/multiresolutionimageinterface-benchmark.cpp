@@ -0,0 +1,145 @@
+#include "UnitTest++/UnitTest++.h"
+#include "TileCache.h"
+#include "JPEG2000Codec.h"
+#include "core/PathologyEnums.h"
+#include "core/PixelConversion.h"
+#include <iostream>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+using namespace UnitTest;
+using namespace std;
+using namespace pathology;
+
+namespace
+{
+  SUITE(MultiResolutionImageInterfaceBenchmarks)
+  {
+
+    TEST(TestTileCacheLookupBenchmark)
+    {
+      const unsigned int nrTiles = 1000000;
+      TileCache<unsigned char> cache(nrTiles);
+      std::shared_ptr<unsigned char> tile(new unsigned char[1], std::default_delete<unsigned char[]>());
+      for (unsigned int i = 0; i < nrTiles; ++i) {
+        cache.set(makeTileKey(0, 0, i % 1000, i / 1000), tile, 1);
+      }
+      std::shared_ptr<unsigned char> cached;
+      unsigned int size = 0, hits = 0;
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (unsigned int i = 0; i < nrTiles; ++i) {
+        hits += cache.get(makeTileKey(0, 0, (i * 7919) % 1000, (i * 104729) % 1000), cached, size);
+      }
+      double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+      CHECK_EQUAL(nrTiles, hits);
+      cout << "TileCache lookup with " << nrTiles << " tiles: " << elapsed / nrTiles << " ns per lookup" << endl;
+    }
+
+    TEST(TestPixelConversionBenchmark)
+    {
+      const unsigned long long nrPixels = 1000003;
+      std::vector<unsigned char> bgra(nrPixels * 4), rgbScalar(nrPixels * 3), rgbVector(nrPixels * 3);
+      for (unsigned long long i = 0; i < nrPixels; ++i) {
+        unsigned char alpha = (i / 64) % 4 == 0 ? static_cast<unsigned char>(i * 37) : ((i / 64) % 4 == 1 ? 0 : 255);
+        bgra[i * 4] = static_cast<unsigned char>(std::min<unsigned long long>(i * 7 % 256, alpha));
+        bgra[i * 4 + 1] = static_cast<unsigned char>(std::min<unsigned long long>(i * 13 % 256, alpha));
+        bgra[i * 4 + 2] = static_cast<unsigned char>(std::min<unsigned long long>(i * 29 % 256, alpha));
+        bgra[i * 4 + 3] = alpha;
+      }
+      const unsigned char background[3] = {255, 255, 255};
+      std::vector<float> floatsScalar(nrPixels * 4), floatsVector(nrPixels * 4);
+      std::vector<unsigned char> swapScalar(bgra), swapVector(bgra);
+
+      const core::SIMDInstructionSet detected = core::getSIMDInstructionSet();
+      core::setMaximumSIMDInstructionSet(core::ScalarInstructions);
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      core::unpremultiplyBGRAToRGB(bgra.data(), rgbScalar.data(), nrPixels, background);
+      core::convertSamples(bgra.data(), pathology::UChar, floatsScalar.data(), pathology::Float, nrPixels * 4);
+      core::swapRedAndBlue(swapScalar.data(), pathology::UChar, nrPixels);
+      double scalarTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+      core::setMaximumSIMDInstructionSet(core::AVX2Instructions);
+      start = std::chrono::steady_clock::now();
+      core::unpremultiplyBGRAToRGB(bgra.data(), rgbVector.data(), nrPixels, background);
+      core::convertSamples(bgra.data(), pathology::UChar, floatsVector.data(), pathology::Float, nrPixels * 4);
+      core::swapRedAndBlue(swapVector.data(), pathology::UChar, nrPixels);
+      double vectorTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+      CHECK(rgbScalar == rgbVector);
+      CHECK(floatsScalar == floatsVector);
+      CHECK(swapScalar == swapVector);
+      CHECK_EQUAL(detected, core::getSIMDInstructionSet());
+      cout << "Pixel conversion of " << nrPixels << " pixels: " << scalarTime << " ms scalar, " << vectorTime << " ms with instruction set " << detected << endl;
+    }
+
+    TEST(TestJPEG2000DecodeBenchmark)
+    {
+      // A lossless tile, so the decodes can be checked against the pixels
+      const unsigned int tileSize = 512, nrDecodes = 10;
+      std::vector<unsigned char> pixels(tileSize * tileSize * 3);
+      for (unsigned int y = 0; y < tileSize; ++y) {
+        for (unsigned int x = 0; x < tileSize; ++x) {
+          for (unsigned int c = 0; c < 3; ++c) {
+            pixels[(y * tileSize + x) * 3 + c] = static_cast<unsigned char>((x * (c + 1) + y * 2) / 4 + (x * y) % 7);
+          }
+        }
+      }
+      JPEG2000Codec codec;
+      std::vector<unsigned char> encoded(pixels);
+      unsigned int encodedSize = static_cast<unsigned int>(encoded.size());
+      codec.encode(reinterpret_cast<char*>(encoded.data()), encodedSize, tileSize, 100, 3, UChar, RGB);
+      encoded.resize(encodedSize);
+      const unsigned int resolutions = JPEG2000Codec::getNumberOfResolutions(encoded.data(), encodedSize);
+      CHECK(resolutions > 2);
+
+      // The in-place decode the readers used before
+      std::vector<unsigned char> inPlace(pixels.size());
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (unsigned int i = 0; i < nrDecodes; ++i) {
+        std::copy(encoded.begin(), encoded.end(), inPlace.begin());
+        codec.decode(inPlace.data(), encodedSize, static_cast<unsigned int>(inPlace.size()));
+      }
+      double inPlaceTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / nrDecodes;
+      CHECK(inPlace == pixels);
+
+      std::vector<unsigned char> decoded(pixels.size());
+      unsigned int width = 0, height = 0;
+      JPEG2000Codec::DecodeParameters parameters;
+      parameters.threads = 4;
+      start = std::chrono::steady_clock::now();
+      for (unsigned int i = 0; i < nrDecodes; ++i) {
+        CHECK(codec.decode(encoded.data(), encodedSize, decoded.data(), static_cast<unsigned int>(decoded.size()), parameters, width, height));
+      }
+      double threadedTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / nrDecodes;
+      CHECK(decoded == pixels);
+      CHECK_EQUAL(tileSize, width);
+
+      parameters.threads = 1;
+      parameters.reduce = 2;
+      start = std::chrono::steady_clock::now();
+      for (unsigned int i = 0; i < nrDecodes; ++i) {
+        CHECK(codec.decode(encoded.data(), encodedSize, decoded.data(), static_cast<unsigned int>(decoded.size()), parameters, width, height));
+      }
+      double reducedTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / nrDecodes;
+      CHECK_EQUAL(tileSize / 4, width);
+      CHECK_EQUAL(tileSize / 4, height);
+
+      parameters.reduce = 0;
+      parameters.x = 128;
+      parameters.y = 256;
+      parameters.width = 128;
+      parameters.height = 64;
+      start = std::chrono::steady_clock::now();
+      for (unsigned int i = 0; i < nrDecodes; ++i) {
+        CHECK(codec.decode(encoded.data(), encodedSize, decoded.data(), static_cast<unsigned int>(decoded.size()), parameters, width, height));
+      }
+      double regionTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / nrDecodes;
+      CHECK_EQUAL(128, width);
+      CHECK_EQUAL(64, height);
+      cout << "JPEG2000 decode of a " << tileSize << "x" << tileSize << " tile: " << inPlaceTime << " ms in place, " << threadedTime << " ms with 4 threads, "
+        << reducedTime << " ms at 1/4 resolution, " << regionTime << " ms for a 128x64 region" << endl;
+    }
+  }
+}
@@ -8,15 +8,19 @@
 
 %{
 #define SWIG_FILE_WITH_INIT
+#include "ImageMetadata.h"
 #include "MultiResolutionImageReader.h"
 #include "MultiResolutionImageWriter.h"
 #include "MultiResolutionImage.h"
 #include "TIFFImage.h"
+#include "TileCacheManager.h"
+#include "ImageStatistics.h"
 #include "multiresolutionimageinterface_export.h"
 #include "../config/ASAPMacros.h"
 #include "../core/Point.h"
 #include "../core/ProgressMonitor.h"
 #include "../core/CmdLineProgressMonitor.h"
+#include "../core/Resampling.h"
 #include "../annotation/AnnotationBase.h"
 #include "../annotation/Annotation.h"
 #include "../annotation/AnnotationGroup.h"
@@ -56,6 +60,10 @@ namespace std {
   %template(vector_point) vector<Point>;
   %template(map_int_string) map<int, string>;
   %template(map_string_int) map<string, int>;
+  %template(map_string_string) map<string, string>;
+  %template(vector_vector_unsigned_long_long) vector<vector<unsigned long long> >;
+  %template(vector_managed_cache_statistics) vector<ManagedCacheStatistics>;
+  %template(vector_decode_statistics) vector<DecodeStatistics>;
 }
 %include "numpy.i"
 
@@ -63,6 +71,31 @@ namespace std {
 import_array();
 %}
 
+%{
+// Reads the patches at (xs[i], ys[i]) into a single [n, height, width, samples] array in one batch
+template <typename T>
+PyObject* readPatchesIntoArray(MultiResolutionImage* image, const std::vector<long long>& xs, const std::vector<long long>& ys,
+                               const unsigned long long& width, const unsigned long long& height, const unsigned int& level, int npyType) {
+  unsigned int nrPatches = std::min(xs.size(), ys.size());
+  unsigned int nrSamples = image->getSamplesPerPixel();
+  npy_intp dimsDesc[4];
+  dimsDesc[0] = nrPatches;
+  dimsDesc[1] = height;
+  dimsDesc[2] = width;
+  dimsDesc[3] = nrSamples;
+  PyObject* patches = PyArray_SimpleNew(4, dimsDesc, npyType);
+  T* array_data = (T*)PyArray_DATA((PyArrayObject*)patches);
+  std::vector<RegionRequest> requests;
+  std::vector<T*> outputs;
+  for (unsigned int i = 0; i < nrPatches; ++i) {
+    requests.push_back(RegionRequest(xs[i], ys[i], width, height, level));
+    outputs.push_back(array_data + i * width * height * nrSamples);
+  }
+  image->readRegions(requests, outputs);
+  return patches;
+}
+%}
+
 #ifdef SWIG
 #define MULTIRESOLUTIONIMAGEINTERFACE_EXPORT
 #define CORE_EXPORT
@@ -90,6 +123,26 @@ import_array();
 %include "../annotation/ImageScopeRepository.h"
 
 %numpy_typemaps(void, NPY_NOTYPE, int)
+%ignore ByteSource::open;
+%ignore ByteSource::read;
+%ignore ByteSource::data;
+%include "ByteSource.h";
+%ignore TileCacheBase;
+%ignore TileCache;
+%ignore TileCachePolicy;
+%ignore ScopedCacheAccessHint;
+%include "TileCache.h";
+%ignore TileCacheManager::registerCache;
+%ignore TileCacheManager::unregisterCache;
+%ignore TileCacheManager::isRegistered;
+%ignore TileCacheManager::enforceBudget;
+%include "TileCacheManager.h";
+%ignore ImageStatisticsCollector;
+%include "ImageStatistics.h";
+%ignore core::resample;
+%ignore core::getResamplingSupport;
+%include "../core/Resampling.h";
+%ignore MultiResolutionImage::readRegions;
 %include "MultiResolutionImage.h";
 %include "TIFFImage.h";
 
@@ -102,11 +155,8 @@ import_array();
 		dimsDesc[1] = width;
 		dimsDesc[2] = nrSamples;
 		PyObject* patch = PyArray_SimpleNew(3, dimsDesc, NPY_UBYTE);
-		unsigned char* tmp = new unsigned char[height*width*nrSamples];
-		self->getRawRegion(startX, startY, width, height, level, tmp);
 		unsigned char* array_data = (unsigned char*)PyArray_DATA((PyArrayObject*)patch);
-		std::copy(tmp, tmp + height*width*nrSamples, array_data);
-		delete[] tmp;
+		self->getRawRegion(startX, startY, width, height, level, array_data, width*nrSamples);
 		return patch;
 	}
 };
@@ -119,11 +169,8 @@ import_array();
 		dimsDesc[1] = width;
 		dimsDesc[2] = nrSamples;
 		PyObject* patch = PyArray_SimpleNew(3, dimsDesc, NPY_UINT16);
-		unsigned short* tmp = new unsigned short[height*width*nrSamples];
-		self->getRawRegion(startX, startY, width, height, level, tmp);
 		unsigned short* array_data = (unsigned short*)PyArray_DATA((PyArrayObject*)patch);
-		std::copy(tmp, tmp + height*width*nrSamples, array_data);
-		delete[] tmp;
+		self->getRawRegion(startX, startY, width, height, level, array_data, width*nrSamples);
 		return patch;
 	}
 };
@@ -136,11 +183,8 @@ import_array();
 		dimsDesc[1] = width;
 		dimsDesc[2] = nrSamples;
 		PyObject* patch = PyArray_SimpleNew(3, dimsDesc, NPY_UINT32);
-		unsigned int* tmp = new unsigned int[height*width*nrSamples];
-		self->getRawRegion(startX, startY, width, height, level, tmp);
 		unsigned int* array_data = (unsigned int*)PyArray_DATA((PyArrayObject*)patch);
-		std::copy(tmp, tmp + height*width*nrSamples, array_data);
-		delete[] tmp;
+		self->getRawRegion(startX, startY, width, height, level, array_data, width*nrSamples);
 		return patch;
 	}
 };
@@ -153,14 +197,63 @@ import_array();
 		dimsDesc[1] = width;
 		dimsDesc[2] = nrSamples;
 		PyObject* patch = PyArray_SimpleNew(3, dimsDesc, NPY_FLOAT);
-		float* tmp = new float[height*width*nrSamples];
-		self->getRawRegion(startX, startY, width, height, level, tmp);
 		float* array_data = (float*)PyArray_DATA((PyArrayObject*)patch);
-		std::copy(tmp, tmp + height*width*nrSamples, array_data);
-		delete[] tmp;
+		self->getRawRegion(startX, startY, width, height, level, array_data, width*nrSamples);
+		return patch;
+	}
+};
+%extend MultiResolutionImage {
+     PyObject* getUCharPatchAtDownsample(const long long& startX, const long long& startY, const unsigned long long& width, 
+						     const unsigned long long& height, const double& downsample, const core::ResamplingFilter& filter = core::AreaResampling) { 
+		unsigned int nrSamples = self->getSamplesPerPixel();
+        npy_intp dimsDesc[3];
+		dimsDesc[0] = height;
+		dimsDesc[1] = width;
+		dimsDesc[2] = nrSamples;
+		PyObject* patch = PyArray_SimpleNew(3, dimsDesc, NPY_UBYTE);
+		unsigned char* array_data = (unsigned char*)PyArray_DATA((PyArrayObject*)patch);
+		self->getRegionAtDownsample(startX, startY, width, height, downsample, array_data, filter);
 		return patch;
 	}
 };
+%extend MultiResolutionImage {
+     PyObject* getFloatPatchAtDownsample(const long long& startX, const long long& startY, const unsigned long long& width, 
+						     const unsigned long long& height, const double& downsample, const core::ResamplingFilter& filter = core::AreaResampling) { 
+		unsigned int nrSamples = self->getSamplesPerPixel();
+        npy_intp dimsDesc[3];
+		dimsDesc[0] = height;
+		dimsDesc[1] = width;
+		dimsDesc[2] = nrSamples;
+		PyObject* patch = PyArray_SimpleNew(3, dimsDesc, NPY_FLOAT);
+		float* array_data = (float*)PyArray_DATA((PyArrayObject*)patch);
+		self->getRegionAtDownsample(startX, startY, width, height, downsample, array_data, filter);
+		return patch;
+	}
+};
+%extend MultiResolutionImage {
+     PyObject* getUCharPatches(const std::vector<long long>& xs, const std::vector<long long>& ys, const unsigned long long& width, 
+						     const unsigned long long& height, const unsigned int& level) { 
+		return readPatchesIntoArray<unsigned char>(self, xs, ys, width, height, level, NPY_UBYTE);
+	}
+};
+%extend MultiResolutionImage {
+     PyObject* getUInt16Patches(const std::vector<long long>& xs, const std::vector<long long>& ys, const unsigned long long& width, 
+						     const unsigned long long& height, const unsigned int& level) { 
+		return readPatchesIntoArray<unsigned short>(self, xs, ys, width, height, level, NPY_UINT16);
+	}
+};
+%extend MultiResolutionImage {
+     PyObject* getUInt32Patches(const std::vector<long long>& xs, const std::vector<long long>& ys, const unsigned long long& width, 
+						     const unsigned long long& height, const unsigned int& level) { 
+		return readPatchesIntoArray<unsigned int>(self, xs, ys, width, height, level, NPY_UINT32);
+	}
+};
+%extend MultiResolutionImage {
+     PyObject* getFloatPatches(const std::vector<long long>& xs, const std::vector<long long>& ys, const unsigned long long& width, 
+						     const unsigned long long& height, const unsigned int& level) { 
+		return readPatchesIntoArray<float>(self, xs, ys, width, height, level, NPY_FLOAT);
+	}
+};
 %extend TIFFImage {
      PyObject* getEncodedTile(const long long& startX, const long long& startY, const unsigned int& level) { 
 		long long encoded_tile_size = self->getEncodedTileSize(startX, startY, level);
@@ -185,6 +278,7 @@ import_array();
   }
 %}
 
+%include "ImageMetadata.h"
 %newobject MultiResolutionImageReader::open;
 %include "MultiResolutionImageReader.h"
 
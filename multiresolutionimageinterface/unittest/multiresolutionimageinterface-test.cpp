@@ -1,10 +1,20 @@
 #include "UnitTest++/UnitTest++.h"
 #include "MultiResolutionImage.h"
 #include "MultiResolutionImageReader.h"
+#include "ImageMetadata.h"
 #include "MultiResolutionImageWriter.h"
+#include "TIFFImage.h"
+#include "JPEG2000Codec.h"
+#include "TileCacheManager.h"
 #include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <numeric>
+#include <stdexcept>
+#include <boost/thread.hpp>
 #include "core/filetools.h"
 #include "core/PathologyEnums.h"
+#include "core/PixelConversion.h"
 #include "TestData.h"
 
 using namespace UnitTest;
@@ -58,6 +68,32 @@ namespace
       delete img;
 	  }
 
+    TEST(TestOpenMetadata)
+    {
+      MultiResolutionImageReader test;
+      ImageMetadata metadata;
+      CHECK(test.openMetadata(g_dataPath + "/images/OpenSlideInterfaceTestImage.tif", metadata));
+      MultiResolutionImage* img = test.open(g_dataPath + "/images/OpenSlideInterfaceTestImage.tif");
+      CHECK_EQUAL(static_cast<size_t>(img->getNumberOfLevels()), metadata.levelDimensions.size());
+      CHECK(img->getDimensions() == metadata.levelDimensions[0]);
+      CHECK(img->getSpacing() == metadata.spacing);
+      CHECK_EQUAL(img->getSamplesPerPixel(), metadata.samplesPerPixel);
+      CHECK_EQUAL(img->getColorType(), metadata.colorType);
+      CHECK_EQUAL(img->getDataType(), metadata.dataType);
+      CHECK_EQUAL("ASAP TIF", metadata.factoryName);
+      delete img;
+
+      // A file that only has the extension of a slide is turned down by its first bytes
+      std::string notATIFF = g_dataPath + "/images/OpenSlideInterfaceNotATIFF.tif";
+      FILE* file = fopen(notATIFF.c_str(), "wb");
+      fputs("This is not a TIFF file", file);
+      fclose(file);
+      CHECK(!test.openMetadata(notATIFF, metadata));
+      CHECK(metadata.levelDimensions.empty());
+      CHECK(test.open(notATIFF) == NULL);
+      remove(notATIFF.c_str());
+	  }
+
     TEST(TestgetRawRegionUInt32)
     {
       MultiResolutionImageReader test;
@@ -86,6 +122,138 @@ namespace
       delete img;
 	  }
     
+    TEST(TestgetRawRegionStridedAndConverted)
+    {
+      MultiResolutionImageReader test;
+      MultiResolutionImage* img = test.open(g_dataPath + "/images/OpenSlideInterfaceTestImage.tif");
+      unsigned char* reference = new unsigned char[256 * 256 * 3];
+      img->getRawRegion<unsigned char>(13824, 11776, 256, 256, 0, reference);
+      // Read into the right half of a buffer that is twice as wide
+      std::vector<unsigned char> wide(512 * 256 * 3, 0);
+      img->getRawRegion<unsigned char>(13824, 11776, 256, 256, 0, wide.data() + 256 * 3, 512 * 3);
+      std::vector<float> converted(256 * 256 * 3, 0);
+      img->getRawRegion<float>(13824, 11776, 256, 256, 0, converted.data(), 256 * 3);
+      int diffSum = 0;
+      for (unsigned int y = 0; y < 256; ++y) {
+        for (unsigned int x = 0; x < 256 * 3; ++x) {
+          diffSum += abs(wide[y * 512 * 3 + 256 * 3 + x] - reference[y * 256 * 3 + x]);
+          diffSum += abs(static_cast<int>(converted[y * 256 * 3 + x]) - reference[y * 256 * 3 + x]);
+        }
+        diffSum += wide[y * 512 * 3];
+      }
+      CHECK_EQUAL(0, diffSum);
+      delete[] reference;
+      delete img;
+    }
+
+    TEST(TestReadRegionsMatchesGetRawRegion)
+    {
+      MultiResolutionImageReader test;
+      MultiResolutionImage* img = test.open(g_dataPath + "/images/OpenSlideInterfaceTestImage.tif");
+      // Overlapping patches (sharing decoded tiles), a distant one, one partly outside the image and one on a lower level
+      std::vector<RegionRequest> requests;
+      requests.push_back(RegionRequest(13824, 11776, 200, 200, 0));
+      requests.push_back(RegionRequest(13924, 11876, 200, 200, 0));
+      requests.push_back(RegionRequest(2000, 3000, 100, 50, 0));
+      requests.push_back(RegionRequest(-50, -30, 100, 100, 0));
+      requests.push_back(RegionRequest(13824, 11776, 128, 128, 1));
+      std::vector<std::vector<unsigned char> > batch(requests.size());
+      std::vector<unsigned char*> outputs;
+      for (unsigned int i = 0; i < requests.size(); ++i) {
+        batch[i].resize(requests[i].width * requests[i].height * 3);
+        outputs.push_back(batch[i].data());
+      }
+      img->readRegions(requests, outputs);
+      std::vector<unsigned int> calledBack(requests.size(), 0);
+      int diffSum = 0;
+      boost::mutex diffMutex;
+      img->readRegions<unsigned char>(requests, [&](unsigned int index, const unsigned char* data) {
+        boost::lock_guard<boost::mutex> l(diffMutex);
+        calledBack[index] += 1;
+        diffSum += memcmp(data, batch[index].data(), batch[index].size()) != 0;
+      });
+      for (unsigned int i = 0; i < requests.size(); ++i) {
+        unsigned char* reference = new unsigned char[batch[i].size()];
+        img->getRawRegion<unsigned char>(requests[i].startX, requests[i].startY, requests[i].width, requests[i].height, requests[i].level, reference);
+        diffSum += memcmp(reference, batch[i].data(), batch[i].size()) != 0;
+        CHECK_EQUAL(1, calledBack[i]);
+        delete[] reference;
+      }
+      CHECK_EQUAL(0, diffSum);
+
+      // A failing callback does not stop the other requests, its exception reaches the caller
+      std::fill(calledBack.begin(), calledBack.end(), 0);
+      CHECK_THROW(img->readRegions<unsigned char>(requests, [&](unsigned int index, const unsigned char* data) {
+        boost::lock_guard<boost::mutex> l(diffMutex);
+        calledBack[index] += 1;
+        if (index == 1) {
+          throw std::runtime_error("callback failed");
+        }
+      }), std::runtime_error);
+      CHECK_EQUAL(requests.size(), std::accumulate(calledBack.begin(), calledBack.end(), 0u));
+      delete img;
+    }
+
+    TEST(TestgetRawRegionAsync)
+    {
+      MultiResolutionImageReader test;
+      MultiResolutionImage* img = test.open(g_dataPath + "/images/OpenSlideInterfaceTestImage.tif");
+      std::vector<unsigned char> reference(256 * 256 * 3), async(256 * 256 * 3), cancelled(256 * 256 * 3);
+      unsigned char* referenceData = reference.data();
+      img->getRawRegion<unsigned char>(13824, 11776, 256, 256, 0, referenceData);
+      std::future<bool> read = img->getRawRegionAsync(13824, 11776, 256, 256, 0, async.data());
+      CancellationToken token;
+      token.cancel();
+      std::future<bool> cancelledRead = img->getRawRegionAsync(13824, 11776, 256, 256, 0, cancelled.data(), 1, token);
+      std::promise<bool> calledBack;
+      img->getRawRegionAsync<unsigned char>(13824, 11776, 256, 256, 0, [&](const unsigned char* data) {
+        calledBack.set_value(data && memcmp(data, reference.data(), reference.size()) == 0);
+      });
+      CHECK(read.get());
+      CHECK(!cancelledRead.get());
+      CHECK(calledBack.get_future().get());
+      CHECK_EQUAL(0, memcmp(async.data(), reference.data(), reference.size()));
+      delete img;
+    }
+
+    TEST(TestForEachTileMatchesGetRawRegion)
+    {
+      MultiResolutionImageReader test;
+      MultiResolutionImage* img = test.open(g_dataPath + "/images/OpenSlideInterfaceTestImage.tif");
+      unsigned int level = img->getNumberOfLevels() - 1;
+      std::vector<unsigned long long> dims = img->getLevelDimensions(level);
+      unsigned char* whole = new unsigned char[dims[0] * dims[1] * 3];
+      img->getRawRegion<unsigned char>(0, 0, dims[0], dims[1], level, whole);
+      // Once straight on the decoded tiles, once in parallel with a halo which needs neighbouring tiles
+      for (unsigned int halo = 0; halo < 3; halo += 2) {
+        TileIterationOptions options;
+        options.halo = halo;
+        options.parallel = halo > 0;
+        unsigned long long covered = 0, mismatches = 0;
+        boost::mutex statsMutex;
+        img->forEachTile<unsigned char>(level, [&](const TileView<unsigned char>& tile) {
+          unsigned long long tileMismatches = 0;
+          for (long long y = -static_cast<long long>(halo); y < static_cast<long long>(tile.height + halo); ++y) {
+            for (long long x = -static_cast<long long>(halo); x < static_cast<long long>(tile.width + halo); ++x) {
+              long long wx = tile.x + x, wy = tile.y + y;
+              bool inside = wx >= 0 && wy >= 0 && wx < static_cast<long long>(dims[0]) && wy < static_cast<long long>(dims[1]);
+              for (unsigned int c = 0; c < 3; ++c) {
+                unsigned char expected = inside ? whole[(wy * dims[0] + wx) * 3 + c] : 0;
+                tileMismatches += tile.at(x, y, c) != expected;
+              }
+            }
+          }
+          boost::lock_guard<boost::mutex> l(statsMutex);
+          covered += tile.width * tile.height;
+          mismatches += tileMismatches;
+        }, options);
+        CHECK_EQUAL(dims[0] * dims[1], covered);
+        CHECK_EQUAL(0, mismatches);
+      }
+      delete[] whole;
+      delete img;
+    }
+
     TEST(TestgetRawRegionUCharOpenSlide)
     {
       MultiResolutionImageReader test;
@@ -270,6 +438,390 @@ namespace
       delete img;
     }
 
+    TEST(TestEncodedTileCacheServesRepeatedReads)
+    {
+      MultiResolutionImageReader testRead;
+      MultiResolutionImage* img = testRead.open(g_dataPath + "/images/OpenSlideInterfaceMultiResOut.tif");
+      img->setCacheSize(0);
+      img->setEncodedCacheSize(64 * 1024 * 1024);
+      std::vector<unsigned char> first(1024 * 1024 * 3), second(1024 * 1024 * 3);
+      unsigned char* firstData = first.data();
+      unsigned char* secondData = second.data();
+      img->getRawRegion<unsigned char>(0, 0, 1024, 1024, 0, firstData);
+      TileCacheStatistics afterFirst = img->getEncodedCacheStatistics();
+      CHECK_EQUAL(0ULL, afterFirst.hits);
+      CHECK(afterFirst.misses > 0);
+      CHECK(afterFirst.currentByteSize > 0 && afterFirst.currentByteSize < first.size());
+      img->getRawRegion<unsigned char>(0, 0, 1024, 1024, 0, secondData);
+      CHECK_EQUAL(afterFirst.misses, img->getEncodedCacheStatistics().hits);
+      CHECK(first == second);
+      delete img;
+    }
+
+    TEST(TestImageStatisticsCountReadsAndDecodes)
+    {
+      MultiResolutionImageReader testRead;
+      MultiResolutionImage* img = testRead.open(g_dataPath + "/images/OpenSlideInterfaceMultiResOut.tif");
+      img->setCacheSize(64 * 1024 * 1024);
+      std::vector<unsigned char> region(1024 * 1024 * 3);
+      unsigned char* data = region.data();
+      img->getRawRegion<unsigned char>(0, 0, 1024, 1024, 0, data);
+      img->getRawRegion<unsigned char>(0, 0, 1024, 1024, 0, data);
+      ImageStatistics statistics = img->getStatistics();
+      CHECK(statistics.bytesRead > 0);
+      CHECK_EQUAL(2ULL, statistics.requestsCompleted);
+      CHECK_EQUAL(0ULL, statistics.requestsInFlight);
+      CHECK(!statistics.cache.hitsPerLevel.empty());
+      CHECK_EQUAL(statistics.cache.misses, statistics.cache.hits);
+      CHECK_EQUAL(statistics.cache.hits, statistics.cache.hitsPerLevel[0]);
+      CHECK_EQUAL(1, statistics.decoding.size());
+      CHECK_EQUAL(statistics.cache.misses, statistics.decoding[0].decodeTime.count);
+      img->resetStatistics();
+      statistics = img->getStatistics();
+      CHECK_EQUAL(0ULL, statistics.bytesRead);
+      CHECK_EQUAL(0ULL, statistics.cache.hits);
+      CHECK(statistics.decoding.empty());
+      delete img;
+    }
+
+    TEST(TestResamplingMatchesAveraging)
+    {
+      MultiResolutionImageReader testRead;
+      MultiResolutionImage* img = testRead.open(g_dataPath + "/images/OpenSlideInterfaceMultiResOut.tif");
+      std::vector<float> full(512 * 512 * 3), downsampled(256 * 256 * 3), cached(256 * 256 * 3);
+      float* fullData = full.data();
+      img->getRawRegion<float>(1024, 1024, 512, 512, 0, fullData);
+      core::resample(fullData, pathology::Float, 3, 512, 512, 512 * 3, 0., 0., 2., 2., downsampled.data(), pathology::Float, 256, 256, 256 * 3, core::AreaResampling);
+      unsigned int mismatches = 0;
+      for (unsigned int y = 0; y < 256; ++y) {
+        for (unsigned int x = 0; x < 256; ++x) {
+          for (unsigned int c = 0; c < 3; ++c) {
+            float mean = (full[(2 * y * 512 + 2 * x) * 3 + c] + full[(2 * y * 512 + 2 * x + 1) * 3 + c] +
+              full[((2 * y + 1) * 512 + 2 * x) * 3 + c] + full[((2 * y + 1) * 512 + 2 * x + 1) * 3 + c]) / 4.f;
+            mismatches += std::abs(mean - downsampled[(y * 256 + x) * 3 + c]) > 0.01f;
+          }
+        }
+      }
+      CHECK_EQUAL(0, mismatches);
+
+      // Downsamples of a level read the level, resampled tiles from the cache equal uncached ones
+      std::vector<float> level(256 * 256 * 3);
+      float* levelData = level.data();
+      img->getRawRegion<float>(1024, 1024, 256, 256, 1, levelData);
+      img->getRegionAtDownsample<float>(1024, 1024, 256, 256, img->getLevelDownsample(1), downsampled.data());
+      CHECK(level == downsampled);
+      img->getRegionAtDownsample<float>(1536, 1536, 256, 256, 3., downsampled.data(), core::LanczosResampling);
+      img->setResampledCacheSize(16 * 1024 * 1024);
+      img->getRegionAtDownsample<float>(1536, 1536, 256, 256, 3., cached.data(), core::LanczosResampling);
+      CHECK(cached == downsampled);
+      delete img;
+    }
+
+    TEST(TestDownsampleKernelsMatchResampling)
+    {
+      MultiResolutionImageReader testRead;
+      MultiResolutionImage* img = testRead.open(g_dataPath + "/images/OpenSlideInterfaceTestImage.tif");
+      std::vector<unsigned char> full(512 * 512 * 3);
+      unsigned char* fullData = full.data();
+      img->getRawRegion<unsigned char>(13824, 11776, 512, 512, 0, fullData);
+      delete img;
+      unsigned int factors[2] = { 2, 4 };
+      core::ResamplingFilter filters[2] = { core::NearestResampling, core::AreaResampling };
+      for (unsigned int i = 0; i < 2; ++i) {
+        for (unsigned int j = 0; j < 2; ++j) {
+          unsigned int size = 512 / factors[i];
+          std::vector<unsigned char> expected(size * size * 3), vectorized(size * size * 3), scalar(size * size * 3);
+          core::resample(fullData, pathology::UChar, 3, 512, 512, 512 * 3, 0., 0., factors[i], factors[i], expected.data(), pathology::UChar, size, size, size * 3, filters[j]);
+          core::downsample(fullData, pathology::UChar, 3, 512, 512, 512 * 3, factors[i], vectorized.data(), size * 3, filters[j]);
+          core::setMaximumSIMDInstructionSet(core::ScalarInstructions);
+          core::downsample(fullData, pathology::UChar, 3, 512, 512, 512 * 3, factors[i], scalar.data(), size * 3, filters[j]);
+          core::setMaximumSIMDInstructionSet(core::AVX2Instructions);
+          CHECK(expected == vectorized);
+          CHECK(scalar == vectorized);
+        }
+      }
+
+      // Mode downsampling of a label image only gives labels that were there
+      std::vector<unsigned int> labels(512 * 512), modes(256 * 256), resampled(256 * 256);
+      for (unsigned int y = 0; y < 512; ++y) {
+        for (unsigned int x = 0; x < 512; ++x) {
+          labels[y * 512 + x] = ((x / 3 + y / 5) % 2) * 7;
+        }
+      }
+      core::downsample(labels.data(), pathology::UInt32, 1, 512, 512, 512, 2, modes.data(), 256, core::ModeResampling);
+      core::resample(labels.data(), pathology::UInt32, 1, 512, 512, 512, 0., 0., 2., 2., resampled.data(), pathology::UInt32, 256, 256, 256, core::ModeResampling);
+      CHECK(modes == resampled);
+      unsigned int blended = 0;
+      for (unsigned int i = 0; i < modes.size(); ++i) {
+        blended += modes[i] != 0 && modes[i] != 7;
+      }
+      CHECK_EQUAL(0, blended);
+    }
+
+    TEST(TestReadWriteUncompressedTilesExact)
+    {
+      MultiResolutionImageReader testRead;
+      MultiResolutionImageWriter testWrite;
+      MultiResolutionImage* img = testRead.open(g_dataPath + "/images/OpenSlideInterfaceTestImage.tif");
+      testWrite.openFile(g_dataPath + "/images/OpenSlideInterfaceRawOut.tif");
+      testWrite.setTileSize(256);
+      testWrite.setCompression(RAW);
+      testWrite.setDataType(UChar);
+      testWrite.setColorType(RGB);
+      testWrite.writeImageInformation(1000, 700);
+      unsigned char* data = new unsigned char[256 * 256 * 3];
+      for (int y = 0; y < 700; y += 256) {
+        for (int x = 0; x < 1000; x += 256) {
+          img->getRawRegion<unsigned char>(13824 + x, 11776 + y, 256, 256, 0, data);
+          testWrite.writeBaseImagePart((void*)data);
+        }
+      }
+      testWrite.finishImage();
+      delete[] data;
+      std::vector<unsigned char> original(1000 * 700 * 3), written(1000 * 700 * 3);
+      unsigned char* originalData = original.data();
+      img->getRawRegion<unsigned char>(13824, 11776, 1000, 700, 0, originalData);
+      delete img;
+      MultiResolutionImageReader testRead2;
+      img = testRead2.open(g_dataPath + "/images/OpenSlideInterfaceRawOut.tif");
+      unsigned char* writtenData = written.data();
+      img->getRawRegion<unsigned char>(0, 0, 1000, 700, 0, writtenData);
+      CHECK(original == written);
+      delete img;
+    }
+
+    TEST(TestRawRegionAllocatesNullBuffer)
+    {
+      MultiResolutionImageReader testRead;
+      MultiResolutionImage* img = testRead.open(g_dataPath + "/images/OpenSlideInterfaceTestImage.tif");
+      std::vector<unsigned char> expected(256 * 256 * 3);
+      unsigned char* expectedData = expected.data();
+      img->getRawRegion<unsigned char>(13824, 11776, 256, 256, 0, expectedData);
+      unsigned char* allocated = NULL;
+      img->getRawRegion<unsigned char>(13824, 11776, 256, 256, 0, allocated);
+      CHECK(allocated != NULL);
+      CHECK(std::equal(expected.begin(), expected.end(), allocated));
+      delete[] allocated;
+      CHECK_THROW(img->getRawRegion<unsigned char>(13824, 11776, 256, 256, 0, NULL, 256 * 3), std::invalid_argument);
+      delete img;
+    }
+
+    TEST(TestParallelCompressionWritesSameTiles)
+    {
+      // Tiles compressed on worker threads and written out of order by the writer thread read back as written
+      MultiResolutionImageReader testRead;
+      MultiResolutionImageWriter testWrite;
+      MultiResolutionImage* img = testRead.open(g_dataPath + "/images/OpenSlideInterfaceTestImage.tif");
+      testWrite.openFile(g_dataPath + "/images/OpenSlideInterfaceParallelLZWOut.tif");
+      testWrite.setTileSize(256);
+      testWrite.setCompression(LZW);
+      testWrite.setDataType(UChar);
+      testWrite.setColorType(RGB);
+      testWrite.setNumberOfCompressionThreads(4);
+      testWrite.setMaxNumberOfTilesInFlight(3);
+      testWrite.writeImageInformation(1000, 700);
+      unsigned char* data = new unsigned char[256 * 256 * 3];
+      for (int y = 0; y < 700; y += 256) {
+        for (int x = 0; x < 1000; x += 256) {
+          img->getRawRegion<unsigned char>(13824 + x, 11776 + y, 256, 256, 0, data);
+          testWrite.writeBaseImagePart((void*)data);
+        }
+      }
+      CHECK_EQUAL(0, testWrite.finishImage());
+      delete[] data;
+      std::vector<unsigned char> original(1000 * 700 * 3), written(1000 * 700 * 3);
+      unsigned char* originalData = original.data();
+      img->getRawRegion<unsigned char>(13824, 11776, 1000, 700, 0, originalData);
+      delete img;
+      MultiResolutionImageReader testRead2;
+      img = testRead2.open(g_dataPath + "/images/OpenSlideInterfaceParallelLZWOut.tif");
+      CHECK(img != NULL);
+      CHECK(img->getNumberOfLevels() > 1);
+      unsigned char* writtenData = written.data();
+      img->getRawRegion<unsigned char>(0, 0, 1000, 700, 0, writtenData);
+      CHECK(original == written);
+      delete img;
+    }
+
+    TEST(TestStreamedPyramidMatchesPyramidFromFile)
+    {
+      // Tiles written in order build the pyramid while writing, tiles written out of order build it from the file,
+      // as do tiles in order whose pyramid does not fit the memory budget
+      MultiResolutionImageReader testRead;
+      MultiResolutionImage* img = testRead.open(g_dataPath + "/images/OpenSlideInterfaceTestImage.tif");
+      std::string outputs[3] = { g_dataPath + "/images/OpenSlideInterfaceStreamedPyramidOut.tif", g_dataPath + "/images/OpenSlideInterfaceFilePyramidOut.tif",
+        g_dataPath + "/images/OpenSlideInterfaceOverBudgetPyramidOut.tif" };
+      unsigned char* data = new unsigned char[256 * 256 * 3];
+      for (int i = 0; i < 3; ++i) {
+        MultiResolutionImageWriter testWrite;
+        testWrite.openFile(outputs[i]);
+        testWrite.setTileSize(256);
+        testWrite.setCompression(RAW);
+        testWrite.setDataType(UChar);
+        testWrite.setColorType(RGB);
+        testWrite.setNumberOfCompressionThreads(i == 1 ? 0 : 4);
+        if (i == 2) {
+          testWrite.setMaxStreamedPyramidSize(256 * 256 * 3 * 4);
+        }
+        testWrite.writeImageInformation(3000, 2000);
+        for (int y = 0; y < 2000; y += 256) {
+          for (int x = 0; x < 3000; x += 256) {
+            int tileX = i == 1 ? 2816 - x : x;
+            img->getRawRegion<unsigned char>(12000 + tileX, 10000 + y, 256, 256, 0, data);
+            testWrite.writeBaseImagePartToLocation((void*)data, tileX, y);
+          }
+        }
+        CHECK_EQUAL(0, testWrite.finishImage());
+      }
+      delete[] data;
+      delete img;
+      MultiResolutionImageReader testRead2;
+      MultiResolutionImage* fromFile = testRead2.open(outputs[1]);
+      CHECK(fromFile != NULL);
+      for (int i = 0; i < 3; i += 2) {
+        MultiResolutionImage* streamed = testRead2.open(outputs[i]);
+        CHECK(streamed != NULL);
+        CHECK_EQUAL(fromFile->getNumberOfLevels(), streamed->getNumberOfLevels());
+        for (int level = 1; level < fromFile->getNumberOfLevels(); ++level) {
+          std::vector<unsigned long long> dims = fromFile->getLevelDimensions(level);
+          CHECK(dims == streamed->getLevelDimensions(level));
+          std::vector<unsigned char> expected(dims[0] * dims[1] * 3), actual(dims[0] * dims[1] * 3);
+          unsigned char* expectedData = expected.data();
+          unsigned char* actualData = actual.data();
+          double downsample = fromFile->getLevelDownsample(level);
+          fromFile->getRawRegion<unsigned char>(0, 0, dims[0], dims[1], level, expectedData);
+          streamed->getRawRegion<unsigned char>(0, 0, dims[0], dims[1], level, actualData);
+          CHECK(expected == actual);
+          CHECK_EQUAL(downsample, streamed->getLevelDownsample(level));
+        }
+        delete streamed;
+      }
+      delete fromFile;
+    }
+
+    TEST(TestPyramidWithDownsampleOfThree)
+    {
+      // A factor that divides the tile size is accepted, every level pixel is the average of a 3x3 block
+      MultiResolutionImageWriter testWrite;
+      testWrite.openFile(g_dataPath + "/images/DownsampleOfThreeOut.tif");
+      testWrite.setTileSize(384);
+      CHECK_EQUAL(-1, testWrite.setDownsamplePerLevel(5));
+      CHECK_EQUAL(0, testWrite.setDownsamplePerLevel(3));
+      testWrite.setMaxNumberOfPyramidLevels(1);
+      testWrite.setInterpolation(Area);
+      testWrite.setCompression(RAW);
+      testWrite.setDataType(UChar);
+      testWrite.setColorType(RGB);
+      testWrite.writeImageInformation(1152, 768);
+      std::vector<unsigned char> base(1152 * 768 * 3), tile(384 * 384 * 3);
+      for (unsigned int i = 0; i < base.size(); ++i) {
+        base[i] = static_cast<unsigned char>(((i / 3) % 1152 * 7 + (i / 3) / 1152 * 3 + i % 3 * 50) % 256);
+      }
+      for (int y = 0; y < 768; y += 384) {
+        for (int x = 0; x < 1152; x += 384) {
+          for (int row = 0; row < 384; ++row) {
+            std::copy(base.begin() + ((y + row) * 1152 + x) * 3, base.begin() + ((y + row) * 1152 + x + 384) * 3, tile.begin() + row * 384 * 3);
+          }
+          testWrite.writeBaseImagePart((void*)tile.data());
+        }
+      }
+      CHECK_EQUAL(0, testWrite.finishImage());
+      MultiResolutionImageReader testRead;
+      MultiResolutionImage* img = testRead.open(g_dataPath + "/images/DownsampleOfThreeOut.tif");
+      CHECK(img != NULL);
+      CHECK_EQUAL(2, img->getNumberOfLevels());
+      CHECK_EQUAL(384ULL, img->getLevelDimensions(1)[0]);
+      CHECK_EQUAL(256ULL, img->getLevelDimensions(1)[1]);
+      std::vector<unsigned char> level(384 * 256 * 3);
+      unsigned char* levelData = level.data();
+      img->getRawRegion<unsigned char>(0, 0, 384, 256, 1, levelData);
+      int maxDifference = 0;
+      for (unsigned int y = 0; y < 256; ++y) {
+        for (unsigned int x = 0; x < 384; ++x) {
+          for (unsigned int c = 0; c < 3; ++c) {
+            int sum = 0;
+            for (unsigned int i = 0; i < 9; ++i) {
+              sum += base[((y * 3 + i / 3) * 1152 + x * 3 + i % 3) * 3 + c];
+            }
+            maxDifference = std::max(maxDifference, std::abs(sum / 9 - static_cast<int>(level[(y * 384 + x) * 3 + c])));
+          }
+        }
+      }
+      CHECK(maxDifference <= 1);
+      delete img;
+    }
+
+    TEST(TestMemoryMappedMatchesPositionalReads)
+    {
+      std::vector<unsigned char> positional(1000 * 700 * 3), mapped(1000 * 700 * 3);
+      unsigned char* positionalData = positional.data();
+      unsigned char* mappedData = mapped.data();
+      MultiResolutionImageReader testRead;
+      MultiResolutionImage* img = testRead.open(g_dataPath + "/images/OpenSlideInterfaceTestImage.tif");
+      img->getRawRegion<unsigned char>(13824, 11776, 1000, 700, 0, positionalData);
+      delete img;
+      ByteSource::setMemoryMappingEnabled(true);
+      img = testRead.open(g_dataPath + "/images/OpenSlideInterfaceTestImage.tif");
+      ByteSource::setMemoryMappingEnabled(false);
+      img->setAccessPattern(ByteSource::RandomAccess);
+      img->setEncodedCacheSize(64 * 1024 * 1024);
+      img->getRawRegion<unsigned char>(13824, 11776, 1000, 700, 0, mappedData);
+      CHECK(positional == mapped);
+      CHECK_EQUAL(0ULL, img->getEncodedCacheStatistics().numberOfTiles);
+      delete img;
+    }
+
+    TEST(TestVirtualPyramidForSingleLevelImage)
+    {
+      MultiResolutionImageReader testRead;
+      MultiResolutionImageWriter testWrite;
+      MultiResolutionImage* img = testRead.open(g_dataPath + "/images/OpenSlideInterfaceTestImage.tif");
+      testWrite.openFile(g_dataPath + "/images/OpenSlideInterfaceSingleLevelOut.tif");
+      testWrite.setTileSize(512);
+      testWrite.setCompression(LZW);
+      testWrite.setDataType(UChar);
+      testWrite.setColorType(RGB);
+      testWrite.setMaxNumberOfPyramidLevels(0);
+      testWrite.writeImageInformation(1024, 1024);
+      unsigned char* data = new unsigned char[512 * 512 * 3];
+      for (int y = 0; y < 1024; y += 512) {
+        for (int x = 0; x < 1024; x += 512) {
+          img->getRawRegion<unsigned char>(13824 + x, 11776 + y, 512, 512, 0, data);
+          testWrite.writeBaseImagePart((void*)data);
+        }
+      }
+      testWrite.finishImage();
+      delete[] data;
+      delete img;
+
+      // The generated level averages 2x2 pixels of level 0
+      img = testRead.open(g_dataPath + "/images/OpenSlideInterfaceSingleLevelOut.tif");
+      CHECK_EQUAL(2, img->getNumberOfLevels());
+      CHECK(img->isVirtualLevel(1));
+      CHECK_EQUAL(512, img->getLevelDimensions(1)[0]);
+      std::vector<unsigned char> full(1024 * 1024 * 3), expected(512 * 512 * 3), generated(512 * 512 * 3), stored(512 * 512 * 3);
+      unsigned char* fullData = full.data();
+      img->getRawRegion<unsigned char>(0, 0, 1024, 1024, 0, fullData);
+      core::resample(fullData, pathology::UChar, 3, 1024, 1024, 1024 * 3, 0., 0., 2., 2., expected.data(), pathology::UChar, 512, 512, 512 * 3, core::AreaResampling);
+      unsigned char* generatedData = generated.data();
+      std::string sidecar = g_dataPath + "/images/OpenSlideInterfaceSingleLevelOut.vpy";
+      std::remove(sidecar.c_str());
+      CHECK(img->setVirtualPyramidSidecar(sidecar));
+      img->getRawRegion<unsigned char>(0, 0, 512, 512, 1, generatedData);
+      CHECK(expected == generated);
+      delete img;
+
+      // Reopened, the tiles come from the sidecar
+      img = testRead.open(g_dataPath + "/images/OpenSlideInterfaceSingleLevelOut.tif");
+      CHECK(img->setVirtualPyramidSidecar(sidecar));
+      unsigned char* storedData = stored.data();
+      img->resetStatistics();
+      img->getRawRegion<unsigned char>(0, 0, 512, 512, 1, storedData);
+      CHECK(generated == stored);
+      CHECK_EQUAL(0, img->getStatistics().bytesRead);
+      delete img;
+    }
+
     TEST(TestReadWriteMultiResOneGo)
     {
       MultiResolutionImageReader testRead;
@@ -378,6 +930,354 @@ namespace
       delete[] dataOrg, dataWritten;
       delete img;
     }
+
+    TEST(TestConcurrentRawRegionTIFF)
+    {
+      MultiResolutionImageReader test;
+      MultiResolutionImage* img = test.open(g_dataPath + "/images/OpenSlideInterfaceTestImage.tif");
+      TIFFImage* tiffImg = dynamic_cast<TIFFImage*>(img);
+      CHECK(tiffImg != NULL);
+      tiffImg->setMaxNumberOfReadHandles(4);
+      img->setCacheSize(64 * 512 * 512 * 3);
+      const unsigned int nrThreads = 8;
+      unsigned char* reference = new unsigned char[1024 * 1024 * 3];
+      img->getRawRegion<unsigned char>(13000, 11000, 1024, 1024, 0, reference);
+      std::vector<unsigned char*> results(nrThreads, NULL);
+      boost::thread_group threads;
+      for (unsigned int t = 0; t < nrThreads; ++t) {
+        results[t] = new unsigned char[1024 * 1024 * 3];
+        unsigned char*& result = results[t];
+        threads.create_thread([img, &result]() {
+          img->getRawRegion<unsigned char>(13000, 11000, 1024, 1024, 0, result);
+        });
+      }
+      threads.join_all();
+      for (unsigned int t = 0; t < nrThreads; ++t) {
+        CHECK_EQUAL(0, memcmp(reference, results[t], 1024 * 1024 * 3));
+        delete[] results[t];
+      }
+      CHECK(tiffImg->getMaxNumberOfReadHandles() == 4);
+      delete[] reference;
+      delete img;
+    }
+
+    TEST(TestCloneSharesCacheTIFF)
+    {
+      MultiResolutionImageReader test;
+      MultiResolutionImage* img = test.open(g_dataPath + "/images/OpenSlideInterfaceTestImage.tif");
+      img->setCacheSize(64 * 512 * 512 * 3);
+      img->setMaxNumberOfReadHandles(2);
+      MultiResolutionImage* clone = dynamic_cast<MultiResolutionImage*>(img->clone());
+      CHECK(clone != NULL);
+      CHECK(clone->getDimensions() == img->getDimensions());
+      CHECK_EQUAL(img->getNumberOfLevels(), clone->getNumberOfLevels());
+      CHECK_EQUAL(2u, clone->getMaxNumberOfReadHandles());
+      unsigned char* reference = new unsigned char[1024 * 1024 * 3];
+      unsigned char* result = new unsigned char[1024 * 1024 * 3];
+      img->getRawRegion<unsigned char>(13000, 11000, 1024, 1024, 0, reference);
+      const unsigned long long missesBefore = clone->getCacheStatistics().misses;
+      clone->getRawRegion<unsigned char>(13000, 11000, 1024, 1024, 0, result);
+      CHECK_EQUAL(0, memcmp(reference, result, 1024 * 1024 * 3));
+      // The tiles the original decoded are hits for the clone
+      CHECK_EQUAL(missesBefore, clone->getCacheStatistics().misses);
+
+      // The clone keeps the file open after the original is gone
+      delete img;
+      std::fill(result, result + 1024 * 1024 * 3, 0);
+      clone->getRawRegion<unsigned char>(13000, 11000, 1024, 1024, 0, result);
+      CHECK_EQUAL(0, memcmp(reference, result, 1024 * 1024 * 3));
+      unsigned char* lowerLevel = new unsigned char[256 * 256 * 3];
+      clone->getRawRegion<unsigned char>(0, 0, 256, 256, 2, lowerLevel);
+      delete[] lowerLevel;
+      delete[] result;
+      delete[] reference;
+      delete clone;
+    }
+
+    TEST(TestTileCacheEviction)
+    {
+      TileCache<unsigned char> cache(10 * 256);
+      std::shared_ptr<unsigned char> tile(new unsigned char[256], std::default_delete<unsigned char[]>());
+      for (unsigned int i = 0; i < 20; ++i) {
+        CHECK_EQUAL(0, cache.set(makeTileKey(0, 0, i, 0), tile, 256));
+      }
+      CHECK_EQUAL(1, cache.set(makeTileKey(0, 0, 19, 0), tile, 256));
+      CHECK_EQUAL(1, cache.set(makeTileKey(1, 0, 0, 0), tile, 11 * 256));
+      CHECK_EQUAL(10 * 256, cache.currentCacheSize());
+      CHECK_EQUAL(10, cache.numberOfTiles());
+      std::shared_ptr<unsigned char> cached;
+      unsigned int size = 0;
+      CHECK(cache.get(makeTileKey(0, 0, 19, 0), cached, size));
+      CHECK_EQUAL(256, size);
+      CHECK(!cache.get(makeTileKey(0, 0, 19, 1), cached, size));
+      cache.setMaxCacheSize(256);
+      CHECK_EQUAL(1, cache.numberOfTiles());
+      cache.clear();
+      CHECK_EQUAL(0, cache.currentCacheSize());
+    }
+
+    TEST(TestTileCacheManagerSharesBudgetByWeight)
+    {
+      TileCacheManager& manager = TileCacheManager::getInstance();
+      manager.setMaxCacheSize(30 * 256);
+      TileCache<unsigned char> first, second;
+      manager.registerCache(&first, "first");
+      manager.registerCache(&second, "second", 2.0);
+      CHECK_EQUAL(30 * 256, second.maxCacheSize());
+      std::shared_ptr<unsigned char> tile(new unsigned char[256], std::default_delete<unsigned char[]>());
+      for (unsigned int i = 0; i < 40; ++i) {
+        first.set(makeTileKey(0, 0, i, 0), tile, 256);
+      }
+      CHECK_EQUAL(30, first.numberOfTiles());
+      for (unsigned int i = 0; i < 40; ++i) {
+        second.set(makeTileKey(0, 0, i, 0), tile, 256);
+      }
+      CHECK(manager.getCurrentCacheSize() <= 30 * 256);
+      CHECK_CLOSE(10., static_cast<double>(first.numberOfTiles()), 1.);
+      CHECK_CLOSE(20., static_cast<double>(second.numberOfTiles()), 1.);
+      std::vector<ManagedCacheStatistics> statistics = manager.getStatistics();
+      CHECK_EQUAL(2, statistics.size());
+      manager.setMaxCacheSize(10 * 256);
+      CHECK(first.currentCacheSize() + second.currentCacheSize() <= 10 * 256);
+      manager.unregisterCache(&first);
+      manager.unregisterCache(&second);
+      manager.setMaxCacheSize(0);
+    }
+
+    // Asks the manager for its size from evicted(), which needs the lock of the manager
+    class ManagerQueryingCache : public TileCacheBase {
+    public:
+      ManagerQueryingCache() : evictions(0) {}
+      int set(const TileKey& k, const std::shared_ptr<void>& value, const unsigned int& size) { return setEntry(k, value, size); }
+      unsigned int evictions;
+
+    protected:
+      void evicted(const TileKey& k, const std::shared_ptr<void>& value, const unsigned int& size) {
+        TileCacheManager::getInstance().getCurrentCacheSize();
+        ++evictions;
+      }
+    };
+
+    TEST(TestTileCacheManagerEvictsOutsideItsLock)
+    {
+      TileCacheManager& manager = TileCacheManager::getInstance();
+      manager.setMaxCacheSize(20 * 256);
+      ManagerQueryingCache evictable;
+      TileCache<unsigned char> viewer(20 * 256), other;
+      manager.registerCache(&evictable, "evictable");
+      manager.registerCache(&viewer, "viewer", 1.0, false, false);
+      manager.registerCache(&other, "other");
+      std::shared_ptr<unsigned char> tile(new unsigned char[256], std::default_delete<unsigned char[]>());
+      for (unsigned int i = 0; i < 10; ++i) {
+        evictable.set(makeTileKey(0, 0, i, 0), tile, 256);
+        viewer.set(makeTileKey(0, 0, i, 0), tile, 256);
+      }
+      // The other caches make room, the tiles of the cache that is not evictable stay
+      for (unsigned int i = 0; i < 10; ++i) {
+        other.set(makeTileKey(0, 0, i, 0), tile, 256);
+      }
+      CHECK(manager.getCurrentCacheSize() <= 20 * 256);
+      CHECK(evictable.evictions > 0);
+      CHECK_EQUAL(10, viewer.numberOfTiles());
+      CHECK_EQUAL(20 * 256, viewer.maxCacheSize());
+      manager.unregisterCache(&evictable);
+      manager.unregisterCache(&viewer);
+      manager.unregisterCache(&other);
+      manager.setMaxCacheSize(0);
+    }
+
+    TEST(TestTileCacheReplacementPoliciesResistScans)
+    {
+      // Replays a viewer working set of 40 tiles interleaved with a whole-slide scan, in a cache of 64 tiles
+      std::shared_ptr<unsigned char> tile(new unsigned char[256], std::default_delete<unsigned char[]>());
+      auto replay = [&tile](const CacheReplacementPolicy& policy, const CacheAccessHint& scanHint, unsigned long long& evictions) {
+        TileCache<unsigned char> cache(64 * 256, policy);
+        std::shared_ptr<unsigned char> cached;
+        unsigned int size = 0, hits = 0, lookups = 0;
+        for (unsigned int round = 0; round < 50; ++round) {
+          for (unsigned int i = 0; i < 40; ++i) {
+            TileKey key = makeTileKey(0, 0, i % 8, i / 8);
+            bool hit = cache.get(key, cached, size);
+            if (!hit) {
+              cache.set(key, tile, 256);
+            }
+            if (round >= 10) {
+              hits += hit;
+              ++lookups;
+            }
+          }
+          ScopedCacheAccessHint hint(scanHint);
+          for (unsigned int i = 0; i < 50; ++i) {
+            TileKey key = makeTileKey(2, 0, (round * 50 + i) % 100, (round * 50 + i) / 100);
+            if (!cache.get(key, cached, size)) {
+              cache.set(key, tile, 256);
+            }
+          }
+        }
+        evictions = cache.getStatistics().evictions;
+        return static_cast<double>(hits) / lookups;
+      };
+      unsigned long long evictions = 0;
+      CacheReplacementPolicy policies[] = {LRUReplacement, TwoQueueReplacement, ARCReplacement, LevelAwareReplacement};
+      for (unsigned int i = 0; i < 4; ++i) {
+        CHECK(replay(policies[i], ScanCacheAccess, evictions) > 0.95);
+        CHECK(evictions > 0);
+      }
+      // Without the hint the scan flushes the working set out of LRU, the scan resistant policies keep it
+      double lru = replay(LRUReplacement, NormalCacheAccess, evictions);
+      CHECK(replay(TwoQueueReplacement, NormalCacheAccess, evictions) > lru);
+      CHECK(replay(ARCReplacement, NormalCacheAccess, evictions) > lru);
+    }
+
+    // Z-stack of 300 planes of 64x64 pixels, every pixel of a plane holds the index of the plane
+    class ZStackTestImage : public MultiResolutionImage {
+    public:
+      double getMinValue(int channel = -1) { return 0; }
+      double getMaxValue(int channel = -1) { return 299; }
+
+    protected:
+      bool initializeType(const std::string& imagePath) {
+        _levelDimensions.push_back(std::vector<unsigned long long>(2, 64));
+        _numberOfLevels = 1;
+        _numberOfZPlanes = 300;
+        _samplesPerPixel = 1;
+        _dataType = UInt16;
+        _colorType = Monochrome;
+        _isValid = true;
+        return true;
+      }
+
+      void readDataIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+        const unsigned long long& height, const unsigned int& level, void* data, const pathology::DataType& dataType, const unsigned long long& rowStride) {
+        readZPlaneIntoBuffer(startX, startY, width, height, level, _currentZPlaneIndex, data, dataType, rowStride);
+      }
+
+      void readZPlaneIntoBuffer(const long long& startX, const long long& startY, const unsigned long long& width,
+        const unsigned long long& height, const unsigned int& level, const unsigned int& zPlane, void* data, const pathology::DataType& dataType,
+        const unsigned long long& rowStride) {
+        for (unsigned long long y = 0; y < height; ++y) {
+          std::fill(static_cast<unsigned short*>(data) + y * rowStride, static_cast<unsigned short*>(data) + y * rowStride + width, static_cast<unsigned short>(zPlane));
+        }
+      }
+    };
+
+    TEST(TestZPlaneCacheKeepsPlanesApart)
+    {
+      CHECK(makeTileKey(0, 0, 1, 1) != makeTileKey(0, 256, 1, 1));
+      ZStackTestImage img;
+      CHECK(img.initialize("zstack"));
+      img.setZPlanePrefetchRadius(0);
+      std::vector<unsigned short> first(64 * 64), second(64 * 64);
+      img.getRawRegion<unsigned short>(0, 0, 64, 64, 0, first.data(), 64);
+      img.setCurrentZPlaneIndex(256);
+      img.getRawRegion<unsigned short>(0, 0, 64, 64, 0, second.data(), 64);
+      CHECK_EQUAL(0, first[0]);
+      CHECK_EQUAL(256, second[0]);
+      CHECK(first != second);
+    }
+
+    TEST(TestPixelConversionKernelsMatchScalar)
+    {
+      // Every vectorized kernel must give the same results as the scalar code, odd counts exercise the tails
+      const unsigned long long nrPixels = 10007;
+      std::vector<unsigned char> bgra(nrPixels * 4);
+      for (unsigned long long i = 0; i < nrPixels; ++i) {
+        unsigned char alpha = (i / 64) % 4 == 0 ? static_cast<unsigned char>(i * 37) : ((i / 64) % 4 == 1 ? 0 : 255);
+        bgra[i * 4] = static_cast<unsigned char>(std::min<unsigned long long>(i * 7 % 256, alpha));
+        bgra[i * 4 + 1] = static_cast<unsigned char>(std::min<unsigned long long>(i * 13 % 256, alpha));
+        bgra[i * 4 + 2] = static_cast<unsigned char>(std::min<unsigned long long>(i * 29 % 256, alpha));
+        bgra[i * 4 + 3] = alpha;
+      }
+      const unsigned char background[3] = {255, 255, 255};
+      const core::SIMDInstructionSet detected = core::getSIMDInstructionSet();
+      const core::SIMDInstructionSet instructionSets[] = {core::ScalarInstructions, core::SSE41Instructions, core::AVX2Instructions};
+      std::vector<unsigned char> rgbScalar, swapScalar;
+      std::vector<float> floatsScalar;
+      for (unsigned int i = 0; i < 3; ++i) {
+        core::setMaximumSIMDInstructionSet(instructionSets[i]);
+        std::vector<unsigned char> rgb(nrPixels * 3), swap(bgra);
+        std::vector<float> floats(nrPixels * 4);
+        core::unpremultiplyBGRAToRGB(bgra.data(), rgb.data(), nrPixels, background);
+        core::convertSamples(bgra.data(), pathology::UChar, floats.data(), pathology::Float, nrPixels * 4);
+        core::swapRedAndBlue(swap.data(), pathology::UChar, nrPixels);
+        if (i == 0) {
+          rgbScalar = rgb;
+          floatsScalar = floats;
+          swapScalar = swap;
+          CHECK_EQUAL(bgra[2], swap[0]);
+          CHECK_EQUAL(bgra[0], swap[2]);
+        }
+        else {
+          CHECK(rgb == rgbScalar);
+          CHECK(floats == floatsScalar);
+          CHECK(swap == swapScalar);
+        }
+        std::vector<unsigned char> roundTrip(nrPixels * 4);
+        core::convertSamples(floats.data(), pathology::Float, roundTrip.data(), pathology::UChar, nrPixels * 4);
+        CHECK(roundTrip == bgra);
+      }
+      core::setMaximumSIMDInstructionSet(core::AVX2Instructions);
+      CHECK_EQUAL(detected, core::getSIMDInstructionSet());
+    }
+
+    TEST(TestJPEG2000DecodeRoundTrip)
+    {
+      // A lossless tile, so reduced and region decodes can be compared with the pixels exactly
+      const unsigned int tileSize = 512;
+      std::vector<unsigned char> pixels(tileSize * tileSize * 3);
+      for (unsigned int y = 0; y < tileSize; ++y) {
+        for (unsigned int x = 0; x < tileSize; ++x) {
+          for (unsigned int c = 0; c < 3; ++c) {
+            pixels[(y * tileSize + x) * 3 + c] = static_cast<unsigned char>((x * (c + 1) + y * 2) / 4 + (x * y) % 7);
+          }
+        }
+      }
+      JPEG2000Codec codec;
+      std::vector<unsigned char> encoded(pixels);
+      unsigned int encodedSize = static_cast<unsigned int>(encoded.size());
+      codec.encode(reinterpret_cast<char*>(encoded.data()), encodedSize, tileSize, 100, 3, UChar, RGB);
+      encoded.resize(encodedSize);
+      const unsigned int resolutions = JPEG2000Codec::getNumberOfResolutions(encoded.data(), encodedSize);
+      CHECK(resolutions > 2);
+
+      std::vector<unsigned char> inPlace(encoded);
+      inPlace.resize(pixels.size());
+      codec.decode(inPlace.data(), encodedSize, static_cast<unsigned int>(inPlace.size()));
+      CHECK(inPlace == pixels);
+
+      std::vector<unsigned char> decoded(pixels.size());
+      unsigned int width = 0, height = 0;
+      JPEG2000Codec::DecodeParameters parameters;
+      parameters.threads = 4;
+      CHECK(codec.decode(encoded.data(), encodedSize, decoded.data(), static_cast<unsigned int>(decoded.size()), parameters, width, height));
+      CHECK(decoded == pixels);
+      CHECK_EQUAL(tileSize, width);
+      CHECK_EQUAL(tileSize, height);
+
+      parameters.threads = 1;
+      parameters.reduce = 2;
+      CHECK(codec.decode(encoded.data(), encodedSize, decoded.data(), static_cast<unsigned int>(decoded.size()), parameters, width, height));
+      CHECK_EQUAL(tileSize / 4, width);
+      CHECK_EQUAL(tileSize / 4, height);
+
+      parameters.reduce = 0;
+      parameters.x = 128;
+      parameters.y = 256;
+      parameters.width = 128;
+      parameters.height = 64;
+      CHECK(codec.decode(encoded.data(), encodedSize, decoded.data(), static_cast<unsigned int>(decoded.size()), parameters, width, height));
+      CHECK_EQUAL(128, width);
+      CHECK_EQUAL(64, height);
+      bool regionMatches = true;
+      for (unsigned int y = 0; y < height; ++y) {
+        regionMatches = regionMatches && std::equal(decoded.begin() + y * width * 3, decoded.begin() + (y + 1) * width * 3, pixels.begin() + ((256 + y) * tileSize + 128) * 3);
+      }
+      CHECK(regionMatches);
+
+      parameters = JPEG2000Codec::DecodeParameters();
+      parameters.reduce = resolutions;
+      CHECK(!codec.decode(encoded.data(), encodedSize, decoded.data(), static_cast<unsigned int>(decoded.size()), parameters, width, height));
+    }
   }
   
   SUITE(VSISupport)
@@ -521,5 +1421,28 @@ namespace
       double max = img->getMaxValue();
 
     }
+
+    TEST(TestReadZStackFromLIF)
+    {
+      MultiResolutionImageReader test;
+      MultiResolutionImage* img = test.open(g_dataPath + "/images/TestLeicaLIF.lif");
+      CHECK(img != NULL);
+      const unsigned int numberOfZPlanes = std::min(img->getNumberOfZPlanes(), 3);
+      const unsigned long long planeSize = 256 * 256 * img->getSamplesPerPixel();
+      std::vector<unsigned short> stack(numberOfZPlanes * planeSize);
+      img->getRawRegionZStack<unsigned short>(4000, 4000, 256, 256, 0, 0, numberOfZPlanes, stack.data());
+
+      // Every plane of the stack matches a read of that plane as the current one, also from the cache
+      for (int pass = 0; pass < 2; ++pass) {
+        for (unsigned int z = 0; z < numberOfZPlanes; ++z) {
+          std::vector<unsigned short> plane(planeSize);
+          img->setCurrentZPlaneIndex(z);
+          img->getRawRegion<unsigned short>(4000, 4000, 256, 256, 0, plane.data(), 256 * img->getSamplesPerPixel());
+          CHECK(std::equal(plane.begin(), plane.end(), stack.begin() + z * planeSize));
+        }
+      }
+      img->setCurrentZPlaneIndex(0);
+      delete img;
+    }
   }
 }
\ No newline at end of file